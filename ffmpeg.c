@@ -43,6 +43,10 @@
 #include "libavutil/libm.h"
 #include "libavformat/os_support.h"
 
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #if CONFIG_AVFILTER
 # include "libavfilter/avfilter.h"
 # include "libavfilter/avfiltergraph.h"
@@ -184,6 +188,8 @@ static int file_overwrite = 0;
 static int metadata_count;
 static AVMetadataTag *metadata;
 static int do_benchmark = 0;
+static char *benchmark_filename;
+static FILE *benchmark_file;
 static int do_hex_dump = 0;
 static int do_pkt_dump = 0;
 static int do_psnr = 0;
@@ -204,6 +210,9 @@ static int opt_programid = 0;
 static int copy_initial_nonkeyframes = 0;
 
 static int rate_emu = 0;
+static int read_ahead_size = 0;
+static int pipeline = 0;
+static int parallel_outputs = 0;
 
 static int  video_channel = 0;
 static char *video_standard;
@@ -246,6 +255,87 @@ static AVBitStreamFilterContext *bitstream_filters[MAX_FILES][MAX_STREAMS];
 
 struct AVInputStream;
 
+/* stages timed for -benchmark_file */
+enum Stage {
+    STAGE_DEMUX,
+    STAGE_DECODE,
+    STAGE_FILTER,
+    STAGE_SCALE,                ///< video scaling and audio resampling
+    STAGE_ENCODE,
+    STAGE_MUX,
+    STAGE_WAIT,                 ///< blocked on a full -pipeline queue
+    STAGE_NB
+};
+
+static const char *stage_names[STAGE_NB] = {
+    "demux", "decode", "filter", "scale", "encode", "mux", "wait"
+};
+
+#if HAVE_PTHREADS
+static int pipeline_active = 0;
+static int parallel_outputs_active = 0;
+static pthread_t main_thread;
+/* held while the global size and frame drop counters, the stage times
+   and the copies of the stream states made for the main thread are used */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/* held while thread_error is used */
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+static int thread_error = 0;    ///< set when a thread stopped on an error
+
+static void thread_exit(int ret);
+
+static int get_thread_error(void)
+{
+    int ret;
+
+    pthread_mutex_lock(&error_lock);
+    ret = thread_error;
+    pthread_mutex_unlock(&error_lock);
+    return ret;
+}
+
+static void lock_stats(void)
+{
+    if (pipeline_active || parallel_outputs_active)
+        pthread_mutex_lock(&stats_lock);
+}
+
+static void unlock_stats(void)
+{
+    if (pipeline_active || parallel_outputs_active)
+        pthread_mutex_unlock(&stats_lock);
+}
+#else
+static void lock_stats(void)    { }
+static void unlock_stats(void)  { }
+#endif
+
+/* start timing a stage, returns 0 when stages are not timed */
+static int64_t stage_clock(void)
+{
+    return benchmark_file ? av_gettime() : 0;
+}
+
+static void stage_add(int64_t *stage_time, int64_t t0)
+{
+    if (t0) {
+        int64_t t = av_gettime() - t0;
+        lock_stats();
+        *stage_time += t;
+        unlock_stats();
+    }
+}
+
+/* what the main thread looks at in an output stream to choose the next
+   input packet and for the progress report */
+typedef struct OutputStreamState {
+    int frame_number;
+    int coded_frames;           ///< frame_number of the encoder
+    int quality;                ///< quality of the last coded frame
+    uint64_t error[4];          ///< error of the last coded frame
+    int64_t pts;                ///< pts of the muxer, in stream time base
+} OutputStreamState;
+
 typedef struct AVOutputStream {
     int file_index;          /* file index */
     int index;               /* stream index in the output file */
@@ -290,8 +380,14 @@ typedef struct AVOutputStream {
     AVAudioConvert *reformat_ctx;
     AVFifoBuffer *fifo;     /* for compression: one audio fifo per codec */
     FILE *logfile;
+    int64_t stage_time[STAGE_NB]; /* microseconds spent in each stage */
+    /* copy of the state while -pipeline runs, updated under the stats
+       lock by the threads changing it */
+    OutputStreamState shared;
 } AVOutputStream;
 
+static AVOutputStream **output_streams_for_file[MAX_FILES];
+
 typedef struct AVInputStream {
     int file_index;
     int index;
@@ -304,6 +400,8 @@ typedef struct AVInputStream {
     int64_t       next_pts;  /* synthetic pts for cases where pkt.pts
                                 is not defined */
     int64_t       pts;       /* current pts */
+    AVFifoBuffer *pts_fifo;  /* pts of the packets still queued inside a
+                                frame-threaded decoder */
     int is_start;            /* is 1 at the start and after a discontinuity */
     int showed_multi_packet_warning;
     int is_past_recording_time;
@@ -314,6 +412,10 @@ typedef struct AVInputStream {
     int has_filter_frame;
     AVFilterPicRef *picref;
 #endif
+    int64_t stage_time[STAGE_NB]; /* microseconds spent in each stage */
+    /* copies of pts and next_pts while -pipeline runs, updated under the
+       stats lock by the worker of the stream */
+    int64_t shared_pts, shared_next_pts;
 } AVInputStream;
 
 typedef struct AVInputFile {
@@ -582,6 +684,14 @@ static int av_exit(int ret)
 {
     int i;
 
+#if HAVE_PTHREADS
+    /* the other threads still use what is freed here, so only the main
+       thread exits, once it has stopped them */
+    if ((pipeline_active || parallel_outputs_active) &&
+        !pthread_equal(pthread_self(), main_thread))
+        thread_exit(ret);
+#endif
+
     /* close files */
     for(i=0;i<nb_output_files;i++) {
         /* maybe av_close_output_file ??? */
@@ -757,8 +867,225 @@ get_sync_ipts(const AVOutputStream *ost)
     return (double)(ist->pts - start_time)/AV_TIME_BASE;
 }
 
+/* read the parts of the state changed by the thread encoding ost */
+static void read_encoder_state(AVOutputStream *ost, OutputStreamState *state)
+{
+    AVCodecContext *enc = ost->st->codec;
+
+    state->frame_number = ost->frame_number;
+    state->coded_frames = enc->frame_number;
+    state->quality      = 0;
+    memset(state->error, 0, sizeof(state->error));
+    if (!ost->st->stream_copy && enc->coded_frame) {
+        state->quality = enc->coded_frame->quality;
+        memcpy(state->error, enc->coded_frame->error, sizeof(state->error));
+    }
+}
+
+/* state of ost as the main thread may see it */
+static void get_output_state(AVOutputStream *ost, OutputStreamState *state)
+{
+#if HAVE_PTHREADS
+    if (pipeline_active) {
+        lock_stats();
+        *state = ost->shared;
+        unlock_stats();
+        return;
+    }
+#endif
+    read_encoder_state(ost, state);
+    state->pts = ost->st->pts.val;
+}
+
+/* pts and next_pts of ist as the main thread may see them */
+static void get_input_pts(AVInputStream *ist, int64_t *pts, int64_t *next_pts)
+{
+#if HAVE_PTHREADS
+    if (pipeline_active) {
+        lock_stats();
+        *pts      = ist->shared_pts;
+        *next_pts = ist->shared_next_pts;
+        unlock_stats();
+        return;
+    }
+#endif
+    *pts      = ist->pts;
+    *next_pts = ist->next_pts;
+}
+
+#if HAVE_PTHREADS
+/* bounded FIFO handing packets from one pipeline stage to the next */
+typedef struct PacketQueue {
+    AVFifoBuffer *fifo;
+    int max_packets;
+    int finished;               ///< no more packets will be put
+    int aborted;                ///< a thread failed, packets are dropped
+    int max_count;              ///< largest number of queued packets seen
+    int64_t count_sum;          ///< sum of the queued packets seen by each put
+    int nb_puts;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} PacketQueue;
+
+typedef struct QueuedPacket {
+    AVPacket pkt;
+    int index;                  ///< input stream or output file index
+} QueuedPacket;
+
+static PacketQueue mux_queue;
+static pthread_t mux_thread;
+/* held while an output file is written or its position is read */
+static pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int packet_queue_init(PacketQueue *q, int max_packets)
+{
+    memset(q, 0, sizeof(*q));
+    q->fifo = av_fifo_alloc(max_packets * sizeof(QueuedPacket));
+    if (!q->fifo)
+        return AVERROR(ENOMEM);
+    q->max_packets = max_packets;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    return 0;
+}
+
+/* move pkt into the queue, waiting while it is full; the time spent
+   waiting is added to *wait_time */
+static void packet_queue_put(PacketQueue *q, AVPacket *pkt, int index,
+                             int64_t *wait_time)
+{
+    QueuedPacket qp;
+    int64_t t0 = 0;
+    int count;
+
+    qp.pkt   = *pkt;
+    qp.index = index;
+    pthread_mutex_lock(&q->mutex);
+    if (av_fifo_space(q->fifo) < sizeof(qp) && !q->aborted) {
+        t0 = stage_clock();
+        while (av_fifo_space(q->fifo) < sizeof(qp) && !q->aborted)
+            pthread_cond_wait(&q->cond, &q->mutex);
+    }
+    if (q->aborted) {
+        pthread_mutex_unlock(&q->mutex);
+        av_free_packet(pkt);
+    } else {
+        av_fifo_generic_write(q->fifo, &qp, sizeof(qp), NULL);
+        count = av_fifo_size(q->fifo) / sizeof(qp);
+        q->max_count  = FFMAX(q->max_count, count);
+        q->count_sum += count;
+        q->nb_puts++;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->mutex);
+        stage_add(wait_time, t0);
+    }
+
+    /* queued or dropped, the caller does not own the payload anymore and
+       may still free pkt */
+    pkt->data     = NULL;
+    pkt->size     = 0;
+    pkt->destruct = NULL;
+}
+
+/* take the oldest packet, return 0 once the queue is finished and empty
+   or aborted */
+static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int *index)
+{
+    QueuedPacket qp;
+
+    pthread_mutex_lock(&q->mutex);
+    while (!av_fifo_size(q->fifo) && !q->finished && !q->aborted)
+        pthread_cond_wait(&q->cond, &q->mutex);
+    if (!av_fifo_size(q->fifo) || q->aborted) {
+        pthread_mutex_unlock(&q->mutex);
+        return 0;
+    }
+    av_fifo_generic_read(q->fifo, &qp, sizeof(qp), NULL);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+
+    *pkt   = qp.pkt;
+    *index = qp.index;
+    return 1;
+}
+
+static void packet_queue_finish(PacketQueue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->finished = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* wake up the threads waiting on the queue and make it drop packets */
+static void packet_queue_abort(PacketQueue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->aborted = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void packet_queue_destroy(PacketQueue *q)
+{
+    QueuedPacket qp;
+
+    while (av_fifo_size(q->fifo)) {
+        av_fifo_generic_read(q->fifo, &qp, sizeof(qp), NULL);
+        av_free_packet(&qp.pkt);
+    }
+    av_fifo_free(q->fifo);
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+}
+
+static void *mux_thread_func(void *arg)
+{
+    AVPacket pkt;
+    int file_index, ret;
+
+    while (packet_queue_get(&mux_queue, &pkt, &file_index)) {
+        AVOutputStream *ost = output_streams_for_file[file_index][pkt.stream_index];
+        int64_t t0 = stage_clock();
+        pthread_mutex_lock(&mux_lock);
+        ret = av_interleaved_write_frame(output_files[file_index], &pkt);
+        pthread_mutex_unlock(&mux_lock);
+        stage_add(&ost->stage_time[STAGE_MUX], t0);
+        if (ret < 0) {
+            print_error("av_interleaved_write_frame()", ret);
+            av_free_packet(&pkt);
+            thread_exit(1);
+        }
+        /* the muxer is only used by this thread */
+        lock_stats();
+        ost->shared.pts = ost->st->pts.val;
+        unlock_stats();
+        av_free_packet(&pkt);
+    }
+    return NULL;
+}
+
+static void lock_output(void)
+{
+    if (pipeline_active)
+        pthread_mutex_lock(&mux_lock);
+}
+
+static void unlock_output(void)
+{
+    if (pipeline_active)
+        pthread_mutex_unlock(&mux_lock);
+}
+
+#else
+static void lock_output(void)   { }
+static void unlock_output(void) { }
+#endif
+
 static void write_frame(AVFormatContext *s, AVPacket *pkt, AVCodecContext *avctx, AVBitStreamFilterContext *bsfc){
-    int ret;
+    AVOutputStream *ost;
+    int64_t t0;
+    int i, ret;
 
     while(bsfc){
         AVPacket new_pkt= *pkt;
@@ -782,7 +1109,23 @@ static void write_frame(AVFormatContext *s, AVPacket *pkt, AVCodecContext *avctx
         bsfc= bsfc->next;
     }
 
+    for (i = 0; output_files[i] != s; i++);
+    ost = output_streams_for_file[i][pkt->stream_index];
+
+#if HAVE_PTHREADS
+    if (pipeline_active) {
+        /* the payload may point into an encoder buffer that gets reused */
+        if (av_dup_packet(pkt) < 0) {
+            fprintf(stderr, "Could not allocate output packet\n");
+            av_exit(1);
+        }
+        packet_queue_put(&mux_queue, pkt, i, &ost->stage_time[STAGE_WAIT]);
+        return;
+    }
+#endif
+    t0 = stage_clock();
     ret= av_interleaved_write_frame(s, pkt);
+    stage_add(&ost->stage_time[STAGE_MUX], t0);
     if(ret < 0){
         print_error("av_interleaved_write_frame()", ret);
         av_exit(1);
@@ -799,6 +1142,7 @@ static void do_audio_out(AVFormatContext *s,
     uint8_t *buftmp;
     int64_t audio_out_size, audio_buf_size;
     int64_t allocated_for_size= size;
+    int64_t t0;
 
     int size_out, frame_bytes, ret;
     AVCodecContext *enc= ost->st->codec;
@@ -913,6 +1257,7 @@ need_realloc:
         ost->sync_opts= lrintf(get_sync_ipts(ost) * enc->sample_rate)
                         - av_fifo_size(ost->fifo)/(ost->st->codec->channels * 2); //FIXME wrong
 
+    t0 = stage_clock();
     if (ost->audio_resample) {
         buftmp = audio_buf;
         size_out = audio_resample(ost->resample,
@@ -939,6 +1284,7 @@ need_realloc:
         buftmp = audio_buf;
         size_out = len*osize;
     }
+    stage_add(&ost->stage_time[STAGE_SCALE], t0);
 
     /* now encode as many frames as possible */
     if (enc->frame_size > 1) {
@@ -959,8 +1305,10 @@ need_realloc:
 
             //FIXME pass ost->sync_opts as AVFrame.pts in avcodec_encode_audio()
 
+            t0 = stage_clock();
             ret = avcodec_encode_audio(enc, audio_out, audio_out_size,
                                        (short *)audio_buf);
+            stage_add(&ost->stage_time[STAGE_ENCODE], t0);
             if (ret < 0) {
                 fprintf(stderr, "Audio encoding failed\n");
                 av_exit(1);
@@ -994,8 +1342,10 @@ need_realloc:
         }
 
         //FIXME pass ost->sync_opts as AVFrame.pts in avcodec_encode_audio()
+        t0 = stage_clock();
         ret = avcodec_encode_audio(enc, audio_out, size_out,
                                    (short *)buftmp);
+        stage_add(&ost->stage_time[STAGE_ENCODE], t0);
         if (ret < 0) {
             fprintf(stderr, "Audio encoding failed\n");
             av_exit(1);
@@ -1062,6 +1412,7 @@ static void do_subtitle_out(AVFormatContext *s,
     static uint8_t *subtitle_out = NULL;
     int subtitle_out_max_size = 1024 * 1024;
     int subtitle_out_size, nb, i;
+    int64_t t0;
     AVCodecContext *enc;
     AVPacket pkt;
 
@@ -1092,8 +1443,10 @@ static void do_subtitle_out(AVFormatContext *s,
         sub->pts              += av_rescale_q(sub->start_display_time, (AVRational){1, 1000}, AV_TIME_BASE_Q);
         sub->end_display_time -= sub->start_display_time;
         sub->start_display_time = 0;
+        t0 = stage_clock();
         subtitle_out_size = avcodec_encode_subtitle(enc, subtitle_out,
                                                     subtitle_out_max_size, sub);
+        stage_add(&ost->stage_time[STAGE_ENCODE], t0);
         if (subtitle_out_size < 0) {
             fprintf(stderr, "Subtitle encoding failed\n");
             av_exit(1);
@@ -1123,6 +1476,7 @@ static void do_video_out(AVFormatContext *s,
                          AVOutputStream *ost,
                          AVInputStream *ist,
                          AVFrame *in_picture,
+                         uint8_t *out_buf,
                          int *frame_size)
 {
     int nb_frames, i, ret;
@@ -1133,6 +1487,7 @@ static void do_video_out(AVFormatContext *s,
     AVFrame picture_crop_temp, picture_pad_temp;
     AVCodecContext *enc, *dec;
     double sync_ipts;
+    int64_t t0;
 
     avcodec_get_frame_defaults(&picture_crop_temp);
     avcodec_get_frame_defaults(&picture_pad_temp);
@@ -1160,12 +1515,16 @@ static void do_video_out(AVFormatContext *s,
         }else if (vdelta > 1.1)
             nb_frames = lrintf(vdelta);
 //fprintf(stderr, "vdelta:%f, ost->sync_opts:%"PRId64", ost->sync_ipts:%f nb_frames:%d\n", vdelta, ost->sync_opts, get_sync_ipts(ost), nb_frames);
-        if (nb_frames == 0){
+        lock_stats();
+        if (nb_frames == 0)
             ++nb_frames_drop;
+        else if (nb_frames > 1)
+            nb_frames_dup += nb_frames - 1;
+        unlock_stats();
+        if (nb_frames == 0){
             if (verbose>2)
                 fprintf(stderr, "*** drop!\n");
         }else if (nb_frames > 1) {
-            nb_frames_dup += nb_frames - 1;
             if (verbose>2)
                 fprintf(stderr, "*** %d dup!\n", nb_frames-1);
         }
@@ -1236,7 +1595,6 @@ static void do_video_out(AVFormatContext *s,
 
             /* initialize a new scaler context */
             sws_freeContext(ost->img_resample_ctx);
-            sws_flags = av_get_int(sws_opts, "sws_flags", NULL);
             ost->img_resample_ctx = sws_getContext(
                 ist->st->codec->width  - (ost->leftBand + ost->rightBand),
                 ist->st->codec->height - (ost->topBand  + ost->bottomBand),
@@ -1244,14 +1602,16 @@ static void do_video_out(AVFormatContext *s,
                 ost->st->codec->width,
                 ost->st->codec->height,
                 ost->st->codec->pix_fmt,
-                sws_flags, NULL, NULL, NULL);
+                av_get_int(sws_opts, "sws_flags", NULL), NULL, NULL, NULL);
             if (ost->img_resample_ctx == NULL) {
                 fprintf(stderr, "Cannot get resampling context\n");
                 av_exit(1);
             }
         }
+        t0 = stage_clock();
         sws_scale(ost->img_resample_ctx, formatted_picture->data, formatted_picture->linesize,
               0, ost->resample_height, resampling_dst->data, resampling_dst->linesize);
+        stage_add(&ost->stage_time[STAGE_SCALE], t0);
     }
 #endif
 
@@ -1300,16 +1660,18 @@ static void do_video_out(AVFormatContext *s,
             big_picture.pts= ost->sync_opts;
 //            big_picture.pts= av_rescale(ost->sync_opts, AV_TIME_BASE*(int64_t)enc->time_base.num, enc->time_base.den);
 //av_log(NULL, AV_LOG_DEBUG, "%"PRId64" -> encoder\n", ost->sync_opts);
+            t0 = stage_clock();
             ret = avcodec_encode_video(enc,
-                                       bit_buffer, bit_buffer_size,
+                                       out_buf, bit_buffer_size,
                                        &big_picture);
+            stage_add(&ost->stage_time[STAGE_ENCODE], t0);
             if (ret < 0) {
                 fprintf(stderr, "Video encoding failed\n");
                 av_exit(1);
             }
 
             if(ret>0){
-                pkt.data= bit_buffer;
+                pkt.data= out_buf;
                 pkt.size= ret;
                 if(enc->coded_frame->pts != AV_NOPTS_VALUE)
                     pkt.pts= av_rescale_q(enc->coded_frame->pts, enc->time_base, ost->st->time_base);
@@ -1321,7 +1683,9 @@ static void do_video_out(AVFormatContext *s,
                     pkt.flags |= AV_PKT_FLAG_KEY;
                 write_frame(s, &pkt, ost->st->codec, bitstream_filters[ost->file_index][pkt.stream_index]);
                 *frame_size = ret;
+                lock_stats();
                 video_size += ret;
+                unlock_stats();
                 //fprintf(stderr,"\nFrame: %3d size: %5d type: %d",
                 //        enc->frame_number-1, ret, enc->pict_type);
                 /* if two pass, output log */
@@ -1382,10 +1746,11 @@ static void print_report(AVFormatContext **output_files,
 {
     char buf[1024];
     AVOutputStream *ost;
+    OutputStreamState state;
     AVFormatContext *oc;
     int64_t total_size;
     AVCodecContext *enc;
-    int frame_number, vid, i;
+    int frame_number, vid, i, frames_dup, frames_drop;
     double bitrate, ti1, pts;
     static int64_t last_time = -1;
     static int qp_histogram[52];
@@ -1406,9 +1771,11 @@ static void print_report(AVFormatContext **output_files,
 
     oc = output_files[0];
 
+    lock_output();
     total_size = url_fsize(oc->pb);
     if(total_size<0) // FIXME improve url_fsize() so it works with non seekable output too
         total_size= url_ftell(oc->pb);
+    unlock_output();
 
     buf[0] = '\0';
     ti1 = 1e10;
@@ -1416,24 +1783,25 @@ static void print_report(AVFormatContext **output_files,
     for(i=0;i<nb_ostreams;i++) {
         ost = ost_table[i];
         enc = ost->st->codec;
+        get_output_state(ost, &state);
         if (vid && enc->codec_type == AVMEDIA_TYPE_VIDEO) {
             snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "q=%2.1f ",
                      !ost->st->stream_copy ?
-                     enc->coded_frame->quality/(float)FF_QP2LAMBDA : -1);
+                     state.quality/(float)FF_QP2LAMBDA : -1);
         }
         if (!vid && enc->codec_type == AVMEDIA_TYPE_VIDEO) {
             float t = (av_gettime()-timer_start) / 1000000.0;
 
-            frame_number = ost->frame_number;
+            frame_number = state.frame_number;
             snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "frame=%5d fps=%3d q=%3.1f ",
                      frame_number, (t>1)?(int)(frame_number/t+0.5) : 0,
                      !ost->st->stream_copy ?
-                     enc->coded_frame->quality/(float)FF_QP2LAMBDA : -1);
+                     state.quality/(float)FF_QP2LAMBDA : -1);
             if(is_last_report)
                 snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "L");
             if(qp_hist){
                 int j;
-                int qp= lrintf(enc->coded_frame->quality/(float)FF_QP2LAMBDA);
+                int qp= lrintf(state.quality/(float)FF_QP2LAMBDA);
                 if(qp>=0 && qp<FF_ARRAY_ELEMS(qp_histogram))
                     qp_histogram[qp]++;
                 for(j=0; j<32; j++)
@@ -1450,7 +1818,7 @@ static void print_report(AVFormatContext **output_files,
                         error= enc->error[j];
                         scale= enc->width*enc->height*255.0*255.0*frame_number;
                     }else{
-                        error= enc->coded_frame->error[j];
+                        error= state.error[j];
                         scale= enc->width*enc->height*255.0*255.0;
                     }
                     if(j) scale/=4;
@@ -1463,7 +1831,7 @@ static void print_report(AVFormatContext **output_files,
             vid = 1;
         }
         /* compute min output value */
-        pts = (double)ost->st->pts.val * av_q2d(ost->st->time_base);
+        pts = (double)state.pts * av_q2d(ost->st->time_base);
         if ((pts < ti1) && (pts > 0))
             ti1 = pts;
     }
@@ -1477,9 +1845,13 @@ static void print_report(AVFormatContext **output_files,
             "size=%8.0fkB time=%0.2f bitrate=%6.1fkbits/s",
             (double)total_size / 1024, ti1, bitrate);
 
-        if (nb_frames_dup || nb_frames_drop)
+        lock_stats();
+        frames_dup  = nb_frames_dup;
+        frames_drop = nb_frames_drop;
+        unlock_stats();
+        if (frames_dup || frames_drop)
           snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), " dup=%d drop=%d",
-                  nb_frames_dup, nb_frames_drop);
+                  frames_dup, frames_drop);
 
         if (verbose >= 0)
             fprintf(stderr, "%s    \r", buf);
@@ -1500,9 +1872,180 @@ static void print_report(AVFormatContext **output_files,
 }
 
 /* pkt = NULL means EOF (needed to flush decoder buffers) */
+#if HAVE_PTHREADS
+/* encodes the video streams of one output file, so that the renditions
+   of a decoded frame are scaled and encoded concurrently; the decoding
+   thread is the only one handing out jobs and waits for all of them
+   before the frame is released */
+typedef struct EncodeWorker {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t *bit_buffer;
+    AVInputStream *ist;
+    AVFrame *picture;
+    AVOutputStream *ost[MAX_STREAMS];
+    int nb_ost;
+    int busy;
+    int exit;
+} EncodeWorker;
+
+static EncodeWorker *encode_workers[MAX_FILES];
+
+static void stop_encode_workers(void);
+
+/* run when the worker ends in thread_exit(), the thread handing out the
+   jobs must not wait for it */
+static void encode_worker_cleanup(void *arg)
+{
+    EncodeWorker *w = arg;
+
+    pthread_mutex_lock(&w->mutex);
+    w->nb_ost = 0;
+    w->busy   = 0;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static void *encode_worker_func(void *arg)
+{
+    EncodeWorker *w = arg;
+    AVOutputStream *ost;
+    int i, frame_size;
+
+    pthread_mutex_lock(&w->mutex);
+    for (;;) {
+        while (!w->busy && !w->exit)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        if (!w->busy)
+            break;
+        pthread_mutex_unlock(&w->mutex);
+
+        pthread_cleanup_push(encode_worker_cleanup, w);
+        for (i = 0; i < w->nb_ost; i++) {
+            ost = w->ost[i];
+            do_video_out(output_files[ost->file_index], ost, w->ist,
+                         w->picture, w->bit_buffer, &frame_size);
+            if (vstats_filename && frame_size) {
+                lock_stats();
+                do_video_stats(output_files[ost->file_index], ost, frame_size);
+                unlock_stats();
+            }
+        }
+        pthread_cleanup_pop(0);
+
+        pthread_mutex_lock(&w->mutex);
+        w->nb_ost = 0;
+        w->busy   = 0;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+/* encode the current frame for all queued output streams */
+static void run_encode_workers(AVInputStream *ist, AVFrame *picture)
+{
+    EncodeWorker *w;
+    int i;
+
+    for (i = 0; i < nb_output_files; i++) {
+        if (!(w = encode_workers[i]) || !w->nb_ost)
+            continue;
+        pthread_mutex_lock(&w->mutex);
+        w->ist     = ist;
+        w->picture = picture;
+        w->busy    = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+    }
+    for (i = 0; i < nb_output_files; i++) {
+        if (!(w = encode_workers[i]))
+            continue;
+        pthread_mutex_lock(&w->mutex);
+        while (w->busy)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        pthread_mutex_unlock(&w->mutex);
+    }
+    if (get_thread_error()) {
+        stop_encode_workers();
+        av_exit(1);
+    }
+}
+
+static void stop_encode_workers(void)
+{
+    EncodeWorker *w;
+    int i;
+
+    for (i = 0; i < MAX_FILES; i++) {
+        if (!(w = encode_workers[i]))
+            continue;
+        pthread_mutex_lock(&w->mutex);
+        w->exit = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->mutex);
+        pthread_cond_destroy(&w->cond);
+        av_free(w->bit_buffer);
+        av_freep(&encode_workers[i]);
+    }
+    parallel_outputs_active = 0;
+}
+
+/* start one worker per output file with video to encode, if there are
+   at least two such files */
+static int start_encode_workers(AVOutputStream **ost_table, int nb_ostreams)
+{
+    EncodeWorker *w;
+    int i, file_index, nb_files = 0;
+    int has_video[MAX_FILES] = { 0 };
+
+    for (i = 0; i < nb_ostreams; i++) {
+        if (ost_table[i]->encoding_needed &&
+            ost_table[i]->st->codec->codec_type == AVMEDIA_TYPE_VIDEO &&
+            !(output_files[ost_table[i]->file_index]->oformat->flags & AVFMT_RAWPICTURE))
+            has_video[ost_table[i]->file_index] = 1;
+    }
+    for (i = 0; i < nb_output_files; i++)
+        nb_files += has_video[i];
+    if (nb_files < 2)
+        return 0;
+
+    for (file_index = 0; file_index < nb_output_files; file_index++) {
+        if (!has_video[file_index])
+            continue;
+        w = av_mallocz(sizeof(*w));
+        if (!w)
+            goto fail;
+        w->bit_buffer = av_malloc(bit_buffer_size);
+        if (!w->bit_buffer) {
+            av_free(w);
+            goto fail;
+        }
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->thread, NULL, encode_worker_func, w)) {
+            pthread_mutex_destroy(&w->mutex);
+            pthread_cond_destroy(&w->cond);
+            av_free(w->bit_buffer);
+            av_free(w);
+            goto fail;
+        }
+        encode_workers[file_index] = w;
+    }
+    parallel_outputs_active = 1;
+    return 0;
+ fail:
+    stop_encode_workers();
+    return AVERROR(ENOMEM);
+}
+#endif
+
 static int output_packet(AVInputStream *ist, int ist_index,
                          AVOutputStream **ost_table, int nb_ostreams,
-                         const AVPacket *pkt)
+                         AVPacket *pkt)
 {
     AVFormatContext *os;
     AVOutputStream *ost;
@@ -1512,6 +2055,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
     void *buffer_to_free;
     static unsigned int samples_size= 0;
     AVSubtitle subtitle, *subtitle_to_free;
+    int64_t t0;
 #if CONFIG_AVFILTER
     int frame_available;
 #endif
@@ -1565,8 +2109,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
                 decoded_data_size= samples_size;
                     /* XXX: could avoid copy if PCM 16 bits with same
                        endianness as CPU */
+                t0 = stage_clock();
                 ret = avcodec_decode_audio3(ist->st->codec, samples, &decoded_data_size,
                                             &avpkt);
+                stage_add(&ist->stage_time[STAGE_DECODE], t0);
                 if (ret < 0)
                     goto fail_decode;
                 avpkt.data += ret;
@@ -1587,9 +2133,26 @@ static int output_packet(AVInputStream *ist, int ist_index,
                     /* XXX: allocate picture correctly */
                     avcodec_get_frame_defaults(&picture);
 
+                    if (ist->pts_fifo && pkt) {
+                        /* synthetic timestamps already follow the output */
+                        int64_t pkt_pts = pkt->dts != AV_NOPTS_VALUE ? ist->pts : AV_NOPTS_VALUE;
+                        av_fifo_generic_write(ist->pts_fifo, &pkt_pts, sizeof(pkt_pts), NULL);
+                    }
+
+                    t0 = stage_clock();
                     ret = avcodec_decode_video2(ist->st->codec,
                                                 &picture, &got_picture, &avpkt);
+                    stage_add(&ist->stage_time[STAGE_DECODE], t0);
                     ist->st->quality= picture.quality;
+                    /* a frame-threaded decoder returns the picture of the packet
+                       sent thread_count-1 calls earlier, use that packet's pts */
+                    if (ist->pts_fifo &&
+                        av_fifo_size(ist->pts_fifo) >= (pkt ? ist->st->codec->thread_count : 1) * sizeof(int64_t)) {
+                        int64_t queued_pts;
+                        av_fifo_generic_read(ist->pts_fifo, &queued_pts, sizeof(queued_pts), NULL);
+                        if (got_picture && queued_pts != AV_NOPTS_VALUE)
+                            ist->next_pts = ist->pts = queued_pts;
+                    }
                     if (ret < 0)
                         goto fail_decode;
                     if (!got_picture) {
@@ -1605,8 +2168,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
                     avpkt.size = 0;
                     break;
             case AVMEDIA_TYPE_SUBTITLE:
+                t0 = stage_clock();
                 ret = avcodec_decode_subtitle2(ist->st->codec,
                                                &subtitle, &got_picture, &avpkt);
+                stage_add(&ist->stage_time[STAGE_DECODE], t0);
                 if (ret < 0)
                     goto fail_decode;
                 if (!got_picture) {
@@ -1646,9 +2211,11 @@ static int output_packet(AVInputStream *ist, int ist_index,
 #if CONFIG_AVFILTER
         if (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO && ist->input_video_filter) {
             // add it to be filtered
+            t0 = stage_clock();
             av_vsrc_buffer_add_frame(ist->input_video_filter, &picture,
                                      ist->pts,
                                      ist->st->codec->sample_aspect_ratio);
+            stage_add(&ist->stage_time[STAGE_FILTER], t0);
         }
 #endif
 
@@ -1682,8 +2249,11 @@ static int output_packet(AVInputStream *ist, int ist_index,
         if (start_time == 0 || ist->pts >= start_time)
 #if CONFIG_AVFILTER
         while (frame_available) {
-            if (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO && ist->out_video_filter)
+            if (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO && ist->out_video_filter) {
+                t0 = stage_clock();
                 get_filtered_video_pic(ist->out_video_filter, &ist->picref, &picture, &ist->pts);
+                stage_add(&ist->stage_time[STAGE_FILTER], t0);
+            }
 #endif
             for(i=0;i<nb_ostreams;i++) {
                 int frame_size;
@@ -1705,7 +2275,14 @@ static int output_packet(AVInputStream *ist, int ist_index,
 #if CONFIG_AVFILTER
                             ost->st->codec->sample_aspect_ratio = ist->picref->pixel_aspect;
 #endif
-                            do_video_out(os, ost, ist, &picture, &frame_size);
+#if HAVE_PTHREADS
+                            if (encode_workers[ost->file_index]) {
+                                EncodeWorker *w = encode_workers[ost->file_index];
+                                w->ost[w->nb_ost++] = ost;
+                                break;
+                            }
+#endif
+                            do_video_out(os, ost, ist, &picture, bit_buffer, &frame_size);
                             if (vstats_filename && frame_size)
                                 do_video_stats(os, ost, frame_size);
                             break;
@@ -1767,6 +2344,21 @@ static int output_packet(AVInputStream *ist, int ist_index,
                             opkt.size = data_size;
                         }
 
+                        /* reference the input payload instead of having the
+                           muxer copy it */
+                        if (!opkt.destruct && opkt.data >= pkt->data &&
+                            opkt.data + opkt.size <= pkt->data + pkt->size) {
+                            AVPacket ref;
+                            int offset = opkt.data - pkt->data;
+                            if (av_packet_ref(&ref, pkt) < 0) {
+                                fprintf(stderr, "Failed to reference packet from stream %d\n", pkt->stream_index);
+                                av_exit(1);
+                            }
+                            opkt.data     = ref.data + offset;
+                            opkt.destruct = ref.destruct;
+                            opkt.priv     = ref.priv;
+                        }
+
                         write_frame(os, &opkt, ost->st->codec, bitstream_filters[ost->file_index][opkt.stream_index]);
                         ost->st->codec->frame_number++;
                         ost->frame_number++;
@@ -1774,6 +2366,10 @@ static int output_packet(AVInputStream *ist, int ist_index,
                     }
                 }
             }
+#if HAVE_PTHREADS
+            if (parallel_outputs_active && ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+                run_encode_workers(ist, &picture);
+#endif
 
 #if CONFIG_AVFILTER
             frame_available = (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO) &&
@@ -1819,6 +2415,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
                         av_init_packet(&pkt);
                         pkt.stream_index= ost->index;
 
+                        t0 = stage_clock();
                         switch(ost->st->codec->codec_type) {
                         case AVMEDIA_TYPE_AUDIO:
                             fifo_bytes = av_fifo_size(ost->fifo);
@@ -1869,6 +2466,7 @@ static int output_packet(AVInputStream *ist, int ist_index,
                         default:
                             ret=-1;
                         }
+                        stage_add(&ost->stage_time[STAGE_ENCODE], t0);
 
                         if(ret<=0)
                             break;
@@ -1938,6 +2536,291 @@ static int copy_chapters(int infile, int outfile)
     return 0;
 }
 
+static const char *media_type_name(enum AVMediaType type)
+{
+    static const char *names[AVMEDIA_TYPE_NB] = {
+        "video", "audio", "data", "subtitle", "attachment"
+    };
+    return type >= 0 && type < AVMEDIA_TYPE_NB ? names[type] : "unknown";
+}
+
+#if HAVE_PTHREADS
+/* decodes, filters and encodes the packets of all input streams of one
+   media type; the static buffers of output_packet() and do_*_out() are
+   only ever used by a single worker this way */
+typedef struct PipelineWorker {
+    pthread_t thread;
+    PacketQueue queue;
+    AVInputStream **ist_table;
+    AVOutputStream **ost_table;
+    int nb_ostreams;
+} PipelineWorker;
+
+static PipelineWorker *pipeline_workers[AVMEDIA_TYPE_NB];
+
+/* end a -pipeline or -parallel_outputs thread on a fatal error: the main
+   thread exits once it notices, the threads waiting on this one are woken
+   up and the queues drop their packets */
+static void thread_exit(int ret)
+{
+    int type;
+
+    pthread_mutex_lock(&error_lock);
+    thread_error = ret;
+    pthread_mutex_unlock(&error_lock);
+    if (pipeline_active) {
+        packet_queue_abort(&mux_queue);
+        for (type = 0; type < AVMEDIA_TYPE_NB; type++)
+            if (pipeline_workers[type])
+                packet_queue_abort(&pipeline_workers[type]->queue);
+    }
+    pthread_exit(NULL);
+}
+
+/* copy what the main thread reads of the streams fed by ist */
+static void publish_stream_state(PipelineWorker *w, AVInputStream *ist)
+{
+    AVOutputStream *ost;
+    int i;
+
+    lock_stats();
+    ist->shared_pts      = ist->pts;
+    ist->shared_next_pts = ist->next_pts;
+    for (i = 0; i < w->nb_ostreams; i++) {
+        ost = w->ost_table[i];
+        if (w->ist_table[ost->source_index] == ist)
+            read_encoder_state(ost, &ost->shared);
+    }
+    unlock_stats();
+}
+
+static void *pipeline_worker_func(void *arg)
+{
+    PipelineWorker *w = arg;
+    AVInputStream *ist;
+    AVPacket pkt;
+    int ist_index;
+
+    while (packet_queue_get(&w->queue, &pkt, &ist_index)) {
+        ist = w->ist_table[ist_index];
+        if (output_packet(ist, ist_index, w->ost_table, w->nb_ostreams, &pkt) < 0) {
+            if (verbose >= 0)
+                fprintf(stderr, "Error while decoding stream #%d.%d\n",
+                        ist->file_index, ist->index);
+            if (exit_on_error) {
+                av_free_packet(&pkt);
+                thread_exit(1);
+            }
+        }
+        av_free_packet(&pkt);
+        publish_stream_state(w, ist);
+    }
+    return NULL;
+}
+
+static int pipeline_type(AVInputStream *ist)
+{
+    int type = ist->st->codec->codec_type;
+    return type >= 0 && type < AVMEDIA_TYPE_NB ? type : AVMEDIA_TYPE_DATA;
+}
+
+static int pipeline_start(AVInputStream **ist_table, int nb_istreams,
+                          AVOutputStream **ost_table, int nb_ostreams)
+{
+    PipelineWorker *w;
+    int i, type, ret = AVERROR(ENOMEM);
+
+    /* raw pictures point into decoder buffers, they cannot wait in a queue */
+    for (i = 0; i < nb_output_files; i++) {
+        if (output_files[i]->oformat->flags & AVFMT_RAWPICTURE) {
+            fprintf(stderr, "Warning: -pipeline is not supported with raw picture output, transcoding serially\n");
+            return 0;
+        }
+    }
+
+    if (packet_queue_init(&mux_queue, 256) < 0)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < nb_ostreams; i++) {
+        read_encoder_state(ost_table[i], &ost_table[i]->shared);
+        ost_table[i]->shared.pts = ost_table[i]->st->pts.val;
+    }
+    for (i = 0; i < nb_istreams; i++) {
+        ist_table[i]->shared_pts      = ist_table[i]->pts;
+        ist_table[i]->shared_next_pts = ist_table[i]->next_pts;
+        if (ist_table[i]->discard)
+            continue;
+        type = pipeline_type(ist_table[i]);
+        if (pipeline_workers[type])
+            continue;
+        w = av_mallocz(sizeof(*w));
+        if (!w || packet_queue_init(&w->queue, 64) < 0) {
+            av_free(w);
+            goto fail;
+        }
+        w->ist_table   = ist_table;
+        w->ost_table   = ost_table;
+        w->nb_ostreams = nb_ostreams;
+        pipeline_workers[type] = w;
+    }
+
+    pipeline_active = 1;
+    if (pthread_create(&mux_thread, NULL, mux_thread_func, NULL)) {
+        pipeline_active = 0;
+        goto thread_fail;
+    }
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        if (!pipeline_workers[type] ||
+            !pthread_create(&pipeline_workers[type]->thread, NULL,
+                            pipeline_worker_func, pipeline_workers[type]))
+            continue;
+        /* stop the threads already started, nothing was queued yet */
+        packet_queue_abort(&mux_queue);
+        for (i = 0; i < type; i++) {
+            if (!pipeline_workers[i])
+                continue;
+            packet_queue_abort(&pipeline_workers[i]->queue);
+            pthread_join(pipeline_workers[i]->thread, NULL);
+        }
+        pthread_join(mux_thread, NULL);
+        pipeline_active = 0;
+        goto thread_fail;
+    }
+    return 0;
+ thread_fail:
+    fprintf(stderr, "Warning: could not start the -pipeline threads, transcoding serially\n");
+    ret = 0;
+ fail:
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        if (!pipeline_workers[type])
+            continue;
+        packet_queue_destroy(&pipeline_workers[type]->queue);
+        av_freep(&pipeline_workers[type]);
+    }
+    packet_queue_destroy(&mux_queue);
+    return ret;
+}
+
+/* write the occupancy of the pipeline queues to the -benchmark_file */
+static void print_queue_report(double t, int is_last_report)
+{
+    PacketQueue *q;
+    int type;
+
+    for (type = -1; type < AVMEDIA_TYPE_NB; type++) {
+        if (type < 0)
+            q = &mux_queue;
+        else if (pipeline_workers[type])
+            q = &pipeline_workers[type]->queue;
+        else
+            continue;
+        pthread_mutex_lock(&q->mutex);
+        fprintf(benchmark_file, "bench: time=%0.3f final=%d queue=%s count=%d max=%d avg=%0.1f size=%d\n",
+                t, is_last_report, type < 0 ? "mux" : media_type_name(type),
+                av_fifo_size(q->fifo) / (int)sizeof(QueuedPacket),
+                q->max_count, q->nb_puts ? (double)q->count_sum / q->nb_puts : 0,
+                q->max_packets);
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
+
+/* drain all stages and go back to doing everything in the calling thread */
+static void pipeline_stop(void)
+{
+    PipelineWorker *w;
+    int type;
+
+    /* the queues are gone by the time of the final stage report */
+    if (benchmark_file)
+        print_queue_report((av_gettime() - timer_start) / 1000000.0, 1);
+
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        if (!(w = pipeline_workers[type]))
+            continue;
+        packet_queue_finish(&w->queue);
+        pthread_join(w->thread, NULL);
+    }
+    packet_queue_finish(&mux_queue);
+    pthread_join(mux_thread, NULL);
+    pipeline_active = 0;
+
+    /* only now, as a failing thread aborts all the queues */
+    for (type = 0; type < AVMEDIA_TYPE_NB; type++) {
+        if (!(w = pipeline_workers[type]))
+            continue;
+        packet_queue_destroy(&w->queue);
+        av_freep(&pipeline_workers[type]);
+    }
+    packet_queue_destroy(&mux_queue);
+}
+#endif
+
+static void print_stage_times(const int64_t *stage_time, const int *stages)
+{
+    int64_t times[STAGE_NB];
+
+    lock_stats();
+    memcpy(times, stage_time, sizeof(times));
+    unlock_stats();
+    for (; *stages >= 0; stages++)
+        fprintf(benchmark_file, " %s=%0.3fs", stage_names[*stages],
+                times[*stages] / 1000000.0);
+}
+
+/* write one line per stream and pipeline queue to the -benchmark_file,
+   every second and at the end */
+static void print_stage_report(AVInputStream **ist_table, int nb_istreams,
+                               AVOutputStream **ost_table, int nb_ostreams,
+                               int is_last_report)
+{
+    static const int input_stages[]  = { STAGE_DEMUX, STAGE_DECODE, STAGE_FILTER, STAGE_WAIT, -1 };
+    static const int output_stages[] = { STAGE_SCALE, STAGE_ENCODE, STAGE_MUX, STAGE_WAIT, -1 };
+    static int64_t last_time = -1;
+    int64_t cur_time;
+    double t;
+    int i;
+
+    if (!benchmark_file)
+        return;
+    cur_time = av_gettime();
+    if (!is_last_report) {
+        if (last_time == -1) {
+            last_time = cur_time;
+            return;
+        }
+        if (cur_time - last_time < 1000000)
+            return;
+        last_time = cur_time;
+    }
+    t = (cur_time - timer_start) / 1000000.0;
+
+    for (i = 0; i < nb_istreams; i++) {
+        AVInputStream *ist = ist_table[i];
+        if (ist->discard)
+            continue;
+        fprintf(benchmark_file, "bench: time=%0.3f final=%d input=%d.%d type=%s",
+                t, is_last_report, ist->file_index, ist->index,
+                media_type_name(ist->st->codec->codec_type));
+        print_stage_times(ist->stage_time, input_stages);
+        fprintf(benchmark_file, "\n");
+    }
+    for (i = 0; i < nb_ostreams; i++) {
+        AVOutputStream *ost = ost_table[i];
+        OutputStreamState state;
+        get_output_state(ost, &state);
+        fprintf(benchmark_file, "bench: time=%0.3f final=%d output=%d.%d type=%s frames=%d fps=%0.1f",
+                t, is_last_report, ost->file_index, ost->index,
+                media_type_name(ost->st->codec->codec_type),
+                state.coded_frames, t > 0 ? state.coded_frames / t : 0);
+        print_stage_times(ost->stage_time, output_stages);
+        fprintf(benchmark_file, "\n");
+    }
+#if HAVE_PTHREADS
+    if (pipeline_active)
+        print_queue_report(t, is_last_report);
+#endif
+    fflush(benchmark_file);
+}
+
 /*
  * The following code is the main loop of the file converter
  */
@@ -1947,7 +2830,7 @@ static int av_transcode(AVFormatContext **output_files,
                         int nb_input_files,
                         AVStreamMap *stream_maps, int nb_stream_maps)
 {
-    int ret = 0, i, j, k, n, nb_istreams = 0, nb_ostreams = 0;
+    int ret = 0, i, j, k, n, nb_istreams = 0, nb_ostreams = 0, trailer_ret = 0;
     AVFormatContext *is, *os;
     AVCodecContext *codec, *icodec;
     AVOutputStream *ost, **ost_table = NULL;
@@ -1958,6 +2841,7 @@ static int av_transcode(AVFormatContext **output_files,
     int want_sdp = 1;
     uint8_t no_packet[MAX_FILES]={0};
     int no_packet_count=0;
+    int64_t t0;
 
     file_table= av_mallocz(nb_input_files * sizeof(AVInputFile));
     if (!file_table)
@@ -2052,12 +2936,16 @@ static int av_transcode(AVFormatContext **output_files,
     n = 0;
     for(k=0;k<nb_output_files;k++) {
         os = output_files[k];
+        output_streams_for_file[k] = av_mallocz(sizeof(AVOutputStream *) * os->nb_streams);
+        if (!output_streams_for_file[k])
+            goto fail;
         for(i=0;i<os->nb_streams;i++,n++) {
             int found;
             ost = ost_table[n];
             ost->file_index = k;
             ost->index = i;
             ost->st = os->streams[i];
+            output_streams_for_file[k][i] = ost;
             if (nb_stream_maps > 0) {
                 ost->source_index = file_table[stream_maps[n].file_index].ist_index +
                     stream_maps[n].stream_index;
@@ -2244,7 +3132,6 @@ static int av_transcode(AVFormatContext **output_files,
                         fprintf(stderr, "Cannot allocate temp picture, check pix fmt\n");
                         av_exit(1);
                     }
-                    sws_flags = av_get_int(sws_opts, "sws_flags", NULL);
                     ost->img_resample_ctx = sws_getContext(
                             icodec->width - (frame_leftBand + frame_rightBand),
                             icodec->height - (frame_topBand + frame_bottomBand),
@@ -2252,7 +3139,7 @@ static int av_transcode(AVFormatContext **output_files,
                             codec->width,
                             codec->height,
                             codec->pix_fmt,
-                            sws_flags, NULL, NULL, NULL);
+                            av_get_int(sws_opts, "sws_flags", NULL), NULL, NULL, NULL);
                     if (ost->img_resample_ctx == NULL) {
                         fprintf(stderr, "Cannot get resampling context\n");
                         av_exit(1);
@@ -2369,6 +3256,8 @@ static int av_transcode(AVFormatContext **output_files,
                 ret = AVERROR(EINVAL);
                 goto dump_format;
             }
+            if (ist->st->codec->active_thread_type & FF_THREAD_FRAME)
+                ist->pts_fifo = av_fifo_alloc(ist->st->codec->thread_count * sizeof(int64_t));
             //if (ist->st->codec->codec_type == AVMEDIA_TYPE_VIDEO)
             //    ist->st->codec->flags |= CODEC_FLAG_REPEAT_FIELD;
         }
@@ -2479,6 +3368,47 @@ static int av_transcode(AVFormatContext **output_files,
     }
     term_init();
 
+    if (benchmark_filename) {
+        benchmark_file = fopen(benchmark_filename, "w");
+        if (!benchmark_file) {
+            ret = AVERROR(errno);
+            fprintf(stderr, "Could not open benchmark file '%s'\n", benchmark_filename);
+            goto fail;
+        }
+    }
+#if HAVE_PTHREADS
+    main_thread = pthread_self();
+    /* open it here so that a failure is reported from the main thread */
+    if (vstats_filename && (parallel_outputs || pipeline) && !vstats_file) {
+        vstats_file = fopen(vstats_filename, "w");
+        if (!vstats_file) {
+            ret = AVERROR(errno);
+            fprintf(stderr, "Could not open vstats file '%s'\n", vstats_filename);
+            goto fail;
+        }
+    }
+#endif
+    if (parallel_outputs) {
+#if HAVE_PTHREADS
+        if ((ret = start_encode_workers(ost_table, nb_ostreams)) < 0) {
+            fprintf(stderr, "Could not start the output encoding threads\n");
+            goto fail;
+        }
+#else
+        fprintf(stderr, "Warning: -parallel_outputs needs thread support, encoding serially\n");
+#endif
+    }
+    if (pipeline) {
+#if HAVE_PTHREADS
+        if ((ret = pipeline_start(ist_table, nb_istreams, ost_table, nb_ostreams)) < 0) {
+            fprintf(stderr, "Could not start the transcoding pipeline\n");
+            goto fail;
+        }
+#else
+        fprintf(stderr, "Warning: -pipeline needs thread support, transcoding serially\n");
+#endif
+    }
+
     timer_start = av_gettime();
 
     for(; received_sigterm == 0;) {
@@ -2486,8 +3416,14 @@ static int av_transcode(AVFormatContext **output_files,
         AVPacket pkt;
         double ipts_min;
         double opts_min;
+        int64_t ist_pts, ist_next_pts;
 
     redo:
+#if HAVE_PTHREADS
+        /* a worker thread failed, stop feeding the pipeline */
+        if (pipeline_active && get_thread_error())
+            break;
+#endif
         ipts_min= 1e100;
         opts_min= 1e100;
         /* if 'q' pressed, exits */
@@ -2504,14 +3440,17 @@ static int av_transcode(AVFormatContext **output_files,
            smallest output pts */
         file_index = -1;
         for(i=0;i<nb_ostreams;i++) {
+            OutputStreamState state;
             double ipts, opts;
             ost = ost_table[i];
             os = output_files[ost->file_index];
             ist = ist_table[ost->source_index];
             if(ist->is_past_recording_time || no_packet[ist->file_index])
                 continue;
-                opts = ost->st->pts.val * av_q2d(ost->st->time_base);
-            ipts = (double)ist->pts;
+            get_output_state(ost, &state);
+            get_input_pts(ist, &ist_pts, &ist_next_pts);
+                opts = state.pts * av_q2d(ost->st->time_base);
+            ipts = (double)ist_pts;
             if (!file_table[ist->file_index].eof_reached){
                 if(ipts < ipts_min) {
                     ipts_min = ipts;
@@ -2522,7 +3461,7 @@ static int av_transcode(AVFormatContext **output_files,
                     if(!input_sync) file_index = ist->file_index;
                 }
             }
-            if(ost->frame_number >= max_frames[ost->st->codec->codec_type]){
+            if(state.frame_number >= max_frames[ost->st->codec->codec_type]){
                 file_index= -1;
                 break;
             }
@@ -2539,11 +3478,18 @@ static int av_transcode(AVFormatContext **output_files,
         }
 
         /* finish if limit size exhausted */
-        if (limit_filesize != 0 && limit_filesize < url_ftell(output_files[0]->pb))
-            break;
+        if (limit_filesize != 0) {
+            int64_t size;
+            lock_output();
+            size = url_ftell(output_files[0]->pb);
+            unlock_output();
+            if (limit_filesize < size)
+                break;
+        }
 
         /* read a frame from it and output it in the fifo */
         is = input_files[file_index];
+        t0 = stage_clock();
         ret= av_read_frame(is, &pkt);
         if(ret == AVERROR(EAGAIN)){
             no_packet[file_index]=1;
@@ -2572,6 +3518,7 @@ static int av_transcode(AVFormatContext **output_files,
         ist = ist_table[ist_index];
         if (ist->discard)
             goto discard_packet;
+        stage_add(&ist->stage_time[STAGE_DEMUX], t0);
 
         if (pkt.dts != AV_NOPTS_VALUE)
             pkt.dts += av_rescale_q(input_files_ts_offset[ist->file_index], AV_TIME_BASE_Q, ist->st->time_base);
@@ -2586,11 +3533,12 @@ static int av_transcode(AVFormatContext **output_files,
         }
 
 //        fprintf(stderr, "next:%"PRId64" dts:%"PRId64" off:%"PRId64" %d\n", ist->next_pts, pkt.dts, input_files_ts_offset[ist->file_index], ist->st->codec->codec_type);
-        if (pkt.dts != AV_NOPTS_VALUE && ist->next_pts != AV_NOPTS_VALUE
+        get_input_pts(ist, &ist_pts, &ist_next_pts);
+        if (pkt.dts != AV_NOPTS_VALUE && ist_next_pts != AV_NOPTS_VALUE
             && (is->iformat->flags & AVFMT_TS_DISCONT)) {
             int64_t pkt_dts= av_rescale_q(pkt.dts, ist->st->time_base, AV_TIME_BASE_Q);
-            int64_t delta= pkt_dts - ist->next_pts;
-            if((FFABS(delta) > 1LL*dts_delta_threshold*AV_TIME_BASE || pkt_dts+1<ist->pts)&& !copy_ts){
+            int64_t delta= pkt_dts - ist_next_pts;
+            if((FFABS(delta) > 1LL*dts_delta_threshold*AV_TIME_BASE || pkt_dts+1<ist_pts)&& !copy_ts){
                 input_files_ts_offset[ist->file_index]-= delta;
                 if (verbose > 2)
                     fprintf(stderr, "timestamp discontinuity %"PRId64", new offset= %"PRId64"\n", delta, input_files_ts_offset[ist->file_index]);
@@ -2608,6 +3556,15 @@ static int av_transcode(AVFormatContext **output_files,
         }
 
         //fprintf(stderr,"read #%d.%d size=%d\n", ist->file_index, ist->index, pkt.size);
+#if HAVE_PTHREADS
+        if (pipeline_active) {
+            if (av_dup_packet(&pkt) < 0)
+                goto discard_packet;
+            packet_queue_put(&pipeline_workers[pipeline_type(ist)]->queue, &pkt, ist_index,
+                             &ist->stage_time[STAGE_WAIT]);
+            goto discard_packet;
+        }
+#endif
         if (output_packet(ist, ist_index, ost_table, nb_ostreams, &pkt) < 0) {
 
             if (verbose >= 0)
@@ -2624,8 +3581,18 @@ static int av_transcode(AVFormatContext **output_files,
 
         /* dump report by using the output first video and audio streams */
         print_report(output_files, ost_table, nb_ostreams, 0);
+        print_stage_report(ist_table, nb_istreams, ost_table, nb_ostreams, 0);
     }
 
+#if HAVE_PTHREADS
+    if (pipeline_active)
+        pipeline_stop();
+    if (parallel_outputs_active)
+        stop_encode_workers();
+    if (get_thread_error())
+        av_exit(1);
+#endif
+
     /* at the end of stream, we must flush the decoder buffers */
     for(i=0;i<nb_istreams;i++) {
         ist = ist_table[i];
@@ -2639,11 +3606,15 @@ static int av_transcode(AVFormatContext **output_files,
     /* write the trailer if needed and close file */
     for(i=0;i<nb_output_files;i++) {
         os = output_files[i];
-        av_write_trailer(os);
+        if ((ret = av_write_trailer(os)) < 0) {
+            print_error(os->filename, ret);
+            trailer_ret = ret;
+        }
     }
 
     /* dump report by using the first video and audio streams */
     print_report(output_files, ost_table, nb_ostreams, 1);
+    print_stage_report(ist_table, nb_istreams, ost_table, nb_ostreams, 1);
 
     /* close each encoder */
     for(i=0;i<nb_ostreams;i++) {
@@ -2669,15 +3640,22 @@ static int av_transcode(AVFormatContext **output_files,
 #endif
 
     /* finished ! */
-    ret = 0;
+    ret = trailer_ret;
 
  fail:
     av_freep(&bit_buffer);
     av_free(file_table);
+    for(i=0;i<nb_output_files;i++)
+        av_freep(&output_streams_for_file[i]);
+    if (benchmark_file) {
+        fclose(benchmark_file);
+        benchmark_file = NULL;
+    }
 
     if (ist_table) {
         for(i=0;i<nb_istreams;i++) {
             ist = ist_table[i];
+            av_fifo_free(ist->pts_fifo);
             av_free(ist);
         }
         av_free(ist_table);
@@ -3176,6 +4154,9 @@ static void opt_input_file(const char *filename)
         print_error(filename, err);
         av_exit(1);
     }
+    if (read_ahead_size && ic->pb &&
+        (err = url_set_read_ahead(ic->pb, read_ahead_size)) < 0)
+        print_error(filename, err);
     if(opt_programid) {
         int i, j;
         int found=0;
@@ -4197,12 +5178,17 @@ static const OptionDef options[] = {
     { "dframes", OPT_INT | HAS_ARG, {(void*)&max_frames[AVMEDIA_TYPE_DATA]}, "set the number of data frames to record", "number" },
     { "benchmark", OPT_BOOL | OPT_EXPERT, {(void*)&do_benchmark},
       "add timings for benchmarking" },
+    { "benchmark_file", HAS_ARG | OPT_STRING | OPT_EXPERT, {(void*)&benchmark_filename},
+      "write per stream and stage timings to file", "file" },
     { "timelimit", OPT_FUNC2 | HAS_ARG, {(void*)opt_timelimit}, "set max runtime in seconds", "limit" },
     { "dump", OPT_BOOL | OPT_EXPERT, {(void*)&do_pkt_dump},
       "dump each input packet" },
     { "hex", OPT_BOOL | OPT_EXPERT, {(void*)&do_hex_dump},
       "when dumping packets, also dump the payload" },
     { "re", OPT_BOOL | OPT_EXPERT, {(void*)&rate_emu}, "read input at native frame rate", "" },
+    { "readahead", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&read_ahead_size}, "read input ahead in a background thread into a ring of the given size", "bytes" },
+    { "pipeline", OPT_BOOL | OPT_EXPERT, {(void*)&pipeline}, "decode/encode each media type and mux in separate threads" },
+    { "parallel_outputs", OPT_BOOL | OPT_EXPERT, {(void*)&parallel_outputs}, "encode the video of each output file in a separate thread" },
     { "loop_input", OPT_BOOL | OPT_EXPERT, {(void*)&loop_input}, "loop (current only works with images)" },
     { "loop_output", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&loop_output}, "number of times to loop output in formats that support looping (0 loops forever)", "" },
     { "v", HAS_ARG | OPT_FUNC2, {(void*)opt_verbose}, "set ffmpeg verbosity level", "number" },
@@ -44,6 +44,9 @@
 #if HAVE_POLL_H
 #include <poll.h>
 #endif
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <errno.h>
 #include <sys/time.h>
 #include <time.h>
@@ -52,6 +55,9 @@
 #if HAVE_DLFCN_H
 #include <dlfcn.h>
 #endif
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include "cmdutils.h"
 
@@ -99,6 +105,9 @@ static const char *http_state[] = {
 
 #define SYNC_TIMEOUT (10 * 1000)
 
+#define FEED_RING_MARGIN (5 * 1000000) /* in us, on top of the preroll */
+#define FEED_RING_MAX_CHUNKS 65536
+
 typedef struct RTSPActionServerSetup {
     uint32_t ipaddr;
     char transport_option[512];
@@ -115,6 +124,10 @@ typedef struct HTTPContext {
     int fd; /* socket file descriptor */
     struct sockaddr_in from_addr; /* origin */
     struct pollfd *poll_entry; /* used when polling */
+    int revents; /* POLL* events of fd. With epoll they are kept until
+                    the socket would block, as it is edge-triggered */
+    int ready; /* in one of the lists of connections to handle */
+    struct HTTPContext *next_ready;
     int64_t timeout;
     uint8_t *buffer_ptr, *buffer_end;
     int http_error;
@@ -137,6 +150,8 @@ typedef struct HTTPContext {
                                   packet */
     int pts_stream_index;        /* stream we choose as clock reference */
     int64_t cur_clock;           /* current clock reference value in us */
+    int catch_up;                /* send the feed data older than now
+                                    without pacing it */
     /* output format handling */
     struct FFStream *stream;
     /* -1 is invalid stream */
@@ -144,6 +159,14 @@ typedef struct HTTPContext {
     int switch_feed_streams[MAX_STREAMS]; /* index of streams in the feed */
     int switch_pending;
     AVFormatContext fmt_ctx; /* instance of FFStream for one user */
+    struct FeedRing *ring; /* if non NULL, data is taken from the shared
+                              ring of the stream instead of fmt_in */
+    int64_t ring_seq;      /* next chunk of the ring to send */
+    struct FeedChunk *chunk; /* chunk being sent, a reference is held */
+    struct ServerWorker *worker; /* if non NULL, the data is sent by this
+                                    worker thread */
+    struct HTTPContext *next_worker;
+    int64_t worker_data_count; /* data_count when given to the worker */
     int last_packet_sent; /* true if last data packet was sent */
     int suppress_log;
     DataRateData datarate;
@@ -179,6 +202,7 @@ enum StreamType {
     STREAM_TYPE_LIVE,
     STREAM_TYPE_STATUS,
     STREAM_TYPE_REDIRECT,
+    STREAM_TYPE_METRICS,
 };
 
 enum IPAddressAction {
@@ -194,6 +218,31 @@ typedef struct IPAddressACL {
     struct in_addr last;
 } IPAddressACL;
 
+/* a piece of muxed output of a stream, shared by all its clients */
+typedef struct FeedChunk {
+    int refcount;
+    int key;        /* true if a client can start with this chunk */
+    int64_t pts;    /* time of the first packet in the chunk, in us */
+    int size;
+    uint8_t *data;
+} FeedChunk;
+
+/* recent output of a live stream, read and muxed once from the feed
+   and then sent as is to every client of the stream */
+typedef struct FeedRing {
+    AVFormatContext *fmt_in;  /* reader of the feed file */
+    AVFormatContext fmt_ctx;  /* muxer common to all the clients */
+    FeedChunk *header;
+    FeedChunk **chunks;       /* chunk of sequence number n is at n & (size - 1) */
+    int size;                 /* allocated entries, a power of 2 */
+    int64_t first_seq;        /* oldest chunk still available */
+    int64_t next_seq;         /* sequence number of the next chunk */
+    int64_t last_key_seq;     /* last chunk with key set, -1 if none */
+    int pending_key;          /* a key frame did not produce output yet */
+    int closed;               /* the feeder went away, no chunk will follow */
+    int nb_clients;
+} FeedRing;
+
 /* description of each stream of the ffserver.conf file */
 typedef struct FFStream {
     enum StreamType stream_type;
@@ -209,6 +258,8 @@ typedef struct FFStream {
     int prebuffer;      /* Number of millseconds early to start */
     int64_t max_time;      /* Number of milliseconds to run */
     int send_on_key;
+    int shared_mux;     /* true if the clients share one muxer */
+    FeedRing *ring;     /* shared output, NULL if no client uses it */
     AVStream *streams[MAX_STREAMS];
     int feed_streams[MAX_STREAMS]; /* index of streams in the feed */
     char feed_filename[1024]; /* file name of the feed storage, or
@@ -238,9 +289,17 @@ typedef struct FFStream {
     int truncate;        /* True if feeder connection truncate the feed file */
     int conns_served;
     int64_t bytes_served;
+    int64_t mux_time;           /* time spent muxing output, in us */
+    int64_t dropped_chunks;     /* shared output skipped by slow clients */
     int64_t feed_max_size;      /* maximum storage size, zero means unlimited */
     int64_t feed_write_index;   /* current write position in feed (it wraps around) */
     int64_t feed_size;          /* current size of feed */
+    int64_t bytes_received;     /* data received from the feeders */
+    DataRateData ingest_rate;
+    int64_t last_pts;           /* time of the last packet of the feed in us */
+    AVFormatContext *key_in;    /* reader finding the key frames of the feed */
+    int64_t key_pts[MAX_STREAMS]; /* time of the last key frame of each
+                                     feed stream in us, 0 if unknown */
     struct FFStream *next_feed;
 } FFStream;
 
@@ -254,20 +313,72 @@ static struct sockaddr_in my_rtsp_addr;
 
 static char logfilename[1024];
 static HTTPContext *first_http_ctx;
+#if HAVE_SYS_EPOLL_H
+static int epoll_fd = -1; /* -1 if poll() is used */
+#endif
+/* connections to handle in the next iteration of the epoll loop, and the
+   rest of the ones of the current iteration */
+static HTTPContext *first_ready_ctx, *pending_ready_ctx;
+static int timed_connections; /* set if a connection has timed output */
 static FFStream *first_feed;   /* contains only feeds */
 static FFStream *first_stream; /* contains all streams, including feeds */
 
+#if HAVE_PTHREADS
+/* thread sending the shared output of the streams to some of the clients */
+typedef struct ServerWorker {
+    pthread_t thread;
+    int pipe[2];               /* written to wake the worker up */
+    struct pollfd *poll_table;
+    HTTPContext *new_ctx;      /* connections given to the worker */
+} ServerWorker;
+
+static ServerWorker *workers;
+static int nb_workers;
+static unsigned int next_worker;
+/* protects the rings, the chunk reference counts and the fields of the
+   connections sent by the workers */
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static HTTPContext *returned_ctx; /* connections the workers are done with */
+static int worker_pipe[2];        /* written to wake the main loop up */
+#endif
+
+static void ring_lock(void)
+{
+#if HAVE_PTHREADS
+    if (nb_workers)
+        pthread_mutex_lock(&ring_mutex);
+#endif
+}
+
+static void ring_unlock(void)
+{
+#if HAVE_PTHREADS
+    if (nb_workers)
+        pthread_mutex_unlock(&ring_mutex);
+#endif
+}
+
 static void new_connection(int server_fd, int is_rtsp);
 static void close_connection(HTTPContext *c);
 
 /* HTTP handling */
 static int handle_connection(HTTPContext *c);
 static int http_parse_request(HTTPContext *c);
+static int http_prepare_data(HTTPContext *c);
 static int http_send_data(HTTPContext *c);
 static void compute_status(HTTPContext *c);
+static void compute_metrics(HTTPContext *c, const char *info);
 static int open_input_stream(HTTPContext *c, const char *info);
+static int feed_ring_open(HTTPContext *c, const char *info);
+static void feed_ring_close(HTTPContext *c);
+static void feed_ring_fill(FFStream *stream);
 static int http_start_receive_data(HTTPContext *c);
 static int http_receive_data(HTTPContext *c);
+#if HAVE_PTHREADS
+static int start_workers(void);
+static void give_to_worker(HTTPContext *c);
+static void close_worker_connections(void);
+#endif
 
 /* RTSP handling */
 static int rtsp_parse_request(HTTPContext *c);
@@ -581,19 +692,203 @@ static void start_multicast(void)
     }
 }
 
+/* return the POLL* events a connection waits for in its current state */
+static int connection_events(HTTPContext *c)
+{
+    if (c->worker)
+        return 0;
+    switch(c->state) {
+    case HTTPSTATE_SEND_HEADER:
+    case RTSPSTATE_SEND_REPLY:
+    case RTSPSTATE_SEND_PACKET:
+        return POLLOUT;
+    case HTTPSTATE_SEND_DATA_HEADER:
+    case HTTPSTATE_SEND_DATA:
+    case HTTPSTATE_SEND_DATA_TRAILER:
+        /* for TCP, we output as much as we can (may need to put a limit),
+           packetized output is timed by ffserver instead */
+        return c->is_packetized ? 0 : POLLOUT;
+    case HTTPSTATE_WAIT_REQUEST:
+    case HTTPSTATE_RECEIVE_DATA:
+    case HTTPSTATE_WAIT_FEED:
+    case RTSPSTATE_WAIT_REQUEST:
+        /* need to catch errors */
+        return POLLIN; /* Maybe this will work */
+    default:
+        return 0;
+    }
+}
+
+/* return true if ffserver sends the packets of the connection at their
+   time, which needs looking at it every 10 ms */
+static int connection_is_timed(HTTPContext *c)
+{
+    return c->is_packetized &&
+           (c->state == HTTPSTATE_SEND_DATA_HEADER ||
+            c->state == HTTPSTATE_SEND_DATA ||
+            c->state == HTTPSTATE_SEND_DATA_TRAILER);
+}
+
+/* queue a connection for the next iteration of the epoll loop, for
+   events on its socket or a state change made by another connection */
+static void wake_connection(HTTPContext *c)
+{
+#if HAVE_SYS_EPOLL_H
+    if (epoll_fd < 0 || c->ready)
+        return;
+    c->ready = 1;
+    c->next_ready = first_ready_ctx;
+    first_ready_ctx = c;
+#endif
+}
+
+static void unlink_ready_connection(HTTPContext *c)
+{
+    HTTPContext **cp;
+
+    for (cp = &first_ready_ctx; *cp; cp = &(*cp)->next_ready)
+        if (*cp == c) {
+            *cp = c->next_ready;
+            return;
+        }
+    for (cp = &pending_ready_ctx; *cp; cp = &(*cp)->next_ready)
+        if (*cp == c) {
+            *cp = c->next_ready;
+            return;
+        }
+}
+
+static void process_connection(HTTPContext *c)
+{
+    if (c->worker) {
+        /* only the statistics are kept by the main loop */
+        ring_lock();
+        update_datarate(&c->datarate, c->data_count);
+        ring_unlock();
+        return;
+    }
+    if (handle_connection(c) < 0) {
+        /* close and free the connection */
+        log_connection(c);
+        close_connection(c);
+        return;
+    }
+#if HAVE_PTHREADS
+    if (c->ring && nb_workers && c->state == HTTPSTATE_SEND_DATA_HEADER) {
+        if (http_prepare_data(c) < 0) {
+            log_connection(c);
+            close_connection(c);
+        } else
+            give_to_worker(c);
+        return;
+    }
+#endif
+    /* come back to connections which could go on, as poll() would report
+       their events again */
+    if (c->revents & (connection_events(c) | POLLERR | POLLHUP))
+        wake_connection(c);
+    if (connection_is_timed(c))
+        timed_connections = 1;
+}
+
+#if HAVE_SYS_EPOLL_H
+/* Main loop using edge-triggered epoll. Only the connections with events
+   or woken up by others are handled in each iteration, all of them are
+   looked at every second for timeouts, or every 10 ms while there are
+   connections with timed output. */
+static int http_server_epoll(int server_fd, int rtsp_server_fd)
+{
+    struct epoll_event events[256], ev;
+    HTTPContext *c, *c_next;
+    int64_t next_sweep;
+    int ret, i, delay, new_http, new_rtsp;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server_fd;
+    if (server_fd && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+        return -1;
+    ev.data.ptr = &rtsp_server_fd;
+    if (rtsp_server_fd && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rtsp_server_fd, &ev) < 0)
+        return -1;
+#if HAVE_PTHREADS
+    ev.data.ptr = worker_pipe;
+    if (nb_workers && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker_pipe[0], &ev) < 0)
+        return -1;
+#endif
+
+    next_sweep = cur_time = av_gettime() / 1000;
+    for(;;) {
+        delay = first_ready_ctx ? 0 : FFMAX(next_sweep - cur_time, 0);
+        do {
+            ret = epoll_wait(epoll_fd, events, FF_ARRAY_ELEMS(events), delay);
+            if (ret < 0 && ff_neterrno() != FF_NETERROR(EAGAIN) &&
+                ff_neterrno() != FF_NETERROR(EINTR))
+                return -1;
+        } while (ret < 0);
+
+        cur_time = av_gettime() / 1000;
+
+        if (need_to_start_children) {
+            need_to_start_children = 0;
+            start_children(first_feed);
+        }
+
+        new_http = new_rtsp = 0;
+        for (i = 0; i < ret; i++) {
+            if (events[i].data.ptr == &server_fd) {
+                new_http = 1;
+            } else if (events[i].data.ptr == &rtsp_server_fd) {
+                new_rtsp = 1;
+#if HAVE_PTHREADS
+            } else if (events[i].data.ptr == worker_pipe) {
+                close_worker_connections();
+#endif
+            } else {
+                c = events[i].data.ptr;
+                if (events[i].events & EPOLLIN)  c->revents |= POLLIN;
+                if (events[i].events & EPOLLOUT) c->revents |= POLLOUT;
+                if (events[i].events & EPOLLERR) c->revents |= POLLERR;
+                if (events[i].events & EPOLLHUP) c->revents |= POLLHUP;
+                wake_connection(c);
+            }
+        }
+
+        /* now handle the events */
+        pending_ready_ctx = first_ready_ctx;
+        first_ready_ctx = NULL;
+        while ((c = pending_ready_ctx)) {
+            pending_ready_ctx = c->next_ready;
+            c->ready = 0;
+            process_connection(c);
+        }
+
+        if (cur_time >= next_sweep) {
+            timed_connections = 0;
+            for(c = first_http_ctx; c != NULL; c = c_next) {
+                c_next = c->next;
+                process_connection(c);
+            }
+            next_sweep = cur_time + 1000;
+        }
+        if (timed_connections)
+            next_sweep = FFMIN(next_sweep, cur_time + 10);
+
+        if (new_http)
+            new_connection(server_fd, 0);
+        if (new_rtsp)
+            new_connection(rtsp_server_fd, 1);
+    }
+}
+#endif
+
 /* main loop of the http server */
 static int http_server(void)
 {
     int server_fd = 0, rtsp_server_fd = 0;
-    int ret, delay, delay1;
+    int ret, delay;
     struct pollfd *poll_table, *poll_entry;
     HTTPContext *c, *c_next;
 
-    if(!(poll_table = av_mallocz((nb_max_http_connections + 2)*sizeof(*poll_table)))) {
-        http_log("Impossible to allocate a poll table handling %d connections.\n", nb_max_http_connections);
-        return -1;
-    }
-
     if (my_http_addr.sin_port) {
         server_fd = socket_open_listen(&my_http_addr);
         if (server_fd < 0)
@@ -617,6 +912,25 @@ static int http_server(void)
 
     start_multicast();
 
+#if HAVE_PTHREADS
+    if (start_workers() < 0)
+        return -1;
+#endif
+
+#if HAVE_SYS_EPOLL_H
+    epoll_fd = epoll_create(nb_max_http_connections + 2);
+    if (epoll_fd >= 0) {
+        fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+        return http_server_epoll(server_fd, rtsp_server_fd);
+    }
+    http_log("epoll not available, using poll: %s\n", strerror(errno));
+#endif
+
+    if(!(poll_table = av_mallocz((nb_max_http_connections + 3)*sizeof(*poll_table)))) {
+        http_log("Impossible to allocate a poll table handling %d connections.\n", nb_max_http_connections);
+        return -1;
+    }
+
     for(;;) {
         poll_entry = poll_table;
         if (server_fd) {
@@ -629,53 +943,29 @@ static int http_server(void)
             poll_entry->events = POLLIN;
             poll_entry++;
         }
+#if HAVE_PTHREADS
+        if (nb_workers) {
+            poll_entry->fd = worker_pipe[0];
+            poll_entry->events = POLLIN;
+            poll_entry++;
+        }
+#endif
 
         /* wait for events on each HTTP handle */
         c = first_http_ctx;
         delay = 1000;
         while (c != NULL) {
-            int fd;
-            fd = c->fd;
-            switch(c->state) {
-            case HTTPSTATE_SEND_HEADER:
-            case RTSPSTATE_SEND_REPLY:
-            case RTSPSTATE_SEND_PACKET:
-                c->poll_entry = poll_entry;
-                poll_entry->fd = fd;
-                poll_entry->events = POLLOUT;
-                poll_entry++;
-                break;
-            case HTTPSTATE_SEND_DATA_HEADER:
-            case HTTPSTATE_SEND_DATA:
-            case HTTPSTATE_SEND_DATA_TRAILER:
-                if (!c->is_packetized) {
-                    /* for TCP, we output as much as we can (may need to put a limit) */
-                    c->poll_entry = poll_entry;
-                    poll_entry->fd = fd;
-                    poll_entry->events = POLLOUT;
-                    poll_entry++;
-                } else {
-                    /* when ffserver is doing the timing, we work by
-                       looking at which packet need to be sent every
-                       10 ms */
-                    delay1 = 10; /* one tick wait XXX: 10 ms assumed */
-                    if (delay1 < delay)
-                        delay = delay1;
-                }
-                break;
-            case HTTPSTATE_WAIT_REQUEST:
-            case HTTPSTATE_RECEIVE_DATA:
-            case HTTPSTATE_WAIT_FEED:
-            case RTSPSTATE_WAIT_REQUEST:
-                /* need to catch errors */
+            c->poll_entry = NULL;
+            if (connection_events(c)) {
                 c->poll_entry = poll_entry;
-                poll_entry->fd = fd;
-                poll_entry->events = POLLIN;/* Maybe this will work */
+                poll_entry->fd = c->fd;
+                poll_entry->events = connection_events(c);
                 poll_entry++;
-                break;
-            default:
-                c->poll_entry = NULL;
-                break;
+            } else if (connection_is_timed(c)) {
+                /* when ffserver is doing the timing, we work by
+                   looking at which packet need to be sent every
+                   10 ms */
+                delay = FFMIN(delay, 10); /* one tick wait XXX: 10 ms assumed */
             }
             c = c->next;
         }
@@ -699,11 +989,8 @@ static int http_server(void)
         /* now handle the events */
         for(c = first_http_ctx; c != NULL; c = c_next) {
             c_next = c->next;
-            if (handle_connection(c) < 0) {
-                /* close and free the connection */
-                log_connection(c);
-                close_connection(c);
-            }
+            c->revents = c->poll_entry ? c->poll_entry->revents : 0;
+            process_connection(c);
         }
 
         poll_entry = poll_table;
@@ -717,7 +1004,12 @@ static int http_server(void)
             /* new RTSP connection request ? */
             if (poll_entry->revents & POLLIN)
                 new_connection(rtsp_server_fd, 1);
+            poll_entry++;
         }
+#if HAVE_PTHREADS
+        if (nb_workers && poll_entry->revents & POLLIN)
+            close_worker_connections();
+#endif
     }
 }
 
@@ -785,6 +1077,18 @@ static void new_connection(int server_fd, int is_rtsp)
     if (!c->buffer)
         goto fail;
 
+#if HAVE_SYS_EPOLL_H
+    if (epoll_fd >= 0) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            http_log("error adding connection to epoll %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+#endif
+
     c->next = first_http_ctx;
     first_http_ctx = c;
     nb_connections++;
@@ -819,6 +1123,9 @@ static void close_connection(HTTPContext *c)
             cp = &c1->next;
     }
 
+    if (c->ready)
+        unlink_ready_connection(c);
+
     /* remove references, if any (XXX: do it faster) */
     for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
         if (c1->rtsp_c == c)
@@ -826,8 +1133,14 @@ static void close_connection(HTTPContext *c)
     }
 
     /* remove connection associated resources */
-    if (c->fd >= 0)
+    if (c->fd >= 0) {
+#if HAVE_SYS_EPOLL_H
+        if (epoll_fd >= 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+#endif
         closesocket(c->fd);
+    }
+    feed_ring_close(c);
     if (c->fmt_in) {
         /* close each frame parser */
         for(i=0;i<c->fmt_in->nb_streams;i++) {
@@ -898,11 +1211,11 @@ static int handle_connection(HTTPContext *c)
         /* timeout ? */
         if ((c->timeout - cur_time) < 0)
             return -1;
-        if (c->poll_entry->revents & (POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
 
         /* no need to read if no events */
-        if (!(c->poll_entry->revents & POLLIN))
+        if (!(c->revents & POLLIN))
             return 0;
         /* read the data */
     read_loop:
@@ -911,6 +1224,8 @@ static int handle_connection(HTTPContext *c)
             if (ff_neterrno() != FF_NETERROR(EAGAIN) &&
                 ff_neterrno() != FF_NETERROR(EINTR))
                 return -1;
+            if (ff_neterrno() == FF_NETERROR(EAGAIN))
+                c->revents &= ~POLLIN;
         } else if (len == 0) {
             return -1;
         } else {
@@ -936,11 +1251,11 @@ static int handle_connection(HTTPContext *c)
         break;
 
     case HTTPSTATE_SEND_HEADER:
-        if (c->poll_entry->revents & (POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
 
         /* no need to write if no events */
-        if (!(c->poll_entry->revents & POLLOUT))
+        if (!(c->revents & POLLOUT))
             return 0;
         len = send(c->fd, c->buffer_ptr, c->buffer_end - c->buffer_ptr, 0);
         if (len < 0) {
@@ -950,6 +1265,8 @@ static int handle_connection(HTTPContext *c)
                 av_freep(&c->pb_buffer);
                 return -1;
             }
+            if (ff_neterrno() == FF_NETERROR(EAGAIN))
+                c->revents &= ~POLLOUT;
         } else {
             c->buffer_ptr += len;
             if (c->stream)
@@ -974,11 +1291,11 @@ static int handle_connection(HTTPContext *c)
            input streams sets the speed). It may be better to verify
            that we do not rely too much on the kernel queues */
         if (!c->is_packetized) {
-            if (c->poll_entry->revents & (POLLERR | POLLHUP))
+            if (c->revents & (POLLERR | POLLHUP))
                 return -1;
 
             /* no need to read if no events */
-            if (!(c->poll_entry->revents & POLLOUT))
+            if (!(c->revents & POLLOUT))
                 return 0;
         }
         if (http_send_data(c) < 0)
@@ -989,28 +1306,36 @@ static int handle_connection(HTTPContext *c)
         break;
     case HTTPSTATE_RECEIVE_DATA:
         /* no need to read if no events */
-        if (c->poll_entry->revents & (POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
-        if (!(c->poll_entry->revents & POLLIN))
+        if (!(c->revents & POLLIN))
             return 0;
         if (http_receive_data(c) < 0)
             return -1;
         break;
     case HTTPSTATE_WAIT_FEED:
         /* no need to read if no events */
-        if (c->poll_entry->revents & (POLLIN | POLLERR | POLLHUP))
+        if (c->revents & (POLLERR | POLLHUP))
             return -1;
+        if (c->revents & POLLIN) {
+            /* with epoll, POLLIN may be left over from the request */
+            uint8_t dummy;
+            if (recv(c->fd, &dummy, 1, MSG_PEEK) >= 0 ||
+                ff_neterrno() != FF_NETERROR(EAGAIN))
+                return -1;
+            c->revents &= ~POLLIN;
+        }
 
         /* nothing to do, we'll be waken up by incoming feed packets */
         break;
 
     case RTSPSTATE_SEND_REPLY:
-        if (c->poll_entry->revents & (POLLERR | POLLHUP)) {
+        if (c->revents & (POLLERR | POLLHUP)) {
             av_freep(&c->pb_buffer);
             return -1;
         }
         /* no need to write if no events */
-        if (!(c->poll_entry->revents & POLLOUT))
+        if (!(c->revents & POLLOUT))
             return 0;
         len = send(c->fd, c->buffer_ptr, c->buffer_end - c->buffer_ptr, 0);
         if (len < 0) {
@@ -1020,6 +1345,8 @@ static int handle_connection(HTTPContext *c)
                 av_freep(&c->pb_buffer);
                 return -1;
             }
+            if (ff_neterrno() == FF_NETERROR(EAGAIN))
+                c->revents &= ~POLLOUT;
         } else {
             c->buffer_ptr += len;
             c->data_count += len;
@@ -1031,12 +1358,12 @@ static int handle_connection(HTTPContext *c)
         }
         break;
     case RTSPSTATE_SEND_PACKET:
-        if (c->poll_entry->revents & (POLLERR | POLLHUP)) {
+        if (c->revents & (POLLERR | POLLHUP)) {
             av_freep(&c->packet_buffer);
             return -1;
         }
         /* no need to write if no events */
-        if (!(c->poll_entry->revents & POLLOUT))
+        if (!(c->revents & POLLOUT))
             return 0;
         len = send(c->fd, c->packet_buffer_ptr,
                     c->packet_buffer_end - c->packet_buffer_ptr, 0);
@@ -1047,6 +1374,8 @@ static int handle_connection(HTTPContext *c)
                 av_freep(&c->packet_buffer);
                 return -1;
             }
+            if (ff_neterrno() == FF_NETERROR(EAGAIN))
+                c->revents &= ~POLLOUT;
         } else {
             c->packet_buffer_ptr += len;
             if (c->packet_buffer_ptr >= c->packet_buffer_end) {
@@ -1801,11 +2130,12 @@ static int http_parse_request(HTTPContext *c)
         http_log("\nGot request:\n%s\n", c->buffer);
 #endif
 
-    if (c->stream->stream_type == STREAM_TYPE_STATUS)
+    if (c->stream->stream_type == STREAM_TYPE_STATUS ||
+        c->stream->stream_type == STREAM_TYPE_METRICS)
         goto send_status;
 
     /* open input stream */
-    if (open_input_stream(c, info) < 0) {
+    if (feed_ring_open(c, info) < 0 && open_input_stream(c, info) < 0) {
         snprintf(msg, sizeof(msg), "Input stream corresponding to '%s' not found", url);
         goto send_error;
     }
@@ -1852,13 +2182,43 @@ static int http_parse_request(HTTPContext *c)
     c->state = HTTPSTATE_SEND_HEADER;
     return 0;
  send_status:
-    compute_status(c);
+    /* the fields the workers update are read under ring_lock() when listed */
+    if (c->stream->stream_type == STREAM_TYPE_METRICS)
+        compute_metrics(c, info);
+    else
+        compute_status(c);
     c->http_error = 200; /* horrible : we use this value to avoid
                             going to the send data state */
     c->state = HTTPSTATE_SEND_HEADER;
     return 0;
 }
 
+/* bytes sent on a connection, which a worker may be updating */
+static int64_t connection_data_count(HTTPContext *c)
+{
+    int64_t count;
+
+    if (!c->worker)
+        return c->data_count;
+    ring_lock();
+    count = c->data_count;
+    ring_unlock();
+    return count;
+}
+
+/* bytes sent to the clients of a stream, including the connections
+   still handled by a worker */
+static int64_t stream_bytes_served(FFStream *stream)
+{
+    int64_t bytes = stream->bytes_served;
+    HTTPContext *c;
+
+    for(c = first_http_ctx; c; c = c->next)
+        if (c->worker && c->stream == stream)
+            bytes += connection_data_count(c) - c->worker_data_count;
+    return bytes;
+}
+
 static void fmt_bytecount(ByteIOContext *pb, int64_t count)
 {
     static const char *suffix = " kMGTP";
@@ -1875,6 +2235,7 @@ static void compute_status(HTTPContext *c)
     FFStream *stream;
     char *p;
     time_t ti;
+    int64_t data_count;
     int i, len;
     ByteIOContext *pb;
 
@@ -1930,7 +2291,7 @@ static void compute_status(HTTPContext *c)
                          sfilename, stream->filename);
             url_fprintf(pb, "<td align=right> %d <td align=right> ",
                         stream->conns_served);
-            fmt_bytecount(pb, stream->bytes_served);
+            fmt_bytecount(pb, stream_bytes_served(stream));
             switch(stream->stream_type) {
             case STREAM_TYPE_LIVE: {
                     int audio_bit_rate = 0;
@@ -2092,9 +2453,10 @@ static void compute_status(HTTPContext *c)
                     http_state[c1->state]);
         fmt_bytecount(pb, bitrate);
         url_fprintf(pb, "<td align=right>");
-        fmt_bytecount(pb, compute_datarate(&c1->datarate, c1->data_count) * 8);
+        data_count = connection_data_count(c1);
+        fmt_bytecount(pb, compute_datarate(&c1->datarate, data_count) * 8);
         url_fprintf(pb, "<td align=right>");
-        fmt_bytecount(pb, c1->data_count);
+        fmt_bytecount(pb, data_count);
         url_fprintf(pb, "\n");
         c1 = c1->next;
     }
@@ -2111,6 +2473,282 @@ static void compute_status(HTTPContext *c)
     c->buffer_end = c->pb_buffer + len;
 }
 
+/* writer of the metrics page, either as JSON or as one
+   "name{labels} value" line per metric */
+typedef struct MetricsWriter {
+    ByteIOContext *pb;
+    int json;
+    const char *prefix;  /* kind of the object the next values are about */
+    char labels[512];    /* text format: labels of the current object */
+    int nb_values;       /* values written in the current JSON object */
+    int nb_objects;      /* objects written in the current JSON array */
+} MetricsWriter;
+
+static void metrics_string(MetricsWriter *m, const char *str)
+{
+    url_fprintf(m->pb, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            url_fprintf(m->pb, "\\%c", *str);
+        else if ((unsigned char)*str >= ' ')
+            url_fprintf(m->pb, "%c", *str);
+    }
+    url_fprintf(m->pb, "\"");
+}
+
+static void metrics_begin_list(MetricsWriter *m, const char *name)
+{
+    if (m->json)
+        url_fprintf(m->pb, ",\n\"%s\": [", name);
+    m->nb_objects = 0;
+}
+
+static void metrics_end_list(MetricsWriter *m)
+{
+    if (m->json)
+        url_fprintf(m->pb, "]");
+}
+
+/* start the values of one feed, stream or connection */
+static void metrics_begin(MetricsWriter *m, const char *prefix)
+{
+    if (m->json)
+        url_fprintf(m->pb, "%s\n{", m->nb_objects ? "," : "");
+    m->nb_objects++;
+    m->prefix = prefix;
+    m->labels[0] = '\0';
+    m->nb_values = 0;
+}
+
+static void metrics_end(MetricsWriter *m)
+{
+    if (m->json)
+        url_fprintf(m->pb, "}");
+    m->prefix = NULL;
+    m->labels[0] = '\0';
+    m->nb_values = 0;
+}
+
+static void metrics_label(MetricsWriter *m, const char *name, const char *value)
+{
+    if (m->json) {
+        url_fprintf(m->pb, "%s\"%s\": ", m->nb_values++ ? ", " : "", name);
+        metrics_string(m, value);
+    } else {
+        char *q = m->labels + strlen(m->labels);
+        int size = m->labels + sizeof(m->labels) - q;
+        /* quotes and backslashes cannot be escaped in the labels */
+        snprintf(q, size, "%s%s=\"", *m->labels ? "," : "", name);
+        q += strlen(q);
+        for (; *value && q < m->labels + sizeof(m->labels) - 2; value++)
+            if (*value != '"' && *value != '\\' && (unsigned char)*value >= ' ')
+                *q++ = *value;
+        *q++ = '"';
+        *q = '\0';
+    }
+}
+
+static void metrics_value(MetricsWriter *m, const char *name, int64_t value)
+{
+    if (m->json) {
+        url_fprintf(m->pb, "%s\"%s\": %"PRId64, m->nb_values++ ? ", " : "",
+                    name, value);
+    } else if (m->prefix) {
+        url_fprintf(m->pb, "ffserver_%s_%s{%s} %"PRId64"\n",
+                    m->prefix, name, m->labels, value);
+    } else {
+        url_fprintf(m->pb, "ffserver_%s %"PRId64"\n", name, value);
+    }
+}
+
+/* bytes accepted by the kernel but not yet sent on the socket */
+static int socket_backlog(int fd)
+{
+#ifdef TIOCOUTQ
+    int size;
+    if (fd >= 0 && !ioctl(fd, TIOCOUTQ, &size))
+        return size;
+#endif
+    return 0;
+}
+
+/* data a connection has to send before reaching what it would send if
+   it was not late */
+static int64_t connection_backlog(HTTPContext *c)
+{
+    int64_t size = 0;
+
+    if (c->state == HTTPSTATE_SEND_DATA ||
+        c->state == HTTPSTATE_WAIT_FEED ||
+        c->state == HTTPSTATE_SEND_DATA_TRAILER) {
+        /* a worker moves the send position of the connections it owns */
+        if (c->worker)
+            ring_lock();
+        size = c->buffer_end - c->buffer_ptr;
+        if (c->ring) {
+            int64_t seq;
+            for(seq = FFMAX(c->ring_seq, c->ring->first_seq); seq < c->ring->next_seq; seq++)
+                size += c->ring->chunks[seq & (c->ring->size - 1)]->size;
+        }
+        if (c->worker)
+            ring_unlock();
+    }
+    if (!c->is_packetized)
+        size += socket_backlog(c->fd);
+    return size;
+}
+
+/* machine readable version of the status page: plain text metrics, or
+   JSON if the request has "format=json" */
+static void compute_metrics(HTTPContext *c, const char *info)
+{
+    MetricsWriter m1, *m = &m1;
+    HTTPContext *c1;
+    FFStream *stream;
+    char buf[32];
+    int64_t data_count;
+    int len, i;
+
+    memset(m, 0, sizeof(*m));
+    if (url_open_dyn_buf(&m->pb) < 0) {
+        c->buffer_ptr = c->buffer;
+        c->buffer_end = c->buffer;
+        return;
+    }
+    m->json = find_info_tag(buf, sizeof(buf), "format", info) &&
+              !strcmp(buf, "json");
+
+    url_fprintf(m->pb, "HTTP/1.0 200 OK\r\n");
+    url_fprintf(m->pb, "Content-type: %s\r\n",
+                m->json ? "application/json" : "text/plain");
+    url_fprintf(m->pb, "Pragma: no-cache\r\n");
+    url_fprintf(m->pb, "\r\n");
+
+    if (m->json)
+        url_fprintf(m->pb, "{");
+    metrics_value(m, "open_connections", nb_connections);
+    metrics_value(m, "max_connections", nb_max_connections);
+    metrics_value(m, "bandwidth_kbits", current_bandwidth);
+    metrics_value(m, "max_bandwidth_kbits", max_bandwidth);
+
+    metrics_begin_list(m, "feeds");
+    for(stream = first_feed; stream; stream = stream->next_feed) {
+        metrics_begin(m, "feed");
+        metrics_label(m, "feed", stream->filename);
+        metrics_value(m, "connected", stream->feed_opened);
+        metrics_value(m, "bytes_received", stream->bytes_received);
+        metrics_value(m, "ingest_bits_per_second",
+                      stream->feed_opened ?
+                      compute_datarate(&stream->ingest_rate, stream->bytes_received) * 8LL : 0);
+        /* how old the newest data of the feed is */
+        metrics_value(m, "write_lag_ms", stream->feed_opened && stream->last_pts ?
+                      (av_gettime() - stream->last_pts) / 1000 : 0);
+        metrics_value(m, "size", stream->feed_size);
+        metrics_value(m, "write_index", stream->feed_write_index);
+        metrics_end(m);
+    }
+    metrics_end_list(m);
+
+    metrics_begin_list(m, "streams");
+    for(stream = first_stream; stream; stream = stream->next) {
+        int nb_clients = 0;
+        int64_t backlog = 0;
+
+        if (stream->stream_type != STREAM_TYPE_LIVE || stream->feed == stream)
+            continue;
+        for(c1 = first_http_ctx; c1; c1 = c1->next) {
+            if (c1->stream == stream && !c1->post) {
+                nb_clients++;
+                backlog += connection_backlog(c1);
+            }
+        }
+        metrics_begin(m, "stream");
+        metrics_label(m, "stream", stream->filename);
+        metrics_label(m, "format", stream->fmt->name);
+        metrics_value(m, "clients", nb_clients);
+        metrics_value(m, "connections_served", stream->conns_served);
+        metrics_value(m, "bytes_sent", stream_bytes_served(stream));
+        metrics_value(m, "backlog_bytes", backlog);
+        metrics_value(m, "dropped_chunks", stream->dropped_chunks);
+        metrics_value(m, "mux_time_us", stream->mux_time);
+        metrics_value(m, "shared_chunks", stream->ring ?
+                      stream->ring->next_seq - stream->ring->first_seq : 0);
+        metrics_end(m);
+    }
+    metrics_end_list(m);
+
+    metrics_begin_list(m, "connections");
+    for(c1 = first_http_ctx, i = 0; c1; c1 = c1->next, i++) {
+        snprintf(buf, sizeof(buf), "%d", i + 1);
+        metrics_begin(m, "connection");
+        metrics_label(m, "id", buf);
+        metrics_label(m, "stream", c1->stream ? c1->stream->filename : "");
+        metrics_label(m, "ip", inet_ntoa(c1->from_addr.sin_addr));
+        metrics_label(m, "protocol", c1->protocol);
+        metrics_label(m, "state", http_state[c1->state]);
+        data_count = connection_data_count(c1);
+        metrics_value(m, "bytes", data_count);
+        metrics_value(m, "bits_per_second",
+                      compute_datarate(&c1->datarate, data_count) * 8LL);
+        metrics_value(m, "backlog_bytes", connection_backlog(c1));
+        metrics_end(m);
+    }
+    metrics_end_list(m);
+    if (m->json)
+        url_fprintf(m->pb, "}\n");
+
+    len = url_close_dyn_buf(m->pb, &c->pb_buffer);
+    c->buffer_ptr = c->pb_buffer;
+    c->buffer_end = c->pb_buffer + len;
+}
+
+/* read the data added to the feed to know where its last key frames are */
+static void feed_find_key_frames(FFStream *feed)
+{
+    AVPacket pkt;
+
+    if (!feed->key_in) {
+        if (av_open_input_file(&feed->key_in, feed->feed_filename, feed->ifmt,
+                               FFM_PACKET_SIZE, feed->ap_in) < 0) {
+            feed->key_in = NULL;
+            return;
+        }
+        if (feed->key_in->iformat->read_seek)
+            av_seek_frame(feed->key_in, -1, av_gettime(), 0);
+    }
+    ffm_set_write_index(feed->key_in, feed->feed_write_index, feed->feed_size);
+
+    while (av_read_frame(feed->key_in, &pkt) >= 0) {
+        AVStream *st = feed->key_in->streams[pkt.stream_index];
+        if (pkt.dts != AV_NOPTS_VALUE) {
+            feed->last_pts = av_rescale_q(pkt.dts, st->time_base, AV_TIME_BASE_Q);
+            if (pkt.flags & AV_PKT_FLAG_KEY && pkt.stream_index < MAX_STREAMS)
+                feed->key_pts[pkt.stream_index] = feed->last_pts;
+        }
+        av_free_packet(&pkt);
+    }
+}
+
+/* return the time in the feed at which a new client of stream starts:
+   the preroll, but not later than the last key frame so that the
+   client can start decoding at once */
+static int64_t feed_start_time(FFStream *stream)
+{
+    int64_t pos = av_gettime() - stream->prebuffer * (int64_t)1000;
+    int64_t key_pts;
+    int i, key_index = stream->feed_streams[0];
+
+    /* video key frames are the only ones worth waiting for */
+    for(i=0;i<stream->nb_streams;i++) {
+        if (stream->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+            key_index = stream->feed_streams[i];
+            break;
+        }
+    }
+    key_pts = key_index >= 0 ? stream->feed->key_pts[key_index] : 0;
+    return key_pts ? FFMIN(pos, key_pts) : pos;
+}
+
 /* check if the parser needs to be opened for stream i */
 static void open_parser(AVFormatContext *s, int i)
 {
@@ -2147,8 +2785,10 @@ static int open_input_stream(HTTPContext *c, const char *info)
         } else if (find_info_tag(buf, sizeof(buf), "buffer", info)) {
             int prebuffer = strtol(buf, 0, 10);
             stream_pos = av_gettime() - prebuffer * (int64_t)1000000;
-        } else
-            stream_pos = av_gettime() - c->stream->prebuffer * (int64_t)1000;
+        } else {
+            stream_pos = feed_start_time(c->stream);
+            c->catch_up = !c->stream->prebuffer;
+        }
     } else {
         strcpy(input_filename, c->stream->feed_filename);
         buf_size = 0;
@@ -2201,6 +2841,562 @@ static int open_input_stream(HTTPContext *c, const char *info)
     return 0;
 }
 
+/* set up ctx to mux stream and write its header into *pbuf. Return
+   the header size or a negative value on error. */
+static int open_output_context(AVFormatContext *ctx, FFStream *stream,
+                               uint8_t **pbuf)
+{
+    int i;
+
+    memset(ctx, 0, sizeof(*ctx));
+    av_metadata_set2(&ctx->metadata, "author"   , stream->author   , 0);
+    av_metadata_set2(&ctx->metadata, "comment"  , stream->comment  , 0);
+    av_metadata_set2(&ctx->metadata, "copyright", stream->copyright, 0);
+    av_metadata_set2(&ctx->metadata, "title"    , stream->title    , 0);
+
+    for(i=0;i<stream->nb_streams;i++) {
+        AVStream *st;
+        AVStream *src;
+        st = av_mallocz(sizeof(AVStream));
+        ctx->streams[i] = st;
+        /* if file or feed, then just take streams from FFStream struct */
+        if (!stream->feed ||
+            stream->feed == stream)
+            src = stream->streams[i];
+        else
+            src = stream->feed->streams[stream->feed_streams[i]];
+
+        *st = *src;
+        st->priv_data = 0;
+        st->codec->frame_number = 0; /* XXX: should be done in
+                                       AVStream, not in codec */
+    }
+    /* set output format parameters */
+    ctx->oformat = stream->fmt;
+    ctx->nb_streams = stream->nb_streams;
+
+    /* prepare header and save header data in a stream */
+    if (url_open_dyn_buf(&ctx->pb) < 0) {
+        /* XXX: potential leak */
+        return -1;
+    }
+    ctx->pb->is_streamed = 1;
+
+    /*
+     * HACK to avoid mpeg ps muxer to spit many underflow errors
+     * Default value from FFmpeg
+     * Try to set it use configuration option
+     */
+    ctx->preload   = (int)(0.5*AV_TIME_BASE);
+    ctx->max_delay = (int)(0.7*AV_TIME_BASE);
+
+    av_set_parameters(ctx, NULL);
+    if (av_write_header(ctx) < 0) {
+        http_log("Error writing output header\n");
+        return -1;
+    }
+    av_metadata_free(&ctx->metadata);
+
+    return url_close_dyn_buf(ctx->pb, pbuf);
+}
+
+static FeedChunk *new_chunk(uint8_t *data, int size)
+{
+    FeedChunk *chunk = av_mallocz(sizeof(FeedChunk));
+
+    if (!chunk) {
+        av_free(data);
+        return NULL;
+    }
+    chunk->refcount = 1;
+    chunk->data = data;
+    chunk->size = size;
+    return chunk;
+}
+
+static void unref_chunk(FeedChunk **pchunk)
+{
+    FeedChunk *chunk = *pchunk;
+
+    if (chunk && !--chunk->refcount) {
+        av_free(chunk->data);
+        av_free(chunk);
+    }
+    *pchunk = NULL;
+}
+
+static void feed_ring_free(FFStream *stream)
+{
+    FeedRing *r = stream->ring;
+    AVFormatContext *ctx = &r->fmt_ctx;
+    uint8_t *buf;
+    int i;
+
+    if (r->fmt_in) {
+        for(i=0;i<r->fmt_in->nb_streams;i++) {
+            AVStream *st = r->fmt_in->streams[i];
+            if (st->codec->codec)
+                avcodec_close(st->codec);
+        }
+        av_close_input_file(r->fmt_in);
+    }
+    if (r->header) {
+        /* nobody receives the trailer, but the muxer must release
+           what it allocated */
+        if (url_open_dyn_buf(&ctx->pb) >= 0) {
+            av_write_trailer(ctx);
+            url_close_dyn_buf(ctx->pb, &buf);
+            av_free(buf);
+        }
+    }
+    av_metadata_free(&ctx->metadata);
+    for(i=0;i<ctx->nb_streams;i++)
+        av_free(ctx->streams[i]);
+    av_free(ctx->priv_data);
+
+    for(; r->first_seq < r->next_seq; r->first_seq++)
+        unref_chunk(&r->chunks[r->first_seq & (r->size - 1)]);
+    av_free(r->chunks);
+    unref_chunk(&r->header);
+    av_freep(&stream->ring);
+}
+
+/* add a chunk at the end of the ring and drop the ones nobody can
+   start from anymore */
+static void feed_ring_add_chunk(FFStream *stream, FeedChunk *chunk)
+{
+    FeedRing *r = stream->ring;
+    /* keep the preroll and a margin for the clients which are late */
+    int64_t keep = FFMAX(stream->prebuffer, 0) * (int64_t)1000 + FEED_RING_MARGIN;
+
+    if (r->next_seq - r->first_seq == r->size) {
+        if (r->size < FEED_RING_MAX_CHUNKS) {
+            FeedChunk **chunks = av_mallocz(2 * r->size * sizeof(*chunks));
+            int64_t seq;
+
+            if (!chunks) {
+                unref_chunk(&chunk);
+                return;
+            }
+            for(seq = r->first_seq; seq < r->next_seq; seq++)
+                chunks[seq & (2 * r->size - 1)] = r->chunks[seq & (r->size - 1)];
+            av_free(r->chunks);
+            r->chunks = chunks;
+            r->size *= 2;
+        } else {
+            unref_chunk(&r->chunks[r->first_seq++ & (r->size - 1)]);
+        }
+    }
+    if (chunk->key)
+        r->last_key_seq = r->next_seq;
+    r->chunks[r->next_seq++ & (r->size - 1)] = chunk;
+
+    while (r->first_seq < r->last_key_seq &&
+           r->chunks[r->first_seq & (r->size - 1)]->pts < chunk->pts - keep)
+        unref_chunk(&r->chunks[r->first_seq++ & (r->size - 1)]);
+}
+
+/* read all the packets available in the feed and mux them once for all
+   the clients of the stream */
+static void feed_ring_fill(FFStream *stream)
+{
+    FeedRing *r = stream->ring;
+    AVFormatContext *ctx = &r->fmt_ctx;
+    AVPacket pkt;
+    int i, len, key;
+    int64_t pts, t;
+    uint8_t *buf;
+
+    ffm_set_write_index(r->fmt_in,
+                        stream->feed->feed_write_index,
+                        stream->feed->feed_size);
+
+    while (av_read_frame(r->fmt_in, &pkt) >= 0) {
+        AVStream *ist = r->fmt_in->streams[pkt.stream_index];
+        AVStream *ost;
+        FeedChunk *chunk;
+
+        for(i=0;i<stream->nb_streams;i++)
+            if (stream->feed_streams[i] == pkt.stream_index)
+                break;
+        if (i == stream->nb_streams || url_open_dyn_buf(&ctx->pb) < 0) {
+            av_free_packet(&pkt);
+            continue;
+        }
+        ctx->pb->is_streamed = 1;
+        ost = ctx->streams[i];
+        key = pkt.flags & AV_PKT_FLAG_KEY &&
+              (ist->codec->codec_type == AVMEDIA_TYPE_VIDEO ||
+               stream->nb_streams == 1);
+        if (pkt.dts != AV_NOPTS_VALUE)
+            pts = av_rescale_q(pkt.dts, ist->time_base, AV_TIME_BASE_Q);
+        else if (r->next_seq > r->first_seq)
+            pts = r->chunks[(r->next_seq - 1) & (r->size - 1)]->pts;
+        else
+            pts = 0;
+
+        pkt.stream_index = i;
+        if (pkt.dts != AV_NOPTS_VALUE)
+            pkt.dts = av_rescale_q(pkt.dts, ist->time_base, ost->time_base);
+        if (pkt.pts != AV_NOPTS_VALUE)
+            pkt.pts = av_rescale_q(pkt.pts, ist->time_base, ost->time_base);
+        pkt.duration = av_rescale_q(pkt.duration, ist->time_base, ost->time_base);
+        t = av_gettime();
+        if (av_write_frame(ctx, &pkt) < 0)
+            http_log("Error writing frame to output\n");
+        stream->mux_time += av_gettime() - t;
+        ost->codec->frame_number++;
+
+        len = url_close_dyn_buf(ctx->pb, &buf);
+        if (!len) {
+            /* the muxer keeps the frame for later */
+            av_free(buf);
+            r->pending_key |= key;
+        } else if ((chunk = new_chunk(buf, len))) {
+            chunk->key = key || r->pending_key;
+            chunk->pts = pts;
+            r->pending_key = 0;
+            ring_lock();
+            feed_ring_add_chunk(stream, chunk);
+            ring_unlock();
+        }
+        av_free_packet(&pkt);
+    }
+}
+
+/* return true if the clients of the stream may switch to other streams
+   of the feed while they play it, as Windows Media Player and RealPlayer
+   do to adapt to their bandwidth */
+static int stream_can_switch(FFStream *stream)
+{
+    return !strcmp(stream->fmt->name, "asf_stream") ||
+           !strcmp(stream->fmt->name, "rm");
+}
+
+/* make c send the shared output of its stream if possible. Return
+   a negative value if c must use its own input and muxer. */
+static int feed_ring_open(HTTPContext *c, const char *info)
+{
+    FFStream *stream = c->stream;
+    FeedRing *r = stream->ring;
+    char buf[128];
+    uint8_t *header;
+    int64_t start, seq;
+    int i, len;
+
+    /* streams from files, RTP, the feeds themselves, the requests for
+       a precise position and the clients choosing their own streams
+       need a demuxer per client */
+    if (!stream->shared_mux || !stream->feed || stream->feed == stream ||
+        stream_can_switch(stream) || stream->max_time || c->is_packetized ||
+        memcmp(c->feed_streams, stream->feed_streams, sizeof(c->feed_streams)) ||
+        find_info_tag(buf, sizeof(buf), "date", info) ||
+        find_info_tag(buf, sizeof(buf), "buffer", info))
+        return -1;
+
+    start = feed_start_time(stream);
+    if (!r) {
+        r = stream->ring = av_mallocz(sizeof(FeedRing));
+        if (!r)
+            return -1;
+        r->last_key_seq = -1;
+        r->size = 64;
+        r->chunks = av_mallocz(r->size * sizeof(*r->chunks));
+        if (!r->chunks)
+            goto fail;
+        if (av_open_input_file(&r->fmt_in, stream->feed->feed_filename,
+                               stream->ifmt, FFM_PACKET_SIZE, stream->ap_in) < 0) {
+            http_log("could not open %s\n", stream->feed->feed_filename);
+            goto fail;
+        }
+        r->fmt_in->flags |= AVFMT_FLAG_GENPTS;
+        for(i=0;i<r->fmt_in->nb_streams;i++)
+            open_parser(r->fmt_in, i);
+        if (r->fmt_in->iformat->read_seek)
+            av_seek_frame(r->fmt_in, -1, start, 0);
+
+        len = open_output_context(&r->fmt_ctx, stream, &header);
+        if (len < 0 || !(r->header = new_chunk(header, len)))
+            goto fail;
+        feed_ring_fill(stream);
+    }
+
+    /* start with the first key frame of the preroll, or else the most
+       recent one */
+    for(seq = r->first_seq; seq < r->next_seq; seq++) {
+        FeedChunk *chunk = r->chunks[seq & (r->size - 1)];
+        if (chunk->key && chunk->pts >= start)
+            break;
+    }
+    if (seq == r->next_seq && r->last_key_seq >= 0)
+        seq = r->last_key_seq;
+    c->ring_seq = seq;
+    c->ring = r;
+    r->nb_clients++;
+    c->start_time = cur_time;
+    return 0;
+ fail:
+    feed_ring_free(stream);
+    return -1;
+}
+
+static void feed_ring_close(HTTPContext *c)
+{
+    ring_lock();
+    unref_chunk(&c->chunk);
+    ring_unlock();
+    if (c->ring && !--c->ring->nb_clients)
+        feed_ring_free(c->stream);
+    c->ring = NULL;
+}
+
+/* give the next chunk of the ring to c. Return 1 if it was already
+   given all of them. Must be called with the ring locked. */
+static int feed_ring_next_chunk(HTTPContext *c)
+{
+    FeedRing *r = c->ring;
+    FeedChunk *chunk;
+
+    unref_chunk(&c->chunk);
+    for(;;) {
+        if (c->ring_seq < r->first_seq) {
+            /* the client is too slow and missed some data: resume at the
+               most recent key frame */
+            int64_t seq = FFMAX(r->last_key_seq, r->first_seq);
+            c->stream->dropped_chunks += seq - c->ring_seq;
+            c->ring_seq = seq;
+            c->got_key_frame = 0;
+        }
+        if (c->ring_seq >= r->next_seq)
+            return 1;
+        chunk = r->chunks[c->ring_seq++ & (r->size - 1)];
+        if (chunk->key)
+            c->got_key_frame = 1;
+        if (!c->stream->send_on_key || c->got_key_frame)
+            break;
+    }
+    chunk->refcount++;
+    c->chunk = chunk;
+    c->buffer_ptr = chunk->data;
+    c->buffer_end = chunk->data + chunk->size;
+    return 0;
+}
+
+static int feed_ring_prepare_data(HTTPContext *c)
+{
+    int ret;
+
+    ring_lock();
+    ret = feed_ring_next_chunk(c);
+    ring_unlock();
+    if (ret) {
+        c->state = HTTPSTATE_WAIT_FEED;
+        return 1; /* state changed */
+    }
+    return 0;
+}
+
+#if HAVE_PTHREADS
+/* wake up the thread polling the read end of a pipe */
+static void write_wake_pipe(int fds[2])
+{
+    /* a full pipe wakes it up as well */
+    if (write(fds[1], "", 1) < 0 && errno != EAGAIN)
+        http_log("Could not write to a wake up pipe: %s\n", strerror(errno));
+}
+#endif
+
+/* tell the workers that the rings have new chunks */
+static void wake_workers(void)
+{
+#if HAVE_PTHREADS
+    int i;
+
+    for(i = 0; i < nb_workers; i++)
+        write_wake_pipe(workers[i].pipe);
+#endif
+}
+
+#if HAVE_PTHREADS
+static int open_wake_pipe(int fds[2])
+{
+    int i;
+
+    if (pipe(fds) < 0)
+        return -1;
+    for(i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
+/* let a worker send the rest of the shared output to c. The main loop
+   does not look at it anymore until the worker gives it back. */
+static void give_to_worker(HTTPContext *c)
+{
+    ServerWorker *w = &workers[next_worker++ % nb_workers];
+
+#if HAVE_SYS_EPOLL_H
+    if (epoll_fd >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+#endif
+    if (c->ready)
+        unlink_ready_connection(c);
+    c->ready = 0;
+    c->worker_data_count = c->data_count;
+
+    ring_lock();
+    c->worker = w;
+    c->next_worker = w->new_ctx;
+    w->new_ctx = c;
+    ring_unlock();
+    write_wake_pipe(w->pipe);
+}
+
+/* close the connections the workers are done with */
+static void close_worker_connections(void)
+{
+    HTTPContext *c, *c_next;
+    uint8_t buf[64];
+
+    while (read(worker_pipe[0], buf, sizeof(buf)) > 0);
+
+    ring_lock();
+    c = returned_ctx;
+    returned_ctx = NULL;
+    ring_unlock();
+
+    for(; c; c = c_next) {
+        c_next = c->next_worker;
+        c->stream->bytes_served += c->data_count - c->worker_data_count;
+        c->worker = NULL;
+        log_connection(c);
+        close_connection(c);
+    }
+}
+
+/* send what is available to c. Return a negative value if the
+   connection must be closed. */
+static int worker_send_data(HTTPContext *c)
+{
+    int len, ret;
+
+    if (c->buffer_ptr >= c->buffer_end) {
+        ring_lock();
+        ret = feed_ring_next_chunk(c);
+        if (ret && c->ring->closed)
+            ret = -1; /* all sent and the feed ended */
+        ring_unlock();
+        if (ret)
+            return FFMIN(ret, 0); /* or else wait for the feed */
+    }
+    len = send(c->fd, c->buffer_ptr, c->buffer_end - c->buffer_ptr, 0);
+    if (len < 0) {
+        if (ff_neterrno() != FF_NETERROR(EAGAIN) &&
+            ff_neterrno() != FF_NETERROR(EINTR))
+            return -1;
+        return 0;
+    }
+    ring_lock();
+    c->buffer_ptr += len;
+    c->data_count += len;
+    ring_unlock();
+    return 0;
+}
+
+/* Worker thread: send the shared output of the streams to its
+   connections. The chunks are not modified once in the ring, so they
+   are sent without holding the lock. */
+static void *worker_thread(void *arg)
+{
+    ServerWorker *w = arg;
+    HTTPContext *first_ctx = NULL, *c, **cp;
+    struct pollfd *poll_entry;
+    uint8_t buf[64];
+    int ret, revents;
+
+    for(;;) {
+        poll_entry = w->poll_table;
+        poll_entry->fd = w->pipe[0];
+        poll_entry->events = POLLIN;
+        poll_entry++;
+
+        ring_lock();
+        while ((c = w->new_ctx)) {
+            w->new_ctx = c->next_worker;
+            c->next_worker = first_ctx;
+            first_ctx = c;
+        }
+        for(c = first_ctx; c; c = c->next_worker) {
+            poll_entry->fd = c->fd;
+            /* without anything to send, only look for the client
+               going away, unless the feed ended and it must be closed */
+            poll_entry->events = c->buffer_ptr < c->buffer_end ||
+                                 c->ring_seq < c->ring->next_seq ||
+                                 c->ring->closed ? POLLOUT : POLLIN;
+            poll_entry++;
+        }
+        ring_unlock();
+
+        do {
+            ret = poll(w->poll_table, poll_entry - w->poll_table, -1);
+        } while (ret < 0 && (ff_neterrno() == FF_NETERROR(EAGAIN) ||
+                             ff_neterrno() == FF_NETERROR(EINTR)));
+        if (ret < 0)
+            continue;
+
+        if (w->poll_table[0].revents & POLLIN)
+            while (read(w->pipe[0], buf, sizeof(buf)) > 0);
+
+        poll_entry = w->poll_table + 1;
+        for(cp = &first_ctx; (c = *cp); poll_entry++) {
+            revents = poll_entry->revents;
+            if (revents & POLLIN) {
+                uint8_t dummy;
+                if (recv(c->fd, &dummy, 1, MSG_PEEK) >= 0 ||
+                    ff_neterrno() != FF_NETERROR(EAGAIN))
+                    revents |= POLLHUP;
+            }
+            if (revents & (POLLERR | POLLHUP) ||
+                (revents & POLLOUT && worker_send_data(c) < 0)) {
+                /* give it back to the main loop to close it */
+                *cp = c->next_worker;
+                ring_lock();
+                c->next_worker = returned_ctx;
+                returned_ctx = c;
+                ring_unlock();
+                write_wake_pipe(worker_pipe);
+            } else
+                cp = &c->next_worker;
+        }
+    }
+    return NULL;
+}
+
+static int start_workers(void)
+{
+    int i;
+
+    if (!nb_workers)
+        return 0;
+    workers = av_mallocz(nb_workers * sizeof(*workers));
+    if (!workers || open_wake_pipe(worker_pipe) < 0)
+        goto fail;
+    for(i = 0; i < nb_workers; i++) {
+        ServerWorker *w = &workers[i];
+        w->poll_table = av_malloc((nb_max_http_connections + 1) * sizeof(*w->poll_table));
+        if (!w->poll_table || open_wake_pipe(w->pipe) < 0 ||
+            pthread_create(&w->thread, NULL, worker_thread, w))
+            goto fail;
+    }
+    return 0;
+ fail:
+    http_log("Could not start the worker threads\n");
+    return -1;
+}
+#endif
+
 /* return the server clock (in us) */
 static int64_t get_server_clock(HTTPContext *c)
 {
@@ -2231,67 +3427,36 @@ static int http_prepare_data(HTTPContext *c)
     AVFormatContext *ctx;
 
     av_freep(&c->pb_buffer);
+    if (c->chunk) {
+        ring_lock();
+        unref_chunk(&c->chunk);
+        ring_unlock();
+    }
     switch(c->state) {
     case HTTPSTATE_SEND_DATA_HEADER:
-        memset(&c->fmt_ctx, 0, sizeof(c->fmt_ctx));
-        av_metadata_set2(&c->fmt_ctx.metadata, "author"   , c->stream->author   , 0);
-        av_metadata_set2(&c->fmt_ctx.metadata, "comment"  , c->stream->comment  , 0);
-        av_metadata_set2(&c->fmt_ctx.metadata, "copyright", c->stream->copyright, 0);
-        av_metadata_set2(&c->fmt_ctx.metadata, "title"    , c->stream->title    , 0);
-
-        for(i=0;i<c->stream->nb_streams;i++) {
-            AVStream *st;
-            AVStream *src;
-            st = av_mallocz(sizeof(AVStream));
-            c->fmt_ctx.streams[i] = st;
-            /* if file or feed, then just take streams from FFStream struct */
-            if (!c->stream->feed ||
-                c->stream->feed == c->stream)
-                src = c->stream->streams[i];
-            else
-                src = c->stream->feed->streams[c->stream->feed_streams[i]];
-
-            *st = *src;
-            st->priv_data = 0;
-            st->codec->frame_number = 0; /* XXX: should be done in
-                                           AVStream, not in codec */
-        }
-        /* set output format parameters */
-        c->fmt_ctx.oformat = c->stream->fmt;
-        c->fmt_ctx.nb_streams = c->stream->nb_streams;
-
         c->got_key_frame = 0;
 
-        /* prepare header and save header data in a stream */
-        if (url_open_dyn_buf(&c->fmt_ctx.pb) < 0) {
-            /* XXX: potential leak */
-            return -1;
-        }
-        c->fmt_ctx.pb->is_streamed = 1;
-
-        /*
-         * HACK to avoid mpeg ps muxer to spit many underflow errors
-         * Default value from FFmpeg
-         * Try to set it use configuration option
-         */
-        c->fmt_ctx.preload   = (int)(0.5*AV_TIME_BASE);
-        c->fmt_ctx.max_delay = (int)(0.7*AV_TIME_BASE);
-
-        av_set_parameters(&c->fmt_ctx, NULL);
-        if (av_write_header(&c->fmt_ctx) < 0) {
-            http_log("Error writing output header\n");
-            return -1;
+        if (c->ring) {
+            ring_lock();
+            c->chunk = c->ring->header;
+            c->chunk->refcount++;
+            ring_unlock();
+            c->buffer_ptr = c->chunk->data;
+            c->buffer_end = c->chunk->data + c->chunk->size;
+        } else {
+            len = open_output_context(&c->fmt_ctx, c->stream, &c->pb_buffer);
+            if (len < 0)
+                return -1;
+            c->buffer_ptr = c->pb_buffer;
+            c->buffer_end = c->pb_buffer + len;
         }
-        av_metadata_free(&c->fmt_ctx.metadata);
-
-        len = url_close_dyn_buf(c->fmt_ctx.pb, &c->pb_buffer);
-        c->buffer_ptr = c->pb_buffer;
-        c->buffer_end = c->pb_buffer + len;
 
         c->state = HTTPSTATE_SEND_DATA;
         c->last_packet_sent = 0;
         break;
     case HTTPSTATE_SEND_DATA:
+        if (c->ring)
+            return feed_ring_prepare_data(c);
         /* find a new packet */
         /* read a packet from the input stream */
         if (c->stream->feed)
@@ -2335,6 +3500,10 @@ static int http_prepare_data(HTTPContext *c)
                 if (c->first_pts == AV_NOPTS_VALUE) {
                     c->first_pts = av_rescale_q(pkt.dts, c->fmt_in->streams[pkt.stream_index]->time_base, AV_TIME_BASE_Q);
                     c->start_time = cur_time;
+                    /* the feed times are wall clock times: what precedes
+                       now is due at once, the rest when it arrives */
+                    if (c->catch_up)
+                        c->start_time -= FFMAX(av_gettime() - c->first_pts, 0) / 1000;
                 }
                 /* send it to the appropriate stream */
                 if (c->stream->feed) {
@@ -2364,6 +3533,7 @@ static int http_prepare_data(HTTPContext *c)
                 } else {
                     AVCodecContext *codec;
                     AVStream *ist, *ost;
+                    int64_t mux_start;
                 send_it:
                     ist = c->fmt_in->streams[source_index];
                     /* specific handling for RTP: we use several
@@ -2412,10 +3582,12 @@ static int http_prepare_data(HTTPContext *c)
                     if (pkt.pts != AV_NOPTS_VALUE)
                         pkt.pts = av_rescale_q(pkt.pts, ist->time_base, ost->time_base);
                     pkt.duration = av_rescale_q(pkt.duration, ist->time_base, ost->time_base);
+                    mux_start = av_gettime();
                     if (av_write_frame(ctx, &pkt) < 0) {
                         http_log("Error writing frame to output\n");
                         c->state = HTTPSTATE_SEND_DATA_TRAILER;
                     }
+                    c->stream->mux_time += av_gettime() - mux_start;
 
                     len = url_close_dyn_buf(ctx->pb, &c->pb_buffer);
                     c->cur_frame_bytes = len;
@@ -2435,7 +3607,7 @@ static int http_prepare_data(HTTPContext *c)
     default:
     case HTTPSTATE_SEND_DATA_TRAILER:
         /* last packet test ? */
-        if (c->last_packet_sent || c->is_packetized)
+        if (c->last_packet_sent || c->is_packetized || c->ring)
             return -1;
         ctx = &c->fmt_ctx;
         /* prepare header */
@@ -2536,11 +3708,14 @@ static int http_send_data(HTTPContext *c)
                                 rtsp_c->packet_buffer_end - rtsp_c->packet_buffer_ptr, 0);
                     if (len > 0)
                         rtsp_c->packet_buffer_ptr += len;
+                    else if (len < 0 && ff_neterrno() == FF_NETERROR(EAGAIN))
+                        rtsp_c->revents &= ~POLLOUT;
                     if (rtsp_c->packet_buffer_ptr < rtsp_c->packet_buffer_end) {
                         /* if we could not send all the data, we will
                            send it later, so a new state is needed to
                            "lock" the RTSP TCP connection */
                         rtsp_c->state = RTSPSTATE_SEND_PACKET;
+                        wake_connection(rtsp_c);
                         break;
                     } else
                         /* all data has been sent */
@@ -2561,8 +3736,9 @@ static int http_send_data(HTTPContext *c)
                         ff_neterrno() != FF_NETERROR(EINTR))
                         /* error : close connection */
                         return -1;
-                    else
-                        return 0;
+                    if (ff_neterrno() == FF_NETERROR(EAGAIN))
+                        c->revents &= ~POLLOUT;
+                    return 0;
                 } else
                     c->buffer_ptr += len;
 
@@ -2612,6 +3788,14 @@ static int http_start_receive_data(HTTPContext *c)
     c->stream->feed_size = lseek(fd, 0, SEEK_END);
     lseek(fd, 0, SEEK_SET);
 
+    /* the key frames are searched again from the new write position */
+    if (c->stream->key_in) {
+        av_close_input_file(c->stream->key_in);
+        c->stream->key_in = NULL;
+    }
+    if (c->stream->truncate)
+        memset(c->stream->key_pts, 0, sizeof(c->stream->key_pts));
+
     /* init buffer input */
     c->buffer_ptr = c->buffer;
     c->buffer_end = c->buffer + FFM_PACKET_SIZE;
@@ -2623,6 +3807,7 @@ static int http_start_receive_data(HTTPContext *c)
 static int http_receive_data(HTTPContext *c)
 {
     HTTPContext *c1;
+    FFStream *stream;
     int len, loop_run = 0;
 
     while (c->chunked_encoding && !c->chunk_size &&
@@ -2635,6 +3820,8 @@ static int http_receive_data(HTTPContext *c)
                 ff_neterrno() != FF_NETERROR(EINTR))
                 /* error : close connection */
                 goto fail;
+            if (ff_neterrno() == FF_NETERROR(EAGAIN))
+                c->revents &= ~POLLIN;
             return 0;
         } else if (len == 0) {
             /* end of connection : close it */
@@ -2662,6 +3849,8 @@ static int http_receive_data(HTTPContext *c)
                 ff_neterrno() != FF_NETERROR(EINTR))
                 /* error : close connection */
                 goto fail;
+            if (ff_neterrno() == FF_NETERROR(EAGAIN))
+                c->revents &= ~POLLIN;
         } else if (len == 0)
             /* end of connection : close it */
             goto fail;
@@ -2670,6 +3859,8 @@ static int http_receive_data(HTTPContext *c)
             c->buffer_ptr += len;
             c->data_count += len;
             update_datarate(&c->datarate, c->data_count);
+            c->stream->bytes_received += len;
+            update_datarate(&c->stream->ingest_rate, c->stream->bytes_received);
         }
     }
 
@@ -2710,11 +3901,25 @@ static int http_receive_data(HTTPContext *c)
                 goto fail;
             }
 
+            feed_find_key_frames(feed);
+
+            /* mux the new data once for the streams using a ring */
+            for(stream = first_stream; stream; stream = stream->next)
+                if (stream->ring && stream->feed == feed) {
+                    ring_lock();
+                    stream->ring->closed = 0;
+                    ring_unlock();
+                    feed_ring_fill(stream);
+                    wake_workers();
+                }
+
             /* wake up any waiting connections */
             for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
                 if (c1->state == HTTPSTATE_WAIT_FEED &&
-                    c1->stream->feed == c->stream->feed)
+                    c1->stream->feed == c->stream->feed) {
                     c1->state = HTTPSTATE_SEND_DATA;
+                    wake_connection(c1);
+                }
             }
         } else {
             /* We have a header in our hands that contains useful data */
@@ -2761,11 +3966,22 @@ static int http_receive_data(HTTPContext *c)
  fail:
     c->stream->feed_opened = 0;
     close(c->feed_fd);
+    /* the workers end their connections once they sent the rest of the
+       ring */
+    for(stream = first_stream; stream; stream = stream->next)
+        if (stream->ring && stream->feed == c->stream->feed) {
+            ring_lock();
+            stream->ring->closed = 1;
+            ring_unlock();
+            wake_workers();
+        }
     /* wake up any waiting connections to stop waiting for feed */
     for(c1 = first_http_ctx; c1 != NULL; c1 = c1->next) {
         if (c1->state == HTTPSTATE_WAIT_FEED &&
-            c1->stream->feed == c->stream->feed)
+            c1->stream->feed == c->stream->feed) {
             c1->state = HTTPSTATE_SEND_DATA_TRAILER;
+            wake_connection(c1);
+        }
     }
     return -1;
 }
@@ -3232,6 +4448,7 @@ static void rtsp_cmd_play(HTTPContext *c, const char *url, RTSPMessageHeader *h)
     }
 
     rtp_c->state = HTTPSTATE_SEND_DATA;
+    wake_connection(rtp_c);
 
     /* now everything is OK, so we can send the connection parameters */
     rtsp_reply_header(c, RTSP_STATUS_OK);
@@ -4128,6 +5345,18 @@ static int parse_ffconfig(const char *filename)
                 ERROR("Invalid MaxBandwidth: %s\n", arg);
             } else
                 max_bandwidth = llval;
+        } else if (!strcasecmp(cmd, "Workers")) {
+            get_arg(arg, sizeof(arg), &p);
+            val = atoi(arg);
+#if HAVE_PTHREADS
+            if (val < 0 || val > 64) {
+                ERROR("Invalid Workers: %s\n", arg);
+            } else
+                nb_workers = val;
+#else
+            if (val)
+                ERROR("Workers needs thread support\n");
+#endif
         } else if (!strcasecmp(cmd, "CustomLog")) {
             if (!ffserver_debug)
                 get_arg(logfilename, sizeof(logfilename), &p);
@@ -4288,6 +5517,9 @@ static int parse_ffconfig(const char *filename)
                 if (!strcmp(arg, "status")) {
                     stream->stream_type = STREAM_TYPE_STATUS;
                     stream->fmt = NULL;
+                } else if (!strcmp(arg, "metrics")) {
+                    stream->stream_type = STREAM_TYPE_METRICS;
+                    stream->fmt = NULL;
                 } else {
                     stream->stream_type = STREAM_TYPE_LIVE;
                     /* jpeg cannot be used here, so use single frame jpeg */
@@ -4336,6 +5568,9 @@ static int parse_ffconfig(const char *filename)
         } else if (!strcasecmp(cmd, "StartSendOnKey")) {
             if (stream)
                 stream->send_on_key = 1;
+        } else if (!strcasecmp(cmd, "SharedMux")) {
+            if (stream)
+                stream->shared_mux = 1;
         } else if (!strcasecmp(cmd, "AudioCodec")) {
             get_arg(arg, sizeof(arg), &p);
             audio_id = opt_audio_codec(arg);
@@ -30,7 +30,7 @@
 #include "libavutil/avutil.h"
 
 #define LIBAVCODEC_VERSION_MAJOR 52
-#define LIBAVCODEC_VERSION_MINOR 84
+#define LIBAVCODEC_VERSION_MINOR 88
 #define LIBAVCODEC_VERSION_MICRO  0
 
 #define LIBAVCODEC_VERSION_INT  AV_VERSION_INT(LIBAVCODEC_VERSION_MAJOR, \
@@ -665,6 +665,10 @@ typedef struct RcOverride{
  * encoders
  */
 #define CODEC_CAP_EXPERIMENTAL     0x0200
+/**
+ * Codec supports frame-level multithreading.
+ */
+#define CODEC_CAP_FRAME_THREADS    0x1000
 
 //The following defines may change, don't expect compatibility if you use them.
 #define MB_TYPE_INTRA4x4   0x0001
@@ -945,6 +949,20 @@ typedef struct AVPanScan{
      * - decoding: Set by libavcodec\
      */\
     void *hwaccel_picture_private;\
+\
+    /**\
+     * the AVCodecContext which ff_thread_get_buffer() was last called on\
+     * - encoding: Set by libavcodec.\
+     * - decoding: Set by libavcodec.\
+     */\
+    struct AVCodecContext *owner;\
+\
+    /**\
+     * used by multithreading to store frame-specific info\
+     * - encoding: Set by libavcodec.\
+     * - decoding: Set by libavcodec.\
+     */\
+    void *thread_opaque;\
 
 
 #define FF_QSCALE_TYPE_MPEG1 0
@@ -1724,6 +1742,7 @@ typedef struct AVCodecContext {
 #define FF_DEBUG_VIS_QP      0x00002000
 #define FF_DEBUG_VIS_MB_TYPE 0x00004000
 #define FF_DEBUG_BUFFERS     0x00008000
+#define FF_DEBUG_THREADS     0x00010000
 
     /**
      * debug
@@ -2707,6 +2726,65 @@ typedef struct AVCodecContext {
      * - decoding: unused
      */
     int lpc_passes;
+
+    /**
+     * Which multithreading methods to use.
+     * Use of FF_THREAD_FRAME will increase decoding delay by one frame per thread,
+     * so clients which cannot provide future frames should not use it.
+     *
+     * - encoding: Set by user, otherwise the default is used.
+     * - decoding: Set by user, otherwise the default is used.
+     */
+    int thread_type;
+#define FF_THREAD_FRAME   1 ///< Decode more than one frame at once
+#define FF_THREAD_SLICE   2 ///< Decode more than one part of a single frame at once
+
+    /**
+     * Which multithreading methods are in use by the codec.
+     * - encoding: Set by libavcodec.
+     * - decoding: Set by libavcodec.
+     */
+    int active_thread_type;
+
+    /**
+     * Set by the client if its custom get_buffer() callback can be called
+     * from another thread, which allows faster multithreaded decoding.
+     * draw_horiz_band() will be called from other threads regardless of this setting.
+     * Ignored if the default get_buffer() is used.
+     * - encoding: Set by user.
+     * - decoding: Set by user.
+     */
+    int thread_safe_callbacks;
+
+    /**
+     * Whether this is a copy of the context which had init() called on it.
+     * This is used by multithreading - shared tables and picture pointers
+     * should be freed from the original context only.
+     * - encoding: Set by libavcodec.
+     * - decoding: Set by libavcodec.
+     */
+    int is_copy;
+
+    /**
+     * Pool the picture buffers of avcodec_default_get_buffer() are
+     * allocated from. Several contexts may share the same pool.
+     * If NULL, the process-wide default pool is used.
+     * The pool must stay valid until the context is closed.
+     * - encoding: Set by user.
+     * - decoding: Set by user.
+     */
+    struct AVFramePool *frame_pool;
+
+    /**
+     * Run slice threading jobs on the process-wide worker pool instead of
+     * starting threads for this context. The pool has one worker per CPU
+     * and is shared by all contexts that set this; thread_count still
+     * limits how many jobs of this context run at the same time.
+     * Frame threading is not used when this is set.
+     * - encoding: Set by user.
+     * - decoding: Set by user.
+     */
+    int thread_pool;
 } AVCodecContext;
 
 /**
@@ -2749,6 +2827,26 @@ typedef struct AVCodec {
     const enum SampleFormat *sample_fmts;   ///< array of supported sample formats, or NULL if unknown, array is terminated by -1
     const int64_t *channel_layouts;         ///< array of support channel layouts, or NULL if unknown. array is terminated by 0
     uint8_t max_lowres;                     ///< maximum value for lowres supported by the decoder
+
+    /**
+     * @defgroup framethreading Frame-level threading support functions.
+     * @{
+     */
+    /**
+     * If defined, called on thread contexts when they are created.
+     * If the codec allocates writable tables in init(), re-allocate them here.
+     * priv_data will be set to a copy of the original.
+     */
+    int (*init_thread_copy)(AVCodecContext *);
+    /**
+     * Copy necessary context variables from a previous thread context to the current one.
+     * If not defined, the next thread will start automatically; otherwise, the codec
+     * must call ff_thread_finish_setup().
+     *
+     * dst and src will (rarely) point to the same context, in which case memcpy should be skipped.
+     */
+    int (*update_thread_context)(AVCodecContext *dst, const AVCodecContext *src);
+    /** @} */
 } AVCodec;
 
 /**
@@ -2977,6 +3075,111 @@ int av_dup_packet(AVPacket *pkt);
  */
 void av_free_packet(AVPacket *pkt);
 
+/**
+ * Make dst reference the payload of src without copying it.
+ *
+ * If src is not reference counted yet, its payload is first moved into a
+ * reference counted buffer, and src is updated to use that buffer too.
+ * The payload is copied only if src does not own it (destruct is NULL).
+ * All other fields of src are copied to dst as well.
+ * Each reference must be released with av_free_packet() or
+ * av_packet_unref(); the payload is freed with the last reference.
+ *
+ * Reference counting is thread-safe only if FFmpeg was built with
+ * pthreads.
+ *
+ * @param dst packet to initialize as a new reference
+ * @param src packet whose payload is to be shared
+ * @return 0 if OK, AVERROR_xxx otherwise
+ */
+int av_packet_ref(AVPacket *dst, AVPacket *src);
+
+/**
+ * Release the payload reference held by pkt and reset its data, size,
+ * destruct and priv fields.
+ *
+ * @param pkt packet to unreference
+ */
+void av_packet_unref(AVPacket *pkt);
+
+/**
+ * Ensure that the payload of pkt may be modified by the caller.
+ * The payload is copied if it is shared with other packets or not owned
+ * by pkt; otherwise this is a no-op.
+ *
+ * @param pkt packet to make writable
+ * @return 0 if OK, AVERROR_xxx otherwise
+ */
+int av_packet_make_writable(AVPacket *pkt);
+
+/* framepool.c */
+
+/**
+ * Pool of picture buffers, which can be shared between several codec
+ * contexts and libavfilter.
+ * Buffers are cached in size classes after release, so that decoders
+ * with similar picture sizes reuse each other's memory.
+ * All functions are thread-safe when FFmpeg was built with pthreads.
+ */
+typedef struct AVFramePool AVFramePool;
+
+/**
+ * Usage statistics of an AVFramePool.
+ */
+typedef struct AVFramePoolStats {
+    uint64_t hits;              ///< requests served from the cache
+    uint64_t misses;            ///< requests that needed a new allocation
+    uint64_t trimmed;           ///< buffers freed by the trimming policy
+    int64_t  bytes_in_use;      ///< bytes handed out and not yet released
+    int64_t  bytes_cached;      ///< bytes held for later requests
+    int      buffers_in_use;
+    int      buffers_cached;
+} AVFramePoolStats;
+
+/**
+ * Allocate a new buffer pool.
+ *
+ * @param max_cached maximum number of bytes kept cached after release;
+ *                   0 bounds the cache by a slowly decaying peak of the
+ *                   memory in use, which is also what the default pool does
+ * @return the new pool or NULL on failure
+ */
+AVFramePool *av_frame_pool_alloc(int64_t max_cached);
+
+/**
+ * Free a pool allocated with av_frame_pool_alloc() and set *pool to NULL.
+ * Buffers still in use are freed when they are released.
+ */
+void av_frame_pool_free(AVFramePool **pool);
+
+/**
+ * Get a buffer of at least size bytes, aligned as by av_malloc().
+ *
+ * @param pool the pool, or NULL for the default pool
+ * @return the buffer or NULL on failure
+ */
+void *av_frame_pool_get(AVFramePool *pool, unsigned int size);
+
+/**
+ * Return a buffer obtained from av_frame_pool_get() to its pool.
+ */
+void av_frame_pool_release(void *buf);
+
+/**
+ * Free cached buffers, least recently released first, until at most
+ * max_cached bytes remain cached.
+ *
+ * @param pool the pool, or NULL for the default pool
+ */
+void av_frame_pool_trim(AVFramePool *pool, int64_t max_cached);
+
+/**
+ * Get usage statistics of a pool.
+ *
+ * @param pool the pool, or NULL for the default pool
+ */
+void av_frame_pool_get_stats(AVFramePool *pool, AVFramePoolStats *stats);
+
 /* resample.c */
 
 struct ReSampleContext;
@@ -3403,6 +3606,12 @@ void avcodec_align_dimensions2(AVCodecContext *s, int *width, int *height,
 int avcodec_check_dimensions(void *av_log_ctx, unsigned int w, unsigned int h);
 enum PixelFormat avcodec_default_get_format(struct AVCodecContext *s, const enum PixelFormat * fmt);
 
+/**
+ * Set the number of threads used by the codec.
+ * If called before avcodec_open(), the threads are started when the codec is
+ * opened, using the methods selected by AVCodecContext.thread_type.
+ * If called on an already opened codec, only slice threading can be enabled.
+ */
 int avcodec_thread_init(AVCodecContext *s, int thread_count);
 void avcodec_thread_free(AVCodecContext *s);
 int avcodec_default_execute(AVCodecContext *c, int (*func)(AVCodecContext *c2, void *arg2),void *arg, int *ret, int count, int size);
@@ -19,8 +19,64 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "config.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "avcodec.h"
 
+/**
+ * Shared payload of reference counted packets, stored in AVPacket.priv.
+ * The original owner's data, size, priv and destruct are kept here and
+ * used to free the payload once the last reference is released.
+ */
+typedef struct PacketBuffer {
+    int refcount;
+    uint8_t *data;
+    int size;
+    void *priv;
+    void (*destruct)(AVPacket *);
+} PacketBuffer;
+
+#if HAVE_PTHREADS
+static pthread_mutex_t refcount_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int buffer_ref(PacketBuffer *buf, int delta)
+{
+    int refcount;
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&refcount_mutex);
+#endif
+    refcount = buf->refcount += delta;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&refcount_mutex);
+#endif
+    return refcount;
+}
+
+static void destruct_packet_ref(AVPacket *pkt)
+{
+    PacketBuffer *buf = pkt->priv;
+
+    if (!buffer_ref(buf, -1)) {
+        AVPacket orig;
+        av_init_packet(&orig);
+        orig.data     = buf->data;
+        orig.size     = buf->size;
+        orig.priv     = buf->priv;
+        orig.destruct = buf->destruct;
+        /* empty packets have nothing to free */
+        if (orig.destruct)
+            orig.destruct(&orig);
+        av_free(buf);
+    }
+    /* like av_destruct_packet(), leave nothing to free a second time */
+    pkt->data = NULL; pkt->size = 0;
+    pkt->priv     = NULL;
+    pkt->destruct = NULL;
+}
+
 
 void av_destruct_packet_nofree(AVPacket *pkt)
 {
@@ -67,6 +123,8 @@ int av_new_packet(AVPacket *pkt, int size)
 void av_shrink_packet(AVPacket *pkt, int size)
 {
     if (pkt->size <= size) return;
+    if (pkt->destruct == destruct_packet_ref && av_packet_make_writable(pkt) < 0)
+        return;
     pkt->size = size;
     memset(pkt->data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
 }
@@ -97,3 +155,55 @@ void av_free_packet(AVPacket *pkt)
         pkt->data = NULL; pkt->size = 0;
     }
 }
+
+int av_packet_ref(AVPacket *dst, AVPacket *src)
+{
+    PacketBuffer *buf;
+
+    if (src->destruct != destruct_packet_ref) {
+        int ret = av_dup_packet(src);
+        if (ret < 0)
+            return ret;
+        if (!(buf = av_malloc(sizeof(PacketBuffer))))
+            return AVERROR(ENOMEM);
+        buf->refcount = 1;
+        buf->data     = src->data;
+        buf->size     = src->size;
+        buf->priv     = src->priv;
+        buf->destruct = src->destruct;
+        src->priv     = buf;
+        src->destruct = destruct_packet_ref;
+    }
+    buf = src->priv;
+    buffer_ref(buf, 1);
+    *dst = *src;
+    return 0;
+}
+
+void av_packet_unref(AVPacket *pkt)
+{
+    av_free_packet(pkt);
+    pkt->destruct = NULL;
+    pkt->priv     = NULL;
+}
+
+int av_packet_make_writable(AVPacket *pkt)
+{
+    AVPacket copy;
+    int ret;
+
+    if (pkt->destruct && pkt->destruct != destruct_packet_ref)
+        return 0;
+    if (pkt->destruct == destruct_packet_ref &&
+        ((PacketBuffer *)pkt->priv)->refcount == 1)
+        return 0;
+
+    copy = *pkt;
+    copy.destruct = NULL;
+    copy.priv     = NULL;
+    if ((ret = av_dup_packet(&copy)) < 0)
+        return ret;
+    av_free_packet(pkt);
+    *pkt = copy;
+    return 0;
+}
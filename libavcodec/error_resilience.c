@@ -32,6 +32,7 @@
 #include "mpegvideo.h"
 #include "h264.h"
 #include "rectangle.h"
+#include "thread.h"
 
 /*
  * H264 redefines mb_intra so it is not mistakely used (its uninitialized in h264)
@@ -763,6 +764,18 @@ void ff_er_frame_end(MpegEncContext *s){
        s->picture_structure != PICT_FRAME || // we dont support ER of field pictures yet, though it should not crash if enabled
        s->error_count==3*s->mb_width*(s->avctx->skip_top + s->avctx->skip_bottom)) return;
 
+    /* concealment may read any part of the reference pictures */
+    if(s->avctx->active_thread_type&FF_THREAD_FRAME){
+        for(i=0; i<2; i++){
+            Picture *ref= i ? s->next_picture_ptr : s->last_picture_ptr;
+            if(ref && ref->data[0] && ref != s->current_picture_ptr){
+                ff_thread_await_progress((AVFrame*)ref, INT_MAX, 0);
+                if(ref->field_picture)
+                    ff_thread_await_progress((AVFrame*)ref, INT_MAX, 1);
+            }
+        }
+    }
+
     if(s->current_picture.motion_val[0] == NULL){
         av_log(s->avctx, AV_LOG_ERROR, "Warning MVs not available\n");
 
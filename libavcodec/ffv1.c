@@ -32,8 +32,12 @@
 #include "rangecoder.h"
 #include "golomb.h"
 #include "mathops.h"
+#include "libavutil/crc.h"
+#include "libavutil/intreadwrite.h"
 
 #define MAX_PLANES 4
+#define MAX_SLICES 256
+#define SLICE_TRAILER_SIZE 7 ///< 24 bit slice size + 32 bit CRC, version 2 and later
 #define CONTEXT_SIZE 32
 
 extern const uint8_t ff_log2_run[32];
@@ -239,6 +243,13 @@ typedef struct FFV1Context{
     int colorspace;
     int_fast16_t *sample_buffer;
 
+    int slice_count;
+    struct FFV1Context *slice_context[MAX_SLICES]; ///< slice_context[0] is the frame context itself
+    int slice_y, slice_height;          ///< luma rows covered by the slice
+    uint8_t *slice_data;                ///< start of the slice in the packet
+    int slice_size;                     ///< size of the slice, without trailer for the decoder
+    int slice_damaged;
+
     DSPContext dsp;
 }FFV1Context;
 
@@ -507,7 +518,7 @@ static inline int encode_line(FFV1Context *s, int w, int_fast16_t *sample[2], in
     return 0;
 }
 
-static void encode_plane(FFV1Context *s, uint8_t *src, int w, int h, int stride, int plane_index){
+static int encode_plane(FFV1Context *s, uint8_t *src, int w, int h, int stride, int plane_index){
     int x,y,i;
     const int ring_size= s->avctx->context_model ? 3 : 2;
     int_fast16_t *sample[3];
@@ -526,18 +537,21 @@ static void encode_plane(FFV1Context *s, uint8_t *src, int w, int h, int stride,
             for(x=0; x<w; x++){
                 sample[0][x]= src[x + stride*y];
             }
-            encode_line(s, w, sample, plane_index, 8);
+            if(encode_line(s, w, sample, plane_index, 8) < 0)
+                return -1;
         }else{
             for(x=0; x<w; x++){
                 sample[0][x]= ((uint16_t*)(src + stride*y))[x] >> (16 - s->avctx->bits_per_raw_sample);
             }
-            encode_line(s, w, sample, plane_index, s->avctx->bits_per_raw_sample);
+            if(encode_line(s, w, sample, plane_index, s->avctx->bits_per_raw_sample) < 0)
+                return -1;
         }
 //STOP_TIMER("encode line")}
     }
+    return 0;
 }
 
-static void encode_rgb_frame(FFV1Context *s, uint32_t *src, int w, int h, int stride){
+static int encode_rgb_frame(FFV1Context *s, uint32_t *src, int w, int h, int stride){
     int x, y, p, i;
     const int ring_size= s->avctx->context_model ? 3 : 2;
     int_fast16_t *sample[3][3];
@@ -571,9 +585,11 @@ static void encode_rgb_frame(FFV1Context *s, uint32_t *src, int w, int h, int st
         for(p=0; p<3; p++){
             sample[p][0][-1]= sample[p][1][0  ];
             sample[p][1][ w]= sample[p][1][w-1];
-            encode_line(s, w, sample[p], FFMIN(p, 1), 9);
+            if(encode_line(s, w, sample[p], FFMIN(p, 1), 9) < 0)
+                return -1;
         }
     }
+    return 0;
 }
 
 static void write_quant_table(RangeCoder *c, int16_t *quant_table){
@@ -616,6 +632,8 @@ static void write_header(FFV1Context *f){
 
     for(i=0; i<5; i++)
         write_quant_table(c, f->quant_table[i]);
+    if(f->version>1)
+        put_symbol(c, state, f->slice_count, 0);
 }
 #endif /* CONFIG_FFV1_ENCODER */
 
@@ -636,6 +654,75 @@ static av_cold int common_init(AVCodecContext *avctx){
     if (!s->sample_buffer)
         return AVERROR(ENOMEM);
 
+    s->slice_context[0]= s;
+    s->slice_count= 1;
+
+    return 0;
+}
+
+/**
+ * Set up the contexts of all slices after the frame parameters changed.
+ * Slices are horizontal stripes aligned to the chroma subsampling, each
+ * with its own coder, context states and sample buffer.
+ */
+static int init_slice_contexts(FFV1Context *f){
+    const int align= 1<<f->chroma_v_shift;
+    int i, j;
+
+    for(i=f->slice_count; i<MAX_SLICES && f->slice_context[i]; i++){
+        FFV1Context *fs= f->slice_context[i];
+        for(j=0; j<MAX_PLANES; j++){
+            av_freep(&fs->plane[j].state);
+            av_freep(&fs->plane[j].vlc_state);
+        }
+        av_freep(&fs->sample_buffer);
+        av_freep(&f->slice_context[i]);
+    }
+
+    for(i=0; i<f->slice_count; i++){
+        FFV1Context *fs= f->slice_context[i];
+
+        if(i){
+            PlaneContext plane[MAX_PLANES];
+            int_fast16_t *sample_buffer;
+
+            if(!fs && !(fs= f->slice_context[i]= av_mallocz(sizeof(FFV1Context))))
+                return AVERROR(ENOMEM);
+
+            /* copy the frame parameters but keep the per slice state */
+            memcpy(plane, fs->plane, sizeof(plane));
+            sample_buffer= fs->sample_buffer;
+            *fs= *f;
+            memcpy(fs->plane, plane, sizeof(plane));
+            fs->sample_buffer= sample_buffer;
+
+            if(!fs->sample_buffer)
+                fs->sample_buffer= av_malloc(6 * (fs->width+6) * sizeof(*fs->sample_buffer));
+            if(!fs->sample_buffer)
+                return AVERROR(ENOMEM);
+
+            for(j=0; j<f->plane_count; j++){
+                PlaneContext * const p= &fs->plane[j];
+
+                p->context_count= f->plane[j].context_count;
+                if(f->ac){
+                    p->state= av_realloc(p->state, CONTEXT_SIZE*p->context_count*sizeof(uint8_t));
+                    if(!p->state)
+                        return AVERROR(ENOMEM);
+                }else{
+                    p->vlc_state= av_realloc(p->vlc_state, p->context_count*sizeof(VlcState));
+                    if(!p->vlc_state)
+                        return AVERROR(ENOMEM);
+                }
+            }
+        }
+
+        fs->slice_y     = (f->height* i   /f->slice_count) & ~(align-1);
+        fs->slice_height= i+1 == f->slice_count ? f->height
+                        : (f->height*(i+1)/f->slice_count) & ~(align-1);
+        fs->slice_height-= fs->slice_y;
+    }
+
     return 0;
 }
 
@@ -725,6 +812,22 @@ static av_cold int encode_init(AVCodecContext *avctx)
     }
     avcodec_get_chroma_sub_sample(avctx->pix_fmt, &s->chroma_h_shift, &s->chroma_v_shift);
 
+    if(avctx->level >= 2){
+        if(avctx->strict_std_compliance > FF_COMPLIANCE_EXPERIMENTAL){
+            av_log(avctx, AV_LOG_ERROR, "Version 2 is experimental, use -strict -2 to enable it\n");
+            return -1;
+        }
+        /* one slice per thread, but enough that single threaded
+         * encodes can still be decoded in parallel */
+        s->version= 2;
+        s->slice_count= FFMAX(avctx->thread_count, 4);
+        s->slice_count= FFMIN(s->slice_count, MAX_SLICES);
+        s->slice_count= FFMIN(s->slice_count, s->height >> s->chroma_v_shift);
+        s->slice_count= FFMAX(s->slice_count, 1);
+    }
+    if(init_slice_contexts(s) < 0)
+        return AVERROR(ENOMEM);
+
     s->picture_number=0;
 
     return 0;
@@ -755,65 +858,133 @@ static void clear_state(FFV1Context *f){
 }
 
 #if CONFIG_FFV1_ENCODER
+static int encode_slice(AVCodecContext *c, void *arg){
+    FFV1Context *fs= *(void**)arg;
+    FFV1Context *f= c->priv_data;
+    const int width= fs->width;
+    const int y= fs->slice_y;
+    const int height= fs->slice_height;
+    AVFrame * const p= &f->picture;
+    /* the coders stop SLICE_TRAILER_SIZE bytes before the next slice */
+    uint8_t *end= fs->ac ? fs->c.bytestream_end : fs->pb.buf_end;
+    int bytes, ret;
+
+    if(fs->colorspace==0){
+        const int chroma_width = -((-width )>>fs->chroma_h_shift);
+        const int chroma_y     = y>>fs->chroma_v_shift;
+        const int chroma_height= -((-(y+height))>>fs->chroma_v_shift) - chroma_y;
+
+        ret= encode_plane(fs, p->data[0] + y*p->linesize[0], width, height, p->linesize[0], 0);
+
+        if(ret >= 0)
+            ret= encode_plane(fs, p->data[1] + chroma_y*p->linesize[1], chroma_width, chroma_height, p->linesize[1], 1);
+        if(ret >= 0)
+            ret= encode_plane(fs, p->data[2] + chroma_y*p->linesize[2], chroma_width, chroma_height, p->linesize[2], 1);
+    }else{
+        ret= encode_rgb_frame(fs, (uint32_t*)(p->data[0] + y*p->linesize[0]), width, height, p->linesize[0]/4);
+    }
+    emms_c();
+
+    if(ret < 0){
+        fs->slice_size= -1;
+        return -1;
+    }
+
+    if(fs->ac){
+        bytes= ff_rac_terminate(&fs->c);
+    }else{
+        flush_put_bits(&fs->pb); //nicer padding FIXME
+        bytes= fs->pb.buf - fs->slice_data + (put_bits_count(&fs->pb)+7)/8;
+    }
+
+    if(bytes > end - fs->slice_data){
+        av_log(c, AV_LOG_ERROR, "slice of %d bytes overran its part of the buffer\n", bytes);
+        fs->slice_size= -1;
+        return -1;
+    }
+
+    if(fs->version>1){
+        if(bytes >= 1<<24){
+            av_log(c, AV_LOG_ERROR, "slice of %d bytes does not fit the slice trailer\n", bytes);
+            fs->slice_size= -1;
+            return -1;
+        }
+        AV_WB24(fs->slice_data + bytes, bytes);
+        AV_WB32(fs->slice_data + bytes + 3,
+                av_crc(av_crc_get_table(AV_CRC_32_IEEE), 0, fs->slice_data, bytes + 3));
+        bytes+= SLICE_TRAILER_SIZE;
+    }
+    fs->slice_size= bytes;
+
+    return 0;
+}
+
 static int encode_frame(AVCodecContext *avctx, unsigned char *buf, int buf_size, void *data){
     FFV1Context *f = avctx->priv_data;
-    RangeCoder * const c= &f->c;
     AVFrame *pict = data;
-    const int width= f->width;
-    const int height= f->height;
     AVFrame * const p= &f->picture;
-    int used_count= 0;
+    const int trailer= f->version>1 ? SLICE_TRAILER_SIZE : 0;
     uint8_t keystate=128;
-
-    ff_init_range_encoder(c, buf, buf_size);
-    ff_build_rac_states(c, 0.05*(1LL<<32), 256-8);
+    uint8_t *buf_p;
+    int i;
 
     *p = *pict;
     p->pict_type= FF_I_TYPE;
+    p->key_frame= avctx->gop_size==0 || f->picture_number % avctx->gop_size == 0;
+
+    /* every slice is coded into its own part of the buffer, sized by the
+     * rows it covers, the parts are moved together once all slices are done */
+    for(i=0; i<f->slice_count; i++){
+        FFV1Context *fs= f->slice_context[i];
+        RangeCoder * const c= &fs->c;
+        uint8_t *start= buf + buf_size*(int64_t) fs->slice_y                    /f->height;
+        uint8_t *end  = buf + buf_size*(int64_t)(fs->slice_y + fs->slice_height)/f->height - trailer;
+
+        if(end - start < 64){
+            av_log(avctx, AV_LOG_ERROR, "output buffer too small for %d slices\n", f->slice_count);
+            return -1;
+        }
 
-    if(avctx->gop_size==0 || f->picture_number % avctx->gop_size == 0){
-        put_rac(c, &keystate, 1);
-        p->key_frame= 1;
-        write_header(f);
-        clear_state(f);
-    }else{
-        put_rac(c, &keystate, 0);
-        p->key_frame= 0;
-    }
+        fs->slice_data= start;
+        ff_init_range_encoder(c, start, end - start);
+        ff_build_rac_states(c, 0.05*(1LL<<32), 256-8);
 
-    if(!f->ac){
-        used_count += ff_rac_terminate(c);
+        if(!i){
+            put_rac(c, &keystate, p->key_frame);
+            if(p->key_frame)
+                write_header(f);
+        }
+        if(p->key_frame)
+            clear_state(fs);
+
+        if(!f->ac){
+            int used_count= i ? 0 : ff_rac_terminate(c);
 //printf("pos=%d\n", used_count);
-        init_put_bits(&f->pb, buf + used_count, buf_size - used_count);
-    }else if (f->ac>1){
-        int i;
-        for(i=1; i<256; i++){
-            c->one_state[i]= f->state_transition[i];
-            c->zero_state[256-i]= 256-c->one_state[i];
+            init_put_bits(&fs->pb, start + used_count, end - start - used_count);
+        }else if (f->ac>1){
+            int j;
+            for(j=1; j<256; j++){
+                c->one_state[j]= f->state_transition[j];
+                c->zero_state[256-j]= 256-c->one_state[j];
+            }
         }
     }
 
-    if(f->colorspace==0){
-        const int chroma_width = -((-width )>>f->chroma_h_shift);
-        const int chroma_height= -((-height)>>f->chroma_v_shift);
-
-        encode_plane(f, p->data[0], width, height, p->linesize[0], 0);
-
-        encode_plane(f, p->data[1], chroma_width, chroma_height, p->linesize[1], 1);
-        encode_plane(f, p->data[2], chroma_width, chroma_height, p->linesize[2], 1);
-    }else{
-        encode_rgb_frame(f, (uint32_t*)(p->data[0]), width, height, p->linesize[0]/4);
-    }
-    emms_c();
+    avctx->execute(avctx, encode_slice, &f->slice_context[0], NULL, f->slice_count, sizeof(void*));
 
     f->picture_number++;
 
-    if(f->ac){
-        return ff_rac_terminate(c);
-    }else{
-        flush_put_bits(&f->pb); //nicer padding FIXME
-        return used_count + (put_bits_count(&f->pb)+7)/8;
+    buf_p= buf;
+    for(i=0; i<f->slice_count; i++){
+        FFV1Context *fs= f->slice_context[i];
+        if(fs->slice_size < 0)
+            return -1;
+        if(i)
+            memmove(buf_p, fs->slice_data, fs->slice_size);
+        buf_p+= fs->slice_size;
     }
+
+    return buf_p - buf;
 }
 #endif /* CONFIG_FFV1_ENCODER */
 
@@ -830,6 +1001,9 @@ static av_cold int common_end(AVCodecContext *avctx){
 
     av_freep(&s->sample_buffer);
 
+    s->slice_count= 1;
+    init_slice_contexts(s);
+
     return 0;
 }
 
@@ -1075,7 +1249,18 @@ static int read_header(FFV1Context *f){
         }
     }
 
-    return 0;
+    f->slice_count= 1;
+    if(f->version>1){
+        f->slice_count= get_symbol(c, state, 0);
+        if(f->slice_count < 1 || f->slice_count > MAX_SLICES
+           || f->slice_count > f->height >> f->chroma_v_shift){
+            av_log(f->avctx, AV_LOG_ERROR, "slice count %d invalid\n", f->slice_count);
+            f->slice_count= 1;
+            return -1;
+        }
+    }
+
+    return init_slice_contexts(f);
 }
 
 static av_cold int decode_init(AVCodecContext *avctx)
@@ -1087,15 +1272,48 @@ static av_cold int decode_init(AVCodecContext *avctx)
     return 0;
 }
 
+static int decode_slice(AVCodecContext *c, void *arg){
+    FFV1Context *fs= *(void**)arg;
+    FFV1Context *f= c->priv_data;
+    const int width= fs->width;
+    const int y= fs->slice_y;
+    const int height= fs->slice_height;
+    AVFrame * const p= &f->picture;
+
+    if(fs->version>1){
+        const uint8_t *trailer= fs->slice_data + fs->slice_size;
+        if(av_crc(av_crc_get_table(AV_CRC_32_IEEE), 0, fs->slice_data, fs->slice_size + 3) != AV_RB32(trailer + 3)){
+            av_log(c, AV_LOG_ERROR, "CRC mismatch in slice at line %d\n", y);
+            fs->slice_damaged= 1;
+            return -1;
+        }
+    }
+
+    if(fs->colorspace==0){
+        const int chroma_width = -((-width )>>fs->chroma_h_shift);
+        const int chroma_y     = y>>fs->chroma_v_shift;
+        const int chroma_height= -((-(y+height))>>fs->chroma_v_shift) - chroma_y;
+
+        decode_plane(fs, p->data[0] + y*p->linesize[0], width, height, p->linesize[0], 0);
+
+        decode_plane(fs, p->data[1] + chroma_y*p->linesize[1], chroma_width, chroma_height, p->linesize[1], 1);
+        decode_plane(fs, p->data[2] + chroma_y*p->linesize[2], chroma_width, chroma_height, p->linesize[2], 1);
+    }else{
+        decode_rgb_frame(fs, (uint32_t*)(p->data[0] + y*p->linesize[0]), width, height, p->linesize[0]/4);
+    }
+    emms_c();
+
+    return 0;
+}
+
 static int decode_frame(AVCodecContext *avctx, void *data, int *data_size, AVPacket *avpkt){
     const uint8_t *buf = avpkt->data;
     int buf_size = avpkt->size;
     FFV1Context *f = avctx->priv_data;
     RangeCoder * const c= &f->c;
-    const int width= f->width;
-    const int height= f->height;
     AVFrame * const p= &f->picture;
-    int bytes_read;
+    uint8_t *buf_p;
+    int bytes_read, i;
     uint8_t keystate= 128;
 
     AVFrame *picture = data;
@@ -1109,21 +1327,53 @@ static int decode_frame(AVCodecContext *avctx, void *data, int *data_size, AVPac
         p->key_frame= 1;
         if(read_header(f) < 0)
             return -1;
-        clear_state(f);
+        for(i=0; i<f->slice_count; i++)
+            clear_state(f->slice_context[i]);
     }else{
         p->key_frame= 0;
     }
-    if(f->ac>1){
-        int i;
-        for(i=1; i<256; i++){
-            c->one_state[i]= f->state_transition[i];
-            c->zero_state[256-i]= 256-c->one_state[i];
-        }
-    }
 
     if(!f->plane[0].state && !f->plane[0].vlc_state)
         return -1;
 
+    /* slices are located from the end of the packet, the header has
+     * already been read from the start of the first one */
+    buf_p= avpkt->data + buf_size;
+    for(i=f->slice_count-1; i>=0; i--){
+        FFV1Context *fs= f->slice_context[i];
+        int slice_size= buf_p - buf;
+
+        if(f->version>1){
+            if(slice_size < SLICE_TRAILER_SIZE
+               || (slice_size= AV_RB24(buf_p - SLICE_TRAILER_SIZE)) > buf_p - buf - SLICE_TRAILER_SIZE){
+                av_log(avctx, AV_LOG_ERROR, "slice %d size invalid\n", i);
+                return -1;
+            }
+            buf_p-= slice_size + SLICE_TRAILER_SIZE;
+        }else
+            buf_p= avpkt->data;
+        if(!i && buf_p != buf){
+            av_log(avctx, AV_LOG_ERROR, "slices do not cover the packet\n");
+            return -1;
+        }
+
+        fs->slice_data= buf_p;
+        fs->slice_size= slice_size;
+        fs->slice_damaged= 0;
+        if(i){
+            ff_init_range_decoder(&fs->c, buf_p, slice_size);
+            ff_build_rac_states(&fs->c, 0.05*(1LL<<32), 256-8);
+        }else
+            c->bytestream_end= buf_p + slice_size;
+        if(f->ac>1){
+            int j;
+            for(j=1; j<256; j++){
+                fs->c.one_state[j]= f->state_transition[j];
+                fs->c.zero_state[256-j]= 256-fs->c.one_state[j];
+            }
+        }
+    }
+
     p->reference= 0;
     if(avctx->get_buffer(avctx, p) < 0){
         av_log(avctx, AV_LOG_ERROR, "get_buffer() failed\n");
@@ -1131,29 +1381,22 @@ static int decode_frame(AVCodecContext *avctx, void *data, int *data_size, AVPac
     }
 
     if(avctx->debug&FF_DEBUG_PICT_INFO)
-        av_log(avctx, AV_LOG_ERROR, "keyframe:%d coder:%d\n", p->key_frame, f->ac);
+        av_log(avctx, AV_LOG_ERROR, "keyframe:%d coder:%d slices:%d\n", p->key_frame, f->ac, f->slice_count);
 
     if(!f->ac){
         bytes_read = c->bytestream - c->bytestream_start - 1;
         if(bytes_read ==0) av_log(avctx, AV_LOG_ERROR, "error at end of AC stream\n"); //FIXME
 //printf("pos=%d\n", bytes_read);
-        init_get_bits(&f->gb, buf + bytes_read, buf_size - bytes_read);
+        init_get_bits(&f->gb, buf + bytes_read, (f->slice_size - bytes_read)*8);
+        for(i=1; i<f->slice_count; i++){
+            FFV1Context *fs= f->slice_context[i];
+            init_get_bits(&fs->gb, fs->slice_data, fs->slice_size*8);
+        }
     } else {
         bytes_read = 0; /* avoid warning */
     }
 
-    if(f->colorspace==0){
-        const int chroma_width = -((-width )>>f->chroma_h_shift);
-        const int chroma_height= -((-height)>>f->chroma_v_shift);
-        decode_plane(f, p->data[0], width, height, p->linesize[0], 0);
-
-        decode_plane(f, p->data[1], chroma_width, chroma_height, p->linesize[1], 1);
-        decode_plane(f, p->data[2], chroma_width, chroma_height, p->linesize[2], 1);
-    }else{
-        decode_rgb_frame(f, (uint32_t*)p->data[0], width, height, p->linesize[0]/4);
-    }
-
-    emms_c();
+    avctx->execute(avctx, decode_slice, &f->slice_context[0], NULL, f->slice_count, sizeof(void*));
 
     f->picture_number++;
 
@@ -1161,9 +1404,15 @@ static int decode_frame(AVCodecContext *avctx, void *data, int *data_size, AVPac
 
     avctx->release_buffer(avctx, p); //FIXME
 
+    for(i=0; i<f->slice_count; i++)
+        if(f->slice_context[i]->slice_damaged)
+            return -1;
+
     *data_size = sizeof(AVFrame);
 
-    if(f->ac){
+    if(f->version>1){
+        bytes_read= buf_size;
+    }else if(f->ac){
         bytes_read= c->bytestream - c->bytestream_start - 1;
         if(bytes_read ==0) av_log(f->avctx, AV_LOG_ERROR, "error at end of frame\n");
     }else{
@@ -0,0 +1,361 @@
+/*
+ * Picture buffer pool
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Pool of picture buffers grouped in size classes.
+ *
+ * Released buffers are kept in a most-recently-used list per size class
+ * and handed out again to later requests of the same class. The amount
+ * of cached memory is bounded either by a fixed limit or, by default, by
+ * a slowly decaying peak of the memory in use, so that caches of closed
+ * decoders are eventually given back.
+ */
+
+#include "config.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#include "avcodec.h"
+#include "internal.h"
+
+typedef struct PoolBuffer {
+    struct AVFramePool *pool;
+    struct PoolBuffer *prev, *next; ///< links in the free list of the class
+    unsigned int size;              ///< size class of the payload
+    uint64_t serial;                ///< release order, for LRU trimming
+    uint64_t owner;                 ///< last user, see ff_frame_pool_get()
+    int64_t tag;                    ///< opaque value stored by the last user
+} PoolBuffer;
+
+/* keep the payload as aligned as av_malloc() returns it */
+#define HEADER_SIZE FFALIGN(sizeof(PoolBuffer), 32)
+
+#define MAX_CLASSES 64
+
+typedef struct SizeClass {
+    unsigned int size;
+    PoolBuffer *head;               ///< most recently released buffer
+    PoolBuffer *tail;               ///< least recently released buffer
+} SizeClass;
+
+struct AVFramePool {
+#if HAVE_PTHREADS
+    pthread_mutex_t mutex;
+#endif
+    SizeClass classes[MAX_CLASSES]; ///< sorted by size
+    int nb_classes;
+    int64_t max_cached;             ///< 0 for the automatic limit
+    int64_t peak_in_use;
+    uint64_t serial;
+    int freed;                      ///< av_frame_pool_free() was called
+    AVFramePoolStats stats;
+};
+
+static AVFramePool default_pool = {
+#if HAVE_PTHREADS
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static void pool_lock(AVFramePool *pool)
+{
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&pool->mutex);
+#endif
+}
+
+static void pool_unlock(AVFramePool *pool)
+{
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+/**
+ * Round size up so that buffers of similar sizes share a class,
+ * wasting less than 1/16 of the requested size.
+ */
+static unsigned int class_size(unsigned int size)
+{
+    unsigned int step = 64;
+    while (step << 4 <= size && step < 1U << 30)
+        step <<= 1;
+    if (size > UINT_MAX - step)
+        return 0;
+    return FFALIGN(size, step);
+}
+
+static SizeClass *find_class(AVFramePool *pool, unsigned int size, int create)
+{
+    int lo = 0, hi = pool->nb_classes;
+
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (pool->classes[mid].size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < pool->nb_classes && pool->classes[lo].size == size)
+        return &pool->classes[lo];
+    if (!create || pool->nb_classes >= MAX_CLASSES)
+        return NULL;
+
+    memmove(&pool->classes[lo + 1], &pool->classes[lo],
+            (pool->nb_classes - lo) * sizeof(SizeClass));
+    pool->nb_classes++;
+    memset(&pool->classes[lo], 0, sizeof(SizeClass));
+    pool->classes[lo].size = size;
+    return &pool->classes[lo];
+}
+
+static void unlink_buffer(SizeClass *c, PoolBuffer *buf)
+{
+    if (buf->prev) buf->prev->next = buf->next;
+    else           c->head         = buf->next;
+    if (buf->next) buf->next->prev = buf->prev;
+    else           c->tail         = buf->prev;
+    buf->prev = buf->next = NULL;
+}
+
+static void remove_class_if_empty(AVFramePool *pool, SizeClass *c)
+{
+    int i = c - pool->classes;
+
+    if (c->head)
+        return;
+    pool->nb_classes--;
+    memmove(c, c + 1, (pool->nb_classes - i) * sizeof(SizeClass));
+}
+
+static void free_pool(AVFramePool *pool)
+{
+#if HAVE_PTHREADS
+    pthread_mutex_destroy(&pool->mutex);
+#endif
+    av_free(pool);
+}
+
+/**
+ * Free least recently released buffers until at most max_cached bytes
+ * remain cached. Must be called with the pool locked.
+ */
+static void trim(AVFramePool *pool, int64_t max_cached)
+{
+    while (pool->stats.bytes_cached > max_cached) {
+        SizeClass *oldest = NULL;
+        PoolBuffer *buf;
+        int i;
+
+        for (i = 0; i < pool->nb_classes; i++) {
+            SizeClass *c = &pool->classes[i];
+            if (c->tail && (!oldest || c->tail->serial < oldest->tail->serial))
+                oldest = c;
+        }
+        if (!oldest)
+            break;
+        buf = oldest->tail;
+        unlink_buffer(oldest, buf);
+        pool->stats.bytes_cached -= buf->size;
+        pool->stats.buffers_cached--;
+        pool->stats.trimmed++;
+        remove_class_if_empty(pool, oldest);
+        av_free(buf);
+    }
+}
+
+AVFramePool *av_frame_pool_alloc(int64_t max_cached)
+{
+    AVFramePool *pool = av_mallocz(sizeof(AVFramePool));
+
+    if (!pool)
+        return NULL;
+#if HAVE_PTHREADS
+    pthread_mutex_init(&pool->mutex, NULL);
+#endif
+    pool->max_cached = max_cached;
+    return pool;
+}
+
+void av_frame_pool_free(AVFramePool **ppool)
+{
+    AVFramePool *pool = *ppool;
+    int in_use;
+
+    if (!pool || pool == &default_pool)
+        return;
+    *ppool = NULL;
+
+    pool_lock(pool);
+    trim(pool, 0);
+    pool->freed = 1;
+    in_use = pool->stats.buffers_in_use;
+    pool_unlock(pool);
+
+    if (!in_use)
+        free_pool(pool);
+}
+
+uint64_t ff_frame_pool_new_owner(void)
+{
+    static uint64_t last_owner;
+    uint64_t owner;
+
+    pool_lock(&default_pool);
+    owner = ++last_owner;
+    pool_unlock(&default_pool);
+    return owner;
+}
+
+void *ff_frame_pool_get(AVFramePool *pool, unsigned int size,
+                        uint64_t owner, int64_t *tag)
+{
+    PoolBuffer *buf = NULL;
+    SizeClass *c;
+
+    if (!pool)
+        pool = &default_pool;
+    if (!(size = class_size(size)) || size > INT_MAX - HEADER_SIZE)
+        return NULL;
+
+    pool_lock(pool);
+    if ((c = find_class(pool, size, 0)) && c->head) {
+        /* prefer a buffer released by the same user, its contents may
+         * still be of use */
+        for (buf = c->head; buf && owner; buf = buf->next)
+            if (buf->owner == owner)
+                break;
+        if (!buf)
+            buf = c->head;
+        unlink_buffer(c, buf);
+        remove_class_if_empty(pool, c);
+        pool->stats.bytes_cached -= size;
+        pool->stats.buffers_cached--;
+        pool->stats.hits++;
+    } else {
+        pool->stats.misses++;
+    }
+    pool->stats.bytes_in_use += size;
+    pool->stats.buffers_in_use++;
+    pool->peak_in_use = FFMAX(pool->peak_in_use, pool->stats.bytes_in_use);
+    pool_unlock(pool);
+
+    if (!buf) {
+        if (!(buf = av_malloc(HEADER_SIZE + size))) {
+            pool_lock(pool);
+            pool->stats.bytes_in_use -= size;
+            pool->stats.buffers_in_use--;
+            pool_unlock(pool);
+            return NULL;
+        }
+        buf->pool  = pool;
+        buf->size  = size;
+        buf->owner = 0;
+    }
+    buf->prev = buf->next = NULL;
+
+    if (tag && owner && buf->owner == owner)
+        *tag = buf->tag;
+    else if (tag)
+        *tag = 0;
+    buf->owner = owner;
+    return (uint8_t *)buf + HEADER_SIZE;
+}
+
+void ff_frame_pool_release(void *ptr, int64_t tag)
+{
+    PoolBuffer *buf;
+    AVFramePool *pool;
+    SizeClass *c;
+    int64_t limit;
+
+    if (!ptr)
+        return;
+    buf  = (PoolBuffer *)((uint8_t *)ptr - HEADER_SIZE);
+    pool = buf->pool;
+    buf->tag = tag;
+
+    pool_lock(pool);
+    limit = pool->max_cached ? pool->max_cached : pool->peak_in_use;
+    pool->stats.bytes_in_use -= buf->size;
+    pool->stats.buffers_in_use--;
+    /* let an unused peak decay so that idle caches shrink over time */
+    pool->peak_in_use -= pool->peak_in_use >> 8;
+    pool->peak_in_use  = FFMAX(pool->peak_in_use, pool->stats.bytes_in_use);
+
+    if (pool->freed) {
+        int last = !pool->stats.buffers_in_use;
+        pool_unlock(pool);
+        av_free(buf);
+        if (last)
+            free_pool(pool);
+        return;
+    }
+
+    if (buf->size <= limit) {
+        trim(pool, limit - buf->size);
+        c = find_class(pool, buf->size, 1);
+    } else
+        c = NULL;
+    if (!c) {
+        pool->stats.trimmed++;
+        pool_unlock(pool);
+        av_free(buf);
+        return;
+    }
+    buf->serial = pool->serial++;
+    buf->next   = c->head;
+    if (c->head) c->head->prev = buf;
+    else         c->tail       = buf;
+    c->head = buf;
+    pool->stats.bytes_cached += buf->size;
+    pool->stats.buffers_cached++;
+    pool_unlock(pool);
+}
+
+void *av_frame_pool_get(AVFramePool *pool, unsigned int size)
+{
+    return ff_frame_pool_get(pool, size, 0, NULL);
+}
+
+void av_frame_pool_release(void *ptr)
+{
+    ff_frame_pool_release(ptr, 0);
+}
+
+void av_frame_pool_trim(AVFramePool *pool, int64_t max_cached)
+{
+    if (!pool)
+        pool = &default_pool;
+    pool_lock(pool);
+    trim(pool, max_cached);
+    pool->peak_in_use = pool->stats.bytes_in_use;
+    pool_unlock(pool);
+}
+
+void av_frame_pool_get_stats(AVFramePool *pool, AVFramePoolStats *stats)
+{
+    if (!pool)
+        pool = &default_pool;
+    pool_lock(pool);
+    *stats = pool->stats;
+    pool_unlock(pool);
+}
@@ -36,6 +36,7 @@
 #include "vdpau_internal.h"
 #include "flv.h"
 #include "mpeg4video.h"
+#include "thread.h"
 
 //#define DEBUG
 //#define PRINT_FRAME_TIME
@@ -171,8 +172,10 @@ static int decode_slice(MpegEncContext *s){
         const int qscale= s->qscale;
 
         if(CONFIG_MPEG4_DECODER && s->codec_id==CODEC_ID_MPEG4){
-            if(ff_mpeg4_decode_partitions(s) < 0)
+            if(ff_mpeg4_decode_partitions(s) < 0){
+                s->error_occurred = 1;
                 return -1;
+            }
         }
 
         /* restore variables which were modified */
@@ -234,16 +237,19 @@ static int decode_slice(MpegEncContext *s){
                     if(++s->mb_x >= s->mb_width){
                         s->mb_x=0;
                         ff_draw_horiz_band(s, s->mb_y*mb_size, mb_size);
+                        MPV_report_decode_progress(s);
                         s->mb_y++;
                     }
                     return 0;
                 }else if(ret==SLICE_NOEND){
                     av_log(s->avctx, AV_LOG_ERROR, "Slice mismatch at MB: %d\n", xy);
                     ff_er_add_slice(s, s->resync_mb_x, s->resync_mb_y, s->mb_x+1, s->mb_y, (AC_END|DC_END|MV_END)&part_mask);
+                    s->error_occurred = 1;
                     return -1;
                 }
                 av_log(s->avctx, AV_LOG_ERROR, "Error at MB: %d\n", xy);
                 ff_er_add_slice(s, s->resync_mb_x, s->resync_mb_y, s->mb_x, s->mb_y, (AC_ERROR|DC_ERROR|MV_ERROR)&part_mask);
+                s->error_occurred = 1;
 
                 return -1;
             }
@@ -254,6 +260,7 @@ static int decode_slice(MpegEncContext *s){
         }
 
         ff_draw_horiz_band(s, s->mb_y*mb_size, mb_size);
+        MPV_report_decode_progress(s);
 
         s->mb_x= 0;
     }
@@ -324,6 +331,7 @@ static int decode_slice(MpegEncContext *s){
             show_bits(&s->gb, 24), s->padding_bug_score);
 
     ff_er_add_slice(s, s->resync_mb_x, s->resync_mb_y, s->mb_x, s->mb_y, (AC_END|DC_END|MV_END)&part_mask);
+    s->error_occurred = 1;
 
     return -1;
 }
@@ -570,6 +578,12 @@ retry:
         || s->height != avctx->coded_height) {
         /* H.263 could change picture size any time */
         ParseContext pc= s->parse_context; //FIXME move these demuxng hack to avformat
+
+        /* the other frame threads still use the pictures of the old size */
+        if ((avctx->active_thread_type&FF_THREAD_FRAME) && s->coded_picture_number) {
+            av_log_missing_feature(avctx, "Changing the picture size with frame threads is", 0);
+            return -1;
+        }
         s->parse_context.buffer=0;
         MPV_common_end(s);
         s->parse_context= pc;
@@ -629,6 +643,10 @@ retry:
             return -1;
     }
 
+    /* the next frame of a packed stream is only known after this one */
+    if (!s->divx_packed)
+        ff_thread_finish_setup(avctx);
+
     ff_er_frame_start(s);
 
     //the second part of the wmv2 header contains the MB skip bits which are stored in current_picture->mb_type
@@ -642,6 +660,7 @@ retry:
     /* decode each macroblock */
     s->mb_x=0;
     s->mb_y=0;
+    s->error_occurred=0;
 
     decode_slice(s);
     while(s->mb_y<s->mb_height){
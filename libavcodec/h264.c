@@ -34,9 +34,11 @@
 #include "h264_mvpred.h"
 #include "h264_parser.h"
 #include "golomb.h"
+#include "startcode.h"
 #include "mathops.h"
 #include "rectangle.h"
 #include "vdpau_internal.h"
+#include "thread.h"
 
 #include "cabac.h"
 
@@ -156,25 +158,8 @@ const uint8_t *ff_h264_decode_nal(H264Context *h, const uint8_t *src, int *dst_l
         printf("%2X ", src[i]);
 #endif
 
-#if HAVE_FAST_UNALIGNED
-# if HAVE_FAST_64BIT
-#   define RS 7
-    for(i=0; i+1<length; i+=9){
-        if(!((~AV_RN64A(src+i) & (AV_RN64A(src+i) - 0x0100010001000101ULL)) & 0x8000800080008080ULL))
-# else
-#   define RS 3
-    for(i=0; i+1<length; i+=5){
-        if(!((~AV_RN32A(src+i) & (AV_RN32A(src+i) - 0x01000101U)) & 0x80008080U))
-# endif
-            continue;
-        if(i>0 && !src[i]) i--;
-        while(src[i]) i++;
-#else
-#   define RS 0
-    for(i=0; i+1<length; i+=2){
-        if(src[i]) continue;
-        if(i>0 && src[i-1]==0) i--;
-#endif
+    for(i=0; i+1<length; i++){
+        i+= ff_startcode_find_candidate(src + i, length - i - 2);
         if(i+2<length && src[i+1]==0 && src[i+2]<=3){
             if(src[i+2]!=3){
                 /* startcode, so we must be past the end */
@@ -182,7 +167,6 @@ const uint8_t *ff_h264_decode_nal(H264Context *h, const uint8_t *src, int *dst_l
             }
             break;
         }
-        i-= RS;
     }
 
     if(i>=length-1){ //no escaped 0
@@ -203,11 +187,14 @@ const uint8_t *ff_h264_decode_nal(H264Context *h, const uint8_t *src, int *dst_l
     memcpy(dst, src, i);
     si=di=i;
     while(si+2<length){
-        //remove escapes (very rare 1:2^22)
-        if(src[si+2]>3){
-            dst[di++]= src[si++];
-            dst[di++]= src[si++];
-        }else if(src[si]==0 && src[si+1]==0){
+        //remove escapes (very rare 1:2^22), copy up to the next zero pair at once
+        int n= ff_startcode_find_candidate(src + si, length - si - 2);
+        memcpy(dst + di, src + si, n);
+        si+= n;
+        di+= n;
+        if(si+2>=length)
+            break;
+        if(src[si+1]==0 && src[si+2]<=3){
             if(src[si+2]==3){ //escape
                 dst[di++]= 0;
                 dst[di++]= 0;
@@ -564,6 +551,128 @@ static inline void prefetch_motion(H264Context *h, int list){
     }
 }
 
+static inline void get_lowest_part_y(H264Context *h, int refs[2][48], int n, int height,
+                                     int y_offset, int list0, int list1, int *nrefs){
+    MpegEncContext * const s = &h->s;
+    int list;
+
+    y_offset += 16*(s->mb_y >> MB_FIELD);
+
+    for(list=0; list<2; list++){
+        int ref_n, my;
+        Picture *ref;
+
+        if(!(list ? list1 : list0))
+            continue;
+
+        ref_n = h->ref_cache[list][ scan8[n] ];
+        ref   = &h->ref_list[list][ref_n];
+
+        /* Error concealment can put the picture being decoded in the list,
+         * waiting on it would never end. Fields can wait on each other. */
+        if(ref->thread_opaque == s->current_picture.thread_opaque &&
+           (!FIELD_PICTURE || (ref->reference&3) == s->picture_structure))
+            continue;
+
+        /* the 6-tap luma filter reads 3 lines below the block, chroma
+         * (one chroma line more when not on a full pel) at most 2 */
+        my = (h->mv_cache[list][ scan8[n] ][1]>>2) + y_offset + height + 2;
+        my = FFMAX(my, 0);
+
+        if(refs[list][ref_n] < 0)
+            nrefs[list]++;
+        refs[list][ref_n] = FFMAX(refs[list][ref_n], my);
+    }
+}
+
+/**
+ * Wait until the reference lines that motion compensation of the current
+ * macroblock reads are decoded, when they come from other frame threads.
+ */
+static void await_references(H264Context *h){
+    MpegEncContext * const s = &h->s;
+    const int mb_xy= h->mb_xy;
+    const int mb_type= s->current_picture.mb_type[mb_xy];
+    int refs[2][48];
+    int nrefs[2] = {0};
+    int ref, list;
+
+    memset(refs, -1, sizeof(refs));
+
+    if(IS_16X16(mb_type)){
+        get_lowest_part_y(h, refs, 0, 16, 0,
+                          IS_DIR(mb_type, 0, 0), IS_DIR(mb_type, 0, 1), nrefs);
+    }else if(IS_16X8(mb_type)){
+        get_lowest_part_y(h, refs, 0, 8, 0,
+                          IS_DIR(mb_type, 0, 0), IS_DIR(mb_type, 0, 1), nrefs);
+        get_lowest_part_y(h, refs, 8, 8, 8,
+                          IS_DIR(mb_type, 1, 0), IS_DIR(mb_type, 1, 1), nrefs);
+    }else if(IS_8X16(mb_type)){
+        get_lowest_part_y(h, refs, 0, 16, 0,
+                          IS_DIR(mb_type, 0, 0), IS_DIR(mb_type, 0, 1), nrefs);
+        get_lowest_part_y(h, refs, 4, 16, 0,
+                          IS_DIR(mb_type, 1, 0), IS_DIR(mb_type, 1, 1), nrefs);
+    }else{
+        int i;
+
+        assert(IS_8X8(mb_type));
+
+        for(i=0; i<4; i++){
+            const int sub_mb_type= h->sub_mb_type[i];
+            const int n= 4*i;
+            int y_offset= (i&2)<<2;
+
+            if(IS_SUB_8X8(sub_mb_type)){
+                get_lowest_part_y(h, refs, n  , 8, y_offset,
+                                  IS_DIR(sub_mb_type, 0, 0), IS_DIR(sub_mb_type, 0, 1), nrefs);
+            }else if(IS_SUB_8X4(sub_mb_type)){
+                get_lowest_part_y(h, refs, n  , 4, y_offset,
+                                  IS_DIR(sub_mb_type, 0, 0), IS_DIR(sub_mb_type, 0, 1), nrefs);
+                get_lowest_part_y(h, refs, n+2, 4, y_offset+4,
+                                  IS_DIR(sub_mb_type, 0, 0), IS_DIR(sub_mb_type, 0, 1), nrefs);
+            }else if(IS_SUB_4X8(sub_mb_type)){
+                get_lowest_part_y(h, refs, n  , 8, y_offset,
+                                  IS_DIR(sub_mb_type, 0, 0), IS_DIR(sub_mb_type, 0, 1), nrefs);
+                get_lowest_part_y(h, refs, n+1, 8, y_offset,
+                                  IS_DIR(sub_mb_type, 0, 0), IS_DIR(sub_mb_type, 0, 1), nrefs);
+            }else{
+                int j;
+                assert(IS_SUB_4X4(sub_mb_type));
+                for(j=0; j<4; j++){
+                    int sub_y_offset= y_offset + 2*(j&2);
+                    get_lowest_part_y(h, refs, n+j, 4, sub_y_offset,
+                                      IS_DIR(sub_mb_type, 0, 0), IS_DIR(sub_mb_type, 0, 1), nrefs);
+                }
+            }
+        }
+    }
+
+    for(list=h->list_count-1; list>=0; list--){
+        for(ref=0; ref<48 && nrefs[list]; ref++){
+            int line = refs[list][ref];
+            if(line >= 0){
+                Picture *ref_pic = &h->ref_list[list][ref];
+                int ref_field = (ref_pic->reference&3) - 1;
+                int ref_field_picture = ref_pic->field_picture;
+                int pic_height = 16*s->mb_height >> ref_field_picture;
+
+                nrefs[list]--;
+
+                if(!MB_FIELD && ref_field_picture){ // frame lines from a pair of fields
+                    ff_thread_await_progress((AVFrame*)ref_pic, FFMIN(line >> 1, pic_height-1), 1);
+                    ff_thread_await_progress((AVFrame*)ref_pic, FFMIN(line >> 1, pic_height-1), 0);
+                }else if(MB_FIELD && !ref_field_picture){ // field lines from a frame
+                    ff_thread_await_progress((AVFrame*)ref_pic, FFMIN(2*line + ref_field, pic_height-1), 0);
+                }else if(MB_FIELD){
+                    ff_thread_await_progress((AVFrame*)ref_pic, FFMIN(line, pic_height-1), ref_field);
+                }else{
+                    ff_thread_await_progress((AVFrame*)ref_pic, FFMIN(line, pic_height-1), 0);
+                }
+            }
+        }
+    }
+}
+
 static void hl_motion(H264Context *h, uint8_t *dest_y, uint8_t *dest_cb, uint8_t *dest_cr,
                       qpel_mc_func (*qpix_put)[16], h264_chroma_mc_func (*chroma_put),
                       qpel_mc_func (*qpix_avg)[16], h264_chroma_mc_func (*chroma_avg),
@@ -574,6 +683,8 @@ static void hl_motion(H264Context *h, uint8_t *dest_y, uint8_t *dest_cb, uint8_t
 
     assert(IS_INTER(mb_type));
 
+    if(s->avctx->active_thread_type&FF_THREAD_FRAME)
+        await_references(h);
     prefetch_motion(h, 0);
 
     if(IS_16X16(mb_type)){
@@ -751,7 +862,7 @@ static void init_dequant_tables(H264Context *h){
 int ff_h264_alloc_tables(H264Context *h){
     MpegEncContext * const s = &h->s;
     const int big_mb_num= s->mb_stride * (s->mb_height+1);
-    const int row_mb_num= 2*s->mb_stride*s->avctx->thread_count;
+    const int row_mb_num= 2*s->mb_stride*s->slice_context_count;
     int x,y;
 
     FF_ALLOCZ_OR_GOTO(h->s.avctx, h->intra4x4_pred_mode, row_mb_num * 8  * sizeof(uint8_t), fail)
@@ -960,6 +1071,8 @@ int ff_h264_frame_start(H264Context *h){
      */
     s->current_picture_ptr->key_frame= 0;
     s->current_picture_ptr->mmco_reset= 0;
+    s->current_picture_ptr->field_picture= FIELD_PICTURE;
+    s->error_occurred= 0;
 
     assert(s->linesize && s->uvlinesize);
 
@@ -976,7 +1089,7 @@ int ff_h264_frame_start(H264Context *h){
 
     /* can't be in alloc_tables because linesize isn't known there.
      * FIXME: redo bipred weight to not require extra buffer? */
-    for(i = 0; i < s->avctx->thread_count; i++)
+    for(i = 0; i < s->slice_context_count; i++)
         if(!h->thread_context[i]->s.obmc_scratchpad)
             h->thread_context[i]->s.obmc_scratchpad = av_malloc(16*2*s->linesize + 8*2*s->uvlinesize);
 
@@ -1642,24 +1755,162 @@ static void init_scan_tables(H264Context *h){
     }
 }
 
-static void field_end(H264Context *h){
+static av_cold int decode_init_thread_copy(AVCodecContext *avctx){
+    H264Context *h= avctx->priv_data;
+
+    if (!avctx->is_copy) return 0;
+    /* the parameter sets and buffers belong to the first thread, ours are
+     * set up by decode_update_thread_context() */
+    memset(h->sps_buffers, 0, sizeof(h->sps_buffers));
+    memset(h->pps_buffers, 0, sizeof(h->pps_buffers));
+    memset(h->rbsp_buffer, 0, sizeof(h->rbsp_buffer));
+    memset(h->rbsp_buffer_size, 0, sizeof(h->rbsp_buffer_size));
+    memset(h->thread_context, 0, sizeof(h->thread_context));
+    h->thread_context[0] = h;
+    h->s.avctx = avctx;
+
+    return 0;
+}
+
+static int copy_parameter_sets(void **to, void * const *from, int count, int size){
+    int i;
+
+    for(i=0; i<count; i++){
+        if(!from[i]){
+            av_freep(&to[i]);
+            continue;
+        }
+        if(!to[i] && !(to[i] = av_malloc(size)))
+            return AVERROR(ENOMEM);
+        memcpy(to[i], from[i], size);
+    }
+    return 0;
+}
+
+static void copy_picture_range(Picture **to, Picture **from, int count,
+                               MpegEncContext *new_base, MpegEncContext *old_base){
+    int i;
+
+    for(i=0; i<count; i++)
+        to[i] = from[i] ? from[i] - old_base->picture + new_base->picture : NULL;
+}
+
+static int decode_update_thread_context(AVCodecContext *dst, const AVCodecContext *src){
+    H264Context *h= dst->priv_data, *h1= src->priv_data;
+    MpegEncContext * const s = &h->s, *s1 = &h1->s;
+    int inited = s->context_initialized, err;
+    int i;
+
+    if(dst == src)
+        return 0;
+
+    if((err = copy_parameter_sets((void**)h->sps_buffers, (void * const *)h1->sps_buffers,
+                                  MAX_SPS_COUNT, sizeof(SPS))) < 0 ||
+       (err = copy_parameter_sets((void**)h->pps_buffers, (void * const *)h1->pps_buffers,
+                                  MAX_PPS_COUNT, sizeof(PPS))) < 0)
+        return err;
+    h->is_avc          = h1->is_avc;
+    h->nal_length_size = h1->nal_length_size;
+    h->x264_build      = h1->x264_build;
+
+    if(!s1->context_initialized)
+        return 0;
+
+    if((err = ff_mpeg_update_thread_context(dst, src)) < 0)
+        return err;
+    /* these point into the reference lists, which every slice sets up again */
+    s->last_picture_ptr = s->next_picture_ptr = NULL;
+
+    h->sps = h1->sps;
+    h->pps = h1->pps;
+
+    if(!inited){
+        h->b_stride = s->mb_width*4;
+        if(ff_h264_alloc_tables(h) < 0 || context_init(h) < 0)
+            return AVERROR(ENOMEM);
+        init_scan_tables(h);
+    }
+
+    /* second fields are decoded without ff_h264_frame_start() */
+    s->linesize   = s1->linesize;
+    s->uvlinesize = s1->uvlinesize;
+    memcpy(h->block_offset, h1->block_offset, sizeof(h->block_offset));
+    if(!s->obmc_scratchpad && s->linesize &&
+       !(s->obmc_scratchpad = av_malloc(16*2*s->linesize + 8*2*s->uvlinesize)))
+        return AVERROR(ENOMEM);
+    if(s->current_picture_ptr)
+        ff_copy_picture(&s->current_picture, s->current_picture_ptr);
+    s->first_field       = s1->first_field;
+    s->picture_structure = s1->picture_structure;
+    s->low_delay         = s1->low_delay;
+
+    memcpy(h->dequant4_buffer, h1->dequant4_buffer, sizeof(h->dequant4_buffer));
+    memcpy(h->dequant8_buffer, h1->dequant8_buffer, sizeof(h->dequant8_buffer));
+    for(i=0; i<6; i++)
+        h->dequant4_coeff[i] = h1->dequant4_coeff[i] ?
+            h->dequant4_buffer[0] + (h1->dequant4_coeff[i] - h1->dequant4_buffer[0]) : NULL;
+    for(i=0; i<2; i++)
+        h->dequant8_coeff[i] = h1->dequant8_coeff[i] ?
+            h->dequant8_buffer[0] + (h1->dequant8_coeff[i] - h1->dequant8_buffer[0]) : NULL;
+    h->dequant_coeff_pps = h1->dequant_coeff_pps;
+
+    memcpy(&h->poc_lsb, &h1->poc_lsb,
+           (char*)&h1->redundant_pic_count - (char*)&h1->poc_lsb + sizeof(h1->redundant_pic_count));
+
+    copy_picture_range(h->short_ref,   h1->short_ref,   32, s, s1);
+    copy_picture_range(h->long_ref,    h1->long_ref,    32, s, s1);
+    copy_picture_range(h->delayed_pic, h1->delayed_pic, MAX_DELAYED_PIC_COUNT+2, s, s1);
+    h->outputed_poc    = h1->outputed_poc;
+    memcpy(h->mmco, h1->mmco, sizeof(h->mmco));
+    h->mmco_index      = h1->mmco_index;
+    h->long_ref_count  = h1->long_ref_count;
+    h->short_ref_count = h1->short_ref_count;
+
+    h->last_slice_type       = h1->last_slice_type;
+    h->prev_interlaced_frame = h1->prev_interlaced_frame;
+
+    if(!s->current_picture_ptr)
+        return 0;
+
+    /* the other thread only marks the last field it decodes after it has
+     * given us its state, so do it here */
+    if(!s->dropable){
+        ff_h264_execute_ref_pic_marking(h, h->mmco, h->mmco_index);
+        h->prev_poc_msb = h->poc_msb;
+        h->prev_poc_lsb = h->poc_lsb;
+    }
+    h->prev_frame_num_offset = h->frame_num_offset;
+    h->prev_frame_num        = h->frame_num;
+
+    return 0;
+}
+
+/**
+ * @param in_setup 1 if called before the next frame thread has been given
+ *                 our state, in which case the reference marking of the
+ *                 field is done here and not in decode_update_thread_context()
+ */
+static void field_end(H264Context *h, int in_setup){
     MpegEncContext * const s = &h->s;
     AVCodecContext * const avctx= s->avctx;
     s->mb_y= 0;
 
     s->current_picture_ptr->qscale_type= FF_QSCALE_TYPE_H264;
-    s->current_picture_ptr->pict_type= s->pict_type;
 
     if (CONFIG_H264_VDPAU_DECODER && s->avctx->codec->capabilities&CODEC_CAP_HWACCEL_VDPAU)
         ff_vdpau_h264_set_reference_frames(s);
 
-    if(!s->dropable) {
-        ff_h264_execute_ref_pic_marking(h, h->mmco, h->mmco_index);
-        h->prev_poc_msb= h->poc_msb;
-        h->prev_poc_lsb= h->poc_lsb;
+    if(in_setup || !(avctx->active_thread_type&FF_THREAD_FRAME)){
+        s->current_picture_ptr->pict_type= s->pict_type;
+
+        if(!s->dropable) {
+            ff_h264_execute_ref_pic_marking(h, h->mmco, h->mmco_index);
+            h->prev_poc_msb= h->poc_msb;
+            h->prev_poc_lsb= h->poc_lsb;
+        }
+        h->prev_frame_num_offset= h->frame_num_offset;
+        h->prev_frame_num= h->frame_num;
     }
-    h->prev_frame_num_offset= h->frame_num_offset;
-    h->prev_frame_num= h->frame_num;
 
     if (avctx->hwaccel) {
         if (avctx->hwaccel->end_frame(avctx) < 0)
@@ -1686,6 +1937,10 @@ static void field_end(H264Context *h){
 
     MPV_frame_end(s);
 
+    if(!s->dropable)
+        ff_thread_report_progress((AVFrame*)s->current_picture_ptr, INT_MAX,
+                                  s->picture_structure == PICT_BOTTOM_FIELD);
+
     h->current_slice=0;
 }
 
@@ -1749,7 +2004,7 @@ static int decode_slice_header(H264Context *h, H264Context *h0){
 
     if(first_mb_in_slice == 0){ //FIXME better field boundary detection
         if(h0->current_slice && FIELD_PICTURE){
-            field_end(h);
+            field_end(h, 1);
         }
 
         h0->current_slice = 0;
@@ -1818,8 +2073,10 @@ static int decode_slice_header(H264Context *h, H264Context *h0){
     if (s->context_initialized
         && (   s->width != s->avctx->width || s->height != s->avctx->height
             || av_cmp_q(h->sps.sar, s->avctx->sample_aspect_ratio))) {
-        if(h != h0)
+        if(h != h0 || (s->avctx->active_thread_type & FF_THREAD_FRAME)){
+            av_log(s->avctx, AV_LOG_ERROR, "Width/height changing with threads is not implemented.\n");
             return -1;   // width / height changed during parallelized decoding
+        }
         free_tables(h);
         flush_dpb(s->avctx);
         MPV_common_end(s);
@@ -1865,7 +2122,7 @@ static int decode_slice_header(H264Context *h, H264Context *h0){
         init_scan_tables(h);
         ff_h264_alloc_tables(h);
 
-        for(i = 1; i < s->avctx->thread_count; i++) {
+        for(i = 1; i < s->slice_context_count; i++) {
             H264Context *c;
             c = h->thread_context[i] = av_malloc(sizeof(H264Context));
             memcpy(c, h->s.thread_context[i], sizeof(MpegEncContext));
@@ -1877,7 +2134,7 @@ static int decode_slice_header(H264Context *h, H264Context *h0){
             clone_tables(c, h, i);
         }
 
-        for(i = 0; i < s->avctx->thread_count; i++)
+        for(i = 0; i < s->slice_context_count; i++)
             if(context_init(h->thread_context[i]) < 0)
                 return -1;
     }
@@ -1908,6 +2165,8 @@ static int decode_slice_header(H264Context *h, H264Context *h0){
             h->prev_frame_num++;
             h->prev_frame_num %= 1<<h->sps.log2_max_frame_num;
             s->current_picture_ptr->frame_num= h->prev_frame_num;
+            ff_thread_report_progress((AVFrame*)s->current_picture_ptr, INT_MAX, 0);
+            ff_thread_report_progress((AVFrame*)s->current_picture_ptr, INT_MAX, 1);
             ff_generate_sliding_window_mmcos(h);
             ff_h264_execute_ref_pic_marking(h, h->mmco, h->mmco_index);
         }
@@ -1924,6 +2183,11 @@ static int decode_slice_header(H264Context *h, H264Context *h0){
                  * Previous field is unmatched. Don't display it, but let it
                  * remain for reference if marked as such.
                  */
+                if (last_pic_structure != PICT_FRAME) {
+                    /* nothing will decode the other field, don't let references wait for it */
+                    ff_thread_report_progress((AVFrame*)s0->current_picture_ptr, INT_MAX,
+                                              last_pic_structure == PICT_TOP_FIELD);
+                }
                 s0->current_picture_ptr = NULL;
                 s0->first_field = FIELD_PICTURE;
 
@@ -1937,6 +2201,10 @@ static int decode_slice_header(H264Context *h, H264Context *h0){
                      * pair. Throw away previous field except for reference
                      * purposes.
                      */
+                    if (last_pic_structure != PICT_FRAME) {
+                        ff_thread_report_progress((AVFrame*)s0->current_picture_ptr, INT_MAX,
+                                                  last_pic_structure == PICT_TOP_FIELD);
+                    }
                     s0->first_field = 1;
                     s0->current_picture_ptr = NULL;
 
@@ -2518,6 +2786,34 @@ static void predict_field_decoding_flag(H264Context *h){
     h->mb_mbaff = h->mb_field_decoding_flag = IS_INTERLACED(mb_type) ? 1 : 0;
 }
 
+/**
+ * Draw the just decoded macroblock row and report it to threads waiting
+ * on this picture as a reference.
+ */
+static void decode_finish_row(H264Context *h){
+    MpegEncContext * const s = &h->s;
+    int top            = 16*(s->mb_y >> FIELD_PICTURE);
+    int height         = 16 << FRAME_MBAFF;
+    int deblock_border = (16 + 4) << FRAME_MBAFF;
+    int pic_height     = 16*s->mb_height >> FIELD_PICTURE;
+
+    ff_draw_horiz_band(s, 16*s->mb_y, 16);
+
+    if(!(s->avctx->active_thread_type&FF_THREAD_FRAME) || s->dropable || s->error_occurred)
+        return;
+
+    /* the bottom lines of the row change again when the next one is deblocked */
+    if(top + height < pic_height)
+        top -= deblock_border;
+
+    if(top + height <= 0)
+        return;
+
+    ff_thread_report_progress((AVFrame*)s->current_picture_ptr,
+                              FFMIN(top + height, pic_height) - 1,
+                              s->picture_structure == PICT_BOTTOM_FIELD);
+}
+
 static int decode_slice(struct AVCodecContext *avctx, void *arg){
     H264Context *h = *(void**)arg;
     MpegEncContext * const s = &h->s;
@@ -2565,13 +2861,14 @@ static int decode_slice(struct AVCodecContext *avctx, void *arg){
             if( ret < 0 || h->cabac.bytestream > h->cabac.bytestream_end + 2) {
                 av_log(h->s.avctx, AV_LOG_ERROR, "error while decoding MB %d %d, bytestream (%td)\n", s->mb_x, s->mb_y, h->cabac.bytestream_end - h->cabac.bytestream);
                 ff_er_add_slice(s, s->resync_mb_x, s->resync_mb_y, s->mb_x, s->mb_y, (AC_ERROR|DC_ERROR|MV_ERROR)&part_mask);
+                s->error_occurred = 1;
                 return -1;
             }
 
             if( ++s->mb_x >= s->mb_width ) {
                 s->mb_x = 0;
                 loop_filter(h);
-                ff_draw_horiz_band(s, 16*s->mb_y, 16);
+                decode_finish_row(h);
                 ++s->mb_y;
                 if(FIELD_OR_MBAFF_PICTURE) {
                     ++s->mb_y;
@@ -2604,6 +2901,7 @@ static int decode_slice(struct AVCodecContext *avctx, void *arg){
             if(ret<0){
                 av_log(h->s.avctx, AV_LOG_ERROR, "error while decoding MB %d %d\n", s->mb_x, s->mb_y);
                 ff_er_add_slice(s, s->resync_mb_x, s->resync_mb_y, s->mb_x, s->mb_y, (AC_ERROR|DC_ERROR|MV_ERROR)&part_mask);
+                s->error_occurred = 1;
 
                 return -1;
             }
@@ -2611,7 +2909,7 @@ static int decode_slice(struct AVCodecContext *avctx, void *arg){
             if(++s->mb_x >= s->mb_width){
                 s->mb_x=0;
                 loop_filter(h);
-                ff_draw_horiz_band(s, 16*s->mb_y, 16);
+                decode_finish_row(h);
                 ++s->mb_y;
                 if(FIELD_OR_MBAFF_PICTURE) {
                     ++s->mb_y;
@@ -2641,6 +2939,7 @@ static int decode_slice(struct AVCodecContext *avctx, void *arg){
                     return 0;
                 }else{
                     ff_er_add_slice(s, s->resync_mb_x, s->resync_mb_y, s->mb_x, s->mb_y, (AC_ERROR|DC_ERROR|MV_ERROR)&part_mask);
+                    s->error_occurred = 1;
 
                     return -1;
                 }
@@ -2736,6 +3035,177 @@ static void execute_decode_slices(H264Context *h, int context_count){
 }
 
 
+/**
+ * Run the parts of decoding a picture that the next frame thread depends on
+ * and that could not be done before its slices were decoded: choose the
+ * picture to output and update the reordering delay.
+ */
+static void decode_postinit(H264Context *h){
+    MpegEncContext * const s = &h->s;
+    Picture *out = s->current_picture_ptr;
+    Picture *cur = s->current_picture_ptr;
+    int i, pics, out_of_order, out_idx;
+    int saved_poc, saved_field_poc[2];
+    int mmco_reset = 0;
+
+    cur->qscale_type= FF_QSCALE_TYPE_H264;
+    cur->pict_type= s->pict_type;
+
+    if (cur->field_poc[0]==INT_MAX || cur->field_poc[1]==INT_MAX) {
+        /* Wait for second field. */
+        return;
+    }
+
+    /* Frame threads get here before the reference marking of the picture
+     * is executed, so do what an MMCO_RESET in it does to the output order. */
+    if(!cur->mmco_reset && !s->dropable)
+        for(i=0; i<h->mmco_index; i++)
+            if(h->mmco[i].opcode == MMCO_RESET)
+                mmco_reset = 1;
+    saved_poc          = cur->poc;
+    saved_field_poc[0] = cur->field_poc[0];
+    saved_field_poc[1] = cur->field_poc[1];
+    if(mmco_reset){
+        cur->mmco_reset = 1;
+        cur->poc = cur->field_poc[0] = cur->field_poc[1] = 0;
+    }
+
+    cur->interlaced_frame = 0;
+    cur->repeat_pict = 0;
+
+    /* Signal interlacing information externally. */
+    /* Prioritize picture timing SEI information over used decoding process if it exists. */
+
+    if(h->sps.pic_struct_present_flag){
+        switch (h->sei_pic_struct)
+        {
+        case SEI_PIC_STRUCT_FRAME:
+            break;
+        case SEI_PIC_STRUCT_TOP_FIELD:
+        case SEI_PIC_STRUCT_BOTTOM_FIELD:
+            cur->interlaced_frame = 1;
+            break;
+        case SEI_PIC_STRUCT_TOP_BOTTOM:
+        case SEI_PIC_STRUCT_BOTTOM_TOP:
+            if (FIELD_OR_MBAFF_PICTURE)
+                cur->interlaced_frame = 1;
+            else
+                // try to flag soft telecine progressive
+                cur->interlaced_frame = h->prev_interlaced_frame;
+            break;
+        case SEI_PIC_STRUCT_TOP_BOTTOM_TOP:
+        case SEI_PIC_STRUCT_BOTTOM_TOP_BOTTOM:
+            // Signal the possibility of telecined film externally (pic_struct 5,6)
+            // From these hints, let the applications decide if they apply deinterlacing.
+            cur->repeat_pict = 1;
+            break;
+        case SEI_PIC_STRUCT_FRAME_DOUBLING:
+            // Force progressive here, as doubling interlaced frame is a bad idea.
+            cur->repeat_pict = 2;
+            break;
+        case SEI_PIC_STRUCT_FRAME_TRIPLING:
+            cur->repeat_pict = 4;
+            break;
+        }
+
+        if ((h->sei_ct_type & 3) && h->sei_pic_struct <= SEI_PIC_STRUCT_BOTTOM_TOP)
+            cur->interlaced_frame = (h->sei_ct_type & (1<<1)) != 0;
+    }else{
+        /* Derive interlacing flag from used decoding process. */
+        cur->interlaced_frame = FIELD_OR_MBAFF_PICTURE;
+    }
+    h->prev_interlaced_frame = cur->interlaced_frame;
+
+    if (cur->field_poc[0] != cur->field_poc[1]){
+        /* Derive top_field_first from field pocs. */
+        cur->top_field_first = cur->field_poc[0] < cur->field_poc[1];
+    }else{
+        if(cur->interlaced_frame || h->sps.pic_struct_present_flag){
+            /* Use picture timing SEI information. Even if it is a information of a past frame, better than nothing. */
+            if(h->sei_pic_struct == SEI_PIC_STRUCT_TOP_BOTTOM
+              || h->sei_pic_struct == SEI_PIC_STRUCT_TOP_BOTTOM_TOP)
+                cur->top_field_first = 1;
+            else
+                cur->top_field_first = 0;
+        }else{
+            /* Most likely progressive */
+            cur->top_field_first = 0;
+        }
+    }
+
+//FIXME do something with unavailable reference frames
+
+    /* Sort B-frames into display order */
+
+    if(h->sps.bitstream_restriction_flag
+       && s->avctx->has_b_frames < h->sps.num_reorder_frames){
+        s->avctx->has_b_frames = h->sps.num_reorder_frames;
+        s->low_delay = 0;
+    }
+
+    if(   s->avctx->strict_std_compliance >= FF_COMPLIANCE_STRICT
+       && !h->sps.bitstream_restriction_flag){
+        s->avctx->has_b_frames= MAX_DELAYED_PIC_COUNT;
+        s->low_delay= 0;
+    }
+
+    pics = 0;
+    while(h->delayed_pic[pics]) pics++;
+
+    assert(pics <= MAX_DELAYED_PIC_COUNT);
+
+    h->delayed_pic[pics++] = cur;
+    if(cur->reference == 0)
+        cur->reference = DELAYED_PIC_REF;
+
+    out = h->delayed_pic[0];
+    out_idx = 0;
+    for(i=1; h->delayed_pic[i] && !h->delayed_pic[i]->key_frame && !h->delayed_pic[i]->mmco_reset; i++)
+        if(h->delayed_pic[i]->poc < out->poc){
+            out = h->delayed_pic[i];
+            out_idx = i;
+        }
+    if(s->avctx->has_b_frames == 0 && (h->delayed_pic[0]->key_frame || h->delayed_pic[0]->mmco_reset))
+        h->outputed_poc= INT_MIN;
+    out_of_order = out->poc < h->outputed_poc;
+
+    if(h->sps.bitstream_restriction_flag && s->avctx->has_b_frames >= h->sps.num_reorder_frames)
+        { }
+    else if((out_of_order && pics-1 == s->avctx->has_b_frames && s->avctx->has_b_frames < MAX_DELAYED_PIC_COUNT)
+       || (s->low_delay &&
+        ((h->outputed_poc != INT_MIN && out->poc > h->outputed_poc + 2)
+         || cur->pict_type == FF_B_TYPE)))
+    {
+        s->low_delay = 0;
+        s->avctx->has_b_frames++;
+    }
+
+    if(out_of_order || pics > s->avctx->has_b_frames){
+        out->reference &= ~DELAYED_PIC_REF;
+        out->owner2 = s; // for frame threading, the thread returning the picture releases it,
+                         // its first field may have been decoded by another thread
+        for(i=out_idx; h->delayed_pic[i]; i++)
+            h->delayed_pic[i] = h->delayed_pic[i+1];
+    }
+    if(!out_of_order && pics > s->avctx->has_b_frames){
+        h->next_output_pic = out;
+        if(out_idx==0 && h->delayed_pic[0] && (h->delayed_pic[0]->key_frame || h->delayed_pic[0]->mmco_reset)) {
+            h->outputed_poc = INT_MIN;
+        } else
+            h->outputed_poc = out->poc;
+    }else{
+        av_log(s->avctx, AV_LOG_DEBUG, "no picture\n");
+    }
+
+    if(mmco_reset){
+        cur->poc          = saved_poc;
+        cur->field_poc[0] = saved_field_poc[0];
+        cur->field_poc[1] = saved_field_poc[1];
+    }
+
+    ff_thread_finish_setup(s->avctx);
+}
+
 static int decode_nal_units(H264Context *h, const uint8_t *buf, int buf_size){
     MpegEncContext * const s = &h->s;
     AVCodecContext * const avctx= s->avctx;
@@ -2744,7 +3214,7 @@ static int decode_nal_units(H264Context *h, const uint8_t *buf, int buf_size){
     int context_count = 0;
     int next_avc= h->is_avc ? 0 : buf_size;
 
-    h->max_contexts = avctx->thread_count;
+    h->max_contexts = (avctx->active_thread_type&FF_THREAD_FRAME) ? 1 : avctx->thread_count;
 #if 0
     int i;
     for(i=0; i<50; i++){
@@ -2851,9 +3321,14 @@ static int decode_nal_units(H264Context *h, const uint8_t *buf, int buf_size){
                     ff_vdpau_h264_picture_start(s);
             }
 
-            s->current_picture_ptr->key_frame |=
-                    (hx->nal_unit_type == NAL_IDR_SLICE) ||
-                    (h->sei_recovery_frame_cnt >= 0);
+            /* only written when it changes, the picture is also read by
+             * other frame threads once its output has been decided */
+            if(!s->current_picture_ptr->key_frame &&
+               ((hx->nal_unit_type == NAL_IDR_SLICE) || (h->sei_recovery_frame_cnt >= 0)))
+                s->current_picture_ptr->key_frame = 1;
+
+            if(avctx->active_thread_type&FF_THREAD_FRAME && h->current_slice == 1)
+                decode_postinit(h);
             if(hx->redundant_pic_count==0 && hx->s.hurry_up < 5
                && (avctx->skip_frame < AVDISCARD_NONREF || hx->nal_ref_idc)
                && (avctx->skip_frame < AVDISCARD_BIDIR  || hx->slice_type_nos!=FF_B_TYPE)
@@ -2976,12 +3451,17 @@ static int decode_frame(AVCodecContext *avctx,
 
     s->flags= avctx->flags;
     s->flags2= avctx->flags2;
+    /* second fields start without MPV_frame_start(), which forces this */
+    if(avctx->active_thread_type&FF_THREAD_FRAME)
+        s->flags|= CODEC_FLAG_EMU_EDGE;
 
    /* end of stream, output what is still in the buffers */
     if (buf_size == 0) {
         Picture *out;
         int i, out_idx;
 
+        s->current_picture_ptr = NULL;
+
 //FIXME factorize this with the output code below
         out = h->delayed_pic[0];
         out_idx = 0;
@@ -3002,9 +3482,17 @@ static int decode_frame(AVCodecContext *avctx,
         return 0;
     }
 
+    h->next_output_pic = NULL;
+
     buf_index=decode_nal_units(h, buf, buf_size);
-    if(buf_index < 0)
+    if(buf_index < 0){
+        /* don't leave threads waiting on rows that will never be decoded */
+        if(avctx->active_thread_type&FF_THREAD_FRAME && s->current_picture_ptr){
+            ff_thread_report_progress((AVFrame*)s->current_picture_ptr, INT_MAX, 0);
+            ff_thread_report_progress((AVFrame*)s->current_picture_ptr, INT_MAX, 1);
+        }
         return -1;
+    }
 
     if(!(s->flags2 & CODEC_FLAG2_CHUNKS) && !s->current_picture_ptr){
         if (avctx->skip_frame >= AVDISCARD_NONREF || s->hurry_up) return 0;
@@ -3013,143 +3501,19 @@ static int decode_frame(AVCodecContext *avctx,
     }
 
     if(!(s->flags2 & CODEC_FLAG2_CHUNKS) || (s->mb_y >= s->mb_height && s->mb_height)){
-        Picture *out = s->current_picture_ptr;
-        Picture *cur = s->current_picture_ptr;
-        int i, pics, out_of_order, out_idx;
 
-        field_end(h);
+        field_end(h, 0);
 
-        if (cur->field_poc[0]==INT_MAX || cur->field_poc[1]==INT_MAX) {
+        if(!(avctx->active_thread_type&FF_THREAD_FRAME))
+            decode_postinit(h);
+
+        if (!h->next_output_pic) {
             /* Wait for second field. */
             *data_size = 0;
 
         } else {
-            cur->interlaced_frame = 0;
-            cur->repeat_pict = 0;
-
-            /* Signal interlacing information externally. */
-            /* Prioritize picture timing SEI information over used decoding process if it exists. */
-
-            if(h->sps.pic_struct_present_flag){
-                switch (h->sei_pic_struct)
-                {
-                case SEI_PIC_STRUCT_FRAME:
-                    break;
-                case SEI_PIC_STRUCT_TOP_FIELD:
-                case SEI_PIC_STRUCT_BOTTOM_FIELD:
-                    cur->interlaced_frame = 1;
-                    break;
-                case SEI_PIC_STRUCT_TOP_BOTTOM:
-                case SEI_PIC_STRUCT_BOTTOM_TOP:
-                    if (FIELD_OR_MBAFF_PICTURE)
-                        cur->interlaced_frame = 1;
-                    else
-                        // try to flag soft telecine progressive
-                        cur->interlaced_frame = h->prev_interlaced_frame;
-                    break;
-                case SEI_PIC_STRUCT_TOP_BOTTOM_TOP:
-                case SEI_PIC_STRUCT_BOTTOM_TOP_BOTTOM:
-                    // Signal the possibility of telecined film externally (pic_struct 5,6)
-                    // From these hints, let the applications decide if they apply deinterlacing.
-                    cur->repeat_pict = 1;
-                    break;
-                case SEI_PIC_STRUCT_FRAME_DOUBLING:
-                    // Force progressive here, as doubling interlaced frame is a bad idea.
-                    cur->repeat_pict = 2;
-                    break;
-                case SEI_PIC_STRUCT_FRAME_TRIPLING:
-                    cur->repeat_pict = 4;
-                    break;
-                }
-
-                if ((h->sei_ct_type & 3) && h->sei_pic_struct <= SEI_PIC_STRUCT_BOTTOM_TOP)
-                    cur->interlaced_frame = (h->sei_ct_type & (1<<1)) != 0;
-            }else{
-                /* Derive interlacing flag from used decoding process. */
-                cur->interlaced_frame = FIELD_OR_MBAFF_PICTURE;
-            }
-            h->prev_interlaced_frame = cur->interlaced_frame;
-
-            if (cur->field_poc[0] != cur->field_poc[1]){
-                /* Derive top_field_first from field pocs. */
-                cur->top_field_first = cur->field_poc[0] < cur->field_poc[1];
-            }else{
-                if(cur->interlaced_frame || h->sps.pic_struct_present_flag){
-                    /* Use picture timing SEI information. Even if it is a information of a past frame, better than nothing. */
-                    if(h->sei_pic_struct == SEI_PIC_STRUCT_TOP_BOTTOM
-                      || h->sei_pic_struct == SEI_PIC_STRUCT_TOP_BOTTOM_TOP)
-                        cur->top_field_first = 1;
-                    else
-                        cur->top_field_first = 0;
-                }else{
-                    /* Most likely progressive */
-                    cur->top_field_first = 0;
-                }
-            }
-
-        //FIXME do something with unavailable reference frames
-
-            /* Sort B-frames into display order */
-
-            if(h->sps.bitstream_restriction_flag
-               && s->avctx->has_b_frames < h->sps.num_reorder_frames){
-                s->avctx->has_b_frames = h->sps.num_reorder_frames;
-                s->low_delay = 0;
-            }
-
-            if(   s->avctx->strict_std_compliance >= FF_COMPLIANCE_STRICT
-               && !h->sps.bitstream_restriction_flag){
-                s->avctx->has_b_frames= MAX_DELAYED_PIC_COUNT;
-                s->low_delay= 0;
-            }
-
-            pics = 0;
-            while(h->delayed_pic[pics]) pics++;
-
-            assert(pics <= MAX_DELAYED_PIC_COUNT);
-
-            h->delayed_pic[pics++] = cur;
-            if(cur->reference == 0)
-                cur->reference = DELAYED_PIC_REF;
-
-            out = h->delayed_pic[0];
-            out_idx = 0;
-            for(i=1; h->delayed_pic[i] && !h->delayed_pic[i]->key_frame && !h->delayed_pic[i]->mmco_reset; i++)
-                if(h->delayed_pic[i]->poc < out->poc){
-                    out = h->delayed_pic[i];
-                    out_idx = i;
-                }
-            if(s->avctx->has_b_frames == 0 && (h->delayed_pic[0]->key_frame || h->delayed_pic[0]->mmco_reset))
-                h->outputed_poc= INT_MIN;
-            out_of_order = out->poc < h->outputed_poc;
-
-            if(h->sps.bitstream_restriction_flag && s->avctx->has_b_frames >= h->sps.num_reorder_frames)
-                { }
-            else if((out_of_order && pics-1 == s->avctx->has_b_frames && s->avctx->has_b_frames < MAX_DELAYED_PIC_COUNT)
-               || (s->low_delay &&
-                ((h->outputed_poc != INT_MIN && out->poc > h->outputed_poc + 2)
-                 || cur->pict_type == FF_B_TYPE)))
-            {
-                s->low_delay = 0;
-                s->avctx->has_b_frames++;
-            }
-
-            if(out_of_order || pics > s->avctx->has_b_frames){
-                out->reference &= ~DELAYED_PIC_REF;
-                for(i=out_idx; h->delayed_pic[i]; i++)
-                    h->delayed_pic[i] = h->delayed_pic[i+1];
-            }
-            if(!out_of_order && pics > s->avctx->has_b_frames){
-                *data_size = sizeof(AVFrame);
-
-                if(out_idx==0 && h->delayed_pic[0] && (h->delayed_pic[0]->key_frame || h->delayed_pic[0]->mmco_reset)) {
-                    h->outputed_poc = INT_MIN;
-                } else
-                    h->outputed_poc = out->poc;
-                *pict= *(AVFrame*)out;
-            }else{
-                av_log(avctx, AV_LOG_DEBUG, "no picture\n");
-            }
+            *data_size = sizeof(AVFrame);
+            *pict = *(AVFrame*)h->next_output_pic;
         }
     }
 
@@ -3392,9 +3756,11 @@ AVCodec h264_decoder = {
     NULL,
     ff_h264_decode_end,
     decode_frame,
-    /*CODEC_CAP_DRAW_HORIZ_BAND |*/ CODEC_CAP_DR1 | CODEC_CAP_DELAY,
+    /*CODEC_CAP_DRAW_HORIZ_BAND |*/ CODEC_CAP_DR1 | CODEC_CAP_DELAY | CODEC_CAP_FRAME_THREADS,
     .flush= flush_dpb,
     .long_name = NULL_IF_CONFIG_SMALL("H.264 / AVC / MPEG-4 AVC / MPEG-4 part 10"),
+    .init_thread_copy      = decode_init_thread_copy,
+    .update_thread_context = decode_update_thread_context,
 };
 
 #if CONFIG_H264_VDPAU_DECODER
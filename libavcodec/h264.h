@@ -503,6 +503,7 @@ typedef struct H264Context{
     Picture default_ref_list[2][32]; ///< base reference list for all slices of a coded picture
     Picture *delayed_pic[MAX_DELAYED_PIC_COUNT+2]; //FIXME size?
     int outputed_poc;
+    Picture *next_output_pic; ///< picture decode_frame() returns, chosen by decode_postinit()
 
     /**
      * memory management control operations buffer.
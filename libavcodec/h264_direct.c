@@ -31,6 +31,7 @@
 #include "mpegvideo.h"
 #include "h264.h"
 #include "rectangle.h"
+#include "thread.h"
 
 //#undef NDEBUG
 #include <assert.h>
@@ -98,6 +99,34 @@ static void fill_colmap(H264Context *h, int map[2][16+32], int list, int field,
     }
 }
 
+/**
+ * Wait until the co-located picture has been decoded down to the given
+ * frame macroblock row, INT_MAX for all of it, in the fields not decoded
+ * by this thread.
+ */
+static void await_reference_mb_row(H264Context * const h, Picture *ref, int mb_y){
+    MpegEncContext * const s = &h->s;
+    int field;
+
+    if(!(s->avctx->active_thread_type&FF_THREAD_FRAME))
+        return;
+
+    if(!ref->field_picture){
+        ff_thread_await_progress((AVFrame*)ref, mb_y == INT_MAX ? INT_MAX : 16*mb_y, 0);
+        return;
+    }
+
+    for(field=0; field<2; field++){
+        /* a second field uses its own first field */
+        if(ref->thread_opaque == s->current_picture.thread_opaque &&
+           field == (s->picture_structure == PICT_BOTTOM_FIELD))
+            continue;
+        if(mb_y < field)
+            continue;
+        ff_thread_await_progress((AVFrame*)ref, mb_y == INT_MAX ? INT_MAX : 16*((mb_y - field) >> 1), field);
+    }
+}
+
 void ff_h264_direct_ref_list_init(H264Context * const h){
     MpegEncContext * const s = &h->s;
     Picture * const ref1 = &h->ref_list[1][0];
@@ -117,7 +146,10 @@ void ff_h264_direct_ref_list_init(H264Context * const h){
         memcpy(cur->ref_poc  [1], cur->ref_poc  [0], sizeof(cur->ref_poc  [0]));
     }
 
-    cur->mbaff= FRAME_MBAFF;
+    /* the other slices of the picture can't change it, and other frame
+     * threads may already be reading it */
+    if(!(s->avctx->active_thread_type&FF_THREAD_FRAME) || !h->current_slice)
+        cur->mbaff= FRAME_MBAFF;
 
     h->col_fieldoff= 0;
     if(s->picture_structure == PICT_FRAME){
@@ -132,6 +164,9 @@ void ff_h264_direct_ref_list_init(H264Context * const h){
     if(cur->pict_type != FF_B_TYPE || h->direct_spatial_mv_pred)
         return;
 
+    /* the reference lists of ref1 are only known once all its slices are */
+    await_reference_mb_row(h, ref1, INT_MAX);
+
     for(list=0; list<2; list++){
         fill_colmap(h, h->map_col_to_list0, list, sidx, ref1sidx, 0);
         if(FRAME_MBAFF)
@@ -582,6 +617,18 @@ single_col:
 }
 
 void ff_h264_pred_direct_motion(H264Context * const h, int *mb_type){
+    MpegEncContext * const s = &h->s;
+
+    if(s->avctx->active_thread_type&FF_THREAD_FRAME){
+        Picture *ref1 = &h->ref_list[1][0];
+        int mb_y = s->mb_y;
+
+        /* interlaced current or co-located macroblocks use the pair */
+        if(FIELD_OR_MBAFF_PICTURE || ref1->field_picture || ref1->mbaff)
+            mb_y |= 1;
+        await_reference_mb_row(h, ref1, FFMIN(mb_y, s->mb_height-1));
+    }
+
     if(h->direct_spatial_mv_pred){
         pred_spatial_direct_motion(h, mb_type);
     }else{
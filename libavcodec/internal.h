@@ -50,4 +50,37 @@ int ff_match_2uint16(const uint16_t (*tab)[2], int size, int a, int b);
 
 unsigned int ff_toupper4(unsigned int x);
 
+/**
+ * Get a new identifier for ff_frame_pool_get(), unique for the lifetime of
+ * the process. Unlike a pointer it is never reused by a later caller.
+ */
+uint64_t ff_frame_pool_new_owner(void);
+
+/**
+ * Get a buffer of at least size bytes from pool, preferring one that was
+ * last released by owner.
+ *
+ * @param pool  the pool, or NULL for the default pool
+ * @param owner identifier from ff_frame_pool_new_owner(), or 0 for none
+ * @param tag   if not NULL, set to the value passed to
+ *              ff_frame_pool_release() when the buffer was last released by
+ *              owner, 0 otherwise
+ * @return the buffer or NULL on failure
+ */
+void *ff_frame_pool_get(AVFramePool *pool, unsigned int size,
+                        uint64_t owner, int64_t *tag);
+
+/**
+ * Return a buffer obtained from ff_frame_pool_get() to its pool.
+ *
+ * @param tag value handed back to the same owner on its next request
+ */
+void ff_frame_pool_release(void *buf, int64_t tag);
+
+/**
+ * Return the number of online CPUs, at least 1.
+ * Only available if FFmpeg was built with pthreads.
+ */
+int ff_get_cpu_count(void);
+
 #endif /* AVCODEC_INTERNAL_H */
@@ -23,6 +23,7 @@
 #include "mpegvideo.h"
 #include "mpeg4video.h"
 #include "h263.h"
+#include "thread.h"
 
 // The defines below define the number of bits that are read at once for
 // reading vlc values. Changing these may improve speed and data cache needs
@@ -373,7 +374,12 @@ int mpeg4_decode_video_packet_header(MpegEncContext *s)
         return -1;
     }
     if(s->pict_type == FF_B_TYPE){
-        while(s->next_picture.mbskip_table[ s->mb_index2xy[ mb_num ] ]) mb_num++;
+        for(;;){
+            ff_thread_await_progress((AVFrame*)s->next_picture_ptr, mb_num / s->mb_width, 0);
+            if(!s->next_picture.mbskip_table[ s->mb_index2xy[ mb_num ] ])
+                break;
+            mb_num++;
+        }
         if(mb_num >= s->mb_num) return -1; // slice contains just skipped MBs which where already decoded
     }
 
@@ -1315,6 +1321,9 @@ static int mpeg4_decode_mb(MpegEncContext *s,
             }
         }
 
+        /* the skip flag and the direct mode vectors come from the future P Frame */
+        ff_thread_await_progress((AVFrame*)s->next_picture_ptr, s->mb_y, 0);
+
         /* if we skipped it in the future P Frame than skip it now too */
         s->mb_skipped= s->next_picture.mbskip_table[s->mb_y * s->mb_stride + s->mb_x]; // Note, skiptab=0 if last was GMC
 
@@ -1492,8 +1501,12 @@ end:
     if(s->codec_id==CODEC_ID_MPEG4){
         if(mpeg4_is_resync(s)){
             const int delta= s->mb_x + 1 == s->mb_width ? 2 : 1;
-            if(s->pict_type==FF_B_TYPE && s->next_picture.mbskip_table[xy + delta])
-                return SLICE_OK;
+            if(s->pict_type==FF_B_TYPE){
+                ff_thread_await_progress((AVFrame*)s->next_picture_ptr,
+                                         FFMIN(s->mb_y + (delta == 2), s->mb_height-1), 0);
+                if(s->next_picture.mbskip_table[xy + delta])
+                    return SLICE_OK;
+            }
             return SLICE_END;
         }
     }
@@ -2243,11 +2256,12 @@ AVCodec mpeg4_decoder = {
     NULL,
     ff_h263_decode_end,
     ff_h263_decode_frame,
-    CODEC_CAP_DRAW_HORIZ_BAND | CODEC_CAP_DR1 | CODEC_CAP_TRUNCATED | CODEC_CAP_DELAY,
+    CODEC_CAP_DRAW_HORIZ_BAND | CODEC_CAP_DR1 | CODEC_CAP_TRUNCATED | CODEC_CAP_DELAY | CODEC_CAP_FRAME_THREADS,
     .flush= ff_mpeg_flush,
     .max_lowres= 3,
     .long_name= NULL_IF_CONFIG_SMALL("MPEG-4 part 2"),
     .pix_fmts= ff_hwaccel_pixfmt_list_420,
+    .update_thread_context= ff_mpeg_update_thread_context,
 };
 
 
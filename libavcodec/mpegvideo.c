@@ -33,10 +33,12 @@
 #include "internal.h"
 #include "mpegvideo.h"
 #include "mpegvideo_common.h"
+#include "startcode.h"
 #include "mjpegenc.h"
 #include "msmpeg4.h"
 #include "faandct.h"
 #include "xvmc_internal.h"
+#include "thread.h"
 #include <limits.h>
 
 //#undef NDEBUG
@@ -134,12 +136,15 @@ const uint8_t *ff_find_start_code(const uint8_t * restrict p, const uint8_t *end
             return p;
     }
 
-    while(p<end){
-        if     (p[-1] > 1      ) p+= 3;
-        else if(p[-2]          ) p+= 2;
-        else if(p[-3]|(p[-1]-1)) p++;
-        else{
-            p++;
+    /* look for 00 00 01 at p-3 onwards, from one zero pair to the next */
+    for(p-= 3; ; p++){
+        p+= ff_startcode_find_candidate(p, end - p - 2);
+        if(p+2 >= end){
+            p= end;
+            break;
+        }
+        if(!p[1] && p[2] == 1){
+            p+= 4;
             break;
         }
     }
@@ -204,7 +209,7 @@ void ff_copy_picture(Picture *dst, Picture *src){
  */
 static void free_frame_buffer(MpegEncContext *s, Picture *pic)
 {
-    s->avctx->release_buffer(s->avctx, (AVFrame*)pic);
+    ff_thread_release_buffer(s->avctx, (AVFrame*)pic);
     av_freep(&pic->hwaccel_picture_private);
 }
 
@@ -226,7 +231,7 @@ static int alloc_frame_buffer(MpegEncContext *s, Picture *pic)
         }
     }
 
-    r = s->avctx->get_buffer(s->avctx, (AVFrame*)pic);
+    r = ff_thread_get_buffer(s->avctx, (AVFrame*)pic);
 
     if (r<0 || !pic->age || !pic->type || !pic->data[0]) {
         av_log(s->avctx, AV_LOG_ERROR, "get_buffer() failed (%d %d %d %p)\n", r, pic->age, pic->type, pic->data[0]);
@@ -274,6 +279,7 @@ int ff_alloc_picture(MpegEncContext *s, Picture *pic, int shared){
         s->linesize  = pic->linesize[0];
         s->uvlinesize= pic->linesize[1];
     }
+    pic->owner2 = s;
 
     if(pic->qscale_table==NULL){
         if (s->encoding) {
@@ -477,6 +483,9 @@ void MPV_common_defaults(MpegEncContext *s){
 
     s->f_code = 1;
     s->b_code = 1;
+
+    s->picture_range_start = 0;
+    s->picture_range_end = MAX_PICTURE_COUNT;
 }
 
 /**
@@ -505,7 +514,14 @@ av_cold int MPV_common_init(MpegEncContext *s)
         return -1;
     }
 
-    if(s->avctx->thread_count > MAX_THREADS || (s->avctx->thread_count > s->mb_height && s->mb_height)){
+    /* frame threads decode a whole picture each, so they only need one */
+    if (s->avctx->active_thread_type & FF_THREAD_FRAME)
+        s->slice_context_count = 1;
+    else
+        s->slice_context_count = s->avctx->thread_count;
+    threads = s->slice_context_count;
+
+    if(threads > MAX_THREADS || (threads > s->mb_height && s->mb_height)){
         av_log(s->avctx, AV_LOG_ERROR, "too many threads\n");
         return -1;
     }
@@ -598,8 +614,11 @@ av_cold int MPV_common_init(MpegEncContext *s)
             FF_ALLOCZ_OR_GOTO(s->avctx, s->dct_offset, 2 * 64 * sizeof(uint16_t), fail)
         }
     }
-    FF_ALLOCZ_OR_GOTO(s->avctx, s->picture, MAX_PICTURE_COUNT * sizeof(Picture), fail)
-    for(i = 0; i < MAX_PICTURE_COUNT; i++) {
+    s->picture_count = MAX_PICTURE_COUNT;
+    if (s->avctx->active_thread_type & FF_THREAD_FRAME)
+        s->picture_count *= s->avctx->thread_count;
+    FF_ALLOCZ_OR_GOTO(s->avctx, s->picture, s->picture_count * sizeof(Picture), fail)
+    for(i = 0; i < s->picture_count; i++) {
         avcodec_get_frame_defaults((AVFrame *)&s->picture[i]);
     }
 
@@ -661,7 +680,6 @@ av_cold int MPV_common_init(MpegEncContext *s)
     s->context_initialized = 1;
 
     s->thread_context[0]= s;
-    threads = s->avctx->thread_count;
 
     for(i=1; i<threads; i++){
         s->thread_context[i]= av_malloc(sizeof(MpegEncContext));
@@ -671,8 +689,8 @@ av_cold int MPV_common_init(MpegEncContext *s)
     for(i=0; i<threads; i++){
         if(init_duplicate_context(s->thread_context[i], s) < 0)
            goto fail;
-        s->thread_context[i]->start_mb_y= (s->mb_height*(i  ) + s->avctx->thread_count/2) / s->avctx->thread_count;
-        s->thread_context[i]->end_mb_y  = (s->mb_height*(i+1) + s->avctx->thread_count/2) / s->avctx->thread_count;
+        s->thread_context[i]->start_mb_y= (s->mb_height*(i  ) + threads/2) / threads;
+        s->thread_context[i]->end_mb_y  = (s->mb_height*(i+1) + threads/2) / threads;
     }
 
     return 0;
@@ -681,15 +699,99 @@ av_cold int MPV_common_init(MpegEncContext *s)
     return -1;
 }
 
+#define REBASE_PICTURE(pic, new_ctx, old_ctx) \
+    ((pic) ? (pic) - (old_ctx)->picture + (new_ctx)->picture : NULL)
+
+/**
+ * Copy the state the next frame depends on from the previous frame
+ * thread's context.
+ * Every frame thread allocates its pictures in its own part of the
+ * picture array and only releases the pictures it allocated, so the
+ * array itself can be copied as a whole.
+ */
+int ff_mpeg_update_thread_context(AVCodecContext *dst, const AVCodecContext *src)
+{
+    MpegEncContext *s = dst->priv_data, *s1 = src->priv_data;
+
+    if(dst == src || !s1->context_initialized)
+        return 0;
+
+    if(!s->context_initialized){
+        /* the rest was copied from the first thread right after its
+         * init; s1 is still decoding, so only read what it has set up */
+        s->avctx               = dst;
+        s->width               = s1->width;
+        s->height              = s1->height;
+        s->picture_range_start = s1->picture_range_start + MAX_PICTURE_COUNT;
+        s->picture_range_end   = s1->picture_range_end   + MAX_PICTURE_COUNT;
+
+        if(MPV_common_init(s) < 0)
+            return -1;
+    }
+
+    s->coded_picture_number = s1->coded_picture_number;
+    s->picture_number       = s1->picture_number;
+
+    memcpy(s->picture, s1->picture, s1->picture_count * sizeof(Picture));
+    s->last_picture_ptr    = REBASE_PICTURE(s1->last_picture_ptr,    s, s1);
+    s->current_picture_ptr = REBASE_PICTURE(s1->current_picture_ptr, s, s1);
+    s->next_picture_ptr    = REBASE_PICTURE(s1->next_picture_ptr,    s, s1);
+
+    /* an unused picture picked by the other thread lies outside our range */
+    if(s->current_picture_ptr && !s->current_picture_ptr->data[0])
+        s->current_picture_ptr = NULL;
+
+    /* MPEG-4 timing, VOL and bug workaround info; mcsel, use_intra_dc_vlc
+     * and padding_bug_score change while the other thread decodes */
+    memcpy(&s->time_increment_bits, &s1->time_increment_bits,
+           (char*)&s1->mcsel - (char*)&s1->time_increment_bits);
+    memcpy(&s->quant_precision, &s1->quant_precision,
+           (char*)&s1->use_intra_dc_vlc - (char*)&s1->quant_precision);
+    s->mpeg_quant   = s1->mpeg_quant;
+    s->t_frame      = s1->t_frame;
+    s->divx_version = s1->divx_version;
+    s->divx_build   = s1->divx_build;
+    s->divx_packed  = s1->divx_packed;
+    s->xvid_build   = s1->xvid_build;
+    s->lavc_build   = s1->lavc_build;
+
+    memcpy(s->intra_matrix,        s1->intra_matrix,        sizeof(s->intra_matrix));
+    memcpy(s->chroma_intra_matrix, s1->chroma_intra_matrix, sizeof(s->chroma_intra_matrix));
+    memcpy(s->inter_matrix,        s1->inter_matrix,        sizeof(s->inter_matrix));
+    memcpy(s->chroma_inter_matrix, s1->chroma_inter_matrix, sizeof(s->chroma_inter_matrix));
+
+    s->progressive_sequence = s1->progressive_sequence;
+    s->max_b_frames         = s1->max_b_frames;
+    s->dropable             = s1->dropable;
+
+    /* the next frame of a packed DivX stream */
+    if(s1->bitstream_buffer_size){
+        av_fast_malloc(&s->bitstream_buffer, &s->allocated_bitstream_buffer_size,
+                       s1->bitstream_buffer_size + FF_INPUT_BUFFER_PADDING_SIZE);
+        if(!s->bitstream_buffer)
+            return AVERROR(ENOMEM);
+        memcpy(s->bitstream_buffer, s1->bitstream_buffer, s1->bitstream_buffer_size);
+        memset(s->bitstream_buffer + s1->bitstream_buffer_size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    }
+    s->bitstream_buffer_size = s1->bitstream_buffer_size;
+
+    /* MPV_frame_end() of the other thread may not have run yet */
+    s->last_pict_type = s1->pict_type;
+    if(s1->pict_type != FF_B_TYPE)
+        s->last_non_b_pict_type = s1->pict_type;
+
+    return 0;
+}
+
 /* init common structure for both encoder and decoder */
 void MPV_common_end(MpegEncContext *s)
 {
-    int i, j, k;
+    int i, j, k, threads = s->slice_context_count;
 
-    for(i=0; i<s->avctx->thread_count; i++){
+    for(i=0; i<threads; i++){
         free_duplicate_context(s->thread_context[i]);
     }
-    for(i=1; i<s->avctx->thread_count; i++){
+    for(i=1; i<threads; i++){
         av_freep(&s->thread_context[i]);
     }
 
@@ -746,8 +848,9 @@ void MPV_common_end(MpegEncContext *s)
     av_freep(&s->reordered_input_picture);
     av_freep(&s->dct_offset);
 
-    if(s->picture){
-        for(i=0; i<MAX_PICTURE_COUNT; i++){
+    /* frame thread copies share the per-picture tables with the first thread */
+    if(s->picture && !s->avctx->is_copy){
+        for(i=0; i<s->picture_count; i++){
             free_picture(s, &s->picture[i]);
         }
     }
@@ -761,7 +864,8 @@ void MPV_common_end(MpegEncContext *s)
     for(i=0; i<3; i++)
         av_freep(&s->visualization_buffer[i]);
 
-    avcodec_default_free_buffers(s->avctx);
+    if(!(s->avctx->active_thread_type&FF_THREAD_FRAME))
+        avcodec_default_free_buffers(s->avctx);
 }
 
 void init_rl(RLTable *rl, uint8_t static_store[2][2*MAX_RUN + MAX_LEVEL + 3])
@@ -859,14 +963,14 @@ int ff_find_unused_picture(MpegEncContext *s, int shared){
     int i;
 
     if(shared){
-        for(i=0; i<MAX_PICTURE_COUNT; i++){
+        for(i=s->picture_range_start; i<s->picture_range_end; i++){
             if(s->picture[i].data[0]==NULL && s->picture[i].type==0) return i;
         }
     }else{
-        for(i=0; i<MAX_PICTURE_COUNT; i++){
+        for(i=s->picture_range_start; i<s->picture_range_end; i++){
             if(s->picture[i].data[0]==NULL && s->picture[i].type!=0) return i; //FIXME
         }
-        for(i=0; i<MAX_PICTURE_COUNT; i++){
+        for(i=s->picture_range_start; i<s->picture_range_end; i++){
             if(s->picture[i].data[0]==NULL) return i;
         }
     }
@@ -918,14 +1022,16 @@ int MPV_frame_start(MpegEncContext *s, AVCodecContext *avctx)
     /* mark&release old frames */
     if (s->pict_type != FF_B_TYPE && s->last_picture_ptr && s->last_picture_ptr != s->next_picture_ptr && s->last_picture_ptr->data[0]) {
       if(s->out_format != FMT_H264 || s->codec_id == CODEC_ID_SVQ3){
-          free_frame_buffer(s, s->last_picture_ptr);
+          if(s->encoding || s->last_picture_ptr->owner == avctx)
+              free_frame_buffer(s, s->last_picture_ptr);
 
         /* release forgotten pictures */
         /* if(mpeg124/h263) */
         if(!s->encoding){
-            for(i=0; i<MAX_PICTURE_COUNT; i++){
-                if(s->picture[i].data[0] && &s->picture[i] != s->next_picture_ptr && s->picture[i].reference){
-                    av_log(avctx, AV_LOG_ERROR, "releasing zombie picture\n");
+            for(i=0; i<s->picture_count; i++){
+                if(s->picture[i].owner == avctx && s->picture[i].data[0] && &s->picture[i] != s->next_picture_ptr && s->picture[i].reference){
+                    if(!(avctx->active_thread_type&FF_THREAD_FRAME))
+                        av_log(avctx, AV_LOG_ERROR, "releasing zombie picture\n");
                     free_frame_buffer(s, &s->picture[i]);
                 }
             }
@@ -934,9 +1040,9 @@ int MPV_frame_start(MpegEncContext *s, AVCodecContext *avctx)
     }
 
     if(!s->encoding){
-        /* release non reference frames */
-        for(i=0; i<MAX_PICTURE_COUNT; i++){
-            if(s->picture[i].data[0] && !s->picture[i].reference /*&& s->picture[i].type!=FF_BUFFER_TYPE_SHARED*/){
+        /* release non reference frames, other frame threads release their own */
+        for(i=0; i<s->picture_count; i++){
+            if(s->picture[i].owner2 == s && s->picture[i].data[0] && !s->picture[i].reference /*&& s->picture[i].type!=FF_BUFFER_TYPE_SHARED*/){
                 free_frame_buffer(s, &s->picture[i]);
             }
         }
@@ -992,6 +1098,8 @@ int MPV_frame_start(MpegEncContext *s, AVCodecContext *avctx)
             s->last_picture_ptr= &s->picture[i];
             if(ff_alloc_picture(s, s->last_picture_ptr, 0) < 0)
                 return -1;
+            ff_thread_report_progress((AVFrame*)s->last_picture_ptr, INT_MAX, 0);
+            ff_thread_report_progress((AVFrame*)s->last_picture_ptr, INT_MAX, 1);
         }
         if((s->next_picture_ptr==NULL || s->next_picture_ptr->data[0]==NULL) && s->pict_type==FF_B_TYPE){
             /* Allocate a dummy frame */
@@ -999,6 +1107,8 @@ int MPV_frame_start(MpegEncContext *s, AVCodecContext *avctx)
             s->next_picture_ptr= &s->picture[i];
             if(ff_alloc_picture(s, s->next_picture_ptr, 0) < 0)
                 return -1;
+            ff_thread_report_progress((AVFrame*)s->next_picture_ptr, INT_MAX, 0);
+            ff_thread_report_progress((AVFrame*)s->next_picture_ptr, INT_MAX, 1);
         }
     }
 
@@ -1022,6 +1132,11 @@ int MPV_frame_start(MpegEncContext *s, AVCodecContext *avctx)
     s->hurry_up= s->avctx->hurry_up;
     s->error_recognition= avctx->error_recognition;
 
+    /* Later frame threads read this picture while it is being decoded, so
+     * its edges cannot be drawn afterwards; emulate them in MC instead. */
+    if(avctx->active_thread_type&FF_THREAD_FRAME)
+        s->flags |= CODEC_FLAG_EMU_EDGE;
+
     /* set dequantizer, we can't do it during init as it might change for mpeg4
        and we can't do it in the header decode as init is not called for mpeg4 there yet */
     if(s->mpeg_quant || s->codec_id == CODEC_ID_MPEG2VIDEO){
@@ -1085,7 +1200,7 @@ void MPV_frame_end(MpegEncContext *s)
 
     if(s->encoding){
         /* release non-reference frames */
-        for(i=0; i<MAX_PICTURE_COUNT; i++){
+        for(i=0; i<s->picture_count; i++){
             if(s->picture[i].data[0] && !s->picture[i].reference /*&& s->picture[i].type!=FF_BUFFER_TYPE_SHARED*/){
                 free_frame_buffer(s, &s->picture[i]);
             }
@@ -1098,6 +1213,10 @@ void MPV_frame_end(MpegEncContext *s)
     memset(&s->current_picture, 0, sizeof(Picture));
 #endif
     s->avctx->coded_frame= (AVFrame*)s->current_picture_ptr;
+
+    if(s->codec_id != CODEC_ID_H264 && s->current_picture.reference){
+        ff_thread_report_progress((AVFrame*)s->current_picture_ptr, INT_MAX, 0);
+    }
 }
 
 /**
@@ -1822,6 +1941,41 @@ void ff_clean_intra_table_entries(MpegEncContext *s)
     s->mbintra_table[xy]= 0;
 }
 
+/**
+ * Find the lowest MB row referenced by the motion vectors of the current
+ * macroblock in one direction, for frame threads waiting on a reference.
+ * @param dir 0 for the forward reference, 1 for the backward one
+ */
+static int lowest_referenced_row(MpegEncContext *s, int dir)
+{
+    int my_max = INT_MIN, qpel_shift = !s->quarter_sample;
+    int off, i, mvs;
+
+    if (s->picture_structure != PICT_FRAME || s->mcsel)
+        return s->mb_height-1;
+
+    switch (s->mv_type) {
+    case MV_TYPE_16X16:
+        mvs = 1;
+        break;
+    case MV_TYPE_8X8:
+        mvs = 4;
+        break;
+    default:
+        return s->mb_height-1;
+    }
+
+    for (i = 0; i < mvs; i++)
+        my_max = FFMAX(my_max, s->mv[dir][i][1] << qpel_shift);
+
+    /* In quarter pel units: the last luma line read is at most 17 lines
+     * below the vector, counting the interpolation taps and the rounding
+     * of the chroma vector. */
+    off = (my_max + 4*17) >> 6;
+
+    return av_clip(s->mb_y + off, 0, s->mb_height-1);
+}
+
 /* generic function called after a macroblock has been parsed by the
    decoder or after it has been encoded by the encoder.
 
@@ -1921,6 +2075,13 @@ void MPV_decode_mb_internal(MpegEncContext *s, DCTELEM block[12][64],
             /* motion handling */
             /* decoding or more than one mb_type (MC was already done otherwise) */
             if(!s->encoding){
+                if(s->avctx->active_thread_type&FF_THREAD_FRAME){
+                    if (s->mv_dir & MV_DIR_FORWARD)
+                        ff_thread_await_progress((AVFrame*)s->last_picture_ptr, lowest_referenced_row(s, 0), 0);
+                    if (s->mv_dir & MV_DIR_BACKWARD)
+                        ff_thread_await_progress((AVFrame*)s->next_picture_ptr, lowest_referenced_row(s, 1), 0);
+                }
+
                 if(lowres_flag){
                     h264_chroma_mc_func *op_pix = s->dsp.put_h264_chroma_pixels_tab;
 
@@ -2156,6 +2317,18 @@ void ff_init_block_index(MpegEncContext *s){ //FIXME maybe rename
     }
 }
 
+/**
+ * Report the rows of the current picture that are fully decoded to the
+ * frame threads waiting on it. Nothing is reported for B-frames, which are
+ * never referenced, and for pictures that error concealment might still
+ * change.
+ */
+void MPV_report_decode_progress(MpegEncContext *s)
+{
+    if(s->pict_type != FF_B_TYPE && !s->partitioned_frame && !s->error_occurred)
+        ff_thread_report_progress((AVFrame*)s->current_picture_ptr, s->mb_y, 0);
+}
+
 void ff_mpeg_flush(AVCodecContext *avctx){
     int i;
     MpegEncContext *s = avctx->priv_data;
@@ -2163,7 +2336,7 @@ void ff_mpeg_flush(AVCodecContext *avctx){
     if(s==NULL || s->picture==NULL)
         return;
 
-    for(i=0; i<MAX_PICTURE_COUNT; i++){
+    for(i=0; i<s->picture_count; i++){
        if(s->picture[i].data[0] && (   s->picture[i].type == FF_BUFFER_TYPE_INTERNAL
                                     || s->picture[i].type == FF_BUFFER_TYPE_USER))
         free_frame_buffer(s, &s->picture[i]);
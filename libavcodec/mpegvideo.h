@@ -123,6 +123,8 @@ typedef struct Picture{
     int ref_poc[2][2][16];      ///< h264 POCs of the frames used as reference (FIXME need per slice)
     int ref_count[2][2];        ///< number of entries in ref_poc              (FIXME need per slice)
     int mbaff;                  ///< h264 1 -> MBAFF frame 0-> not MBAFF
+    int field_picture;          ///< h264 1 -> coded as two separate fields, with their own decoding progress
+    struct MpegEncContext *owner2; ///< pointer to the context that releases this picture
 
     int mb_var_sum;             ///< sum of MB variance for current frame
     int mc_mb_var_sum;          ///< motion compensated MB variance for current frame
@@ -244,12 +246,15 @@ typedef struct MpegEncContext {
     int linesize;              ///< line size, in bytes, may be different from width
     int uvlinesize;            ///< line size, for chroma in bytes, may be different from width
     Picture *picture;          ///< main picture buffer
+    int picture_count;         ///< number of allocated pictures (MAX_PICTURE_COUNT * frame thread count)
+    int picture_range_start, picture_range_end; ///< the part of picture that this context can allocate in
     Picture **input_picture;   ///< next pictures on display order for encoding
     Picture **reordered_input_picture; ///< pointer to the next pictures in codedorder for encoding
 
     int start_mb_y;            ///< start mb_y of this thread (so current thread should process start_mb_y <= row < end_mb_y)
     int end_mb_y;              ///< end   mb_y of this thread (so current thread should process start_mb_y <= row < end_mb_y)
     struct MpegEncContext *thread_context[MAX_THREADS];
+    int slice_context_count;   ///< number of used thread_contexts
 
     /**
      * copy of the previous picture structure.
@@ -485,6 +490,7 @@ typedef struct MpegEncContext {
     int mb_num_left;                 ///< number of MBs left in this video packet (for partitioned Slices only)
     int next_p_frame_damaged;        ///< set if the next p frame is damaged, to avoid showing trashed b frames
     int error_recognition;
+    int error_occurred;              ///< set if a slice of the current picture could not be decoded
 
     ParseContext parse_context;
 
@@ -696,6 +702,8 @@ void MPV_common_init_bfin(MpegEncContext *s);
 void ff_clean_intra_table_entries(MpegEncContext *s);
 void ff_draw_horiz_band(MpegEncContext *s, int y, int h);
 void ff_mpeg_flush(AVCodecContext *avctx);
+int ff_mpeg_update_thread_context(AVCodecContext *dst, const AVCodecContext *src);
+void MPV_report_decode_progress(MpegEncContext *s);
 void ff_print_debug_info(MpegEncContext *s, AVFrame *pict);
 void ff_write_quant_matrix(PutBitContext *pb, uint16_t *matrix);
 int ff_find_unused_picture(MpegEncContext *s, int shared);
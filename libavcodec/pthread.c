@@ -21,9 +21,19 @@
  * License along with FFmpeg; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
+
+/**
+ * @file
+ * Multithreading support functions
+ * @see doc/multithreading.txt
+ */
+
 #include <pthread.h>
+#include <unistd.h>
 
 #include "avcodec.h"
+#include "thread.h"
+#include "internal.h"
 
 typedef int (action_func)(AVCodecContext *c, void *arg);
 typedef int (action_func2)(AVCodecContext *c, void *arg, int jobnr, int threadnr);
@@ -43,8 +53,138 @@ typedef struct ThreadContext {
     pthread_mutex_t current_job_lock;
     int current_job;
     int done;
+
+    /* Only used with the shared worker pool. */
+    struct PoolTask *tasks;        ///< one task per thread of the context
+    int nb_tasks;                  ///< tasks of the current execute() call
+    int tasks_done;
+    int next_job;                  ///< next job number to hand out
+    unsigned generation;           ///< incremented for each execute() call
+    int inflight;                  ///< tasks popped from a queue but not yet finished
 } ThreadContext;
 
+/**
+ * Unit of work queued in the shared worker pool. Each task runs jobs of
+ * its context until there are none left, always with the same thread
+ * number, so that codecs can keep using per-thread scratch buffers.
+ */
+typedef struct PoolTask {
+    AVCodecContext *avctx;
+    int threadnr;
+    unsigned generation;           ///< execute() call the task was queued for
+    int claimed;                   ///< set once a thread started running it
+} PoolTask;
+
+typedef struct TaskEntry {
+    PoolTask *task;
+    unsigned generation;
+} TaskEntry;
+
+/**
+ * Task queue of one pool worker. The owner takes the most recently queued
+ * task, other workers steal the oldest one.
+ */
+typedef struct TaskQueue {
+    pthread_mutex_t lock;
+    TaskEntry *entries;            ///< circular buffer of size+1 entries
+    unsigned size;                 ///< capacity minus one, a power of two minus one
+    unsigned head;                 ///< oldest entry
+    unsigned tail;                 ///< one past the newest entry
+} TaskQueue;
+
+/**
+ * Process-wide pool of workers shared by all contexts that set
+ * AVCodecContext.thread_pool.
+ */
+typedef struct WorkerPool {
+    pthread_t *workers;
+    TaskQueue *queues;
+    int nb_workers;
+    int refcount;                  ///< number of contexts using the pool
+
+    pthread_mutex_t lock;          ///< protects pending, next_queue and die
+    pthread_cond_t  cond;          ///< signaled when tasks are queued
+    int pending;                   ///< entries queued but not yet taken
+    unsigned next_queue;
+    int die;
+} WorkerPool;
+
+static WorkerPool *worker_pool;
+static pthread_mutex_t worker_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Max number of frame buffers that can be allocated when using frame threads.
+#define MAX_BUFFERS (32+1)
+
+/**
+ * Context used by codec threads and stored in their AVCodecContext thread_opaque.
+ */
+typedef struct PerThreadContext {
+    struct FrameThreadContext *parent;
+
+    pthread_t      thread;
+    int            thread_init;
+    pthread_cond_t input_cond;      ///< Used to wait for a new packet from the main thread.
+    pthread_cond_t progress_cond;   ///< Used by child threads to wait for progress to change.
+    pthread_cond_t output_cond;     ///< Used by the main thread to wait for frames to finish.
+
+    pthread_mutex_t mutex;          ///< Mutex used to protect the contents of the PerThreadContext.
+    pthread_mutex_t progress_mutex; ///< Mutex used to protect frame progress values and progress_cond.
+
+    AVCodecContext *avctx;          ///< Context used to decode packets passed to this thread.
+
+    AVPacket       avpkt;           ///< Input packet (for decoding) or output (for encoding).
+    unsigned int   allocated_buf_size; ///< Size allocated for avpkt.data
+
+    AVFrame frame;                  ///< Output frame (for decoding) or input (for encoding).
+    int     got_frame;              ///< The output of got_picture_ptr from the last avcodec_decode_video() call.
+    int     result;                 ///< The result of the last codec decode/encode() call.
+
+    enum {
+        STATE_INPUT_READY,          ///< Set when the thread is awaiting a packet.
+        STATE_SETTING_UP,           ///< Set before the codec has called ff_thread_finish_setup().
+        STATE_GET_BUFFER,           /**<
+                                     * Set when the codec calls get_buffer().
+                                     * State is returned to STATE_SETTING_UP afterwards.
+                                     */
+        STATE_SETUP_FINISHED        ///< Set after the codec has called ff_thread_finish_setup().
+    } state;
+
+    /**
+     * Array of frames passed to ff_thread_release_buffer().
+     * Frames are released after all threads referencing them are finished.
+     */
+    AVFrame released_buffers[MAX_BUFFERS];
+    int     num_released_buffers;
+
+    /**
+     * Array of progress values used by ff_thread_get_buffer().
+     */
+    int     progress[MAX_BUFFERS][2];
+    uint8_t progress_used[MAX_BUFFERS];
+
+    AVFrame *requested_frame;       ///< AVFrame the codec passed to get_buffer()
+
+    int     die;                    ///< Set under mutex when the thread should exit.
+} PerThreadContext;
+
+/**
+ * Context stored in the client AVCodecContext thread_opaque.
+ */
+typedef struct FrameThreadContext {
+    PerThreadContext *threads;     ///< The contexts for each thread.
+    PerThreadContext *prev_thread; ///< The last thread submit_packet() was called on.
+
+    pthread_mutex_t buffer_mutex;  ///< Mutex used to protect get/release_buffer().
+
+    int next_decoding;             ///< The next context to submit a packet to.
+    int next_finished;             ///< The next context to return output from.
+
+    int delaying;                  /**<
+                                    * Set for the first N packets, where N is the number of threads.
+                                    * While it is set, ff_thread_decode_frame() won't return any results.
+                                    */
+} FrameThreadContext;
+
 static void* attribute_align_arg worker(void *v)
 {
     AVCodecContext *avctx = v;
@@ -84,11 +224,18 @@ static av_always_inline void avcodec_thread_park_workers(ThreadContext *c, int t
     pthread_mutex_unlock(&c->current_job_lock);
 }
 
-void avcodec_thread_free(AVCodecContext *avctx)
+static void pool_thread_free(AVCodecContext *avctx);
+
+static void thread_free(AVCodecContext *avctx)
 {
     ThreadContext *c = avctx->thread_opaque;
     int i;
 
+    if (c->tasks) {
+        pool_thread_free(avctx);
+        return;
+    }
+
     pthread_mutex_lock(&c->current_job_lock);
     c->done = 1;
     pthread_cond_broadcast(&c->current_job_cond);
@@ -140,16 +287,371 @@ static int avcodec_thread_execute2(AVCodecContext *avctx, action_func2* func2, v
     return avcodec_thread_execute(avctx, NULL, arg, ret, job_count, 0);
 }
 
-int avcodec_thread_init(AVCodecContext *avctx, int thread_count)
+static int task_queue_push(TaskQueue *q, TaskEntry entry)
+{
+    pthread_mutex_lock(&q->lock);
+    if (((q->tail + 1) & q->size) == (q->head & q->size)) {
+        unsigned n = (q->size + 1) * 2, i, count = q->tail - q->head;
+        TaskEntry *entries = av_malloc(n * sizeof(TaskEntry));
+        if (!entries) {
+            pthread_mutex_unlock(&q->lock);
+            return AVERROR(ENOMEM);
+        }
+        for (i = 0; i < count; i++)
+            entries[i] = q->entries[(q->head + i) & q->size];
+        av_free(q->entries);
+        q->entries = entries;
+        q->size    = n - 1;
+        q->head    = 0;
+        q->tail    = count;
+    }
+    q->entries[q->tail++ & q->size] = entry;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/**
+ * Take an entry from q, the newest one if steal is 0, the oldest otherwise.
+ * The context of the task is marked busy so that it is not freed before
+ * the entry has been handled.
+ */
+static int task_queue_pop(TaskQueue *q, TaskEntry *entry, int steal)
+{
+    ThreadContext *c;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head == q->tail) {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    *entry = steal ? q->entries[q->head++ & q->size]
+                   : q->entries[--q->tail & q->size];
+    c = entry->task->avctx->thread_opaque;
+    pthread_mutex_lock(&c->current_job_lock);
+    c->inflight++;
+    pthread_mutex_unlock(&c->current_job_lock);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+/**
+ * Run the jobs of a task if no other thread did so yet.
+ */
+static void run_task(PoolTask *t, unsigned generation)
+{
+    AVCodecContext *avctx = t->avctx;
+    ThreadContext *c = avctx->thread_opaque;
+    int job;
+
+    pthread_mutex_lock(&c->current_job_lock);
+    if (t->claimed || t->generation != generation) {
+        pthread_mutex_unlock(&c->current_job_lock);
+        return;
+    }
+    t->claimed = 1;
+    while ((job = c->next_job) < c->job_count) {
+        c->next_job++;
+        pthread_mutex_unlock(&c->current_job_lock);
+
+        c->rets[job%c->rets_count] = c->func ? c->func(avctx, (char*)c->args + job*c->job_size):
+                                               c->func2(avctx, c->args, job, t->threadnr);
+
+        pthread_mutex_lock(&c->current_job_lock);
+    }
+    if (++c->tasks_done == c->nb_tasks)
+        pthread_cond_signal(&c->last_job_cond);
+    pthread_mutex_unlock(&c->current_job_lock);
+}
+
+static void* attribute_align_arg pool_worker(void *v)
+{
+    WorkerPool *pool = worker_pool;
+    int self = (TaskQueue *)v - pool->queues;
+    TaskEntry entry;
+    ThreadContext *c;
+    int i, found;
+
+    for (;;) {
+        found = task_queue_pop(&pool->queues[self], &entry, 0);
+        for (i = 1; !found && i < pool->nb_workers; i++)
+            found = task_queue_pop(&pool->queues[(self + i) % pool->nb_workers], &entry, 1);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!found) {
+            if (pool->die) {
+                pthread_mutex_unlock(&pool->lock);
+                return NULL;
+            }
+            if (!pool->pending)
+                pthread_cond_wait(&pool->cond, &pool->lock);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_task(entry.task, entry.generation);
+
+        c = entry.task->avctx->thread_opaque;
+        pthread_mutex_lock(&c->current_job_lock);
+        if (!--c->inflight)
+            pthread_cond_broadcast(&c->current_job_cond);
+        pthread_mutex_unlock(&c->current_job_lock);
+    }
+}
+
+static int pool_execute(AVCodecContext *avctx, action_func* func, void *arg, int *ret, int job_count, int job_size)
+{
+    ThreadContext *c = avctx->thread_opaque;
+    WorkerPool *pool = worker_pool;
+    int dummy_ret;
+    unsigned generation;
+    int i, queued;
+
+    if (job_count <= 0)
+        return 0;
+
+    pthread_mutex_lock(&c->current_job_lock);
+    generation = ++c->generation;
+    c->job_count = job_count;
+    c->job_size = job_size;
+    c->args = arg;
+    c->func = func;
+    if (ret) {
+        c->rets = ret;
+        c->rets_count = job_count;
+    } else {
+        c->rets = &dummy_ret;
+        c->rets_count = 1;
+    }
+    c->next_job   = 0;
+    c->tasks_done = 0;
+    c->nb_tasks   = FFMIN(avctx->thread_count, job_count);
+    for (i = 0; i < c->nb_tasks; i++) {
+        c->tasks[i].generation = generation;
+        c->tasks[i].claimed    = 0;
+    }
+    pthread_mutex_unlock(&c->current_job_lock);
+
+    /* The calling thread runs the first task itself. */
+    for (queued = 1; queued < c->nb_tasks; queued++) {
+        TaskEntry entry = { &c->tasks[queued], generation };
+        unsigned q;
+
+        pthread_mutex_lock(&pool->lock);
+        q = pool->next_queue++ % pool->nb_workers;
+        pthread_mutex_unlock(&pool->lock);
+        if (task_queue_push(&pool->queues[q], entry) < 0)
+            break;
+        pthread_mutex_lock(&pool->lock);
+        pool->pending++;
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    /* Tasks no worker has started yet are run here as well, they return
+     * immediately once all jobs have been handed out. */
+    for (i = 0; i < c->nb_tasks; i++)
+        run_task(&c->tasks[i], generation);
+
+    pthread_mutex_lock(&c->current_job_lock);
+    while (c->tasks_done < c->nb_tasks)
+        pthread_cond_wait(&c->last_job_cond, &c->current_job_lock);
+    c->func2 = NULL;
+    pthread_mutex_unlock(&c->current_job_lock);
+
+    return 0;
+}
+
+static int pool_execute2(AVCodecContext *avctx, action_func2* func2, void *arg, int *ret, int job_count)
+{
+    ThreadContext *c= avctx->thread_opaque;
+    c->func2 = func2;
+    return pool_execute(avctx, NULL, arg, ret, job_count, 0);
+}
+
+int ff_get_cpu_count(void)
+{
+    int n = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return FFMAX(n, 1);
+}
+
+/**
+ * Stop the first nb_threads workers of the pool and free it.
+ * Must be called with worker_pool_lock held.
+ */
+static void worker_pool_destroy(WorkerPool *pool, int nb_threads)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->die = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < nb_threads; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    for (i = 0; i < pool->nb_workers; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        av_free(pool->queues[i].entries);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    av_free(pool->workers);
+    av_free(pool->queues);
+    av_free(pool);
+    worker_pool = NULL;
+}
+
+static void worker_pool_unref(void)
+{
+    pthread_mutex_lock(&worker_pool_lock);
+    if (!--worker_pool->refcount)
+        worker_pool_destroy(worker_pool, worker_pool->nb_workers);
+    pthread_mutex_unlock(&worker_pool_lock);
+}
+
+static int worker_pool_ref(void)
+{
+    WorkerPool *pool;
+    int i, n;
+
+    pthread_mutex_lock(&worker_pool_lock);
+    if (worker_pool) {
+        worker_pool->refcount++;
+        pthread_mutex_unlock(&worker_pool_lock);
+        return 0;
+    }
+
+    n = ff_get_cpu_count();
+    pool = av_mallocz(sizeof(WorkerPool));
+    if (!pool)
+        goto fail;
+    pool->workers = av_mallocz(n * sizeof(pthread_t));
+    pool->queues  = av_mallocz(n * sizeof(TaskQueue));
+    if (!pool->workers || !pool->queues)
+        goto fail;
+    for (i = 0; i < n; i++) {
+        pool->queues[i].size = 15;
+        if (!(pool->queues[i].entries = av_malloc(16 * sizeof(TaskEntry))))
+            goto fail;
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->refcount   = 1;
+    pool->nb_workers = n;
+    worker_pool = pool;
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, &pool->queues[i])) {
+            worker_pool_destroy(pool, i);
+            pthread_mutex_unlock(&worker_pool_lock);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&worker_pool_lock);
+    return 0;
+
+fail:
+    if (pool) {
+        if (pool->queues)
+            for (i = 0; i < n; i++)
+                av_free(pool->queues[i].entries);
+        av_free(pool->queues);
+        av_free(pool->workers);
+        av_free(pool);
+    }
+    pthread_mutex_unlock(&worker_pool_lock);
+    return AVERROR(ENOMEM);
+}
+
+/**
+ * Remove the queued entries of a context from the pool and wait for
+ * workers still holding one.
+ */
+static void pool_thread_free(AVCodecContext *avctx)
 {
+    ThreadContext *c = avctx->thread_opaque;
+    WorkerPool *pool = worker_pool;
     int i;
+
+    for (i = 0; i < pool->nb_workers; i++) {
+        TaskQueue *q = &pool->queues[i];
+        unsigned j, k, removed;
+
+        pthread_mutex_lock(&q->lock);
+        for (j = k = q->head; j != q->tail; j++) {
+            TaskEntry e = q->entries[j & q->size];
+            if (e.task->avctx != avctx)
+                q->entries[k++ & q->size] = e;
+        }
+        removed = q->tail - k;
+        q->tail = k;
+        pthread_mutex_unlock(&q->lock);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending -= removed;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    pthread_mutex_lock(&c->current_job_lock);
+    while (c->inflight)
+        pthread_cond_wait(&c->current_job_cond, &c->current_job_lock);
+    pthread_mutex_unlock(&c->current_job_lock);
+
+    worker_pool_unref();
+
+    pthread_mutex_destroy(&c->current_job_lock);
+    pthread_cond_destroy(&c->current_job_cond);
+    pthread_cond_destroy(&c->last_job_cond);
+    av_free(c->tasks);
+    av_freep(&avctx->thread_opaque);
+}
+
+static int pool_thread_init(AVCodecContext *avctx)
+{
     ThreadContext *c;
+    int i;
 
-    avctx->thread_count = thread_count;
+    if (worker_pool_ref() < 0)
+        return -1;
+
+    c = av_mallocz(sizeof(ThreadContext));
+    if (!c || !(c->tasks = av_mallocz(avctx->thread_count * sizeof(PoolTask)))) {
+        av_free(c);
+        worker_pool_unref();
+        return -1;
+    }
+    for (i = 0; i < avctx->thread_count; i++) {
+        c->tasks[i].avctx    = avctx;
+        c->tasks[i].threadnr = i;
+    }
+    pthread_cond_init(&c->current_job_cond, NULL);
+    pthread_cond_init(&c->last_job_cond, NULL);
+    pthread_mutex_init(&c->current_job_lock, NULL);
+
+    avctx->thread_opaque = c;
+    avctx->execute  = pool_execute;
+    avctx->execute2 = pool_execute2;
+    return 0;
+}
+
+static int thread_init(AVCodecContext *avctx)
+{
+    int i;
+    ThreadContext *c;
+    int thread_count = avctx->thread_count;
 
     if (thread_count <= 1)
         return 0;
 
+    if (avctx->thread_pool)
+        return pool_thread_init(avctx);
+
     c = av_mallocz(sizeof(ThreadContext));
     if (!c)
         return -1;
@@ -173,7 +675,7 @@ int avcodec_thread_init(AVCodecContext *avctx, int thread_count)
         if(pthread_create(&c->workers[i], NULL, worker, avctx)) {
            avctx->thread_count = i;
            pthread_mutex_unlock(&c->current_job_lock);
-           avcodec_thread_free(avctx);
+           thread_free(avctx);
            return -1;
         }
     }
@@ -184,3 +686,711 @@ int avcodec_thread_init(AVCodecContext *avctx, int thread_count)
     avctx->execute2 = avcodec_thread_execute2;
     return 0;
 }
+
+/**
+ * Codec worker thread.
+ *
+ * Automatically calls ff_thread_finish_setup() if the codec does
+ * not provide an update_thread_context method, or if the codec returns
+ * before calling it.
+ */
+static attribute_align_arg void *frame_worker_thread(void *arg)
+{
+    PerThreadContext *p = arg;
+    AVCodecContext *avctx = p->avctx;
+    AVCodec *codec = avctx->codec;
+
+    for (;;) {
+        pthread_mutex_lock(&p->mutex);
+        while (p->state == STATE_INPUT_READY && !p->die)
+            pthread_cond_wait(&p->input_cond, &p->mutex);
+
+        if (p->die) {
+            pthread_mutex_unlock(&p->mutex);
+            break;
+        }
+
+        if (!codec->update_thread_context && avctx->thread_safe_callbacks)
+            ff_thread_finish_setup(avctx);
+
+        avcodec_get_frame_defaults(&p->frame);
+        p->got_frame = 0;
+        p->result = codec->decode(avctx, &p->frame, &p->got_frame, &p->avpkt);
+
+        if (p->state == STATE_SETTING_UP)
+            ff_thread_finish_setup(avctx);
+
+        pthread_mutex_lock(&p->progress_mutex);
+        p->state = STATE_INPUT_READY;
+        pthread_cond_signal(&p->output_cond);
+        pthread_mutex_unlock(&p->progress_mutex);
+
+        pthread_mutex_unlock(&p->mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * Update the next thread's AVCodecContext with values from the reference thread's context.
+ *
+ * @param dst The destination context.
+ * @param src The source context.
+ * @param for_user 0 if the destination is a codec thread, 1 if the destination is the user's thread
+ */
+static int update_context_from_thread(AVCodecContext *dst, AVCodecContext *src, int for_user)
+{
+    int err = 0;
+
+    if (dst != src) {
+        dst->sub_id    = src->sub_id;
+        dst->time_base = src->time_base;
+        dst->width     = src->width;
+        dst->height    = src->height;
+        dst->pix_fmt   = src->pix_fmt;
+
+        dst->coded_width  = src->coded_width;
+        dst->coded_height = src->coded_height;
+
+        dst->has_b_frames = src->has_b_frames;
+        dst->idct_algo    = src->idct_algo;
+        dst->slice_count  = src->slice_count;
+
+        dst->bits_per_coded_sample = src->bits_per_coded_sample;
+        dst->sample_aspect_ratio   = src->sample_aspect_ratio;
+        dst->dtg_active_format     = src->dtg_active_format;
+
+        dst->profile = src->profile;
+        dst->level   = src->level;
+
+        dst->bits_per_raw_sample = src->bits_per_raw_sample;
+        dst->ticks_per_frame     = src->ticks_per_frame;
+        dst->color_primaries     = src->color_primaries;
+
+        dst->color_trc   = src->color_trc;
+        dst->colorspace  = src->colorspace;
+        dst->color_range = src->color_range;
+        dst->chroma_sample_location = src->chroma_sample_location;
+    }
+
+    if (for_user) {
+        dst->coded_frame = src->coded_frame;
+    } else {
+        if (dst->codec->update_thread_context)
+            err = dst->codec->update_thread_context(dst, src);
+    }
+
+    return err;
+}
+
+/**
+ * Update the next thread's AVCodecContext with values set by the user.
+ *
+ * @param dst The destination context.
+ * @param src The source context.
+ */
+static void update_context_from_user(AVCodecContext *dst, AVCodecContext *src)
+{
+    dst->flags          = src->flags;
+
+    dst->draw_horiz_band= src->draw_horiz_band;
+    dst->get_buffer     = src->get_buffer;
+    dst->release_buffer = src->release_buffer;
+
+    dst->opaque   = src->opaque;
+    dst->dsp_mask = src->dsp_mask;
+    dst->debug    = src->debug;
+    dst->debug_mv = src->debug_mv;
+
+    dst->slice_flags = src->slice_flags;
+    dst->flags2      = src->flags2;
+
+    dst->skip_loop_filter = src->skip_loop_filter;
+    dst->skip_idct        = src->skip_idct;
+    dst->skip_frame       = src->skip_frame;
+
+    dst->error_recognition  = src->error_recognition;
+    dst->error_concealment  = src->error_concealment;
+    dst->workaround_bugs    = src->workaround_bugs;
+
+    dst->frame_number     = src->frame_number;
+    dst->reordered_opaque = src->reordered_opaque;
+}
+
+/// Mark the progress values of f as unused.
+static void free_progress(AVFrame *f)
+{
+    PerThreadContext *p = f->owner->thread_opaque;
+    int *progress = f->thread_opaque;
+
+    p->progress_used[(progress - p->progress[0]) / 2] = 0;
+}
+
+/// Releases the buffers that this decoding thread was the last user of.
+static void release_delayed_buffers(PerThreadContext *p)
+{
+    FrameThreadContext *fctx = p->parent;
+
+    while (p->num_released_buffers > 0) {
+        AVFrame *f;
+
+        pthread_mutex_lock(&fctx->buffer_mutex);
+        f = &p->released_buffers[--p->num_released_buffers];
+        free_progress(f);
+        f->thread_opaque = NULL;
+
+        f->owner->release_buffer(f->owner, f);
+        pthread_mutex_unlock(&fctx->buffer_mutex);
+    }
+}
+
+static int submit_packet(PerThreadContext *p, AVPacket *avpkt)
+{
+    FrameThreadContext *fctx = p->parent;
+    PerThreadContext *prev_thread = fctx->prev_thread;
+    AVCodec *codec = p->avctx->codec;
+    uint8_t *buf = p->avpkt.data;
+
+    if (!avpkt->size && !(codec->capabilities & CODEC_CAP_DELAY))
+        return 0;
+
+    pthread_mutex_lock(&p->mutex);
+
+    release_delayed_buffers(p);
+
+    if (prev_thread) {
+        int err;
+        /* always take the lock, it orders the reads of the other context */
+        pthread_mutex_lock(&prev_thread->progress_mutex);
+        while (prev_thread->state == STATE_SETTING_UP)
+            pthread_cond_wait(&prev_thread->progress_cond, &prev_thread->progress_mutex);
+        pthread_mutex_unlock(&prev_thread->progress_mutex);
+
+        err = update_context_from_thread(p->avctx, prev_thread->avctx, 0);
+        if (err) {
+            pthread_mutex_unlock(&p->mutex);
+            return err;
+        }
+    }
+
+    av_fast_malloc(&buf, &p->allocated_buf_size, avpkt->size + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf) {
+        p->avpkt.data = NULL;
+        pthread_mutex_unlock(&p->mutex);
+        return AVERROR(ENOMEM);
+    }
+    p->avpkt = *avpkt;
+    p->avpkt.data     = buf;
+    p->avpkt.destruct = NULL;
+    memcpy(buf, avpkt->data, avpkt->size);
+    memset(buf + avpkt->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+
+    p->state = STATE_SETTING_UP;
+    pthread_cond_signal(&p->input_cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    /*
+     * If the client doesn't have a thread-safe get_buffer(),
+     * then decoding threads call back to the main thread,
+     * and it calls back to the client here.
+     */
+
+    if (!p->avctx->thread_safe_callbacks &&
+         p->avctx->get_buffer != avcodec_default_get_buffer) {
+        while (p->state != STATE_SETUP_FINISHED && p->state != STATE_INPUT_READY) {
+            pthread_mutex_lock(&p->progress_mutex);
+            while (p->state == STATE_SETTING_UP)
+                pthread_cond_wait(&p->progress_cond, &p->progress_mutex);
+
+            if (p->state == STATE_GET_BUFFER) {
+                p->result = p->avctx->get_buffer(p->avctx, p->requested_frame);
+                p->state  = STATE_SETTING_UP;
+                pthread_cond_broadcast(&p->progress_cond);
+            }
+            pthread_mutex_unlock(&p->progress_mutex);
+        }
+    }
+
+    fctx->prev_thread = p;
+
+    return 0;
+}
+
+int ff_thread_decode_frame(AVCodecContext *avctx,
+                           AVFrame *picture, int *got_picture_ptr,
+                           AVPacket *avpkt)
+{
+    FrameThreadContext *fctx = avctx->thread_opaque;
+    int finished = fctx->next_finished;
+    PerThreadContext *p;
+    int err;
+
+    /*
+     * Submit a packet to the next decoding thread.
+     */
+
+    p = &fctx->threads[fctx->next_decoding];
+    update_context_from_user(p->avctx, avctx);
+    err = submit_packet(p, avpkt);
+    if (err)
+        return err;
+
+    fctx->next_decoding++;
+
+    /*
+     * If we're still receiving the initial packets, don't return a frame.
+     */
+
+    if (fctx->delaying && avpkt->size) {
+        if (fctx->next_decoding >= (avctx->thread_count-1))
+            fctx->delaying = 0;
+
+        *got_picture_ptr = 0;
+        return avpkt->size;
+    }
+
+    /*
+     * Return the next available frame from the oldest thread.
+     * If we're at the end of the stream, then we have to skip threads that
+     * didn't output a frame, because we don't want to accidentally signal
+     * EOF (avpkt->size == 0 && *got_picture_ptr == 0).
+     */
+
+    do {
+        p = &fctx->threads[finished++];
+
+        pthread_mutex_lock(&p->progress_mutex);
+        while (p->state != STATE_INPUT_READY)
+            pthread_cond_wait(&p->output_cond, &p->progress_mutex);
+        pthread_mutex_unlock(&p->progress_mutex);
+
+        *picture = p->frame;
+        *got_picture_ptr = p->got_frame;
+
+        /*
+         * A later call with avkpt->size == 0 may loop over all threads,
+         * including this one, searching for a frame to return before being
+         * stopped by the "finished != fctx->next_finished" condition.
+         * Make sure we don't mistakenly return the same frame again.
+         */
+        p->got_frame = 0;
+
+        if (finished >= avctx->thread_count)
+            finished = 0;
+    } while (!avpkt->size && !*got_picture_ptr && finished != fctx->next_finished);
+
+    update_context_from_thread(avctx, p->avctx, 1);
+
+    if (fctx->next_decoding >= avctx->thread_count)
+        fctx->next_decoding = 0;
+
+    fctx->next_finished = finished;
+
+    /* return the size of the consumed packet if no error occurred */
+    return (p->result >= 0) ? avpkt->size : p->result;
+}
+
+void ff_thread_report_progress(AVFrame *f, int n, int field)
+{
+    PerThreadContext *p;
+    int *progress = f->thread_opaque;
+
+    if (!progress || progress[field] >= n)
+        return;
+
+    p = f->owner->thread_opaque;
+
+    if (f->owner->debug & FF_DEBUG_THREADS)
+        av_log(f->owner, AV_LOG_DEBUG, "%p finished %d field %d\n", progress, n, field);
+
+    pthread_mutex_lock(&p->progress_mutex);
+    progress[field] = n;
+    pthread_cond_broadcast(&p->progress_cond);
+    pthread_mutex_unlock(&p->progress_mutex);
+}
+
+void ff_thread_await_progress(AVFrame *f, int n, int field)
+{
+    PerThreadContext *p;
+    int *progress = f->thread_opaque;
+
+    /* progress is only read under the lock, which also makes the
+       reported rows of the picture visible to this thread */
+    if (!progress)
+        return;
+
+    p = f->owner->thread_opaque;
+
+    pthread_mutex_lock(&p->progress_mutex);
+    if ((f->owner->debug & FF_DEBUG_THREADS) && progress[field] < n)
+        av_log(f->owner, AV_LOG_DEBUG, "thread awaiting %d field %d from %p\n", n, field, progress);
+    while (progress[field] < n)
+        pthread_cond_wait(&p->progress_cond, &p->progress_mutex);
+    pthread_mutex_unlock(&p->progress_mutex);
+}
+
+void ff_thread_finish_setup(AVCodecContext *avctx)
+{
+    PerThreadContext *p = avctx->thread_opaque;
+
+    if (!(avctx->active_thread_type & FF_THREAD_FRAME))
+        return;
+
+    pthread_mutex_lock(&p->progress_mutex);
+    p->state = STATE_SETUP_FINISHED;
+    pthread_cond_broadcast(&p->progress_cond);
+    pthread_mutex_unlock(&p->progress_mutex);
+}
+
+/// Waits for all threads to finish.
+static void park_frame_worker_threads(FrameThreadContext *fctx, int thread_count)
+{
+    int i;
+
+    for (i = 0; i < thread_count; i++) {
+        PerThreadContext *p = &fctx->threads[i];
+
+        pthread_mutex_lock(&p->progress_mutex);
+        while (p->state != STATE_INPUT_READY)
+            pthread_cond_wait(&p->output_cond, &p->progress_mutex);
+        pthread_mutex_unlock(&p->progress_mutex);
+    }
+}
+
+static void frame_thread_free(AVCodecContext *avctx, int thread_count)
+{
+    FrameThreadContext *fctx = avctx->thread_opaque;
+    AVCodec *codec = avctx->codec;
+    int i;
+
+    park_frame_worker_threads(fctx, thread_count);
+
+    if (fctx->prev_thread && fctx->prev_thread != fctx->threads)
+        update_context_from_thread(fctx->threads->avctx, fctx->prev_thread->avctx, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        PerThreadContext *p = &fctx->threads[i];
+
+        pthread_mutex_lock(&p->mutex);
+        p->die = 1;
+        pthread_cond_signal(&p->input_cond);
+        pthread_mutex_unlock(&p->mutex);
+
+        if (p->thread_init)
+            pthread_join(p->thread, NULL);
+
+        if (codec->close && p->avctx)
+            codec->close(p->avctx);
+
+        avctx->codec = NULL;
+
+        release_delayed_buffers(p);
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        PerThreadContext *p = &fctx->threads[i];
+
+        pthread_mutex_destroy(&p->mutex);
+        pthread_mutex_destroy(&p->progress_mutex);
+        pthread_cond_destroy(&p->input_cond);
+        pthread_cond_destroy(&p->progress_cond);
+        pthread_cond_destroy(&p->output_cond);
+        av_freep(&p->avpkt.data);
+
+        if (!p->avctx)
+            continue;
+
+        avcodec_default_free_buffers(p->avctx);
+
+        if (i)
+            av_freep(&p->avctx->priv_data);
+
+        av_freep(&p->avctx);
+    }
+
+    av_freep(&fctx->threads);
+    pthread_mutex_destroy(&fctx->buffer_mutex);
+    av_freep(&avctx->thread_opaque);
+}
+
+static int frame_thread_init(AVCodecContext *avctx)
+{
+    int thread_count = avctx->thread_count;
+    AVCodec *codec = avctx->codec;
+    AVCodecContext *src = avctx;
+    FrameThreadContext *fctx;
+    int i, err = 0;
+
+    avctx->thread_opaque = fctx = av_mallocz(sizeof(FrameThreadContext));
+    if (!fctx)
+        return AVERROR(ENOMEM);
+
+    fctx->threads = av_mallocz(sizeof(PerThreadContext) * thread_count);
+    if (!fctx->threads) {
+        av_freep(&avctx->thread_opaque);
+        return AVERROR(ENOMEM);
+    }
+
+    pthread_mutex_init(&fctx->buffer_mutex, NULL);
+    fctx->delaying = 1;
+
+    for (i = 0; i < thread_count; i++) {
+        AVCodecContext *copy = av_malloc(sizeof(AVCodecContext));
+        PerThreadContext *p  = &fctx->threads[i];
+
+        pthread_mutex_init(&p->mutex, NULL);
+        pthread_mutex_init(&p->progress_mutex, NULL);
+        pthread_cond_init(&p->input_cond, NULL);
+        pthread_cond_init(&p->progress_cond, NULL);
+        pthread_cond_init(&p->output_cond, NULL);
+
+        p->parent = fctx;
+        p->avctx  = copy;
+
+        if (!copy) {
+            err = AVERROR(ENOMEM);
+            goto error;
+        }
+
+        *copy = *src;
+        copy->thread_opaque = p;
+
+        if (!i) {
+            src = copy;
+
+            if (codec->init)
+                err = codec->init(copy);
+
+            update_context_from_thread(avctx, copy, 1);
+        } else {
+            copy->is_copy   = 1;
+            copy->priv_data = av_malloc(codec->priv_data_size);
+            if (!copy->priv_data) {
+                av_freep(&p->avctx);
+                err = AVERROR(ENOMEM);
+                goto error;
+            }
+            memcpy(copy->priv_data, src->priv_data, codec->priv_data_size);
+
+            if (codec->init_thread_copy)
+                err = codec->init_thread_copy(copy);
+        }
+
+        if (err)
+            goto error;
+
+        if (pthread_create(&p->thread, NULL, frame_worker_thread, p)) {
+            err = -1;
+            goto error;
+        }
+        p->thread_init = 1;
+    }
+
+    return 0;
+
+error:
+    frame_thread_free(avctx, i+1);
+
+    return err;
+}
+
+void ff_thread_flush(AVCodecContext *avctx)
+{
+    FrameThreadContext *fctx = avctx->thread_opaque;
+    int i;
+
+    if (!avctx->thread_opaque)
+        return;
+
+    park_frame_worker_threads(fctx, avctx->thread_count);
+
+    if (fctx->prev_thread) {
+        if (fctx->prev_thread != &fctx->threads[0])
+            update_context_from_thread(fctx->threads[0].avctx, fctx->prev_thread->avctx, 0);
+        if (avctx->codec->flush)
+            avctx->codec->flush(fctx->threads[0].avctx);
+    }
+
+    fctx->next_decoding = fctx->next_finished = 0;
+    fctx->delaying = 1;
+    fctx->prev_thread = NULL;
+
+    for (i = 0; i < avctx->thread_count; i++) {
+        PerThreadContext *p = &fctx->threads[i];
+        // Make sure decode flush calls with size=0 won't return old frames
+        p->got_frame = 0;
+
+        release_delayed_buffers(p);
+    }
+}
+
+static int *allocate_progress(PerThreadContext *p)
+{
+    int i;
+
+    for (i = 0; i < MAX_BUFFERS; i++)
+        if (!p->progress_used[i])
+            break;
+
+    if (i == MAX_BUFFERS) {
+        av_log(p->avctx, AV_LOG_ERROR, "allocate_progress() overflow\n");
+        return NULL;
+    }
+
+    p->progress_used[i] = 1;
+
+    return p->progress[i];
+}
+
+int ff_thread_get_buffer(AVCodecContext *avctx, AVFrame *f)
+{
+    PerThreadContext *p = avctx->thread_opaque;
+    int *progress, err;
+
+    f->owner = avctx;
+
+    if (!(avctx->active_thread_type & FF_THREAD_FRAME)) {
+        f->thread_opaque = NULL;
+        return avctx->get_buffer(avctx, f);
+    }
+
+    if (p->state != STATE_SETTING_UP &&
+        (avctx->codec->update_thread_context || !avctx->thread_safe_callbacks)) {
+        av_log(avctx, AV_LOG_ERROR, "get_buffer() cannot be called after ff_thread_finish_setup()\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&p->parent->buffer_mutex);
+    f->thread_opaque = progress = allocate_progress(p);
+
+    if (!progress) {
+        pthread_mutex_unlock(&p->parent->buffer_mutex);
+        return -1;
+    }
+
+    progress[0] =
+    progress[1] = -1;
+
+    if (avctx->thread_safe_callbacks ||
+        avctx->get_buffer == avcodec_default_get_buffer) {
+        err = avctx->get_buffer(avctx, f);
+    } else {
+        pthread_mutex_lock(&p->progress_mutex);
+        p->requested_frame = f;
+        p->state = STATE_GET_BUFFER;
+        pthread_cond_broadcast(&p->progress_cond);
+
+        while (p->state != STATE_SETTING_UP)
+            pthread_cond_wait(&p->progress_cond, &p->progress_mutex);
+
+        err = p->result;
+
+        pthread_mutex_unlock(&p->progress_mutex);
+    }
+
+    if (err) {
+        free_progress(f);
+        f->thread_opaque = NULL;
+    } else {
+        /* the buffer was last used by whichever thread released it */
+        f->age = INT_MAX;
+    }
+    pthread_mutex_unlock(&p->parent->buffer_mutex);
+
+    return err;
+}
+
+void ff_thread_release_buffer(AVCodecContext *avctx, AVFrame *f)
+{
+    PerThreadContext *p = avctx->thread_opaque;
+    FrameThreadContext *fctx;
+
+    if (!(avctx->active_thread_type & FF_THREAD_FRAME)) {
+        avctx->release_buffer(avctx, f);
+        return;
+    }
+
+    if (p->num_released_buffers >= MAX_BUFFERS) {
+        av_log(p->avctx, AV_LOG_ERROR, "too many thread_release_buffer calls!\n");
+        return;
+    }
+
+    if (avctx->debug & FF_DEBUG_BUFFERS)
+        av_log(avctx, AV_LOG_DEBUG, "thread_release_buffer called on pic %p, %d buffers used\n",
+                                    f, f->owner->internal_buffer_count);
+
+    fctx = p->parent;
+    pthread_mutex_lock(&fctx->buffer_mutex);
+    p->released_buffers[p->num_released_buffers++] = *f;
+    pthread_mutex_unlock(&fctx->buffer_mutex);
+    memset(f->data, 0, sizeof(f->data));
+}
+
+/**
+ * Set the threading algorithms used.
+ *
+ * Threading requires more than one thread.
+ * Frame threading requires entire frames to be passed to the codec,
+ * and introduces extra decoding delay, so is incompatible with low_delay.
+ *
+ * @param avctx The context.
+ */
+static void validate_thread_parameters(AVCodecContext *avctx)
+{
+    int frame_threading_supported = (avctx->codec->capabilities & CODEC_CAP_FRAME_THREADS)
+                                && avctx->codec->decode
+                                && !(avctx->flags & CODEC_FLAG_TRUNCATED)
+                                && !(avctx->flags & CODEC_FLAG_LOW_DELAY)
+                                && !(avctx->flags2 & CODEC_FLAG2_CHUNKS);
+    if (avctx->thread_count <= 1) {
+        avctx->active_thread_type = 0;
+    } else if (frame_threading_supported && (avctx->thread_type & FF_THREAD_FRAME) &&
+               !avctx->thread_pool) {
+        avctx->active_thread_type = FF_THREAD_FRAME;
+    } else if (avctx->thread_type & FF_THREAD_SLICE) {
+        avctx->active_thread_type = FF_THREAD_SLICE;
+    } else {
+        avctx->active_thread_type = 0;
+    }
+}
+
+int ff_thread_init(AVCodecContext *avctx)
+{
+    if (avctx->thread_opaque) {
+        av_log(avctx, AV_LOG_ERROR, "avcodec_thread_init is ignored after avcodec_open\n");
+        return -1;
+    }
+
+    if (avctx->codec) {
+        validate_thread_parameters(avctx);
+
+        if (avctx->active_thread_type & FF_THREAD_SLICE)
+            return thread_init(avctx);
+        else if (avctx->active_thread_type & FF_THREAD_FRAME)
+            return frame_thread_init(avctx);
+    }
+
+    return 0;
+}
+
+int avcodec_thread_init(AVCodecContext *avctx, int thread_count)
+{
+    avctx->thread_count = thread_count;
+
+    /* Threads are normally started by avcodec_open(); an already opened
+     * codec can only be switched to slice threading. */
+    if (!avctx->codec || avctx->thread_opaque)
+        return 0;
+
+    avctx->active_thread_type = thread_count > 1 ? FF_THREAD_SLICE : 0;
+    return thread_init(avctx);
+}
+
+void avcodec_thread_free(AVCodecContext *avctx)
+{
+    if (avctx->active_thread_type & FF_THREAD_FRAME)
+        frame_thread_free(avctx, avctx->thread_count);
+    else
+        thread_free(avctx);
+    avctx->active_thread_type = 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Start code and emulation prevention scanning
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Start code and emulation prevention scanning
+ */
+
+#include "libavutil/common.h"
+#include "libavutil/intreadwrite.h"
+#include "config.h"
+#include "startcode.h"
+
+int ff_startcode_find_candidate_c(const uint8_t *buf, int size)
+{
+    int i = 0, end;
+
+    while (i < size) {
+#if HAVE_FAST_UNALIGNED
+        /* skip words without two adjacent zero bytes, the words overlap by
+         * one byte so no pair is lost between them */
+#   if HAVE_FAST_64BIT
+        while (i + 8 <= size) {
+            uint64_t x = AV_RN64(buf + i);
+            uint64_t z = ~x & (x - 0x0101010101010101ULL) & 0x8080808080808080ULL;
+            if (z & (z >> 8))
+                break;
+            i += 7;
+        }
+#   else
+        while (i + 4 <= size) {
+            uint32_t x = AV_RN32(buf + i);
+            uint32_t z = ~x & (x - 0x01010101U) & 0x80808080U;
+            if (z & (z >> 8))
+                break;
+            i += 3;
+        }
+#   endif
+#endif
+        for (end = FFMIN(i + 8, size); i < end; i++)
+            if (!buf[i] && (i + 1 == size || !buf[i + 1]))
+                return i;
+    }
+    return size;
+}
+
+int (*ff_startcode_find_candidate)(const uint8_t *buf, int size) = ff_startcode_find_candidate_c;
+
+void ff_startcode_init(void)
+{
+    if (HAVE_MMX) ff_startcode_init_x86();
+}
+
+#ifdef TEST
+#include "libavutil/lfg.h"
+#include "libavutil/log.h"
+
+/** the byte loop the scanners used before */
+static int find_candidate_ref(const uint8_t *buf, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        if (!buf[i] && (i + 1 == size || !buf[i + 1]))
+            return i;
+    return size;
+}
+
+int main(void)
+{
+    uint8_t buf[4096 + 32];
+    AVLFG prng;
+    int i, j, ret = 0;
+
+    av_lfg_init(&prng, 1);
+    /* the fastest version for this CPU, SSE2 where available */
+    ff_startcode_init();
+
+    for (i = 0; i < 20000; i++) {
+        /* from nothing but zero bytes to one zero byte in 2048 */
+        int density = 1 << (i % 12);
+        int offset  = av_lfg_get(&prng) % 16;
+        int size    = av_lfg_get(&prng) % 4096;
+        uint8_t *p  = buf + offset;
+        int ref, c, opt;
+
+        for (j = 0; j < size; j++)
+            p[j] = av_lfg_get(&prng) % density ? av_lfg_get(&prng) | 1 : 0;
+        /* zero bytes after the end must not be found */
+        memset(p + size, 0, sizeof(buf) - offset - size);
+
+        ref = find_candidate_ref(p, size);
+        c   = ff_startcode_find_candidate_c(p, size);
+        opt = ff_startcode_find_candidate(p, size);
+        if (c != ref || opt != ref) {
+            av_log(NULL, AV_LOG_ERROR, "size %d offset %d: ref %d, c %d, opt %d\n",
+                   size, offset, ref, c, opt);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+#endif /* TEST */
@@ -0,0 +1,54 @@
+/*
+ * Start code and emulation prevention scanning
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Start code and emulation prevention scanning
+ */
+
+#ifndef AVCODEC_STARTCODE_H
+#define AVCODEC_STARTCODE_H
+
+#include <stdint.h>
+
+/**
+ * Find the first byte which may begin a 00 00 xx sequence.
+ * Start codes and emulation prevention bytes of MPEG-1/2/4, H.264, VC-1
+ * and CAVS all start with two zero bytes, so everything in front of the
+ * first such pair can be skipped without looking at it again.
+ *
+ * @param buf  buffer to scan
+ * @param size number of bytes to scan
+ * @return offset of the first zero byte in buf which is followed by another
+ *         zero byte or by the end of buf, size if there is none
+ */
+extern int (*ff_startcode_find_candidate)(const uint8_t *buf, int size);
+
+int ff_startcode_find_candidate_c(const uint8_t *buf, int size);
+
+/**
+ * Select the fastest ff_startcode_find_candidate() for the running CPU.
+ * Called from avcodec_init(), until then the C version is used.
+ */
+void ff_startcode_init(void);
+
+void ff_startcode_init_x86(void);
+
+#endif /* AVCODEC_STARTCODE_H */
@@ -35,6 +35,8 @@
 #include "imgconvert.h"
 #include "audioconvert.h"
 #include "internal.h"
+#include "thread.h"
+#include "startcode.h"
 #include <stdlib.h>
 #include <stdarg.h>
 #include <limits.h>
@@ -113,6 +115,8 @@ typedef struct InternalBuffer{
     int linesize[4];
     int width, height;
     enum PixelFormat pix_fmt;
+    int generation;                 ///< incremented whenever width, height or pix_fmt change
+    uint64_t owner;                 ///< frame pool identifier of the context
 }InternalBuffer;
 
 #define INTERNAL_BUFFER_SIZE 32
@@ -224,8 +228,17 @@ int avcodec_default_get_buffer(AVCodecContext *s, AVFrame *pic){
     int i;
     int w= s->width;
     int h= s->height;
-    InternalBuffer *buf;
-    int *picture_number;
+    InternalBuffer *buf, *last;
+    int h_chroma_shift, v_chroma_shift;
+    int size[4] = {0};
+    int offset[4] = {0};
+    int tmpsize;
+    int unaligned;
+    AVPicture picture;
+    int stride_align[4];
+    unsigned int total_size;
+    uint8_t *base;
+    int64_t tag;
 
     if(pic->data[0]!=NULL) {
         av_log(s, AV_LOG_ERROR, "pic->data[0]!=NULL in avcodec_default_get_buffer\n");
@@ -241,94 +254,102 @@ int avcodec_default_get_buffer(AVCodecContext *s, AVFrame *pic){
 
     if(s->internal_buffer==NULL){
         s->internal_buffer= av_mallocz((INTERNAL_BUFFER_SIZE+1)*sizeof(InternalBuffer));
+        if(s->internal_buffer==NULL)
+            return -1;
+        ((InternalBuffer*)s->internal_buffer)[INTERNAL_BUFFER_SIZE].owner= ff_frame_pool_new_owner();
     }
-#if 0
-    s->internal_buffer= av_fast_realloc(
-        s->internal_buffer,
-        &s->internal_buffer_size,
-        sizeof(InternalBuffer)*FFMAX(99,  s->internal_buffer_count+1)/*FIXME*/
-        );
-#endif
 
     buf= &((InternalBuffer*)s->internal_buffer)[s->internal_buffer_count];
-    picture_number= &(((InternalBuffer*)s->internal_buffer)[INTERNAL_BUFFER_SIZE]).last_pic_num; //FIXME ugly hack
-    (*picture_number)++;
-
-    if(buf->base[0] && (buf->width != w || buf->height != h || buf->pix_fmt != s->pix_fmt)){
-        for(i=0; i<4; i++){
-            av_freep(&buf->base[i]);
-            buf->data[i]= NULL;
-        }
+    last= &((InternalBuffer*)s->internal_buffer)[INTERNAL_BUFFER_SIZE]; //FIXME ugly hack
+    last->last_pic_num++;
+
+    /* buffers released with an older layout must not report a valid age */
+    if(last->width != s->width || last->height != s->height || last->pix_fmt != s->pix_fmt){
+        last->width  = s->width;
+        last->height = s->height;
+        last->pix_fmt= s->pix_fmt;
+        last->generation++;
     }
 
-    if(buf->base[0]){
-        pic->age= *picture_number - buf->last_pic_num;
-        buf->last_pic_num= *picture_number;
-    }else{
-        int h_chroma_shift, v_chroma_shift;
-        int size[4] = {0};
-        int tmpsize;
-        int unaligned;
-        AVPicture picture;
-        int stride_align[4];
+    avcodec_get_chroma_sub_sample(s->pix_fmt, &h_chroma_shift, &v_chroma_shift);
+
+    avcodec_align_dimensions2(s, &w, &h, stride_align);
 
-        avcodec_get_chroma_sub_sample(s->pix_fmt, &h_chroma_shift, &v_chroma_shift);
+    if(!(s->flags&CODEC_FLAG_EMU_EDGE)){
+        w+= EDGE_WIDTH*2;
+        h+= EDGE_WIDTH*2;
+    }
 
-        avcodec_align_dimensions2(s, &w, &h, stride_align);
+    do {
+        // NOTE: do not align linesizes individually, this breaks e.g. assumptions
+        // that linesize[0] == 2*linesize[1] in the MPEG-encoder for 4:2:2
+        ff_fill_linesize(&picture, s->pix_fmt, w);
+        // increase alignment of w for next try (rhs gives the lowest bit set in w)
+        w += w & ~(w-1);
 
-        if(!(s->flags&CODEC_FLAG_EMU_EDGE)){
-            w+= EDGE_WIDTH*2;
-            h+= EDGE_WIDTH*2;
+        unaligned = 0;
+        for (i=0; i<4; i++){
+            unaligned |= picture.linesize[i] % stride_align[i];
         }
+    } while (unaligned);
 
-        do {
-            // NOTE: do not align linesizes individually, this breaks e.g. assumptions
-            // that linesize[0] == 2*linesize[1] in the MPEG-encoder for 4:2:2
-            ff_fill_linesize(&picture, s->pix_fmt, w);
-            // increase alignment of w for next try (rhs gives the lowest bit set in w)
-            w += w & ~(w-1);
+    tmpsize = ff_fill_pointer(&picture, NULL, s->pix_fmt, h);
+    if (tmpsize < 0)
+        return -1;
 
-            unaligned = 0;
-            for (i=0; i<4; i++){
-                unaligned |= picture.linesize[i] % stride_align[i];
-            }
-        } while (unaligned);
+    for (i=0; i<3 && picture.data[i+1]; i++)
+        size[i] = picture.data[i+1] - picture.data[i];
+    size[i] = tmpsize - (picture.data[i] - picture.data[0]);
 
-        tmpsize = ff_fill_pointer(&picture, NULL, s->pix_fmt, h);
-        if (tmpsize < 0)
-            return -1;
+    /* all planes share one pool buffer */
+    total_size = 0;
+    for(i=0; i<4 && size[i]; i++){
+        offset[i] = total_size;
+        total_size += FFALIGN(size[i] + 16, 32); //FIXME 16
+    }
 
-        for (i=0; i<3 && picture.data[i+1]; i++)
-            size[i] = picture.data[i+1] - picture.data[i];
-        size[i] = tmpsize - (picture.data[i] - picture.data[0]);
+    base = ff_frame_pool_get(s->frame_pool, total_size, last->owner, &tag);
+    if(!base)
+        return -1;
 
-        buf->last_pic_num= -256*256*256*64;
-        memset(buf->base, 0, sizeof(buf->base));
-        memset(buf->data, 0, sizeof(buf->data));
+    memset(buf->base, 0, sizeof(buf->base));
+    memset(buf->data, 0, sizeof(buf->data));
 
-        for(i=0; i<4 && size[i]; i++){
-            const int h_shift= i==0 ? 0 : h_chroma_shift;
-            const int v_shift= i==0 ? 0 : v_chroma_shift;
+    for(i=0; i<4 && size[i]; i++){
+        const int h_shift= i==0 ? 0 : h_chroma_shift;
+        const int v_shift= i==0 ? 0 : v_chroma_shift;
 
-            buf->linesize[i]= picture.linesize[i];
+        buf->linesize[i]= picture.linesize[i];
+        buf->base[i]= base + offset[i];
 
-            buf->base[i]= av_malloc(size[i]+16); //FIXME 16
-            if(buf->base[i]==NULL) return -1;
-            memset(buf->base[i], 128, size[i]);
+        // no edge if EDGE EMU or not planar YUV
+        if((s->flags&CODEC_FLAG_EMU_EDGE) || !size[2])
+            buf->data[i] = buf->base[i];
+        else
+            buf->data[i] = buf->base[i] + FFALIGN((buf->linesize[i]*EDGE_WIDTH>>v_shift) + (EDGE_WIDTH>>h_shift), stride_align[i]);
+    }
 
-            // no edge if EDGE EMU or not planar YUV
-            if((s->flags&CODEC_FLAG_EMU_EDGE) || !size[2])
-                buf->data[i] = buf->base[i];
-            else
-                buf->data[i] = buf->base[i] + FFALIGN((buf->linesize[i]*EDGE_WIDTH>>v_shift) + (EDGE_WIDTH>>h_shift), stride_align[i]);
-        }
+    if(tag && (tag>>32) == last->generation)
+        pic->age= last->last_pic_num - (int)(uint32_t)tag;
+    else
+        pic->age= 0;
+    /* a buffer not released by this context, or a tag from before
+     * last_pic_num wrapped, has unknown contents */
+    if(pic->age <= 0){
+        for(i=0; i<4 && size[i]; i++)
+            memset(buf->base[i], 128, size[i]);
         if(size[1] && !size[2])
             ff_set_systematic_pal((uint32_t*)buf->data[1], s->pix_fmt);
-        buf->width  = s->width;
-        buf->height = s->height;
-        buf->pix_fmt= s->pix_fmt;
         pic->age= 256*256*256*64;
-    }
+        /* like a newly allocated buffer, it still reports a huge age when
+         * it comes back, whether or not anything was decoded into it */
+        buf->last_pic_num= -256*256*256*64;
+    }else
+        buf->last_pic_num= last->last_pic_num;
+    buf->width  = s->width;
+    buf->height = s->height;
+    buf->pix_fmt= s->pix_fmt;
+    buf->generation= last->generation;
     pic->type= FF_BUFFER_TYPE_INTERNAL;
 
     for(i=0; i<4; i++){
@@ -346,6 +367,17 @@ int avcodec_default_get_buffer(AVCodecContext *s, AVFrame *pic){
     return 0;
 }
 
+/**
+ * Return the planes of buf to the pool, remembering when they were handed
+ * out so that the age of the picture can be set if the same context gets
+ * them back.
+ */
+static void release_internal_buffer(InternalBuffer *buf){
+    ff_frame_pool_release(buf->base[0], ((int64_t)buf->generation<<32) | (uint32_t)buf->last_pic_num);
+    memset(buf->base, 0, sizeof(buf->base));
+    memset(buf->data, 0, sizeof(buf->data));
+}
+
 void avcodec_default_release_buffer(AVCodecContext *s, AVFrame *pic){
     int i;
     InternalBuffer *buf, *last;
@@ -363,6 +395,7 @@ void avcodec_default_release_buffer(AVCodecContext *s, AVFrame *pic){
     s->internal_buffer_count--;
     last = &((InternalBuffer*)s->internal_buffer)[s->internal_buffer_count];
 
+    release_internal_buffer(buf);
     FFSWAP(InternalBuffer, *buf, *last);
 
     for(i=0; i<4; i++){
@@ -505,14 +538,21 @@ int attribute_align_arg avcodec_open(AVCodecContext *avctx, AVCodec *codec)
         goto free_and_end;
     }
     avctx->frame_number = 0;
-    if(avctx->codec->init){
-        if(avctx->codec_type == AVMEDIA_TYPE_VIDEO &&
-           avctx->codec->max_lowres < avctx->lowres){
-            av_log(avctx, AV_LOG_ERROR, "The maximum value for lowres supported by the decoder is %d\n",
-                   avctx->codec->max_lowres);
+    if(avctx->codec->init && avctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+       avctx->codec->max_lowres < avctx->lowres){
+        av_log(avctx, AV_LOG_ERROR, "The maximum value for lowres supported by the decoder is %d\n",
+               avctx->codec->max_lowres);
+        goto free_and_end;
+    }
+
+    if (HAVE_PTHREADS && !avctx->thread_opaque) {
+        ret = ff_thread_init(avctx);
+        if (ret < 0) {
             goto free_and_end;
         }
+    }
 
+    if(avctx->codec->init && !(avctx->active_thread_type&FF_THREAD_FRAME)){
         ret = avctx->codec->init(avctx);
         if (ret < 0) {
             goto free_and_end;
@@ -607,9 +647,13 @@ int attribute_align_arg avcodec_decode_video2(AVCodecContext *avctx, AVFrame *pi
     *got_picture_ptr= 0;
     if((avctx->coded_width||avctx->coded_height) && avcodec_check_dimensions(avctx,avctx->coded_width,avctx->coded_height))
         return -1;
-    if((avctx->codec->capabilities & CODEC_CAP_DELAY) || avpkt->size){
-        ret = avctx->codec->decode(avctx, picture, got_picture_ptr,
-                                avpkt);
+    if((avctx->codec->capabilities & CODEC_CAP_DELAY) || avpkt->size || (avctx->active_thread_type&FF_THREAD_FRAME)){
+        if (HAVE_PTHREADS && avctx->active_thread_type&FF_THREAD_FRAME)
+            ret = ff_thread_decode_frame(avctx, picture, got_picture_ptr,
+                                         avpkt);
+        else
+            ret = avctx->codec->decode(avctx, picture, got_picture_ptr,
+                                       avpkt);
 
         emms_c(); //needed to avoid an emms_c() call before every return;
 
@@ -970,28 +1014,26 @@ void avcodec_init(void)
     initialized = 1;
 
     dsputil_static_init();
+    ff_startcode_init();
 }
 
 void avcodec_flush_buffers(AVCodecContext *avctx)
 {
-    if(avctx->codec->flush)
+    if(HAVE_PTHREADS && avctx->active_thread_type&FF_THREAD_FRAME)
+        ff_thread_flush(avctx);
+    else if(avctx->codec->flush)
         avctx->codec->flush(avctx);
 }
 
 void avcodec_default_free_buffers(AVCodecContext *s){
-    int i, j;
+    int i;
 
     if(s->internal_buffer==NULL) return;
 
     if (s->internal_buffer_count)
         av_log(s, AV_LOG_WARNING, "Found %i unreleased buffers!\n", s->internal_buffer_count);
-    for(i=0; i<INTERNAL_BUFFER_SIZE; i++){
-        InternalBuffer *buf= &((InternalBuffer*)s->internal_buffer)[i];
-        for(j=0; j<4; j++){
-            av_freep(&buf->base[j]);
-            buf->data[j]= NULL;
-        }
-    }
+    for(i=0; i<s->internal_buffer_count; i++)
+        release_internal_buffer(&((InternalBuffer*)s->internal_buffer)[i]);
     av_freep(&s->internal_buffer);
 
     s->internal_buffer_count=0;
@@ -1078,6 +1120,33 @@ int avcodec_thread_init(AVCodecContext *s, int thread_count){
 }
 #endif
 
+#if !HAVE_PTHREADS
+
+int ff_thread_get_buffer(AVCodecContext *avctx, AVFrame *f)
+{
+    f->owner = avctx;
+    return avctx->get_buffer(avctx, f);
+}
+
+void ff_thread_release_buffer(AVCodecContext *avctx, AVFrame *f)
+{
+    f->owner->release_buffer(f->owner, f);
+}
+
+void ff_thread_finish_setup(AVCodecContext *avctx)
+{
+}
+
+void ff_thread_report_progress(AVFrame *f, int progress, int field)
+{
+}
+
+void ff_thread_await_progress(AVFrame *f, int progress, int field)
+{
+}
+
+#endif
+
 unsigned int av_xiphlacing(unsigned char *s, unsigned int v)
 {
     unsigned int n = 0;
@@ -26,6 +26,7 @@
 #include "avcodec.h"
 #include "mpegvideo.h"
 #include "intrax8.h"
+#include "startcode.h"
 
 /** Markers used in VC-1 AP frame data */
 //@{
@@ -321,13 +322,11 @@ typedef struct VC1Context{
  */
 static av_always_inline const uint8_t* find_next_marker(const uint8_t *src, const uint8_t *end)
 {
-    uint32_t mrk = 0xFFFFFFFF;
-
     if(end-src < 4) return end;
-    while(src < end){
-        mrk = (mrk << 8) | *src++;
-        if(IS_MARKER(mrk))
-            return src-4;
+    for(; src + 3 < end; src++){
+        src += ff_startcode_find_candidate(src, end - src - 3);
+        if(src + 3 < end && !src[1] && src[2] == 1)
+            return src;
     }
     return end;
 }
@@ -340,13 +339,18 @@ static av_always_inline int vc1_unescape_buffer(const uint8_t *src, int size, ui
         for(dsize = 0; dsize < size; dsize++) *dst++ = *src++;
         return size;
     }
-    for(i = 0; i < size; i++, src++) {
-        if(src[0] == 3 && i >= 2 && !src[-1] && !src[-2] && i < size-1 && src[1] < 4) {
-            dst[dsize++] = src[1];
-            src++;
-            i++;
-        } else
-            dst[dsize++] = *src;
+    for(i = 0; i < size; ) {
+        /* everything up to the next zero pair is copied unchanged */
+        int n = ff_startcode_find_candidate(src + i, size - i);
+        memcpy(dst + dsize, src + i, n);
+        dsize += n;
+        i     += n;
+        if(i + 3 < size && !src[i + 1] && src[i + 2] == 3 && src[i + 3] < 4) {
+            dst[dsize++] = 0;
+            dst[dsize++] = 0;
+            i += 3;
+        } else if(i < size)
+            dst[dsize++] = src[i++];
     }
     return dsize;
 }
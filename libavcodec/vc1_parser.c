@@ -28,6 +28,7 @@
 #include "parser.h"
 #include "vc1.h"
 #include "get_bits.h"
+#include "startcode.h"
 
 typedef struct {
     ParseContext pc;
@@ -80,6 +81,24 @@ static void vc1_extract_headers(AVCodecParserContext *s, AVCodecContext *avctx,
     av_free(buf2);
 }
 
+/**
+ * Skip the bytes from buf[i] on that cannot end a marker, given that the
+ * bytes before them are in state, and update state for the skipped bytes.
+ * @return the position of the next byte to look at
+ */
+static int skip_to_marker(const uint8_t *buf, int i, int buf_size, uint32_t *state)
+{
+    int j;
+
+    /* the previous bytes may still be the start of a marker */
+    if (!(*state & 0xFF) || (*state & 0xFFFFFF) == 1)
+        return i;
+    j = i + ff_startcode_find_candidate(buf + i, buf_size - i);
+    for (i = FFMAX(i, j - 4); i < j; i++)
+        *state = (*state << 8) | buf[i];
+    return j;
+}
+
 /**
  * finds the end of the current frame in the bitstream.
  * @return the position of the first byte of the next frame, or -1
@@ -95,6 +114,9 @@ static int vc1_find_frame_end(ParseContext *pc, const uint8_t *buf,
     i=0;
     if(!pic_found){
         for(i=0; i<buf_size; i++){
+            i= skip_to_marker(buf, i, buf_size, &state);
+            if(i >= buf_size)
+                break;
             state= (state<<8) | buf[i];
             if(state == VC1_CODE_FRAME || state == VC1_CODE_FIELD){
                 i++;
@@ -109,6 +131,9 @@ static int vc1_find_frame_end(ParseContext *pc, const uint8_t *buf,
         if (buf_size == 0)
             return 0;
         for(; i<buf_size; i++){
+            i= skip_to_marker(buf, i, buf_size, &state);
+            if(i >= buf_size)
+                break;
             state= (state<<8) | buf[i];
             if(IS_MARKER(state) && state != VC1_CODE_FIELD && state != VC1_CODE_SLICE){
                 pc->frame_start_found=0;
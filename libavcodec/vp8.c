@@ -23,6 +23,7 @@
  */
 
 #include "avcodec.h"
+#include "thread.h"
 #include "vp56.h"
 #include "vp8data.h"
 #include "vp8dsp.h"
@@ -54,6 +55,7 @@ typedef struct {
     vp8_mc_func put_pixels_tab[3][3][3];
     AVFrame frames[4];
     AVFrame *framep[4];
+    AVFrame *next_framep[4];
     uint8_t *edge_emu_buffer;
     VP56RangeCoder c;   ///< header context, includes mb modes and motion vectors
     int profile;
@@ -199,17 +201,10 @@ typedef struct {
     } prob[2];
 } VP8Context;
 
-static void vp8_decode_flush(AVCodecContext *avctx)
+static void free_buffers(VP8Context *s)
 {
-    VP8Context *s = avctx->priv_data;
-    int i;
-
-    for (i = 0; i < 4; i++)
-        if (s->frames[i].data[0])
-            avctx->release_buffer(avctx, &s->frames[i]);
-    memset(s->framep, 0, sizeof(s->framep));
-
     av_freep(&s->macroblocks_base);
+    av_freep(&s->filter_strength);
     av_freep(&s->intra4x4_pred_mode_base);
     av_freep(&s->top_nnz);
     av_freep(&s->edge_emu_buffer);
@@ -220,16 +215,30 @@ static void vp8_decode_flush(AVCodecContext *avctx)
     s->intra4x4_pred_mode = NULL;
 }
 
-static int update_dimensions(VP8Context *s, int width, int height)
+static void vp8_decode_flush_impl(AVCodecContext *avctx, int force)
 {
+    VP8Context *s = avctx->priv_data;
     int i;
 
-    if (avcodec_check_dimensions(s->avctx, width, height))
-        return AVERROR_INVALIDDATA;
+    // reference frames are shared by the frame-thread copies, so they are
+    // released from the original context unless the stream state is reset
+    if (!avctx->is_copy || force)
+        for (i = 0; i < 4; i++)
+            if (s->frames[i].data[0])
+                ff_thread_release_buffer(avctx, &s->frames[i]);
+    memset(s->framep, 0, sizeof(s->framep));
+
+    free_buffers(s);
+}
 
-    vp8_decode_flush(s->avctx);
+static void vp8_decode_flush(AVCodecContext *avctx)
+{
+    vp8_decode_flush_impl(avctx, 0);
+}
 
-    avcodec_set_dimensions(s->avctx, width, height);
+static int alloc_buffers(VP8Context *s)
+{
+    int i;
 
     s->mb_width  = (s->avctx->coded_width +15) / 16;
     s->mb_height = (s->avctx->coded_height+15) / 16;
@@ -260,6 +269,18 @@ static int update_dimensions(VP8Context *s, int width, int height)
     return 0;
 }
 
+static int update_dimensions(VP8Context *s, int width, int height)
+{
+    if (avcodec_check_dimensions(s->avctx, width, height))
+        return AVERROR_INVALIDDATA;
+
+    vp8_decode_flush_impl(s->avctx, 1);
+
+    avcodec_set_dimensions(s->avctx, width, height);
+
+    return alloc_buffers(s);
+}
+
 static void parse_segment_info(VP8Context *s)
 {
     VP56RangeCoder *c = &s->c;
@@ -1042,12 +1063,30 @@ void intra_predict(VP8Context *s, uint8_t *dst[3], VP8Macroblock *mb,
                        s->filter.simple, 0);
 }
 
+/**
+ * Wait until a reference frame being decoded by another thread is complete
+ * down to the given line.
+ * Progress is reported in macroblock rows after deblocking; the loop filter
+ * of the following row still modifies the last 3 lines of a reported row.
+ *
+ * @param ref reference picture
+ * @param luma 1 if last_line is a luma line, 0 for a chroma line
+ * @param last_line last line of the plane that will be read
+ */
+static av_always_inline void await_ref_rows(AVFrame *ref, int luma, int last_line)
+{
+    if (!luma)
+        last_line = 2*last_line + 1;
+    ff_thread_await_progress(ref, (last_line + 3) >> 4, 0);
+}
+
 /**
  * Generic MC function.
  *
  * @param s VP8 decoding context
  * @param luma 1 for luma (Y) planes, 0 for chroma (Cb/Cr) planes
  * @param dst target buffer for block data at block position
+ * @param ref reference picture, used to wait for frame-threading progress
  * @param src reference picture buffer at origin (0, 0)
  * @param mv motion vector (relative to block position) to get pixel data from
  * @param x_off horizontal position of block from origin (0, 0)
@@ -1061,7 +1100,7 @@ void intra_predict(VP8Context *s, uint8_t *dst[3], VP8Macroblock *mb,
  */
 static av_always_inline
 void vp8_mc(VP8Context *s, int luma,
-            uint8_t *dst, uint8_t *src, const VP56mv *mv,
+            uint8_t *dst, AVFrame *ref, uint8_t *src, const VP56mv *mv,
             int x_off, int y_off, int block_w, int block_h,
             int width, int height, int linesize,
             vp8_mc_func mc_func[3][3])
@@ -1074,6 +1113,9 @@ void vp8_mc(VP8Context *s, int luma,
         x_off += mv->x >> (3 - luma);
         y_off += mv->y >> (3 - luma);
 
+        // the subpel filter reads 3 lines below the block
+        await_ref_rows(ref, luma, y_off + block_h + 2);
+
         // edge emulation
         src += y_off * linesize + x_off;
         if (x_off < 2 || x_off >= width  - block_w - 3 ||
@@ -1084,8 +1126,10 @@ void vp8_mc(VP8Context *s, int luma,
             src = s->edge_emu_buffer + 2 + linesize * 2;
         }
         mc_func[my_idx][mx_idx](dst, linesize, src, linesize, block_h, mx, my);
-    } else
+    } else {
+        await_ref_rows(ref, luma, y_off + block_h - 1);
         mc_func[0][0](dst, linesize, src + y_off * linesize + x_off, linesize, block_h, 0, 0);
+    }
 }
 
 static av_always_inline
@@ -1099,7 +1143,7 @@ void vp8_mc_part(VP8Context *s, uint8_t *dst[3],
 
     /* Y */
     vp8_mc(s, 1, dst[0] + by_off * s->linesize + bx_off,
-           ref_frame->data[0], mv, x_off + bx_off, y_off + by_off,
+           ref_frame, ref_frame->data[0], mv, x_off + bx_off, y_off + by_off,
            block_w, block_h, width, height, s->linesize,
            s->put_pixels_tab[block_w == 8]);
 
@@ -1113,11 +1157,11 @@ void vp8_mc_part(VP8Context *s, uint8_t *dst[3],
     width   >>= 1; height  >>= 1;
     block_w >>= 1; block_h >>= 1;
     vp8_mc(s, 0, dst[1] + by_off * s->uvlinesize + bx_off,
-           ref_frame->data[1], &uvmv, x_off + bx_off, y_off + by_off,
+           ref_frame, ref_frame->data[1], &uvmv, x_off + bx_off, y_off + by_off,
            block_w, block_h, width, height, s->uvlinesize,
            s->put_pixels_tab[1 + (block_w == 4)]);
     vp8_mc(s, 0, dst[2] + by_off * s->uvlinesize + bx_off,
-           ref_frame->data[2], &uvmv, x_off + bx_off, y_off + by_off,
+           ref_frame, ref_frame->data[2], &uvmv, x_off + bx_off, y_off + by_off,
            block_w, block_h, width, height, s->uvlinesize,
            s->put_pixels_tab[1 + (block_w == 4)]);
 }
@@ -1163,7 +1207,7 @@ void inter_predict(VP8Context *s, uint8_t *dst[3], VP8Macroblock *mb,
         for (y = 0; y < 4; y++) {
             for (x = 0; x < 4; x++) {
                 vp8_mc(s, 1, dst[0] + 4*y*s->linesize + x*4,
-                       ref->data[0], &bmv[4*y + x],
+                       ref, ref->data[0], &bmv[4*y + x],
                        4*x + x_off, 4*y + y_off, 4, 4,
                        width, height, s->linesize,
                        s->put_pixels_tab[2]);
@@ -1189,12 +1233,12 @@ void inter_predict(VP8Context *s, uint8_t *dst[3], VP8Macroblock *mb,
                     uvmv.y &= ~7;
                 }
                 vp8_mc(s, 0, dst[1] + 4*y*s->uvlinesize + x*4,
-                       ref->data[1], &uvmv,
+                       ref, ref->data[1], &uvmv,
                        4*x + x_off, 4*y + y_off, 4, 4,
                        width, height, s->uvlinesize,
                        s->put_pixels_tab[2]);
                 vp8_mc(s, 0, dst[2] + 4*y*s->uvlinesize + x*4,
-                       ref->data[2], &uvmv,
+                       ref, ref->data[2], &uvmv,
                        4*x + x_off, 4*y + y_off, 4, 4,
                        width, height, s->uvlinesize,
                        s->put_pixels_tab[2]);
@@ -1458,6 +1502,9 @@ static int vp8_decode_frame(AVCodecContext *avctx, void *data, int *data_size,
     enum AVDiscard skip_thresh;
     AVFrame *curframe = NULL;
 
+    // the reference state is handed on unchanged if this frame fails to decode
+    memcpy(s->next_framep, s->framep, sizeof(s->framep));
+
     if ((ret = decode_frame_header(s, avpkt->data, avpkt->size)) < 0)
         return ret;
 
@@ -1473,33 +1520,60 @@ static int vp8_decode_frame(AVCodecContext *avctx, void *data, int *data_size,
     }
     s->deblock_filter = s->filter.level && avctx->skip_loop_filter < skip_thresh;
 
+    // Given that arithmetic probabilities are updated every frame, it's quite likely
+    // that the values we have on a random interframe are complete junk if we didn't
+    // start decode on a keyframe. So just don't display anything rather than junk.
+    if (!s->keyframe && (!s->framep[VP56_FRAME_PREVIOUS] ||
+                         !s->framep[VP56_FRAME_GOLDEN] ||
+                         !s->framep[VP56_FRAME_GOLDEN2])) {
+        av_log(avctx, AV_LOG_WARNING, "Discarding interframe without a prior keyframe!\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    // release no longer referenced frames
     for (i = 0; i < 4; i++)
-        if (&s->frames[i] != s->framep[VP56_FRAME_PREVIOUS] &&
+        if (s->frames[i].data[0] &&
+            &s->frames[i] != s->framep[VP56_FRAME_PREVIOUS] &&
             &s->frames[i] != s->framep[VP56_FRAME_GOLDEN] &&
-            &s->frames[i] != s->framep[VP56_FRAME_GOLDEN2]) {
+            &s->frames[i] != s->framep[VP56_FRAME_GOLDEN2])
+            ff_thread_release_buffer(avctx, &s->frames[i]);
+
+    for (i = 0; i < 4; i++)
+        if (!s->frames[i].data[0]) {
             curframe = s->framep[VP56_FRAME_CURRENT] = &s->frames[i];
             break;
         }
-    if (curframe->data[0])
-        avctx->release_buffer(avctx, curframe);
 
     curframe->key_frame = s->keyframe;
     curframe->pict_type = s->keyframe ? FF_I_TYPE : FF_P_TYPE;
     curframe->reference = referenced ? 3 : 0;
-    if ((ret = avctx->get_buffer(avctx, curframe))) {
+    if ((ret = ff_thread_get_buffer(avctx, curframe))) {
         av_log(avctx, AV_LOG_ERROR, "get_buffer() failed!\n");
         return ret;
     }
 
-    // Given that arithmetic probabilities are updated every frame, it's quite likely
-    // that the values we have on a random interframe are complete junk if we didn't
-    // start decode on a keyframe. So just don't display anything rather than junk.
-    if (!s->keyframe && (!s->framep[VP56_FRAME_PREVIOUS] ||
-                         !s->framep[VP56_FRAME_GOLDEN] ||
-                         !s->framep[VP56_FRAME_GOLDEN2])) {
-        av_log(avctx, AV_LOG_WARNING, "Discarding interframe without a prior keyframe!\n");
-        return AVERROR_INVALIDDATA;
-    }
+    // Compute the references for the next frame; the ones in framep stay
+    // valid until this frame is decoded.
+    if (s->update_altref != VP56_FRAME_NONE)
+        s->next_framep[VP56_FRAME_GOLDEN2] = s->framep[s->update_altref];
+    else
+        s->next_framep[VP56_FRAME_GOLDEN2] = s->framep[VP56_FRAME_GOLDEN2];
+
+    if (s->update_golden != VP56_FRAME_NONE)
+        s->next_framep[VP56_FRAME_GOLDEN]  = s->framep[s->update_golden];
+    else
+        s->next_framep[VP56_FRAME_GOLDEN]  = s->framep[VP56_FRAME_GOLDEN];
+
+    if (s->update_last) // move cur->prev
+        s->next_framep[VP56_FRAME_PREVIOUS] = curframe;
+    else
+        s->next_framep[VP56_FRAME_PREVIOUS] = s->framep[VP56_FRAME_PREVIOUS];
+    s->next_framep[VP56_FRAME_CURRENT]      = curframe;
+
+    // A new segmentation map is only complete after the whole frame is
+    // decoded, and the next frame may reuse it.
+    if (!s->segmentation.update_map)
+        ff_thread_finish_setup(avctx);
 
     s->linesize   = curframe->linesize[0];
     s->uvlinesize = curframe->linesize[1];
@@ -1588,37 +1662,19 @@ static int vp8_decode_frame(AVCodecContext *avctx, void *data, int *data_size,
             else
                 filter_mb_row(s, mb_y);
         }
+
+        ff_thread_report_progress(curframe, mb_y, 0);
     }
 
+    ff_thread_report_progress(curframe, INT_MAX, 0);
+
 skip_decode:
     // if future frames don't use the updated probabilities,
     // reset them to the values we saved
     if (!s->update_probabilities)
         s->prob[0] = s->prob[1];
 
-    // check if golden and altref are swapped
-    if (s->update_altref == VP56_FRAME_GOLDEN &&
-        s->update_golden == VP56_FRAME_GOLDEN2)
-        FFSWAP(AVFrame *, s->framep[VP56_FRAME_GOLDEN], s->framep[VP56_FRAME_GOLDEN2]);
-    else {
-        if (s->update_altref != VP56_FRAME_NONE)
-            s->framep[VP56_FRAME_GOLDEN2] = s->framep[s->update_altref];
-
-        if (s->update_golden != VP56_FRAME_NONE)
-            s->framep[VP56_FRAME_GOLDEN] = s->framep[s->update_golden];
-    }
-
-    if (s->update_last) // move cur->prev
-        s->framep[VP56_FRAME_PREVIOUS] = s->framep[VP56_FRAME_CURRENT];
-
-    // release no longer referenced frames
-    for (i = 0; i < 4; i++)
-        if (s->frames[i].data[0] &&
-            &s->frames[i] != s->framep[VP56_FRAME_CURRENT] &&
-            &s->frames[i] != s->framep[VP56_FRAME_PREVIOUS] &&
-            &s->frames[i] != s->framep[VP56_FRAME_GOLDEN] &&
-            &s->frames[i] != s->framep[VP56_FRAME_GOLDEN2])
-            avctx->release_buffer(avctx, &s->frames[i]);
+    memcpy(s->framep, s->next_framep, sizeof(s->framep));
 
     if (!s->invisible) {
         *(AVFrame*)data = *s->framep[VP56_FRAME_CURRENT];
@@ -1654,6 +1710,58 @@ static av_cold int vp8_decode_free(AVCodecContext *avctx)
     return 0;
 }
 
+static av_cold int vp8_decode_init_thread_copy(AVCodecContext *avctx)
+{
+    VP8Context *s = avctx->priv_data;
+
+    s->avctx = avctx;
+
+    s->macroblocks_base        = NULL;
+    s->filter_strength         = NULL;
+    s->intra4x4_pred_mode_base = NULL;
+    s->top_nnz                 = NULL;
+    s->edge_emu_buffer         = NULL;
+    s->top_border              = NULL;
+    s->segmentation_map        = NULL;
+
+    s->macroblocks        = NULL;
+    s->intra4x4_pred_mode = NULL;
+
+    return 0;
+}
+
+#define REBASE(pic) \
+    pic ? pic - &s_src->frames[0] + &s->frames[0] : NULL
+
+static int vp8_decode_update_thread_context(AVCodecContext *dst, const AVCodecContext *src)
+{
+    VP8Context *s = dst->priv_data, *s_src = src->priv_data;
+    int i, ret;
+
+    if (s->macroblocks_base &&
+        (s_src->mb_width != s->mb_width || s_src->mb_height != s->mb_height))
+        free_buffers(s);
+
+    if (!s->macroblocks_base && s_src->macroblocks_base &&
+        (ret = alloc_buffers(s)) < 0)
+        return ret;
+
+    s->prob[0]      = s_src->prob[!s_src->update_probabilities];
+    s->segmentation = s_src->segmentation;
+    s->lf_delta     = s_src->lf_delta;
+    memcpy(s->sign_bias, s_src->sign_bias, sizeof(s->sign_bias));
+
+    if (s_src->segmentation_map)
+        memcpy(s->segmentation_map, s_src->segmentation_map,
+               s->mb_stride * s->mb_height);
+
+    memcpy(&s->frames, &s_src->frames, sizeof(s->frames));
+    for (i = 0; i < 4; i++)
+        s->framep[i] = REBASE(s_src->next_framep[i]);
+
+    return 0;
+}
+
 AVCodec vp8_decoder = {
     "vp8",
     AVMEDIA_TYPE_VIDEO,
@@ -1663,7 +1771,9 @@ AVCodec vp8_decoder = {
     NULL,
     vp8_decode_free,
     vp8_decode_frame,
-    CODEC_CAP_DR1,
+    CODEC_CAP_DR1 | CODEC_CAP_FRAME_THREADS,
     .flush = vp8_decode_flush,
     .long_name = NULL_IF_CONFIG_SMALL("On2 VP8"),
+    .init_thread_copy      = vp8_decode_init_thread_copy,
+    .update_thread_context = vp8_decode_update_thread_context,
 };
@@ -0,0 +1,71 @@
+/*
+ * SSE2 start code scanning
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libavutil/x86_cpu.h"
+#include "libavcodec/dsputil.h"
+#include "libavcodec/startcode.h"
+
+static int startcode_find_candidate_sse2(const uint8_t *buf, int size)
+{
+    x86_reg i = 0;
+
+    /* look for zero pairs in 32 bytes at a time by comparing the block and
+     * the block shifted by one byte against zero, stop at the first block
+     * with a pair and let the C code find it */
+    if (size > 32)
+        __asm__ volatile(
+            "pxor      %%xmm7, %%xmm7   \n\t"
+            "1:                         \n\t"
+            "movdqu    (%2, %0), %%xmm0 \n\t"
+            "movdqu   1(%2, %0), %%xmm1 \n\t"
+            "movdqu  16(%2, %0), %%xmm2 \n\t"
+            "movdqu  17(%2, %0), %%xmm3 \n\t"
+            "pcmpeqb   %%xmm7, %%xmm0   \n\t"
+            "pcmpeqb   %%xmm7, %%xmm1   \n\t"
+            "pcmpeqb   %%xmm7, %%xmm2   \n\t"
+            "pcmpeqb   %%xmm7, %%xmm3   \n\t"
+            "pand      %%xmm1, %%xmm0   \n\t"
+            "pand      %%xmm3, %%xmm2   \n\t"
+            "por       %%xmm2, %%xmm0   \n\t"
+            "pmovmskb  %%xmm0, %%eax    \n\t"
+            "test      %%eax, %%eax     \n\t"
+            "jnz 2f                     \n\t"
+            "add       $32, %0          \n\t"
+            "cmp       %1, %0           \n\t"
+            "jle 1b                     \n\t"
+            "2:                         \n\t"
+            : "+r"(i)
+            : "r"((x86_reg)size - 33), "r"(buf)
+            : "%eax", "memory"
+#if ARCH_X86_64
+              , "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm7"
+#endif
+        );
+
+    return i + ff_startcode_find_candidate_c(buf + i, size - i);
+}
+
+void ff_startcode_init_x86(void)
+{
+    int mm_flags = mm_support();
+
+    if (mm_flags & FF_MM_SSE2)
+        ff_startcode_find_candidate = startcode_find_candidate_sse2;
+}
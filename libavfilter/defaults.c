@@ -22,16 +22,14 @@
 #include "libavcodec/imgconvert.h"
 #include "avfilter.h"
 
-/* TODO: buffer pool.  see comment for avfilter_default_get_video_buffer() */
 static void avfilter_default_free_buffer(AVFilterBuffer *ptr)
 {
-    av_free(ptr->data[0]);
+    av_frame_pool_release(ptr->data[0]);
     av_free(ptr);
 }
 
-/* TODO: set the buffer's priv member to a context structure for the whole
- * filter chain.  This will allow for a buffer pool instead of the constant
- * alloc & free cycle currently implemented. */
+/* Picture memory comes from the default libavcodec frame pool, so it is
+ * recycled across frames and shared with the decoders. */
 AVFilterPicRef *avfilter_default_get_video_buffer(AVFilterLink *link, int perms, int w, int h)
 {
     AVFilterBuffer *pic = av_mallocz(sizeof(AVFilterBuffer));
@@ -55,8 +53,8 @@ AVFilterPicRef *avfilter_default_get_video_buffer(AVFilterLink *link, int perms,
         pic->linesize[i] = FFALIGN(pic->linesize[i], 16);
 
     tempsize = ff_fill_pointer((AVPicture *)pic, NULL, pic->format, ref->h);
-    buf = av_malloc(tempsize + 16); // +2 is needed for swscaler, +16 to be
-                                    // SIMD-friendly
+    buf = av_frame_pool_get(NULL, tempsize + 16); // +2 is needed for swscaler,
+                                                  // +16 to be SIMD-friendly
     ff_fill_pointer((AVPicture *)pic, buf, pic->format, ref->h);
 
     memcpy(ref->data,     pic->data,     sizeof(pic->data));
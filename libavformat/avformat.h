@@ -22,7 +22,7 @@
 #define AVFORMAT_AVFORMAT_H
 
 #define LIBAVFORMAT_VERSION_MAJOR 52
-#define LIBAVFORMAT_VERSION_MINOR 77
+#define LIBAVFORMAT_VERSION_MINOR 83
 #define LIBAVFORMAT_VERSION_MICRO  0
 
 #define LIBAVFORMAT_VERSION_INT AV_VERSION_INT(LIBAVFORMAT_VERSION_MAJOR, \
@@ -182,6 +182,10 @@ void av_metadata_free(AVMetadata **m);
  * Allocate and read the payload of a packet and initialize its
  * fields with default values.
  *
+ * If s reads mapped input (see the mmap protocol), the packet may be
+ * mapped from the input instead of copied. It is still writable and its
+ * padding is zeroed.
+ *
  * @param pkt packet
  * @param size desired payload size
  * @return >0 (read size) if OK, AVERROR_xxx otherwise
@@ -536,6 +540,13 @@ typedef struct AVStream {
      * Number of frames that have been demuxed during av_find_stream_info()
      */
     int codec_info_nb_frames;
+
+    /**
+     * Set if index_entries holds every keyframe of the stream, so that
+     * seeking can use the index instead of searching the file.
+     * - decoding: Set by av_build_index() and av_load_index().
+     */
+    int index_complete;
 } AVStream;
 
 #define AV_PROGRAM_RUNNING 1
@@ -659,6 +670,11 @@ typedef struct AVFormatContext {
 #define AVFMT_FLAG_NOFILLIN     0x0010 ///< Do not infer any values from other values, just return what is stored in the container
 #define AVFMT_FLAG_NOPARSE      0x0020 ///< Do not use AVParsers, you also must set AVFMT_FLAG_NOFILLIN as the fillin code works on frames and no parsing -> no frames. Also seeking to frames can not work if parsing to find frame boundaries has been disabled
 #define AVFMT_FLAG_RTP_HINT     0x0040 ///< Add RTP hinting to the output file
+#define AVFMT_FLAG_FRAGMENT     0x0080 ///< Write the output as a sequence of self-contained fragments (mov/mp4)
+#define AVFMT_FLAG_FRAG_INDEX   0x0100 ///< Write a random access index of the fragments at the end of the output
+#define AVFMT_FLAG_FASTSTART    0x0200 ///< Move the index in front of the data when finishing the output file (mov/mp4)
+#define AVFMT_FLAG_PROBE_THREADS 0x0400 ///< Decode the packets av_find_stream_info() reads for different streams in parallel
+#define AVFMT_FLAG_PROBE_CACHE  0x0800 ///< Reuse the codec parameters av_find_stream_info() found before for streams with the same signature
 
     int loop_input;
     /** decoding: size of data to probe; encoding: unused. */
@@ -747,6 +763,22 @@ typedef struct AVFormatContext {
      * - decoding: Unused.
      */
     int64_t start_time_realtime;
+
+    /**
+     * Minimum duration of a fragment in microseconds, when writing
+     * fragmented output (AVFMT_FLAG_FRAGMENT). A new fragment starts at
+     * the first keyframe after this much time. 0 starts one at each
+     * keyframe.
+     * - encoding: Set by user.
+     * - decoding: Unused.
+     */
+    int frag_duration;
+
+    /**
+     * Packet queues of av_interleave_packet_per_dts().
+     * NOT PART OF PUBLIC API
+     */
+    struct PacketInterleaver *interleaver;
 } AVFormatContext;
 
 typedef struct AVPacketList {
@@ -1151,6 +1183,37 @@ void ff_reduce_index(AVFormatContext *s, int stream_index);
 int av_add_index_entry(AVStream *st, int64_t pos, int64_t timestamp,
                        int size, int distance, int flags);
 
+/**
+ * Build a complete keyframe index by reading the whole file, for formats
+ * which do not store one, such as MPEG-TS and MPEG-PS. Streams whose
+ * discard is AVDISCARD_ALL are not indexed. The read position is reset
+ * to the start of the data afterwards.
+ * Later seeks on the indexed streams go directly to the index entry
+ * instead of searching the file with read_timestamp().
+ *
+ * @return >= 0 on success, a negative AVERROR code on failure
+ */
+int av_build_index(AVFormatContext *s);
+
+/**
+ * Write the index of all streams to pb, for example to a sidecar file
+ * which av_load_index() can read back the next time the file is opened.
+ * Timestamps and positions are stored delta coded, usually taking a few
+ * bytes per entry.
+ *
+ * @return >= 0 on success, a negative AVERROR code on failure
+ */
+int av_save_index(AVFormatContext *s, ByteIOContext *pb);
+
+/**
+ * Replace the index of the streams with one written by av_save_index().
+ * The index is rejected if it was saved for a file of a different size
+ * or with a different number of streams.
+ *
+ * @return >= 0 on success, a negative AVERROR code on failure
+ */
+int av_load_index(AVFormatContext *s, ByteIOContext *pb);
+
 /**
  * Perform a binary search using av_index_search_timestamp() and
  * AVInputFormat.read_timestamp().
@@ -792,7 +792,18 @@ resync:
             return err;
 
         if(ast->has_pal && pkt->data && pkt->size<(unsigned)INT_MAX/2){
-            void *ptr= av_realloc(pkt->data, pkt->size + 4*256 + FF_INPUT_BUFFER_PADDING_SIZE);
+            void *ptr= NULL;
+            if(pkt->destruct != av_destruct_packet){
+                /* referenced (e.g. mapped) data cannot be reallocated */
+                AVPacket copy= *pkt;
+                copy.destruct= NULL;
+                if(av_dup_packet(&copy) >= 0){
+                    av_free_packet(pkt);
+                    *pkt= copy;
+                }
+            }
+            if(pkt->destruct == av_destruct_packet)
+                ptr= av_realloc(pkt->data, pkt->size + 4*256 + FF_INPUT_BUFFER_PADDING_SIZE);
             if(ptr){
             ast->has_pal=0;
             pkt->size += 4*256;
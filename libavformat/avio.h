@@ -33,6 +33,8 @@
 #include "libavutil/common.h"
 #include "libavutil/log.h"
 
+struct AVPacket;
+
 /* unbuffered I/O */
 
 /**
@@ -254,6 +256,23 @@ typedef struct URLProtocol {
     int (*url_get_file_handle)(URLContext *h);
     int priv_data_size;
     const AVClass *priv_data_class;
+    /**
+     * Read without copying: set pkt to a reference counted packet pointing
+     * to the next at most size bytes of the resource and advance the
+     * position past them. Returns the number of bytes like url_read().
+     * At least FF_INPUT_BUFFER_PADDING_SIZE bytes after the returned data
+     * are readable, but unlike with av_new_packet() they are not zeroed.
+     * The data is read only.
+     */
+    int (*url_read_map)(URLContext *h, struct AVPacket *pkt, int size);
+    /**
+     * Map size bytes starting at pos into pkt without copying them. Unlike
+     * with url_read_map(), the packet is writable, does not share its data
+     * with other packets and is followed by FF_INPUT_BUFFER_PADDING_SIZE
+     * zeroed bytes, like with av_new_packet(). The position is unchanged.
+     * Returns size, or AVERROR(ENOSYS) if the data should be copied instead.
+     */
+    int (*url_map_packet)(URLContext *h, struct AVPacket *pkt, int64_t pos, int size);
 } URLProtocol;
 
 #if LIBAVFORMAT_VERSION_MAJOR < 53
@@ -316,6 +335,15 @@ typedef struct {
     int (*read_pause)(void *opaque, int pause);
     int64_t (*read_seek)(void *opaque, int stream_index,
                          int64_t timestamp, int flags);
+    struct ReadAhead *read_ahead; ///< background reader state, see url_set_read_ahead()
+    /**
+     * Set for protocols that can map their data into memory. The buffer
+     * then points directly into the mapped data held by map, and
+     * av_get_packet() maps packets on their own with map_packet.
+     */
+    int (*read_map)(void *opaque, struct AVPacket *pkt, int size);
+    struct AVPacket *map;
+    int (*map_packet)(void *opaque, struct AVPacket *pkt, int64_t pos, int size);
 } ByteIOContext;
 
 int init_put_byte(ByteIOContext *s,
@@ -454,6 +482,26 @@ int url_fdopen(ByteIOContext **s, URLContext *h);
 
 /** @warning must be called before any I/O */
 int url_setbufsize(ByteIOContext *s, int buf_size);
+
+/**
+ * Start or stop reading ahead in a background thread.
+ * The thread keeps up to ring_size bytes from the current position on
+ * prefetched, so that the caller does not block on the protocol as long
+ * as it consumes data no faster than it arrives. Seeks into the data
+ * held in the ring are served without touching the protocol, other seeks
+ * drop the ring and restart reading ahead at the new position.
+ *
+ * Read-ahead is stopped by url_fclose(). Contexts that are not closed
+ * with url_fclose() must stop it with ring_size 0 before being freed.
+ * While read-ahead is active, the read_packet() callback of the context
+ * is called from the background thread.
+ *
+ * @param ring_size size of the ring in bytes, 0 to stop reading ahead
+ * @return 0 on success, a negative AVERROR code on failure; in particular
+ *         AVERROR(ENOSYS) if threads are not available and
+ *         AVERROR(EINVAL) for write or packet based contexts
+ */
+int url_set_read_ahead(ByteIOContext *s, int ring_size);
 #if LIBAVFORMAT_VERSION_MAJOR < 53
 /** Reset the buffer for reading or writing.
  * @note Will drop any data currently in the buffer without transmitting it.
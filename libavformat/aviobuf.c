@@ -25,6 +25,9 @@
 #include "avio.h"
 #include "internal.h"
 #include <stdarg.h>
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #define IO_BUFFER_SIZE 32768
 
@@ -40,6 +43,188 @@ static void fill_buffer(ByteIOContext *s);
 static int url_resetbuf(ByteIOContext *s, int flags);
 #endif
 
+#if HAVE_PTHREADS
+/**
+ * Ring of data read ahead by a background thread.
+ * Positions are absolute stream positions, the byte at position p is
+ * stored at ring[p % size].
+ */
+typedef struct ReadAhead {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t *ring;
+    int size;
+    int64_t base;           ///< oldest position still available in the ring
+    int64_t tail;           ///< next position to be returned to the caller
+    int64_t head;           ///< next position to be read from the protocol
+    int eof;                ///< the protocol returned end of file or an error
+    int error;
+    int reading;            ///< the thread is inside read_packet()
+    int suspended;          ///< the caller is accessing the protocol itself
+    int die;
+} ReadAhead;
+
+/** amount of consumed data kept in the ring for seeking back */
+#define READ_AHEAD_HISTORY(ra) ((ra)->size >> 2)
+
+static void *read_ahead_thread(void *arg)
+{
+    ByteIOContext *s = arg;
+    ReadAhead *ra = s->read_ahead;
+
+    pthread_mutex_lock(&ra->mutex);
+    while (!ra->die) {
+        int len = ra->size - READ_AHEAD_HISTORY(ra) - (ra->head - ra->tail);
+        int pos = ra->head % ra->size;
+
+        if (ra->eof || ra->suspended || len <= 0) {
+            pthread_cond_wait(&ra->cond, &ra->mutex);
+            continue;
+        }
+        len = FFMIN(len, ra->size - pos);
+        len = FFMIN(len, IO_BUFFER_SIZE);
+        /* the part about to be overwritten can no longer be seeked to */
+        ra->base = FFMAX(ra->base, ra->head + len - ra->size);
+        ra->reading = 1;
+        pthread_mutex_unlock(&ra->mutex);
+
+        len = s->read_packet(s->opaque, ra->ring + pos, len);
+
+        pthread_mutex_lock(&ra->mutex);
+        ra->reading = 0;
+        if (len <= 0) {
+            ra->eof   = 1;
+            ra->error = len;
+        } else
+            ra->head += len;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->mutex);
+    return NULL;
+}
+
+static int read_ahead_read(ReadAhead *ra, uint8_t *buf, int size)
+{
+    int len, pos;
+
+    pthread_mutex_lock(&ra->mutex);
+    while (ra->tail == ra->head && !ra->eof)
+        pthread_cond_wait(&ra->cond, &ra->mutex);
+    if (ra->tail == ra->head) {
+        /* report the end once, later reads try the protocol again in
+         * case the resource grew */
+        len = ra->error;
+        ra->eof = ra->error = 0;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->mutex);
+        return len;
+    }
+    pos = ra->tail % ra->size;
+    len = FFMIN(size, ra->head - ra->tail);
+    len = FFMIN(len, ra->size - pos);
+    pthread_mutex_unlock(&ra->mutex);
+
+    /* the thread never writes between tail and head */
+    memcpy(buf, ra->ring + pos, len);
+
+    pthread_mutex_lock(&ra->mutex);
+    ra->tail += len;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    return len;
+}
+
+/** Wait for the thread to leave the protocol alone. */
+static void read_ahead_suspend(ReadAhead *ra)
+{
+    pthread_mutex_lock(&ra->mutex);
+    ra->suspended = 1;
+    while (ra->reading)
+        pthread_cond_wait(&ra->cond, &ra->mutex);
+    pthread_mutex_unlock(&ra->mutex);
+}
+
+/**
+ * Let the thread continue reading ahead.
+ * @param pos new position of the protocol, which drops the ring,
+ *            or a negative value if the position did not change
+ */
+static void read_ahead_resume(ReadAhead *ra, int64_t pos)
+{
+    pthread_mutex_lock(&ra->mutex);
+    if (pos >= 0) {
+        ra->base = ra->tail = ra->head = pos;
+        ra->eof  = ra->error = 0;
+    }
+    ra->suspended = 0;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+}
+
+static void read_ahead_stop(ByteIOContext *s, int restore_pos)
+{
+    ReadAhead *ra = s->read_ahead;
+
+    if (!ra)
+        return;
+    pthread_mutex_lock(&ra->mutex);
+    ra->die = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    pthread_join(ra->thread, NULL);
+    s->read_ahead = NULL;
+
+    /* move the protocol back to the position of the caller */
+    if (restore_pos && ra->head != ra->tail && s->seek)
+        s->seek(s->opaque, ra->tail, SEEK_SET);
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    av_free(ra->ring);
+    av_free(ra);
+}
+#endif /* HAVE_PTHREADS */
+
+static int io_read_packet(ByteIOContext *s, uint8_t *buf, int size)
+{
+#if HAVE_PTHREADS
+    if (s->read_ahead)
+        return read_ahead_read(s->read_ahead, buf, size);
+#endif
+    return s->read_packet(s->opaque, buf, size);
+}
+
+static int64_t io_seek(ByteIOContext *s, int64_t offset, int whence)
+{
+#if HAVE_PTHREADS
+    ReadAhead *ra = s->read_ahead;
+
+    if (ra) {
+        int64_t res;
+
+        pthread_mutex_lock(&ra->mutex);
+        if (whence == SEEK_CUR) {
+            offset += ra->tail;
+            whence  = SEEK_SET;
+        }
+        if (whence == SEEK_SET && offset >= ra->base && offset <= ra->head) {
+            ra->tail = offset;
+            pthread_cond_broadcast(&ra->cond);
+            pthread_mutex_unlock(&ra->mutex);
+            return offset;
+        }
+        pthread_mutex_unlock(&ra->mutex);
+
+        read_ahead_suspend(ra);
+        res = s->seek(s->opaque, offset, whence);
+        read_ahead_resume(ra, whence == AVSEEK_SIZE ? -1 : res);
+        return res;
+    }
+#endif
+    return s->seek(s->opaque, offset, whence);
+}
+
 int init_put_byte(ByteIOContext *s,
                   unsigned char *buffer,
                   int buffer_size,
@@ -70,6 +255,10 @@ int init_put_byte(ByteIOContext *s,
     }
     s->read_pause = NULL;
     s->read_seek  = NULL;
+    s->read_ahead = NULL;
+    s->read_map   = NULL;
+    s->map        = NULL;
+    s->map_packet = NULL;
     return 0;
 }
 
@@ -180,7 +369,7 @@ int64_t url_fseek(ByteIOContext *s, int64_t offset, int whence)
 #endif /* CONFIG_MUXERS || CONFIG_NETWORK */
         if (!s->seek)
             return AVERROR(EPIPE);
-        if ((res = s->seek(s->opaque, offset, SEEK_SET)) < 0)
+        if ((res = io_seek(s, offset, SEEK_SET)) < 0)
             return res;
         if (!s->write_flag)
             s->buf_end = s->buffer;
@@ -211,12 +400,12 @@ int64_t url_fsize(ByteIOContext *s)
 
     if (!s->seek)
         return AVERROR(ENOSYS);
-    size = s->seek(s->opaque, 0, AVSEEK_SIZE);
+    size = io_seek(s, 0, AVSEEK_SIZE);
     if(size<0){
-        if ((size = s->seek(s->opaque, -1, SEEK_END)) < 0)
+        if ((size = io_seek(s, -1, SEEK_END)) < 0)
             return size;
         size++;
-        s->seek(s->opaque, s->pos, SEEK_SET);
+        io_seek(s, s->pos, SEEK_SET);
     }
     return size;
 }
@@ -322,9 +511,35 @@ void put_tag(ByteIOContext *s, const char *tag)
 
 /* Input stream */
 
+/**
+ * Point the buffer to the next part of the mapped input.
+ */
+static void fill_map_buffer(ByteIOContext *s)
+{
+    AVPacket window;
+    int len;
+
+    if(s->update_checksum && s->buf_end > s->checksum_ptr)
+        s->checksum= s->update_checksum(s->checksum, s->checksum_ptr, s->buf_end - s->checksum_ptr);
+
+    len = s->read_map(s->opaque, &window, INT_MAX);
+    if (len <= 0) {
+        s->eof_reached = 1;
+        if(len<0)
+            s->error= len;
+        return;
+    }
+    av_free_packet(s->map);
+    *s->map = window;
+    s->buffer = s->buf_ptr = s->checksum_ptr = window.data;
+    s->buf_end = window.data + len;
+    s->buffer_size = len;
+    s->pos += len;
+}
+
 static void fill_buffer(ByteIOContext *s)
 {
-    uint8_t *dst= !s->max_packet_size && s->buf_end - s->buffer < s->buffer_size ? s->buf_ptr : s->buffer;
+    uint8_t *dst= !s->max_packet_size && s->buf_end - s->buffer < s->buffer_size ? s->buf_end : s->buffer;
     int len= s->buffer_size - (dst - s->buffer);
     int max_buffer_size = s->max_packet_size ? s->max_packet_size : IO_BUFFER_SIZE;
 
@@ -332,6 +547,11 @@ static void fill_buffer(ByteIOContext *s)
     if (s->eof_reached)
         return;
 
+    if (s->map) {
+        fill_map_buffer(s);
+        return;
+    }
+
     if(s->update_checksum && dst == s->buffer){
         if(s->buf_end > s->checksum_ptr)
             s->checksum= s->update_checksum(s->checksum, s->checksum_ptr, s->buf_end - s->checksum_ptr);
@@ -347,7 +567,7 @@ static void fill_buffer(ByteIOContext *s)
     }
 
     if(s->read_packet)
-        len = s->read_packet(s->opaque, dst, len);
+        len = io_read_packet(s, dst, len);
     else
         len = 0;
     if (len <= 0) {
@@ -424,9 +644,9 @@ int get_buffer(ByteIOContext *s, unsigned char *buf, int size)
         if (len > size)
             len = size;
         if (len == 0) {
-            if(size > s->buffer_size && !s->update_checksum){
+            if(size > s->buffer_size && !s->update_checksum && !s->map){
                 if(s->read_packet)
-                    len = s->read_packet(s->opaque, buf, size);
+                    len = io_read_packet(s, buf, size);
                 if (len <= 0) {
                     /* do not modify buffer if EOF reached so that a seek back can
                     be done without rereading data */
@@ -461,6 +681,18 @@ int get_buffer(ByteIOContext *s, unsigned char *buf, int size)
     return size1 - size;
 }
 
+int ff_get_buffer_indirect(ByteIOContext *s, unsigned char *buf, int size,
+                           const unsigned char **data)
+{
+    if (s->buf_end - s->buf_ptr >= size && !s->write_flag) {
+        *data = s->buf_ptr;
+        s->buf_ptr += size;
+        return size;
+    }
+    *data = buf;
+    return get_buffer(s, buf, size);
+}
+
 int get_partial_buffer(ByteIOContext *s, unsigned char *buf, int size)
 {
     int len;
@@ -618,6 +850,19 @@ int url_fdopen(ByteIOContext **s, URLContext *h)
     }
     (*s)->is_streamed = h->is_streamed;
     (*s)->max_packet_size = max_packet_size;
+    if (h->prot->url_read_map && !(*s)->write_flag) {
+        /* the buffer will point into the mapped data */
+        if (!((*s)->map = av_mallocz(sizeof(AVPacket)))) {
+            av_free(buffer);
+            av_freep(s);
+            return AVERROR(ENOMEM);
+        }
+        (*s)->read_map = (int (*)(void *, AVPacket *, int))h->prot->url_read_map;
+        (*s)->map_packet = (int (*)(void *, AVPacket *, int64_t, int))h->prot->url_map_packet;
+        av_free(buffer);
+        (*s)->buffer = (*s)->buf_ptr = (*s)->buf_end = NULL;
+        (*s)->buffer_size = 0;
+    }
     if(h->prot) {
         (*s)->read_pause = (int (*)(void *, int))h->prot->url_read_pause;
         (*s)->read_seek  = (int64_t (*)(void *, int, int64_t, int))h->prot->url_read_seek;
@@ -625,9 +870,50 @@ int url_fdopen(ByteIOContext **s, URLContext *h)
     return 0;
 }
 
+int url_set_read_ahead(ByteIOContext *s, int ring_size)
+{
+#if HAVE_PTHREADS
+    ReadAhead *ra;
+
+    read_ahead_stop(s, 1);
+    if (!ring_size)
+        return 0;
+    if (s->write_flag || s->max_packet_size || !s->read_packet || s->map || ring_size < 0)
+        return AVERROR(EINVAL);
+
+    ra = av_mallocz(sizeof(ReadAhead));
+    if (!ra)
+        return AVERROR(ENOMEM);
+    ra->size = FFMAX(ring_size, 2 * IO_BUFFER_SIZE);
+    ra->ring = av_malloc(ra->size);
+    if (!ra->ring) {
+        av_free(ra);
+        return AVERROR(ENOMEM);
+    }
+    ra->base = ra->tail = ra->head = s->pos;
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    s->read_ahead = ra;
+    if (pthread_create(&ra->thread, NULL, read_ahead_thread, s)) {
+        s->read_ahead = NULL;
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->mutex);
+        av_free(ra->ring);
+        av_free(ra);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+#else
+    return ring_size ? AVERROR(ENOSYS) : 0;
+#endif
+}
+
 int url_setbufsize(ByteIOContext *s, int buf_size)
 {
     uint8_t *buffer;
+    if (s->map)
+        return 0;
     buffer = av_malloc(buf_size);
     if (!buffer)
         return AVERROR(ENOMEM);
@@ -672,6 +958,14 @@ int ff_rewind_with_probe_data(ByteIOContext *s, unsigned char *buf, int buf_size
     if (s->write_flag)
         return AVERROR(EINVAL);
 
+    if (s->map) {
+        /* mapped input can go back without keeping the probe data */
+        if (url_fseek(s, 0, SEEK_SET) < 0)
+            return AVERROR(EINVAL);
+        av_free(buf);
+        return 0;
+    }
+
     buffer_size = s->buf_end - s->buffer;
 
     /* the buffers must touch or overlap */
@@ -722,7 +1016,14 @@ int url_fclose(ByteIOContext *s)
 {
     URLContext *h = s->opaque;
 
-    av_free(s->buffer);
+#if HAVE_PTHREADS
+    read_ahead_stop(s, 0);
+#endif
+    if (s->map) {
+        av_free_packet(s->map);
+        av_free(s->map);
+    } else
+        av_free(s->buffer);
     av_free(s);
     return url_close(h);
 }
@@ -787,6 +1088,10 @@ int64_t av_url_read_fseek(ByteIOContext *s, int stream_index,
     int64_t ret;
     if (!s->read_seek)
         return AVERROR(ENOSYS);
+#if HAVE_PTHREADS
+    if (s->read_ahead)
+        read_ahead_suspend(s->read_ahead);
+#endif
     ret = s->read_seek(h, stream_index, timestamp, flags);
     if(ret >= 0) {
         int64_t pos;
@@ -797,6 +1102,10 @@ int64_t av_url_read_fseek(ByteIOContext *s, int stream_index,
         else if (pos != AVERROR(ENOSYS))
             ret = pos;
     }
+#if HAVE_PTHREADS
+    if (s->read_ahead)
+        read_ahead_resume(s->read_ahead, ret >= 0 ? s->pos : -1);
+#endif
     return ret;
 }
 
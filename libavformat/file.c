@@ -106,6 +106,239 @@ URLProtocol file_protocol = {
 
 #endif /* CONFIG_FILE_PROTOCOL */
 
+#if CONFIG_MMAP_PROTOCOL
+#include <sys/mman.h>
+
+/* memory mapped file protocol
+ *
+ * Only meant for files that do not change while they are read: accessing
+ * a mapped page past the end of a file that was truncated meanwhile raises
+ * SIGBUS. Each new mapping checks that the file did not shrink, which
+ * narrows but does not close that window. Use the file protocol for files
+ * that can grow or shrink. */
+
+/** largest part of the file mapped at once */
+#define MMAP_WINDOW_SIZE (64 << 20)
+
+/** smaller packets are cheaper to copy than to map on their own */
+#define MMAP_PACKET_MIN_SIZE (16 << 10)
+
+typedef struct MmapContext {
+    int fd;
+    int64_t size;       ///< file size, fixed when the file is opened
+    int64_t pos;
+    AVPacket window;    ///< current mapping, shared with the packets read from it
+    int64_t window_pos; ///< file position of the start of the mapping
+} MmapContext;
+
+/** mapping of a single packet, kept in AVPacket.priv */
+typedef struct MmapPacket {
+    void *base;
+    size_t size;
+} MmapPacket;
+
+static void mmap_destruct_window(AVPacket *pkt)
+{
+    munmap(pkt->data, pkt->size);
+    pkt->data = NULL; pkt->size = 0;
+}
+
+static void mmap_destruct_packet(AVPacket *pkt)
+{
+    MmapPacket *m = pkt->priv;
+
+    munmap(m->base, m->size);
+    av_freep(&pkt->priv);
+    pkt->data = NULL; pkt->size = 0;
+}
+
+static int mmap_check_size(MmapContext *c)
+{
+    struct stat st;
+
+    if (fstat(c->fd, &st) < 0)
+        return AVERROR(errno);
+    if (st.st_size < c->size) {
+        av_log(NULL, AV_LOG_ERROR, "mmap: file was truncated while reading\n");
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+static int mmap_window(MmapContext *c)
+{
+    int64_t pos = c->pos & ~(int64_t)(sysconf(_SC_PAGESIZE) - 1);
+    int size = FFMIN(MMAP_WINDOW_SIZE, c->size - pos);
+    int ret;
+    void *data;
+
+    if ((ret = mmap_check_size(c)) < 0)
+        return ret;
+    /* the window is only read from, packets get mappings of their own */
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, c->fd, pos);
+
+    if (data == MAP_FAILED)
+        return AVERROR(errno);
+    av_free_packet(&c->window);
+    av_init_packet(&c->window);
+    c->window.data     = data;
+    c->window.size     = size;
+    c->window.destruct = mmap_destruct_window;
+    c->window_pos      = pos;
+    return 0;
+}
+
+static int mmap_read_map(URLContext *h, AVPacket *pkt, int size)
+{
+    MmapContext *c = h->priv_data;
+    int64_t end = c->window_pos + c->window.size;
+    int ret, len;
+
+    if (c->pos >= c->size)
+        return 0;
+    /* keep FF_INPUT_BUFFER_PADDING_SIZE mapped bytes after every packet */
+    if (!c->window.data || c->pos < c->window_pos ||
+        (c->pos + FF_INPUT_BUFFER_PADDING_SIZE >= end && end < c->size)) {
+        if ((ret = mmap_window(c)) < 0)
+            return ret;
+        end = c->window_pos + c->window.size;
+    }
+
+    if (c->pos + FF_INPUT_BUFFER_PADDING_SIZE >= end) {
+        /* the end of the file has nothing mapped after it, copy it into
+         * a packet with zeroed padding */
+        len = FFMIN(size, end - c->pos);
+        if ((ret = av_new_packet(pkt, len)) < 0)
+            return ret;
+        memcpy(pkt->data, c->window.data + (c->pos - c->window_pos), len);
+    } else {
+        if ((ret = av_packet_ref(pkt, &c->window)) < 0)
+            return ret;
+        len = FFMIN(size, end - FF_INPUT_BUFFER_PADDING_SIZE - c->pos);
+        pkt->data += c->pos - c->window_pos;
+        pkt->size  = len;
+    }
+    c->pos += len;
+    return len;
+}
+
+static int mmap_map_packet(URLContext *h, AVPacket *pkt, int64_t pos, int size)
+{
+    MmapContext *c = h->priv_data;
+    int64_t start = pos & ~(int64_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t map_size = pos - start + size + FF_INPUT_BUFFER_PADDING_SIZE;
+    MmapPacket *m;
+    uint8_t *data;
+    int ret;
+
+    /* the padding must not reach past the end of the file */
+    if (size < MMAP_PACKET_MIN_SIZE ||
+        pos + size + FF_INPUT_BUFFER_PADDING_SIZE > c->size)
+        return AVERROR(ENOSYS);
+    if ((ret = mmap_check_size(c)) < 0)
+        return ret;
+    if (!(m = av_malloc(sizeof(MmapPacket))))
+        return AVERROR(ENOMEM);
+    /* a private writable mapping lets the user modify the packet in place
+     * without touching the file or other packets */
+    data = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, c->fd, start);
+    if (data == MAP_FAILED) {
+        ret = AVERROR(errno);
+        av_free(m);
+        return ret;
+    }
+    /* only the page holding the padding is copied */
+    memset(data + map_size - FF_INPUT_BUFFER_PADDING_SIZE, 0,
+           FF_INPUT_BUFFER_PADDING_SIZE);
+    m->base = data;
+    m->size = map_size;
+
+    av_init_packet(pkt);
+    pkt->data     = data + (pos - start);
+    pkt->size     = size;
+    pkt->priv     = m;
+    pkt->destruct = mmap_destruct_packet;
+    return size;
+}
+
+static int mmap_read(URLContext *h, unsigned char *buf, int size)
+{
+    AVPacket pkt;
+    int len = mmap_read_map(h, &pkt, size);
+
+    if (len > 0) {
+        memcpy(buf, pkt.data, len);
+        av_free_packet(&pkt);
+    }
+    return len;
+}
+
+static int mmap_open(URLContext *h, const char *filename, int flags)
+{
+    MmapContext *c = h->priv_data;
+    struct stat st;
+
+    av_strstart(filename, "mmap:", &filename);
+
+    if (flags & (URL_WRONLY | URL_RDWR))
+        return AVERROR(EINVAL);
+    c->fd = open(filename, O_RDONLY);
+    if (c->fd == -1)
+        return AVERROR(errno);
+    if (fstat(c->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(c->fd);
+        return AVERROR(EINVAL);
+    }
+    c->size = st.st_size;
+    return 0;
+}
+
+static int64_t mmap_seek(URLContext *h, int64_t pos, int whence)
+{
+    MmapContext *c = h->priv_data;
+
+    switch (whence) {
+    case AVSEEK_SIZE: return c->size;
+    case SEEK_CUR:    pos += c->pos;  break;
+    case SEEK_END:    pos += c->size; break;
+    case SEEK_SET:                    break;
+    default:          return AVERROR(EINVAL);
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+    return c->pos = pos;
+}
+
+static int mmap_get_handle(URLContext *h)
+{
+    MmapContext *c = h->priv_data;
+    return c->fd;
+}
+
+static int mmap_close(URLContext *h)
+{
+    MmapContext *c = h->priv_data;
+
+    /* packets still referencing the mapping keep it alive */
+    av_free_packet(&c->window);
+    return close(c->fd);
+}
+
+URLProtocol mmap_protocol = {
+    "mmap",
+    mmap_open,
+    mmap_read,
+    NULL,
+    mmap_seek,
+    mmap_close,
+    .url_get_file_handle = mmap_get_handle,
+    .priv_data_size      = sizeof(MmapContext),
+    .url_read_map        = mmap_read_map,
+    .url_map_packet      = mmap_map_packet,
+};
+
+#endif /* CONFIG_MMAP_PROTOCOL */
+
 #if CONFIG_PIPE_PROTOCOL
 
 static int pipe_open(URLContext *h, const char *filename, int flags)
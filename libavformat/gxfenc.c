@@ -23,6 +23,7 @@
 #include "gxf.h"
 #include "riff.h"
 #include "audiointerleave.h"
+#include "internal.h"
 
 #define GXF_AUDIO_PACKET_SIZE 65536
 
@@ -918,7 +919,7 @@ static int gxf_interleave_packet(AVFormatContext *s, AVPacket *out, AVPacket *pk
     if (pkt && s->streams[pkt->stream_index]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
         pkt->duration = 2; // enforce 2 fields
     return ff_audio_rechunk_interleave(s, out, pkt, flush,
-                               av_interleave_packet_per_dts, gxf_compare_field_nb);
+                               ff_interleave_get_list_packet, gxf_compare_field_nb);
 }
 
 AVOutputFormat gxf_muxer = {
@@ -38,6 +38,26 @@
 #define URL_SIZE    4096
 #define MAX_REDIRECTS 8
 
+/* Once seeking starts, data is requested in ranges on a persistent
+ * connection. The range size starts small, since seeks tend to come in
+ * bursts while headers and indexes are read, and grows while the data
+ * is read sequentially. */
+#define MIN_RANGE_SIZE   (64 * 1024)
+#define MAX_RANGE_SIZE   (4 * 1024 * 1024)
+/** data read and thrown away rather than opening a new connection */
+#define MAX_SKIP_SIZE    (64 * 1024)
+
+#define CACHE_BLOCK_SIZE (64 * 1024)
+#define CACHE_BLOCKS     16
+
+/** recently read data, kept for the next seeks */
+typedef struct {
+    int64_t pos;            ///< position of data[0], multiple of CACHE_BLOCK_SIZE
+    int start, end;         ///< valid part of data
+    unsigned last_use;
+    uint8_t *data;          ///< NULL if the block is unused
+} HTTPCacheBlock;
+
 typedef struct {
     const AVClass *class;
     URLContext *hd;
@@ -49,6 +69,17 @@ typedef struct {
     char location[URL_SIZE];
     HTTPAuthState auth_state;
     unsigned char headers[BUFFER_SIZE];
+    char path[URL_SIZE], hoststr[1024], auth[1024];
+    int64_t req_end;        ///< last byte of the next connection's range, -1 for all
+    int64_t hd_off;         ///< position of the next byte of the current response
+    int64_t hd_end;         ///< end of the current response, -1 if unknown
+    int64_t next_off;       ///< start of a pipelined request's range, -1 if none
+    int64_t next_end;
+    int range_size;
+    int keep_alive;         ///< the connection outlives the current response
+    int no_keep_alive;      ///< the server refused a persistent connection
+    HTTPCacheBlock cache[CACHE_BLOCKS];
+    unsigned cache_clock;
 } HTTPContext;
 
 #define OFFSET(x) offsetof(HTTPContext, x)
@@ -60,8 +91,7 @@ static const AVClass httpcontext_class = {
     "HTTP", av_default_item_name, options, LIBAVUTIL_VERSION_INT
 };
 
-static int http_connect(URLContext *h, const char *path, const char *hoststr,
-                        const char *auth, int *new_location);
+static int http_connect(URLContext *h, int *new_location);
 
 void ff_http_set_headers(URLContext *h, const char *headers)
 {
@@ -128,8 +158,12 @@ static int http_open_cnx(URLContext *h)
         goto fail;
 
     s->hd = hd;
+    /* kept for further requests on the same connection */
+    av_strlcpy(s->path,    path,    sizeof(s->path));
+    av_strlcpy(s->hoststr, hoststr, sizeof(s->hoststr));
+    av_strlcpy(s->auth,    auth,    sizeof(s->auth));
     cur_auth_type = s->auth_state.auth_type;
-    if (http_connect(h, path, hoststr, auth, &location_changed) < 0)
+    if (http_connect(h, &location_changed) < 0)
         goto fail;
     if (s->http_code == 401) {
         if (cur_auth_type == HTTP_AUTH_NONE && s->auth_state.auth_type != HTTP_AUTH_NONE) {
@@ -161,6 +195,9 @@ static int http_open(URLContext *h, const char *uri, int flags)
     h->is_streamed = 1;
 
     s->filesize = -1;
+    s->req_end  = -1;
+    s->next_off = -1;
+    s->range_size = MIN_RANGE_SIZE;
     av_strlcpy(s->location, uri, URL_SIZE);
 
     return http_open_cnx(h);
@@ -223,6 +260,7 @@ static int process_line(URLContext *h, char *line, int line_count,
         while (isspace(*p))
             p++;
         s->http_code = strtol(p, &end, 10);
+        s->keep_alive = av_strstart(line, "HTTP/1.1", NULL);
 
         dprintf(NULL, "http_code=%d\n", s->http_code);
 
@@ -248,14 +286,19 @@ static int process_line(URLContext *h, char *line, int line_count,
         if (!strcmp(tag, "Location")) {
             strcpy(s->location, p);
             *new_location = 1;
-        } else if (!strcmp (tag, "Content-Length") && s->filesize == -1) {
-            s->filesize = atoll(p);
+        } else if (!strcmp (tag, "Content-Length")) {
+            if (s->filesize == -1)
+                s->filesize = atoll(p);
+            if (s->hd_end == -1)
+                s->hd_end = s->hd_off + atoll(p);
         } else if (!strcmp (tag, "Content-Range")) {
             /* "bytes $from-$to/$document_size" */
-            const char *slash;
+            const char *slash, *dash;
             if (!strncmp (p, "bytes ", 6)) {
                 p += 6;
-                s->off = atoll(p);
+                s->hd_off = atoll(p);
+                if ((dash = strchr(p, '-')))
+                    s->hd_end = atoll(dash + 1) + 1;
                 if ((slash = strchr(p, '/')) && strlen(slash) > 0)
                     s->filesize = atoll(slash+1);
             }
@@ -263,6 +306,13 @@ static int process_line(URLContext *h, char *line, int line_count,
         } else if (!strcmp (tag, "Transfer-Encoding") && !strncasecmp(p, "chunked", 7)) {
             s->filesize = -1;
             s->chunksize = 0;
+            s->hd_end = -1;
+            s->keep_alive = 0;
+        } else if (!strcmp (tag, "Connection")) {
+            if (!strncasecmp(p, "close", 5))
+                s->keep_alive = 0;
+            else if (!strncasecmp(p, "keep-alive", 10))
+                s->keep_alive = 1;
         } else if (!strcmp (tag, "WWW-Authenticate")) {
             ff_http_auth_handle_header(&s->auth_state, tag, p);
         } else if (!strcmp (tag, "Authentication-Info")) {
@@ -278,21 +328,23 @@ static inline int has_header(const char *str, const char *header)
     return av_stristart(str, header + 2, NULL) || av_stristr(str, header);
 }
 
-static int http_connect(URLContext *h, const char *path, const char *hoststr,
-                        const char *auth, int *new_location)
+/**
+ * Send a request for the data from off to end (inclusive, -1 for the rest
+ * of the resource) on the current connection.
+ */
+static int http_send_request(URLContext *h, int64_t off, int64_t end)
 {
     HTTPContext *s = h->priv_data;
-    int post, err;
-    char line[1024];
+    int post;
+    char request[URL_SIZE + 2048];
     char headers[1024] = "";
     char *authstr = NULL;
-    int64_t off = s->off;
     int len = 0;
 
 
     /* send http header */
     post = h->flags & URL_WRONLY;
-    authstr = ff_http_auth_create_response(&s->auth_state, auth, path,
+    authstr = ff_http_auth_create_response(&s->auth_state, s->auth, s->path,
                                         post ? "POST" : "GET");
 
     /* set default headers if needed */
@@ -302,49 +354,57 @@ static int http_connect(URLContext *h, const char *path, const char *hoststr,
     if (!has_header(s->headers, "\r\nAccept: "))
         len += av_strlcpy(headers + len, "Accept: */*\r\n",
                           sizeof(headers) - len);
-    if (!has_header(s->headers, "\r\nRange: "))
+    if (!has_header(s->headers, "\r\nRange: ")) {
         len += av_strlcatf(headers + len, sizeof(headers) - len,
-                           "Range: bytes=%"PRId64"-\r\n", s->off);
+                           "Range: bytes=%"PRId64"-", off);
+        if (end >= 0)
+            len += av_strlcatf(headers + len, sizeof(headers) - len,
+                               "%"PRId64, end);
+        len += av_strlcpy(headers + len, "\r\n", sizeof(headers) - len);
+    }
+    /* only bounded ranges leave the connection usable for more requests */
     if (!has_header(s->headers, "\r\nConnection: "))
-        len += av_strlcpy(headers + len, "Connection: close\r\n",
-                          sizeof(headers)-len);
+        len += av_strlcatf(headers + len, sizeof(headers) - len,
+                           "Connection: %s\r\n", end >= 0 ? "keep-alive" : "close");
     if (!has_header(s->headers, "\r\nHost: "))
         len += av_strlcatf(headers + len, sizeof(headers) - len,
-                           "Host: %s\r\n", hoststr);
+                           "Host: %s\r\n", s->hoststr);
 
     /* now add in custom headers */
     av_strlcpy(headers+len, s->headers, sizeof(headers)-len);
 
-    snprintf(s->buffer, sizeof(s->buffer),
+    snprintf(request, sizeof(request),
              "%s %s HTTP/1.1\r\n"
              "%s"
              "%s"
              "%s"
              "\r\n",
              post ? "POST" : "GET",
-             path,
+             s->path,
              post && s->chunksize >= 0 ? "Transfer-Encoding: chunked\r\n" : "",
              headers,
              authstr ? authstr : "");
 
     av_freep(&authstr);
-    if (url_write(s->hd, s->buffer, strlen(s->buffer)) < 0)
+    if (url_write(s->hd, request, strlen(request)) < 0)
         return AVERROR(EIO);
+    return 0;
+}
+
+/**
+ * Read the header of the next response on the connection.
+ * @return 0 if the response contains the data from off on, <0 otherwise
+ */
+static int http_read_header(URLContext *h, int64_t off, int *new_location)
+{
+    HTTPContext *s = h->priv_data;
+    char line[1024];
+    int err;
 
-    /* init input buffer */
-    s->buf_ptr = s->buffer;
-    s->buf_end = s->buffer;
     s->line_count = 0;
-    s->off = 0;
-    s->filesize = -1;
-    if (post) {
-        /* Pretend that it did work. We didn't read any header yet, since
-         * we've still to send the POST data, but the code calling this
-         * function will check http_code after we return. */
-        s->http_code = 200;
-        return 0;
-    }
     s->chunksize = -1;
+    s->hd_off = 0;
+    s->hd_end = -1;
 
     /* wait for header */
     for(;;) {
@@ -361,9 +421,229 @@ static int http_connect(URLContext *h, const char *path, const char *hoststr,
         s->line_count++;
     }
 
-    return (off == s->off) ? 0 : -1;
+    return (off == s->hd_off) ? 0 : -1;
+}
+
+static int http_connect(URLContext *h, int *new_location)
+{
+    HTTPContext *s = h->priv_data;
+    int ret;
+
+    if ((ret = http_send_request(h, s->off, s->req_end)) < 0)
+        return ret;
+
+    /* init input buffer */
+    s->buf_ptr = s->buffer;
+    s->buf_end = s->buffer;
+    s->line_count = 0;
+    s->filesize = -1;
+    s->next_off = -1;
+    if (h->flags & URL_WRONLY) {
+        /* Pretend that it did work. We didn't read any header yet, since
+         * we've still to send the POST data, but the code calling this
+         * function will check http_code after we return. */
+        s->http_code = 200;
+        return 0;
+    }
+
+    ret = http_read_header(h, s->off, new_location);
+    if (s->req_end >= 0 && !s->keep_alive)
+        s->no_keep_alive = 1;
+    return ret;
 }
 
+/** Return the cache block containing pos, replacing the oldest if create is set. */
+static HTTPCacheBlock *cache_find(HTTPContext *s, int64_t pos, int create)
+{
+    int64_t block_pos = pos - pos % CACHE_BLOCK_SIZE;
+    HTTPCacheBlock *b, *lru = NULL;
+    int i;
+
+    for (i = 0; i < CACHE_BLOCKS; i++) {
+        b = &s->cache[i];
+        if (b->data && b->pos == block_pos)
+            return b;
+        if (!lru || b->last_use < lru->last_use)
+            lru = b;
+    }
+    if (!create)
+        return NULL;
+    if (!lru->data && !(lru->data = av_malloc(CACHE_BLOCK_SIZE)))
+        return NULL;
+    lru->pos   = block_pos;
+    lru->start = lru->end = 0;
+    return lru;
+}
+
+static int cache_read(HTTPContext *s, uint8_t *buf, int size)
+{
+    HTTPCacheBlock *b = cache_find(s, s->off, 0);
+    int pos;
+
+    if (!b)
+        return 0;
+    pos = s->off - b->pos;
+    if (pos < b->start || pos >= b->end)
+        return 0;
+    size = FFMIN(size, b->end - pos);
+    memcpy(buf, b->data + pos, size);
+    b->last_use = ++s->cache_clock;
+    return size;
+}
+
+static void cache_write(HTTPContext *s, const uint8_t *buf, int size, int64_t pos)
+{
+    while (size > 0) {
+        HTTPCacheBlock *b = cache_find(s, pos, 1);
+        int off, len;
+
+        if (!b)
+            return;
+        off = pos - b->pos;
+        len = FFMIN(size, CACHE_BLOCK_SIZE - off);
+        /* a block only holds one contiguous part */
+        if (off < b->start || off > b->end)
+            b->start = b->end = off;
+        memcpy(b->data + off, buf, len);
+        b->end = FFMAX(b->end, off + len);
+        b->last_use = ++s->cache_clock;
+        buf  += len;
+        pos  += len;
+        size -= len;
+    }
+}
+
+/** Read from the current response, at most up to its end. */
+static int http_read_data(URLContext *h, uint8_t *buf, int size)
+{
+    HTTPContext *s = h->priv_data;
+    int len;
+
+    if (s->hd_end >= 0 && !h->is_streamed)
+        size = FFMIN(size, s->hd_end - s->hd_off);
+    /* read bytes from input buffer first */
+    len = s->buf_end - s->buf_ptr;
+    if (len > 0) {
+        if (len > size)
+            len = size;
+        memcpy(buf, s->buf_ptr, len);
+        s->buf_ptr += len;
+    } else {
+        len = url_read(s->hd, buf, size);
+    }
+    if (len > 0) {
+        if (!h->is_streamed)
+            cache_write(s, buf, len, s->hd_off);
+        s->hd_off += len;
+    }
+    return len;
+}
+
+/** Read and drop size bytes of the current response. */
+static int http_skip(URLContext *h, int64_t size)
+{
+    uint8_t buf[4096];
+    int len;
+
+    while (size > 0) {
+        len = http_read_data(h, buf, FFMIN(size, sizeof(buf)));
+        if (len <= 0)
+            return len < 0 ? len : AVERROR(EIO);
+        size -= len;
+    }
+    return 0;
+}
+
+/** Send the request for the range following the current response. */
+static int http_pipeline_request(URLContext *h)
+{
+    HTTPContext *s = h->priv_data;
+
+    if (!s->keep_alive || s->hd_end < 0 || s->hd_end >= s->filesize)
+        return 0;
+    s->next_off = s->hd_end;
+    s->next_end = FFMIN(s->hd_end + s->range_size, s->filesize);
+    return http_send_request(h, s->next_off, s->next_end - 1);
+}
+
+/**
+ * Make the connection deliver data from s->off on. The current
+ * connection is reused if it only takes reading a little data.
+ */
+static int http_reposition(URLContext *h)
+{
+    HTTPContext *s = h->priv_data, old;
+    int64_t off = s->off, left, pending = 0, end;
+    int sequential = off == s->hd_end;
+    int ret, new_location = 0;
+
+    if (s->filesize >= 0 && off >= s->filesize)
+        return 0;
+    s->range_size = sequential ? FFMIN(2 * s->range_size, MAX_RANGE_SIZE)
+                               : MIN_RANGE_SIZE;
+
+    if (s->hd && s->keep_alive && s->hd_end >= 0) {
+        left = s->hd_end - s->hd_off;
+        if (s->next_off >= 0)
+            pending = s->next_end - s->next_off;
+        /* forward inside the current response */
+        if (off >= s->hd_off && off < s->hd_end &&
+            off - s->hd_off <= MAX_SKIP_SIZE)
+            return http_skip(h, off - s->hd_off);
+        /* forward inside the pipelined response */
+        if (s->next_off >= 0 && off >= s->next_off && off < s->next_end &&
+            left + off - s->next_off <= MAX_SKIP_SIZE) {
+            if ((ret = http_skip(h, left)) < 0)
+                goto reconnect;
+            s->next_off = -1;
+            if (http_read_header(h, s->hd_off, &new_location) < 0)
+                goto reconnect;
+            if (sequential && (ret = http_pipeline_request(h)) < 0)
+                goto reconnect;
+            return http_skip(h, off - s->hd_off);
+        }
+        /* finish the outstanding responses and ask for the new range */
+        if (left + pending <= MAX_SKIP_SIZE) {
+            if (http_skip(h, left) < 0)
+                goto reconnect;
+            if (s->next_off >= 0) {
+                s->next_off = -1;
+                if (http_read_header(h, s->hd_off, &new_location) < 0 ||
+                    http_skip(h, s->hd_end - s->hd_off) < 0)
+                    goto reconnect;
+            }
+            end = off + s->range_size;
+            if (s->filesize >= 0)
+                end = FFMIN(end, s->filesize);
+            if (s->keep_alive &&
+                http_send_request(h, off, end - 1) >= 0 &&
+                http_read_header(h, off, &new_location) >= 0) {
+                if (sequential)
+                    http_pipeline_request(h);
+                return 0;
+            }
+        }
+    }
+
+reconnect:
+    /* keep the old connection until the new one delivers the range */
+    old = *s;
+    s->hd = NULL;
+    s->req_end = -1;
+    if (!s->no_keep_alive) {
+        s->req_end = off + s->range_size - 1;
+        if (s->filesize >= 0)
+            s->req_end = FFMIN(s->req_end, s->filesize - 1);
+    }
+    if ((ret = http_open_cnx(h)) < 0) {
+        /* buf_ptr and buf_end still point into s->buffer */
+        *s = old;
+        return ret;
+    }
+    if (old.hd)
+        url_close(old.hd);
+    return 0;
+}
 
 static int http_read(URLContext *h, uint8_t *buf, int size)
 {
@@ -391,16 +671,23 @@ static int http_read(URLContext *h, uint8_t *buf, int size)
         }
         size = FFMIN(size, s->chunksize);
     }
-    /* read bytes from input buffer first */
-    len = s->buf_end - s->buf_ptr;
-    if (len > 0) {
-        if (len > size)
-            len = size;
-        memcpy(buf, s->buf_ptr, len);
-        s->buf_ptr += len;
-    } else {
-        len = url_read(s->hd, buf, size);
+
+    if (!h->is_streamed) {
+        /* seeks only move s->off, serve them from the cache if possible */
+        if ((len = cache_read(s, buf, size)) > 0) {
+            s->off += len;
+            return len;
+        }
+        if (s->off != s->hd_off || s->hd_off == s->hd_end) {
+            if ((len = http_reposition(h)) < 0)
+                return len;
+            /* end of file */
+            if (s->off != s->hd_off || s->hd_off == s->hd_end)
+                return 0;
+        }
     }
+
+    len = http_read_data(h, buf, size);
     if (len > 0) {
         s->off += len;
         if (s->chunksize > 0)
@@ -438,7 +725,7 @@ static int http_write(URLContext *h, const uint8_t *buf, int size)
 
 static int http_close(URLContext *h)
 {
-    int ret = 0;
+    int i, ret = 0;
     char footer[] = "0\r\n\r\n";
     HTTPContext *s = h->priv_data;
 
@@ -450,42 +737,42 @@ static int http_close(URLContext *h)
 
     if (s->hd)
         url_close(s->hd);
+    for (i = 0; i < CACHE_BLOCKS; i++)
+        av_free(s->cache[i].data);
     return ret;
 }
 
 static int64_t http_seek(URLContext *h, int64_t off, int whence)
 {
     HTTPContext *s = h->priv_data;
-    URLContext *old_hd = s->hd;
-    int64_t old_off = s->off;
-    uint8_t old_buf[BUFFER_SIZE];
-    int old_buf_size;
+    HTTPCacheBlock *b;
+    int64_t old_off;
 
     if (whence == AVSEEK_SIZE)
         return s->filesize;
     else if ((s->filesize == -1 && whence == SEEK_END) || h->is_streamed)
         return -1;
 
-    /* we save the old context in case the seek fails */
-    old_buf_size = s->buf_end - s->buf_ptr;
-    memcpy(old_buf, s->buf_ptr, old_buf_size);
-    s->hd = NULL;
     if (whence == SEEK_CUR)
         off += s->off;
     else if (whence == SEEK_END)
         off += s->filesize;
-    s->off = off;
+    if (off < 0 || (s->filesize >= 0 && off > s->filesize))
+        return -1;
 
-    /* if it fails, continue on old connection */
-    if (http_open_cnx(h) < 0) {
-        memcpy(s->buffer, old_buf, old_buf_size);
-        s->buf_ptr = s->buffer;
-        s->buf_end = s->buffer + old_buf_size;
-        s->hd = old_hd;
+    /* cached data is served by the next read without touching the connection */
+    b = cache_find(s, off, 0);
+    if (b && off - b->pos >= b->start && off - b->pos < b->end) {
+        s->off = off;
+        return off;
+    }
+    old_off = s->off;
+    s->off = off;
+    if ((off != s->hd_off || s->hd_off == s->hd_end) && http_reposition(h) < 0) {
+        /* the old connection is kept, continue from the old position */
         s->off = old_off;
         return -1;
     }
-    url_close(old_hd);
     return off;
 }
 
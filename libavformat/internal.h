@@ -62,6 +62,15 @@ void ff_program_add_stream_index(AVFormatContext *ac, int progid, unsigned int i
 void ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
                               int (*compare)(AVFormatContext *, AVPacket *, AVPacket *));
 
+/**
+ * Interleave packets through the AVFormatContext->packet_buffer list,
+ * for muxers which add packets with ff_interleave_add_packet().
+ * Same parameters and return values as av_interleave_packet_per_dts(),
+ * which keeps its packets elsewhere.
+ */
+int ff_interleave_get_list_packet(AVFormatContext *s, AVPacket *out,
+                                  AVPacket *pkt, int flush);
+
 void ff_read_frame_flush(AVFormatContext *s);
 
 #define NTP_OFFSET 2208988800ULL
@@ -167,6 +176,17 @@ int ff_get_v_length(uint64_t val);
  */
 void ff_put_v(ByteIOContext *bc, uint64_t val);
 
+/**
+ * Read size bytes from ByteIOContext without copying them if possible.
+ * If the bytes are contiguous in the I/O buffer, *data points there,
+ * otherwise they are read into buf and *data points to buf. The data is
+ * valid until the next read or seek on s.
+ *
+ * @return number of bytes read or AVERROR, like get_buffer()
+ */
+int ff_get_buffer_indirect(ByteIOContext *s, unsigned char *buf, int size,
+                           const unsigned char **data);
+
 /**
  * Read a whole line of text from ByteIOContext. Stop reading after reaching
  * either a \n, a \0 or EOF. The returned string is always \0 terminated,
@@ -180,6 +200,15 @@ void ff_put_v(ByteIOContext *bc, uint64_t val);
  */
 int ff_get_line(ByteIOContext *s, char *buf, int maxlen);
 
+/**
+ * Send the output of a UDP URLContext from a separate thread, paced at
+ * the given rate, unless the bitrate URL option already set one.
+ *
+ * @param bitrate rate in bits per second
+ * @return 0 on success, AVERROR(EINVAL) if h is not UDP output
+ */
+int ff_udp_set_bitrate(URLContext *h, int bitrate);
+
 #define SPACE_CHARS " \t\r\n"
 
 #endif /* AVFORMAT_INTERNAL_H */
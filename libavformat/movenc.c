@@ -53,7 +53,7 @@ static int mov_write_stco_tag(ByteIOContext *pb, MOVTrack *track)
     int mode64 = 0; //   use 32 bit size variant if possible
     int64_t pos = url_ftell(pb);
     put_be32(pb, 0); /* size */
-    if (pos > UINT32_MAX) {
+    if (track->entry && track->cluster[track->entry-1].pos > UINT32_MAX) {
         mode64 = 1;
         put_tag(pb, "co64");
     } else
@@ -89,7 +89,7 @@ static int mov_write_stsz_tag(ByteIOContext *pb, MOVTrack *track)
         entries += track->cluster[i].entries;
     }
     if (equalChunks) {
-        int sSize = track->cluster[0].size/track->cluster[0].entries;
+        int sSize = track->entry ? track->cluster[0].size/track->cluster[0].entries : 0;
         put_be32(pb, sSize); // sample size
         put_be32(pb, entries); // sample count
     }
@@ -971,7 +971,7 @@ static int mov_write_stbl_tag(ByteIOContext *pb, MOVTrack *track)
     if (track->mode == MODE_MOV && track->flags & MOV_TRACK_STPS)
         mov_write_stss_tag(pb, track, MOV_PARTIAL_SYNC_SAMPLE);
     if (track->enc->codec_type == AVMEDIA_TYPE_VIDEO &&
-        track->flags & MOV_TRACK_CTTS)
+        track->flags & MOV_TRACK_CTTS && track->entry)
         mov_write_ctts_tag(pb, track);
     mov_write_stsc_tag(pb, track);
     mov_write_stsz_tag(pb, track);
@@ -1283,7 +1283,9 @@ static int mov_write_trak_tag(ByteIOContext *pb, MOVTrack *track, AVStream *st)
     put_be32(pb, 0); /* size */
     put_tag(pb, "trak");
     mov_write_tkhd_tag(pb, track, st);
-    if (track->mode == MODE_PSP || track->flags & MOV_TRACK_CTTS)
+    /* the empty moov of fragmented output has no entries, but the first
+     * samples are already known when it is written */
+    if ((track->mode == MODE_PSP || track->flags & MOV_TRACK_CTTS) && track->cluster)
         mov_write_edts_tag(pb, track);  // PSP Movies require edts box
     if (track->tref_tag)
         mov_write_tref_tag(pb, track);
@@ -1325,9 +1327,9 @@ static int mov_write_mvhd_tag(ByteIOContext *pb, MOVMuxContext *mov)
                                              AV_ROUND_UP);
             if(maxTrackLen < maxTrackLenTemp)
                 maxTrackLen = maxTrackLenTemp;
-            if(maxTrackID < mov->tracks[i].trackID)
-                maxTrackID = mov->tracks[i].trackID;
         }
+        if(maxTrackID < mov->tracks[i].trackID)
+            maxTrackID = mov->tracks[i].trackID;
     }
 
     version = maxTrackLen < UINT32_MAX ? 0 : 1;
@@ -1687,6 +1689,30 @@ static int mov_write_uuidusmt_tag(ByteIOContext *pb, AVFormatContext *s)
     return 0;
 }
 
+static int mov_write_trex_tag(ByteIOContext *pb, MOVTrack *track)
+{
+    put_be32(pb, 0x20); /* size */
+    put_tag(pb, "trex");
+    put_be32(pb, 0); /* version & flags */
+    put_be32(pb, track->trackID);
+    put_be32(pb, 1); /* default sample description index */
+    put_be32(pb, 0); /* default sample duration */
+    put_be32(pb, 0); /* default sample size */
+    put_be32(pb, 0); /* default sample flags */
+    return 0x20;
+}
+
+static int mov_write_mvex_tag(ByteIOContext *pb, MOVMuxContext *mov)
+{
+    int64_t pos = url_ftell(pb);
+    int i;
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "mvex");
+    for (i = 0; i < mov->nb_streams; i++)
+        mov_write_trex_tag(pb, &mov->tracks[i]);
+    return updateSize(pb, pos);
+}
+
 static int mov_write_moov_tag(ByteIOContext *pb, MOVMuxContext *mov,
                               AVFormatContext *s)
 {
@@ -1696,7 +1722,7 @@ static int mov_write_moov_tag(ByteIOContext *pb, MOVMuxContext *mov,
     put_tag(pb, "moov");
 
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry <= 0) continue;
+        if(mov->tracks[i].entry <= 0 && !mov->fragments) continue;
 
         mov->tracks[i].time = mov->time;
         mov->tracks[i].trackID = i+1;
@@ -1718,10 +1744,12 @@ static int mov_write_moov_tag(ByteIOContext *pb, MOVMuxContext *mov,
     mov_write_mvhd_tag(pb, mov);
     //mov_write_iods_tag(pb, mov);
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry > 0) {
+        if(mov->tracks[i].entry > 0 || mov->fragments) {
             mov_write_trak_tag(pb, &(mov->tracks[i]), i < s->nb_streams ? s->streams[i] : NULL);
         }
     }
+    if (mov->fragments)
+        mov_write_mvex_tag(pb, mov);
 
     if (mov->mode == MODE_PSP)
         mov_write_uuidusmt_tag(pb, s);
@@ -1742,6 +1770,255 @@ static int mov_write_mdat_tag(ByteIOContext *pb, MOVMuxContext *mov)
     return 0;
 }
 
+static int mov_write_mfhd_tag(ByteIOContext *pb, MOVMuxContext *mov)
+{
+    put_be32(pb, 0x10); /* size */
+    put_tag(pb, "mfhd");
+    put_be32(pb, 0); /* version & flags */
+    put_be32(pb, mov->frag_seq); /* sequence number */
+    return 0x10;
+}
+
+static int mov_write_tfhd_tag(ByteIOContext *pb, MOVTrack *track,
+                              int64_t moof_pos)
+{
+    put_be32(pb, 0x18); /* size */
+    put_tag(pb, "tfhd");
+    put_byte(pb, 0); /* version */
+    put_be24(pb, 0x01); /* flags (base data offset present) */
+    put_be32(pb, track->trackID);
+    put_be64(pb, moof_pos); /* base data offset */
+    return 0x18;
+}
+
+static int mov_write_tfdt_tag(ByteIOContext *pb, MOVTrack *track)
+{
+    put_be32(pb, 0x14); /* size */
+    put_tag(pb, "tfdt");
+    put_byte(pb, 1); /* version */
+    put_be24(pb, 0); /* flags */
+    put_be64(pb, track->cluster[0].dts - track->start_dts); /* base media decode time */
+    return 0x14;
+}
+
+static int mov_write_trun_tag(ByteIOContext *pb, MOVTrack *track,
+                              int64_t next_dts)
+{
+    int64_t pos = url_ftell(pb);
+    int flags = 0x001 | 0x100 | 0x200 | 0x400; /* data offset, sample duration, size, flags */
+    int i;
+
+    if (track->enc->codec_type == AVMEDIA_TYPE_VIDEO ||
+        track->flags & MOV_TRACK_CTTS)
+        flags |= 0x800; /* sample composition time offsets */
+
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "trun");
+    put_byte(pb, 0); /* version */
+    put_be24(pb, flags);
+    put_be32(pb, track->entry); /* sample count */
+    track->data_offset_pos = url_ftell(pb);
+    put_be32(pb, 0); /* data offset, written once the moof size is known */
+    for (i = 0; i < track->entry; i++) {
+        int64_t duration = i + 1 < track->entry ?
+            track->cluster[i+1].dts - track->cluster[i].dts :
+            next_dts != AV_NOPTS_VALUE ? next_dts - track->cluster[i].dts :
+                                         track->last_duration;
+        put_be32(pb, duration);
+        put_be32(pb, track->cluster[i].size);
+        /* sample_depends_on = 2 for sync samples, otherwise
+         * sample_depends_on = 1 and sample_is_difference_sample */
+        put_be32(pb, track->cluster[i].flags & MOV_SYNC_SAMPLE ||
+                     track->enc->codec_type != AVMEDIA_TYPE_VIDEO ?
+                     0x02000000 : 0x01010000);
+        if (flags & 0x800)
+            put_be32(pb, track->cluster[i].cts);
+    }
+    return updateSize(pb, pos);
+}
+
+static int mov_write_traf_tag(ByteIOContext *pb, MOVTrack *track,
+                              int64_t moof_pos, int64_t next_dts)
+{
+    int64_t pos = url_ftell(pb);
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "traf");
+    mov_write_tfhd_tag(pb, track, moof_pos);
+    mov_write_tfdt_tag(pb, track);
+    mov_write_trun_tag(pb, track, next_dts);
+    return updateSize(pb, pos);
+}
+
+/**
+ * Write the moov atom of a fragmented file. It describes the tracks but
+ * does not contain any samples, these are all in the following fragments.
+ */
+static int mov_write_empty_moov(ByteIOContext *pb, AVFormatContext *s)
+{
+    MOVMuxContext *mov = s->priv_data;
+    int entry[MAX_STREAMS];
+    int64_t duration[MAX_STREAMS];
+    long sample_count[MAX_STREAMS];
+    int i;
+
+    for (i = 0; i < mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        entry[i]        = track->entry;
+        duration[i]     = track->trackDuration;
+        sample_count[i] = track->sampleCount;
+        track->entry = track->trackDuration = track->sampleCount = 0;
+    }
+    mov_write_moov_tag(pb, mov, s);
+    for (i = 0; i < mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        track->entry         = entry[i];
+        track->trackDuration = duration[i];
+        track->sampleCount   = sample_count[i];
+    }
+    return 0;
+}
+
+/**
+ * Write the samples gathered since the last fragment as a moof atom
+ * followed by an mdat atom, and reset the sample tables.
+ * The moov atom is written before the first fragment, once the first
+ * packets have provided any codec data it needs.
+ *
+ * @param next_track track of the packet following the fragment, or NULL
+ * @param next_dts   dts of that packet, gives the duration of the last
+ *                   sample of next_track
+ */
+static int mov_flush_fragment(AVFormatContext *s, MOVTrack *next_track,
+                              int64_t next_dts)
+{
+    MOVMuxContext *mov = s->priv_data;
+    ByteIOContext *pb = s->pb, *moof_pb;
+    int64_t moof_pos, moof_size, mdat_size = 0;
+    uint8_t *buf;
+    int i, j, size, traf = 0, ret;
+
+    if (!mov->moov_written) {
+        if ((ret = url_open_dyn_buf(&moof_pb)) < 0)
+            return ret;
+        mov_write_empty_moov(moof_pb, s);
+        size = url_close_dyn_buf(moof_pb, &buf);
+        put_buffer(pb, buf, size);
+        av_free(buf);
+        mov->moov_written = 1;
+    }
+
+    for (i = 0; i < mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        track->data_offset = mdat_size;
+        for (j = 0; j < track->entry; j++)
+            mdat_size += track->cluster[j].size;
+    }
+    if (!mdat_size) {
+        put_flush_packet(pb);
+        return 0;
+    }
+
+    if ((ret = url_open_dyn_buf(&moof_pb)) < 0)
+        return ret;
+    moof_pos = url_ftell(pb);
+    mov->frag_seq++;
+    put_be32(moof_pb, 0); /* size */
+    put_tag(moof_pb, "moof");
+    mov_write_mfhd_tag(moof_pb, mov);
+    for (i = 0; i < mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        MOVFragmentInfo *info;
+        if (!track->entry)
+            continue;
+        traf++;
+        if (s->flags & AVFMT_FLAG_FRAG_INDEX &&
+            (track->cluster[0].flags & MOV_SYNC_SAMPLE ||
+             track->enc->codec_type != AVMEDIA_TYPE_VIDEO)) {
+            info = av_realloc(track->frag_info,
+                              (track->nb_frag_info + 1) * sizeof(*info));
+            if (!info) {
+                url_close_dyn_buf(moof_pb, &buf);
+                av_free(buf);
+                return AVERROR(ENOMEM);
+            }
+            track->frag_info = info;
+            info = &info[track->nb_frag_info++];
+            info->time   = track->cluster[0].dts + track->cluster[0].cts -
+                           track->start_dts;
+            info->offset = moof_pos;
+            info->traf   = traf;
+        }
+        mov_write_traf_tag(moof_pb, track, moof_pos,
+                           track == next_track ? next_dts : AV_NOPTS_VALUE);
+    }
+    moof_size = updateSize(moof_pb, 0);
+    /* the sample data follows the moof and the mdat header */
+    for (i = 0; i < mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        if (!track->entry)
+            continue;
+        url_fseek(moof_pb, track->data_offset_pos, SEEK_SET);
+        put_be32(moof_pb, moof_size + 8 + track->data_offset);
+    }
+    url_fseek(moof_pb, moof_size, SEEK_SET);
+    size = url_close_dyn_buf(moof_pb, &buf);
+    put_buffer(pb, buf, size);
+    av_free(buf);
+
+    put_be32(pb, mdat_size + 8);
+    put_tag(pb, "mdat");
+    for (i = 0; i < mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        if (!track->mdat_buf)
+            continue;
+        size = url_close_dyn_buf(track->mdat_buf, &buf);
+        put_buffer(pb, buf, size);
+        av_free(buf);
+        track->mdat_buf = NULL;
+        track->entry = 0;
+    }
+    put_flush_packet(pb);
+    return 0;
+}
+
+static int mov_write_tfra_tag(ByteIOContext *pb, MOVTrack *track)
+{
+    int64_t pos = url_ftell(pb);
+    int i;
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "tfra");
+    put_byte(pb, 1); /* version */
+    put_be24(pb, 0); /* flags */
+    put_be32(pb, track->trackID);
+    put_be32(pb, 0); /* traf, trun and sample numbers are stored in one byte */
+    put_be32(pb, track->nb_frag_info);
+    for (i = 0; i < track->nb_frag_info; i++) {
+        put_be64(pb, track->frag_info[i].time);
+        put_be64(pb, track->frag_info[i].offset);
+        put_byte(pb, track->frag_info[i].traf);
+        put_byte(pb, 1); /* trun number */
+        put_byte(pb, 1); /* sample number */
+    }
+    return updateSize(pb, pos);
+}
+
+static int mov_write_mfra_tag(ByteIOContext *pb, MOVMuxContext *mov)
+{
+    int64_t pos = url_ftell(pb);
+    int i;
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "mfra");
+    for (i = 0; i < mov->nb_streams; i++)
+        if (mov->tracks[i].nb_frag_info)
+            mov_write_tfra_tag(pb, &mov->tracks[i]);
+
+    put_be32(pb, 0x10); /* size */
+    put_tag(pb, "mfro");
+    put_be32(pb, 0); /* version & flags */
+    put_be32(pb, url_ftell(pb) + 4 - pos); /* size of the mfra atom */
+    return updateSize(pb, pos);
+}
+
 /* TODO: This needs to be more general */
 static int mov_write_ftyp_tag(ByteIOContext *pb, AVFormatContext *s)
 {
@@ -1890,9 +2167,34 @@ int ff_mov_write_packet(AVFormatContext *s, AVPacket *pkt)
     unsigned int samplesInChunk = 0;
     int size= pkt->size;
 
-    if (url_is_streamed(s->pb)) return 0; /* Can't handle that */
+    if (url_is_streamed(s->pb) && !mov->fragments) return 0; /* Can't handle that */
     if (!size) return 0; /* Discard 0 sized packets */
 
+    if (mov->fragments) {
+        MOVTrack *ref = &mov->tracks[mov->frag_track];
+        int64_t min_duration = s->frag_duration;
+        int ret;
+
+        if (ref->enc->codec_type != AVMEDIA_TYPE_VIDEO && !min_duration)
+            min_duration = AV_TIME_BASE;
+        /* start a new fragment at a keyframe of the reference track once
+         * the current one is long enough, or when a sample table is full */
+        if ((trk == ref && ref->entry && (pkt->flags & AV_PKT_FLAG_KEY ||
+                                          ref->enc->codec_type != AVMEDIA_TYPE_VIDEO) &&
+             av_rescale_q(pkt->dts - ref->cluster[0].dts,
+                          (AVRational){1, ref->timescale}, AV_TIME_BASE_Q) >= min_duration) ||
+            trk->entry >= MOV_INDEX_CLUSTER_SIZE)
+            if ((ret = mov_flush_fragment(s, trk, pkt->dts)) < 0)
+                return ret;
+        if (!trk->mdat_buf && (ret = url_open_dyn_buf(&trk->mdat_buf)) < 0)
+            return ret;
+        if (trk->start_dts == AV_NOPTS_VALUE)
+            trk->start_dts = pkt->dts;
+        if (trk->entry)
+            trk->last_duration = pkt->dts - trk->cluster[trk->entry-1].dts;
+        pb = trk->mdat_buf;
+    }
+
     if (enc->codec_id == CODEC_ID_AMR_NB) {
         /* We must find out how many AMR blocks there are in one packet */
         static uint16_t packed_size[16] =
@@ -1969,11 +2271,14 @@ int ff_mov_write_packet(AVFormatContext *s, AVPacket *pkt)
         if (trk->cluster[trk->entry].flags & MOV_SYNC_SAMPLE)
             trk->hasKeyframes++;
     }
+    if (pkt->duration)
+        trk->last_duration = pkt->duration;
     trk->entry++;
     trk->sampleCount += samplesInChunk;
     mov->mdat_size += size;
 
-    put_flush_packet(pb);
+    if (!mov->fragments)
+        put_flush_packet(pb);
 
     if (trk->hint_track >= 0 && trk->hint_track < mov->nb_streams)
         ff_mov_add_hinted_packet(s, pkt, trk->hint_track, trk->entry);
@@ -2021,10 +2326,15 @@ static int mov_write_header(AVFormatContext *s)
     MOVMuxContext *mov = s->priv_data;
     int i, hint_track = 0;
 
-    if (url_is_streamed(s->pb)) {
+    mov->fragments = !!(s->flags & AVFMT_FLAG_FRAGMENT);
+    if (url_is_streamed(s->pb) && !mov->fragments) {
         av_log(s, AV_LOG_ERROR, "muxer does not support non seekable output\n");
         return -1;
     }
+    if (mov->fragments && s->flags & AVFMT_FLAG_RTP_HINT) {
+        av_log(s, AV_LOG_ERROR, "RTP hinting is not supported with fragments\n");
+        return -1;
+    }
 
     /* Default mode == MP4 */
     mov->mode = MODE_MP4;
@@ -2047,7 +2357,7 @@ static int mov_write_header(AVFormatContext *s)
     }
 
     mov->nb_streams = s->nb_streams;
-    if (mov->mode & (MODE_MOV|MODE_IPOD) && s->nb_chapters)
+    if (mov->mode & (MODE_MOV|MODE_IPOD) && s->nb_chapters && !mov->fragments)
         mov->chapter_track = mov->nb_streams++;
 
     if (s->flags & AVFMT_FLAG_RTP_HINT) {
@@ -2085,6 +2395,7 @@ static int mov_write_header(AVFormatContext *s)
         /* If hinting of this track is enabled by a later hint track,
          * this is updated. */
         track->hint_track = -1;
+        track->start_dts = AV_NOPTS_VALUE;
         if(st->codec->codec_type == AVMEDIA_TYPE_VIDEO){
             if (track->tag == MKTAG('m','x','3','p') || track->tag == MKTAG('m','x','3','n') ||
                 track->tag == MKTAG('m','x','4','p') || track->tag == MKTAG('m','x','4','n') ||
@@ -2133,7 +2444,15 @@ static int mov_write_header(AVFormatContext *s)
         av_set_pts_info(st, 64, 1, track->timescale);
     }
 
-    mov_write_mdat_tag(pb, mov);
+    if (mov->fragments) {
+        /* fragments start at keyframes of the first video track */
+        for (i = 0; i < s->nb_streams; i++)
+            if (s->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+                mov->frag_track = i;
+                break;
+            }
+    } else
+        mov_write_mdat_tag(pb, mov);
     mov->time = s->timestamp + 0x7C25B080; //1970 based -> 1904 based
 
     if (mov->chapter_track)
@@ -2159,6 +2478,122 @@ static int mov_write_header(AVFormatContext *s)
     return -1;
 }
 
+static int mov_get_moov_size(AVFormatContext *s)
+{
+    ByteIOContext *moov_pb;
+    uint8_t *buf;
+    int ret, size;
+
+    if ((ret = url_open_dyn_buf(&moov_pb)) < 0)
+        return ret;
+    mov_write_moov_tag(moov_pb, s->priv_data, s);
+    size = url_close_dyn_buf(moov_pb, &buf);
+    av_free(buf);
+    return size;
+}
+
+static void mov_shift_chunk_offsets(MOVMuxContext *mov, int64_t shift)
+{
+    int i, j;
+
+    for (i = 0; i < mov->nb_streams; i++)
+        for (j = 0; j < mov->tracks[i].entry; j++)
+            mov->tracks[i].cluster[j].pos += shift;
+}
+
+#define FASTSTART_BLOCK_SIZE (4 << 20)
+
+/**
+ * Move the data from pos to end up by shift bytes.
+ * The data is copied backwards from the end, in large blocks read through
+ * h, a second handle on the output file.
+ */
+static int mov_shift_data(AVFormatContext *s, URLContext *h, uint8_t *buf,
+                          int64_t pos, int64_t end, int shift)
+{
+    ByteIOContext *pb = s->pb;
+
+    while (end > pos) {
+        int size = FFMIN(end - pos, FASTSTART_BLOCK_SIZE);
+        end -= size;
+        if (url_seek(h, end, SEEK_SET) != end ||
+            url_read_complete(h, buf, size) != size)
+            return AVERROR(EIO);
+        url_fseek(pb, end + shift, SEEK_SET);
+        put_buffer(pb, buf, size);
+        if (url_ferror(pb))
+            return url_ferror(pb);
+    }
+    put_flush_packet(pb);
+    return url_ferror(pb);
+}
+
+/**
+ * Write the moov atom in front of the mdat atom, moving the sample data
+ * up by the size of the moov atom.
+ * Everything that can fail before the data is moved is checked first; on
+ * such a failure the moov atom is written at the end of the file instead.
+ * A failure while moving the data leaves a broken file and is returned.
+ */
+static int mov_write_moov_faststart(AVFormatContext *s)
+{
+    MOVMuxContext *mov = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    int64_t pos = mov->mdat_pos - 8; /* free/wide placeholder or 64 bit mdat */
+    int64_t end = url_ftell(pb);
+    int moov_size, shift = 0, ret;
+    URLContext *h = NULL;
+    uint8_t *buf = NULL;
+
+    put_flush_packet(pb);
+    if ((ret = url_ferror(pb)) < 0)
+        return ret;
+
+    if ((ret = url_open(&h, s->filename, URL_RDONLY)) < 0)
+        goto fallback;
+    if (url_seek(h, 0, AVSEEK_SIZE) < end) {
+        ret = AVERROR(EIO);
+        goto fallback;
+    }
+    if (!(buf = av_malloc(FASTSTART_BLOCK_SIZE))) {
+        ret = AVERROR(ENOMEM);
+        goto fallback;
+    }
+    /* the chunk offsets depend on the moov size, which changes if they
+     * no longer fit in 32 bits */
+    while ((moov_size = mov_get_moov_size(s)) != shift) {
+        if (moov_size < 0) {
+            mov_shift_chunk_offsets(mov, -shift);
+            ret = moov_size;
+            goto fallback;
+        }
+        mov_shift_chunk_offsets(mov, moov_size - shift);
+        shift = moov_size;
+    }
+
+    av_log(s, AV_LOG_INFO, "moving the moov atom to the beginning of the file\n");
+    if ((ret = mov_shift_data(s, h, buf, pos, end, moov_size)) < 0) {
+        av_log(s, AV_LOG_ERROR, "moving the sample data failed, the output is broken\n");
+        goto end;
+    }
+    url_fseek(pb, pos, SEEK_SET);
+    mov_write_moov_tag(pb, mov, s);
+    ret = 0;
+    goto end;
+
+ fallback:
+    av_log(s, AV_LOG_WARNING, "could not move the moov atom, "
+           "writing it at the end of the file\n");
+    url_fseek(pb, end, SEEK_SET);
+    mov_write_moov_tag(pb, mov, s);
+    ret = 0;
+ end:
+    av_free(buf);
+    if (h)
+        url_close(h);
+    return ret;
+}
+
 static int mov_write_trailer(AVFormatContext *s)
 {
     MOVMuxContext *mov = s->priv_data;
@@ -2168,6 +2603,23 @@ static int mov_write_trailer(AVFormatContext *s)
 
     int64_t moov_pos = url_ftell(pb);
 
+    if (mov->fragments) {
+        if ((res = mov_flush_fragment(s, NULL, AV_NOPTS_VALUE)) < 0)
+            goto end;
+        if (s->flags & AVFMT_FLAG_FRAG_INDEX) {
+            ByteIOContext *mfra_pb;
+            uint8_t *buf;
+            int size;
+            if ((res = url_open_dyn_buf(&mfra_pb)) < 0)
+                goto end;
+            mov_write_mfra_tag(mfra_pb, mov);
+            size = url_close_dyn_buf(mfra_pb, &buf);
+            put_buffer(pb, buf, size);
+            av_free(buf);
+        }
+        goto end;
+    }
+
     /* Write size of mdat tag */
     if (mov->mdat_size+8 <= UINT32_MAX) {
         url_fseek(pb, mov->mdat_pos, SEEK_SET);
@@ -2181,14 +2633,24 @@ static int mov_write_trailer(AVFormatContext *s)
     }
     url_fseek(pb, moov_pos, SEEK_SET);
 
-    mov_write_moov_tag(pb, mov, s);
+    if (s->flags & AVFMT_FLAG_FASTSTART)
+        res = mov_write_moov_faststart(s);
+    else
+        mov_write_moov_tag(pb, mov, s);
 
+ end:
     if (mov->chapter_track)
         av_freep(&mov->tracks[mov->chapter_track].enc);
 
     for (i=0; i<mov->nb_streams; i++) {
         if (mov->tracks[i].tag == MKTAG('r','t','p',' '))
             ff_mov_close_hinting(&mov->tracks[i]);
+        if (mov->tracks[i].mdat_buf) {
+            uint8_t *buf;
+            url_close_dyn_buf(mov->tracks[i].mdat_buf, &buf);
+            av_free(buf);
+        }
+        av_freep(&mov->tracks[i].frag_info);
         av_freep(&mov->tracks[i].cluster);
 
         if(mov->tracks[i].vosLen) av_free(mov->tracks[i].vosData);
@@ -51,6 +51,12 @@ typedef struct MOVIentry {
     uint32_t     flags;
 } MOVIentry;
 
+typedef struct MOVFragmentInfo {
+    int64_t time;   ///< presentation time of the first sample, relative to the track start
+    int64_t offset; ///< position of the moof atom
+    int     traf;   ///< index of the traf atom within the moof, starting at 1
+} MOVFragmentInfo;
+
 typedef struct HintSample {
     uint8_t *data;
     int size;
@@ -98,6 +104,14 @@ typedef struct MOVIndex {
     uint32_t    max_packet_size;
 
     HintSampleQueue sample_queue;
+
+    ByteIOContext *mdat_buf;     ///< sample data of the current fragment
+    int64_t     start_dts;       ///< dts of the first sample ever written
+    int64_t     last_duration;   ///< duration of the latest sample, used for the last one of a fragment
+    int64_t     data_offset_pos; ///< position of the trun data offset in the moof being written
+    int64_t     data_offset;     ///< offset of the track data from the start of the mdat payload
+    MOVFragmentInfo *frag_info;  ///< random access points for the mfra index
+    int         nb_frag_info;
 } MOVTrack;
 
 typedef struct MOVMuxContext {
@@ -108,6 +122,11 @@ typedef struct MOVMuxContext {
     int64_t mdat_pos;
     uint64_t mdat_size;
     MOVTrack *tracks;
+
+    int     fragments;     ///< write moof/mdat fragments instead of one mdat
+    int     moov_written;
+    int     frag_seq;      ///< sequence number of the last written moof
+    int     frag_track;    ///< track whose keyframes start new fragments
 } MOVMuxContext;
 
 int ff_mov_write_packet(AVFormatContext *s, AVPacket *pkt);
@@ -19,6 +19,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "libavcodec/startcode.h"
 #include "avformat.h"
 #include "mpeg.h"
 
@@ -144,6 +145,18 @@ static int find_next_start_code(ByteIOContext *pb, int *size_ptr,
     while (n > 0) {
         if (url_feof(pb))
             break;
+        /* no start code ends before the next zero pair in the I/O buffer,
+           skip there unless one is just ending */
+        if ((state & 0xff) && state != 0x000001) {
+            int i, len = ff_startcode_find_candidate(pb->buf_ptr,
+                                                     FFMIN(pb->buf_end - pb->buf_ptr, n));
+            for (i = FFMAX(len - 3, 0); i < len; i++)
+                state = ((state << 8) | pb->buf_ptr[i]) & 0xffffff;
+            pb->buf_ptr += len;
+            n -= len;
+            if (n <= 0)
+                break;
+        }
         v = get_byte(pb);
         n--;
         if (state == 0x000001) {
@@ -401,7 +414,8 @@ static int mpegps_read_pes_header(AVFormatContext *s,
         int i;
         for(i=0; i<s->nb_streams; i++){
             if(startcode == s->streams[i]->id &&
-               !url_is_streamed(s->pb) /* index useless on streams anyway */) {
+               !url_is_streamed(s->pb) /* index useless on streams anyway */ &&
+               !s->streams[i]->index_complete) {
                 ff_reduce_index(s, i);
                 av_add_index_entry(s->streams[i], *ppos, dts, 0, 0, AVINDEX_KEYFRAME /* FIXME keyframe? */);
             }
@@ -120,6 +120,13 @@ struct MpegTSContext {
 
     /** filters for various streams specified by PMT + for the PAT and PMT */
     MpegTSFilter *pids[NB_PID_MAX];
+
+    /** set if some program is discarded, otherwise no pid is       */
+    int discard_programs;
+    /** discard_pid() results, valid if pid_discard_gen matches      */
+    uint8_t pid_discarded[NB_PID_MAX];
+    unsigned int pid_discard_gen[NB_PID_MAX];
+    unsigned int discard_gen;
 };
 
 /* TS stream handling */
@@ -238,11 +245,37 @@ static int discard_pid(MpegTSContext *ts, unsigned int pid)
     return !used && discarded;
 }
 
+/**
+ * Forget the cached discard_pid() results, for when the programs or the
+ * caller's selection may have changed.
+ */
+static void update_discard(MpegTSContext *ts)
+{
+    int i;
+
+    ts->discard_gen++;
+    ts->discard_programs = 0;
+    for (i = 0; i < ts->stream->nb_programs; i++)
+        if (ts->stream->programs[i]->discard == AVDISCARD_ALL)
+            ts->discard_programs = 1;
+}
+
+static int pid_discarded(MpegTSContext *ts, unsigned int pid)
+{
+    if (!ts->discard_programs)
+        return 0;
+    if (ts->pid_discard_gen[pid] != ts->discard_gen) {
+        ts->pid_discard_gen[pid] = ts->discard_gen;
+        ts->pid_discarded[pid]   = discard_pid(ts, pid);
+    }
+    return ts->pid_discarded[pid];
+}
+
 /**
  *  Assemble PES packets out of TS packets, and then call the "section_cb"
  *  function when they are complete.
  */
-static void write_section_data(AVFormatContext *s, MpegTSFilter *tss1,
+static void write_section_data(MpegTSContext *ts, MpegTSFilter *tss1,
                                const uint8_t *buf, int buf_size, int is_start)
 {
     MpegTSSectionFilter *tss = &tss1->u.section_filter;
@@ -275,8 +308,11 @@ static void write_section_data(AVFormatContext *s, MpegTSFilter *tss1,
         tss->end_of_section_reached = 1;
         if (!tss->check_crc ||
             av_crc(av_crc_get_table(AV_CRC_32_IEEE), -1,
-                   tss->section_buf, tss->section_h_size) == 0)
+                   tss->section_buf, tss->section_h_size) == 0) {
             tss->section_cb(tss1, tss->section_buf, tss->section_h_size);
+            /* the tables may have changed the programs */
+            update_discard(ts);
+        }
     }
 }
 
@@ -1145,14 +1181,13 @@ static void sdt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
 /* handle one TS packet */
 static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
 {
-    AVFormatContext *s = ts->stream;
     MpegTSFilter *tss;
     int len, pid, cc, cc_ok, afc, is_start;
     const uint8_t *p, *p_end;
     int64_t pos;
 
     pid = AV_RB16(packet + 1) & 0x1fff;
-    if(pid && discard_pid(ts, pid))
+    if(pid && pid_discarded(ts, pid))
         return 0;
     is_start = packet[1] & 0x40;
     tss = ts->pids[pid];
@@ -1184,7 +1219,9 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
     if (p >= p_end)
         return 0;
 
-    pos = url_ftell(ts->stream->pb);
+    /* position behind the current packet; the bytes following the 188
+       bytes of larger raw packets are only skipped after handling it */
+    pos = url_ftell(ts->stream->pb) + ts->raw_packet_size - TS_PACKET_SIZE;
     ts->pos47= pos % ts->raw_packet_size;
 
     if (tss->type == MPEGTS_SECTION) {
@@ -1195,7 +1232,7 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
                 return 0;
             if (len && cc_ok) {
                 /* write remaining section bytes */
-                write_section_data(s, tss,
+                write_section_data(ts, tss,
                                    p, len, 0);
                 /* check whether filter has been closed */
                 if (!ts->pids[pid])
@@ -1203,12 +1240,12 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
             }
             p += len;
             if (p < p_end) {
-                write_section_data(s, tss,
+                write_section_data(ts, tss,
                                    p, p_end - p, 1);
             }
         } else {
             if (cc_ok) {
-                write_section_data(s, tss,
+                write_section_data(ts, tss,
                                    p, p_end - p, 0);
             }
         }
@@ -1244,18 +1281,24 @@ static int mpegts_resync(AVFormatContext *s)
     return -1;
 }
 
-/* return -1 if error or EOF. Return 0 if OK. */
-static int read_packet(AVFormatContext *s, uint8_t *buf, int raw_packet_size)
+/**
+ * Read a TS packet. *data points to it afterwards, either in the I/O
+ * buffer or, if the packet is not contiguous there, in buf, and stays
+ * valid until finished_reading_packet().
+ * @return -1 if error or EOF. Return 0 if OK.
+ */
+static int read_packet(AVFormatContext *s, uint8_t *buf, int raw_packet_size,
+                       const uint8_t **data)
 {
     ByteIOContext *pb = s->pb;
-    int skip, len;
+    int len;
 
     for(;;) {
-        len = get_buffer(pb, buf, TS_PACKET_SIZE);
+        len = ff_get_buffer_indirect(pb, buf, TS_PACKET_SIZE, data);
         if (len != TS_PACKET_SIZE)
             return AVERROR(EIO);
         /* check paquet sync byte */
-        if (buf[0] != 0x47) {
+        if ((*data)[0] != 0x47) {
             /* find a new packet start */
             url_fseek(pb, -TS_PACKET_SIZE, SEEK_CUR);
             if (mpegts_resync(s) < 0)
@@ -1263,21 +1306,28 @@ static int read_packet(AVFormatContext *s, uint8_t *buf, int raw_packet_size)
             else
                 continue;
         } else {
-            skip = raw_packet_size - TS_PACKET_SIZE;
-            if (skip > 0)
-                url_fskip(pb, skip);
             break;
         }
     }
     return 0;
 }
 
+static void finished_reading_packet(AVFormatContext *s, int raw_packet_size)
+{
+    int skip = raw_packet_size - TS_PACKET_SIZE;
+
+    if (skip > 0)
+        url_fskip(s->pb, skip);
+}
+
 static int handle_packets(MpegTSContext *ts, int nb_packets)
 {
     AVFormatContext *s = ts->stream;
     uint8_t packet[TS_PACKET_SIZE];
+    const uint8_t *data;
     int packet_num, ret;
 
+    update_discard(ts);
     ts->stop_parse = 0;
     packet_num = 0;
     for(;;) {
@@ -1286,10 +1336,11 @@ static int handle_packets(MpegTSContext *ts, int nb_packets)
         packet_num++;
         if (nb_packets != 0 && packet_num >= nb_packets)
             break;
-        ret = read_packet(s, packet, ts->raw_packet_size);
+        ret = read_packet(s, packet, ts->raw_packet_size, &data);
         if (ret != 0)
             return ret;
-        ret = handle_packet(ts, packet);
+        ret = handle_packet(ts, data);
+        finished_reading_packet(s, ts->raw_packet_size);
         if (ret != 0)
             return ret;
     }
@@ -1408,6 +1459,7 @@ static int mpegts_read_header(AVFormatContext *s,
         int64_t pcrs[2], pcr_h;
         int packet_count[2];
         uint8_t packet[TS_PACKET_SIZE];
+        const uint8_t *data;
 
         /* only read packets */
 
@@ -1423,19 +1475,21 @@ static int mpegts_read_header(AVFormatContext *s,
         nb_pcrs = 0;
         nb_packets = 0;
         for(;;) {
-            ret = read_packet(s, packet, ts->raw_packet_size);
+            ret = read_packet(s, packet, ts->raw_packet_size, &data);
             if (ret < 0)
                 return -1;
-            pid = AV_RB16(packet + 1) & 0x1fff;
+            pid = AV_RB16(data + 1) & 0x1fff;
             if ((pcr_pid == -1 || pcr_pid == pid) &&
-                parse_pcr(&pcr_h, &pcr_l, packet) == 0) {
+                parse_pcr(&pcr_h, &pcr_l, data) == 0) {
+                finished_reading_packet(s, ts->raw_packet_size);
                 pcr_pid = pid;
                 packet_count[nb_pcrs] = nb_packets;
                 pcrs[nb_pcrs] = pcr_h * 300 + pcr_l;
                 nb_pcrs++;
                 if (nb_pcrs >= 2)
                     break;
-            }
+            } else
+                finished_reading_packet(s, ts->raw_packet_size);
             nb_packets++;
         }
 
@@ -1468,15 +1522,19 @@ static int mpegts_raw_read_packet(AVFormatContext *s,
     int64_t pcr_h, next_pcr_h, pos;
     int pcr_l, next_pcr_l;
     uint8_t pcr_buf[12];
+    const uint8_t *data;
 
     if (av_new_packet(pkt, TS_PACKET_SIZE) < 0)
         return AVERROR(ENOMEM);
     pkt->pos= url_ftell(s->pb);
-    ret = read_packet(s, pkt->data, ts->raw_packet_size);
+    ret = read_packet(s, pkt->data, ts->raw_packet_size, &data);
     if (ret < 0) {
         av_free_packet(pkt);
         return ret;
     }
+    if (data != pkt->data)
+        memcpy(pkt->data, data, TS_PACKET_SIZE);
+    finished_reading_packet(s, ts->raw_packet_size);
     if (ts->mpeg2ts_compute_pcr) {
         /* compute exact PCR for each packet */
         if (parse_pcr(&pcr_h, &pcr_l, pkt->data) == 0) {
@@ -1734,6 +1792,7 @@ int ff_mpegts_parse_packet(MpegTSContext *ts, AVPacket *pkt,
     len1 = len;
     ts->pkt = pkt;
     ts->stop_parse = 0;
+    update_discard(ts);
     for(;;) {
         if (ts->stop_parse>0)
             break;
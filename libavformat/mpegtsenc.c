@@ -21,6 +21,7 @@
 
 #include "libavutil/bswap.h"
 #include "libavutil/crc.h"
+#include "libavutil/avstring.h"
 #include "libavcodec/mpegvideo.h"
 #include "avformat.h"
 #include "internal.h"
@@ -510,6 +511,12 @@ static int mpegts_write_header(AVFormatContext *s)
     ts->pat_packet_count = ts->pat_packet_period-1;
     ts->sdt_packet_count = ts->sdt_packet_period-1;
 
+#if CONFIG_UDP_PROTOCOL
+    /* send constant bitrate streams at the rate of their PCR */
+    if (ts->mux_rate > 1 && av_strstart(s->filename, "udp:", NULL))
+        ff_udp_set_bitrate(url_fileno(s->pb), ts->mux_rate);
+#endif
+
     if (ts->mux_rate == 1)
         av_log(s, AV_LOG_INFO, "muxrate VBR, ");
     else
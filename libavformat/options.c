@@ -50,6 +50,11 @@ static const AVOption options[]={
 {"noparse", "disable AVParsers, this needs nofillin too", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_NOPARSE, INT_MIN, INT_MAX, D, "fflags"},
 {"igndts", "ignore dts", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_IGNDTS, INT_MIN, INT_MAX, D, "fflags"},
 {"rtphint", "add rtp hinting", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_RTP_HINT, INT_MIN, INT_MAX, E, "fflags"},
+{"frag", "write fragmented output", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_FRAGMENT, INT_MIN, INT_MAX, E, "fflags"},
+{"fragidx", "write an index of the fragments at the end", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_FRAG_INDEX, INT_MIN, INT_MAX, E, "fflags"},
+{"faststart", "move the index to the beginning of the file", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_FASTSTART, INT_MIN, INT_MAX, E, "fflags"},
+{"probethreads", "decode probe packets of different streams in parallel", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_PROBE_THREADS, INT_MIN, INT_MAX, D, "fflags"},
+{"probecache", "reuse codec parameters probed before for the same streams", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_PROBE_CACHE, INT_MIN, INT_MAX, D, "fflags"},
 #if LIBAVFORMAT_VERSION_INT < (53<<16)
 {"track", " set the track number", OFFSET(track), FF_OPT_TYPE_INT, DEFAULT, 0, INT_MAX, E},
 {"year", "set the year", OFFSET(year), FF_OPT_TYPE_INT, DEFAULT, INT_MIN, INT_MAX, E},
@@ -58,6 +63,7 @@ static const AVOption options[]={
 {"cryptokey", "decryption key", OFFSET(key), FF_OPT_TYPE_BINARY, 0, 0, 0, D},
 {"indexmem", "max memory used for timestamp index (per stream)", OFFSET(max_index_size), FF_OPT_TYPE_INT, 1<<20, 0, INT_MAX, D},
 {"rtbufsize", "max memory used for buffering real-time frames", OFFSET(max_picture_buffer), FF_OPT_TYPE_INT, 3041280, 0, INT_MAX, D}, /* defaults to 1s of 15fps 352x288 YUYV422 video */
+{"fragduration", "minimum fragment duration in microseconds", OFFSET(frag_duration), FF_OPT_TYPE_INT, DEFAULT, 0, INT_MAX, E},
 {"fdebug", "print specific debug info", OFFSET(debug), FF_OPT_TYPE_FLAGS, DEFAULT, 0, INT_MAX, E|D, "fdebug"},
 {"ts", NULL, 0, FF_OPT_TYPE_CONST, FF_FDEBUG_TS, INT_MIN, INT_MAX, E|D, "fdebug"},
 {NULL},
@@ -110,6 +110,8 @@ static void build_udp_url(char *buf, int buf_size,
         url_add_option(buf, buf_size, "ttl=%d", ttl);
     if (max_packet_size >=0)
         url_add_option(buf, buf_size, "pkt_size=%d", max_packet_size);
+    /* the RTP code waits on the socket itself */
+    url_add_option(buf, buf_size, "fifo_size=0");
 }
 
 /**
@@ -25,11 +25,17 @@
  */
 
 #define _BSD_SOURCE     /* Needed for using struct ip_mreq with recent glibc */
+#define _GNU_SOURCE     /* Needed for recvmmsg() */
 #include "avformat.h"
 #include <unistd.h>
+#include "libavutil/fifo.h"
+#include "libavutil/intreadwrite.h"
 #include "internal.h"
 #include "network.h"
 #include "os_support.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #if HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
@@ -55,10 +61,30 @@ typedef struct {
     int reuse_socket;
     struct sockaddr_storage dest_addr;
     int dest_addr_len;
+
+    /* circular buffer, filled by a receiving thread for input and
+     * emptied by a sending thread for paced output */
+    int circular_buffer_size;
+    AVFifoBuffer *fifo;     ///< datagrams, each preceded by its 32 bit size
+    uint8_t *batch_buf;     ///< UDP_BATCH datagrams of UDP_MAX_PKT_SIZE
+    int circular_buffer_error;
+    int overruns;           ///< datagrams dropped because the fifo was full
+    int bitrate;            ///< output pacing rate in bits per second, 0 for none
+    int64_t next_send;      ///< av_gettime() at which the next datagram is due
+#if HAVE_PTHREADS
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int exit_thread;
+#endif
 } UDPContext;
 
 #define UDP_TX_BUF_SIZE 32768
 #define UDP_MAX_PKT_SIZE 65536
+/** default circular buffer size, in units of 188 byte MPEG-TS packets */
+#define UDP_FIFO_SIZE (7 * 4096)
+/** maximum number of datagrams passed to one receive or send call */
+#define UDP_BATCH 16
 
 static int udp_set_multicast_ttl(int sockfd, int mcastTTL,
                                  struct sockaddr *addr)
@@ -255,6 +281,11 @@ static int udp_port(struct sockaddr_storage *addr, int addr_len)
  *         'localport=n' : set the local port
  *         'pkt_size=n'  : set max packet size
  *         'reuse=1'     : enable reusing the socket
+ *         'buffer_size=n' : set the socket buffer size
+ *         'fifo_size=n' : set the size of the circular buffer filled by the
+ *                         receiving thread, in units of 188 bytes;
+ *                         0 reads the socket on the caller's thread
+ *         'bitrate=n'   : send output from a separate thread at n bits/s
  *
  * @param h media file context
  * @param uri of the remote server
@@ -303,6 +334,287 @@ int udp_get_file_handle(URLContext *h)
     return s->udp_fd;
 }
 
+#if HAVE_PTHREADS
+/**
+ * Receive up to UDP_BATCH datagrams into s->batch_buf without blocking.
+ * @param len set to the sizes of the received datagrams
+ * @return number of datagrams, or -1 with the error in ff_neterrno()
+ */
+static int udp_recv_batch(UDPContext *s, int *len)
+{
+#if HAVE_RECVMMSG
+    struct mmsghdr msg[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    int i, n;
+
+    memset(msg, 0, sizeof(msg));
+    for (i = 0; i < UDP_BATCH; i++) {
+        iov[i].iov_base = s->batch_buf + i * UDP_MAX_PKT_SIZE;
+        iov[i].iov_len  = UDP_MAX_PKT_SIZE;
+        msg[i].msg_hdr.msg_iov    = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(s->udp_fd, msg, UDP_BATCH, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; i++)
+        len[i] = msg[i].msg_len;
+    return n;
+#else
+    int n = recv(s->udp_fd, s->batch_buf, UDP_MAX_PKT_SIZE, 0);
+    if (n < 0)
+        return n;
+    len[0] = n;
+    return 1;
+#endif
+}
+
+static void *udp_rx_thread(void *arg)
+{
+    UDPContext *s = arg;
+    int len[UDP_BATCH];
+    uint8_t size[4];
+    fd_set rfds;
+    struct timeval tv;
+    int i, n;
+
+    pthread_mutex_lock(&s->mutex);
+    while (!s->exit_thread) {
+        pthread_mutex_unlock(&s->mutex);
+
+        FD_ZERO(&rfds);
+        FD_SET(s->udp_fd, &rfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 100 * 1000;
+        n = select(s->udp_fd + 1, &rfds, NULL, NULL, &tv);
+        if (n > 0)
+            n = udp_recv_batch(s, len);
+
+        pthread_mutex_lock(&s->mutex);
+        if (n < 0) {
+            if (ff_neterrno() == FF_NETERROR(EAGAIN) ||
+                ff_neterrno() == FF_NETERROR(EINTR))
+                continue;
+            s->circular_buffer_error = AVERROR(EIO);
+            pthread_cond_signal(&s->cond);
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (av_fifo_space(s->fifo) < len[i] + 4) {
+                /* report the first drop and then every 1000th */
+                if (!(s->overruns++ % 1000))
+                    av_log(NULL, AV_LOG_WARNING,
+                           "UDP circular buffer overrun, %d datagrams dropped. "
+                           "Increase fifo_size to avoid it.\n", s->overruns);
+                continue;
+            }
+            AV_WL32(size, len[i]);
+            av_fifo_generic_write(s->fifo, size, 4, NULL);
+            av_fifo_generic_write(s->fifo, s->batch_buf + i * UDP_MAX_PKT_SIZE,
+                                  len[i], NULL);
+        }
+        if (n > 0)
+            pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+static int udp_start_thread(UDPContext *s, void *(*thread)(void *))
+{
+    s->fifo     = av_fifo_alloc(s->circular_buffer_size);
+    s->batch_buf = av_malloc(UDP_BATCH * UDP_MAX_PKT_SIZE);
+    if (!s->fifo || !s->batch_buf)
+        goto fail;
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, thread, s)) {
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->mutex);
+        goto fail;
+    }
+    return 0;
+fail:
+    av_fifo_free(s->fifo);
+    av_freep(&s->batch_buf);
+    s->fifo = NULL;
+    return AVERROR(ENOMEM);
+}
+
+static void udp_stop_thread(UDPContext *s)
+{
+    pthread_mutex_lock(&s->mutex);
+    s->exit_thread = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    pthread_join(s->thread, NULL);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mutex);
+    av_fifo_free(s->fifo);
+    av_freep(&s->batch_buf);
+    s->fifo = NULL;
+}
+
+/**
+ * Send up to n datagrams from s->batch_buf.
+ * @return number of datagrams sent, or -1 with the error in ff_neterrno()
+ */
+static int udp_send_batch(UDPContext *s, int *len, int n)
+{
+#if HAVE_SENDMMSG
+    struct mmsghdr msg[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    int i;
+
+    memset(msg, 0, sizeof(msg));
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = s->batch_buf + i * UDP_MAX_PKT_SIZE;
+        iov[i].iov_len  = len[i];
+        msg[i].msg_hdr.msg_iov     = &iov[i];
+        msg[i].msg_hdr.msg_iovlen  = 1;
+        msg[i].msg_hdr.msg_name    = &s->dest_addr;
+        msg[i].msg_hdr.msg_namelen = s->dest_addr_len;
+    }
+    return sendmmsg(s->udp_fd, msg, n, 0);
+#else
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (sendto(s->udp_fd, s->batch_buf + i * UDP_MAX_PKT_SIZE, len[i], 0,
+                   (struct sockaddr *) &s->dest_addr, s->dest_addr_len) < 0)
+            return i ? i : -1;
+    return n;
+#endif
+}
+
+/**
+ * Send the datagrams queued by udp_write() at s->bitrate. All datagrams
+ * that are due are passed to the kernel at once, so the batches grow
+ * when the thread falls behind.
+ */
+static void *udp_tx_thread(void *arg)
+{
+    UDPContext *s = arg;
+    int len[UDP_BATCH];
+    uint8_t size[4];
+    int i, n, sent;
+
+    pthread_mutex_lock(&s->mutex);
+    for (;;) {
+        int64_t now = av_gettime();
+
+        if (!av_fifo_size(s->fifo)) {
+            if (s->exit_thread)
+                break;
+            pthread_cond_wait(&s->cond, &s->mutex);
+            continue;
+        }
+        /* do not try to catch up after the input stalled */
+        if (s->next_send < now - 100000)
+            s->next_send = now;
+        if (s->next_send > now) {
+            struct timespec timeout;
+            timeout.tv_sec  = s->next_send / 1000000;
+            timeout.tv_nsec = s->next_send % 1000000 * 1000;
+            pthread_cond_timedwait(&s->cond, &s->mutex, &timeout);
+            continue;
+        }
+        for (n = 0; n < UDP_BATCH && s->next_send <= now &&
+                    av_fifo_size(s->fifo); n++) {
+            av_fifo_generic_read(s->fifo, size, 4, NULL);
+            len[n] = AV_RL32(size);
+            av_fifo_generic_read(s->fifo, s->batch_buf + n * UDP_MAX_PKT_SIZE,
+                                 len[n], NULL);
+            s->next_send += len[n] * 8000000LL / s->bitrate;
+        }
+        /* udp_write() may be waiting for space */
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+
+        for (i = 0; i < n; i += sent) {
+            sent = udp_send_batch(s, len + i, n - i);
+            if (sent < 0) {
+                if (ff_neterrno() != FF_NETERROR(EINTR) &&
+                    ff_neterrno() != FF_NETERROR(EAGAIN))
+                    break;
+                sent = 0;
+            }
+        }
+
+        pthread_mutex_lock(&s->mutex);
+        if (i < n) {
+            s->circular_buffer_error = AVERROR(EIO);
+            pthread_cond_signal(&s->cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+/** av_fifo_generic_write() callback reading from a const buffer. */
+static int udp_fifo_copy(void *src, void *dst, int size)
+{
+    const uint8_t **buf = src;
+    memcpy(dst, *buf, size);
+    *buf += size;
+    return size;
+}
+
+/** Queue a datagram for udp_tx_thread(), waiting for space if needed. */
+static int udp_write_fifo(UDPContext *s, const uint8_t *buf, int size)
+{
+    uint8_t tmp[4];
+    int ret = size;
+
+    if (size > UDP_MAX_PKT_SIZE || size + 4 > s->circular_buffer_size)
+        return AVERROR(EINVAL);
+    pthread_mutex_lock(&s->mutex);
+    while (!s->circular_buffer_error && av_fifo_space(s->fifo) < size + 4)
+        pthread_cond_wait(&s->cond, &s->mutex);
+    if (s->circular_buffer_error) {
+        ret = s->circular_buffer_error;
+    } else {
+        AV_WL32(tmp, size);
+        av_fifo_generic_write(s->fifo, tmp, 4, NULL);
+        av_fifo_generic_write(s->fifo, &buf, size, udp_fifo_copy);
+        pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+
+/** Return the next datagram received by the thread. */
+static int udp_read_fifo(UDPContext *s, uint8_t *buf, int size)
+{
+    uint8_t tmp[4];
+    int avail, len;
+
+    pthread_mutex_lock(&s->mutex);
+    while (!av_fifo_size(s->fifo)) {
+        struct timeval now;
+        struct timespec timeout;
+
+        if (s->circular_buffer_error || url_interrupt_cb()) {
+            len = s->circular_buffer_error ? s->circular_buffer_error
+                                           : AVERROR(EINTR);
+            pthread_mutex_unlock(&s->mutex);
+            return len;
+        }
+        /* wake up regularly to check the interrupt callback */
+        gettimeofday(&now, NULL);
+        timeout.tv_sec  = now.tv_sec + (now.tv_usec + 100000) / 1000000;
+        timeout.tv_nsec = (now.tv_usec + 100000) % 1000000 * 1000;
+        pthread_cond_timedwait(&s->cond, &s->mutex, &timeout);
+    }
+    av_fifo_generic_read(s->fifo, tmp, 4, NULL);
+    avail = AV_RL32(tmp);
+    len   = FFMIN(avail, size);
+    av_fifo_generic_read(s->fifo, buf, len, NULL);
+    av_fifo_drain(s->fifo, avail - len);
+    pthread_mutex_unlock(&s->mutex);
+    return len;
+}
+#endif /* HAVE_PTHREADS */
+
 /* put it in UDP context */
 /* return non zero if error */
 static int udp_open(URLContext *h, const char *uri, int flags)
@@ -328,6 +640,7 @@ static int udp_open(URLContext *h, const char *uri, int flags)
     h->priv_data = s;
     s->ttl = 16;
     s->buffer_size = is_output ? UDP_TX_BUF_SIZE : UDP_MAX_PKT_SIZE;
+    s->circular_buffer_size = is_output ? 0 : UDP_FIFO_SIZE * 188;
 
     p = strchr(uri, '?');
     if (p) {
@@ -344,6 +657,12 @@ static int udp_open(URLContext *h, const char *uri, int flags)
         if (find_info_tag(buf, sizeof(buf), "buffer_size", p)) {
             s->buffer_size = strtol(buf, NULL, 10);
         }
+        if (find_info_tag(buf, sizeof(buf), "fifo_size", p)) {
+            s->circular_buffer_size = strtol(buf, NULL, 10) * 188;
+        }
+        if (find_info_tag(buf, sizeof(buf), "bitrate", p)) {
+            s->bitrate = strtol(buf, NULL, 10);
+        }
     }
 
     /* fill the dest addr */
@@ -413,6 +732,14 @@ static int udp_open(URLContext *h, const char *uri, int flags)
     }
 
     s->udp_fd = udp_fd;
+
+#if HAVE_PTHREADS
+    /* drain the socket on a separate thread so that datagrams are not
+     * lost while the caller is busy */
+    if (!is_output && s->circular_buffer_size > 0 &&
+        udp_start_thread(s, udp_rx_thread) < 0)
+        goto fail;
+#endif
     return 0;
  fail:
     if (udp_fd >= 0)
@@ -429,6 +756,11 @@ static int udp_read(URLContext *h, uint8_t *buf, int size)
     int ret;
     struct timeval tv;
 
+#if HAVE_PTHREADS
+    if (s->fifo)
+        return udp_read_fifo(s, buf, size);
+#endif
+
     for(;;) {
         if (url_interrupt_cb())
             return AVERROR(EINTR);
@@ -461,6 +793,20 @@ static int udp_write(URLContext *h, const uint8_t *buf, int size)
     UDPContext *s = h->priv_data;
     int ret;
 
+#if HAVE_PTHREADS
+    if (s->bitrate > 0) {
+        if (!s->fifo) {
+            /* default to one second of output */
+            if (s->circular_buffer_size <= 0)
+                s->circular_buffer_size = FFMAX(s->bitrate / 8,
+                                                UDP_MAX_PKT_SIZE + 4);
+            if ((ret = udp_start_thread(s, udp_tx_thread)) < 0)
+                return ret;
+        }
+        return udp_write_fifo(s, buf, size);
+    }
+#endif
+
     for(;;) {
         ret = sendto (s->udp_fd, buf, size, 0,
                       (struct sockaddr *) &s->dest_addr,
@@ -480,6 +826,10 @@ static int udp_close(URLContext *h)
 {
     UDPContext *s = h->priv_data;
 
+#if HAVE_PTHREADS
+    if (s->fifo)
+        udp_stop_thread(s);
+#endif
     if (s->is_multicast && !(h->flags & URL_WRONLY))
         udp_leave_multicast_group(s->udp_fd, (struct sockaddr *)&s->dest_addr);
     closesocket(s->udp_fd);
@@ -496,3 +846,14 @@ URLProtocol udp_protocol = {
     udp_close,
     .url_get_file_handle = udp_get_file_handle,
 };
+
+int ff_udp_set_bitrate(URLContext *h, int bitrate)
+{
+    UDPContext *s = h->priv_data;
+
+    if (h->prot != &udp_protocol || !(h->flags & URL_WRONLY))
+        return AVERROR(EINVAL);
+    if (!s->bitrate)
+        s->bitrate = bitrate;
+    return 0;
+}
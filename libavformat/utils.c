@@ -24,12 +24,16 @@
 #include "libavcodec/opt.h"
 #include "metadata.h"
 #include "libavutil/avstring.h"
+#include "libavutil/crc.h"
 #include "riff.h"
 #include "audiointerleave.h"
 #include <sys/time.h>
 #include <time.h>
 #include <strings.h>
 #include <stdarg.h>
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #if CONFIG_NETWORK
 #include "network.h"
 #endif
@@ -318,7 +322,23 @@ FF_SYMVER(void, av_init_packet, (AVPacket *pkt), "LIBAVFORMAT_52")
 
 int av_get_packet(ByteIOContext *s, AVPacket *pkt, int size)
 {
-    int ret= av_new_packet(pkt, size);
+    int ret;
+
+    /* map packets from mapped input on their own instead of copying them,
+     * the shared buffer mapping is read only and has no zeroed padding */
+    if (s->map_packet && size > 0 && s->buf_end - s->buf_ptr >= size) {
+        int64_t pos = url_ftell(s);
+        ret = s->map_packet(s->opaque, pkt, pos, size);
+        if (ret >= 0) {
+            pkt->pos = pos;
+            s->buf_ptr += size;
+            return size;
+        }
+        if (ret != AVERROR(ENOSYS))
+            return ret;
+    }
+
+    ret= av_new_packet(pkt, size);
 
     if(ret<0)
         return ret;
@@ -407,6 +427,29 @@ static int set_codec_from_probe_data(AVFormatContext *s, AVStream *st, AVProbeDa
 /************************************************************/
 /* input media file */
 
+/**
+ * Give back the slack av_fast_realloc() left in the index arrays built
+ * by read_header(), which may stay allocated as long as the file is open.
+ */
+static void trim_index(AVFormatContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_streams; i++) {
+        AVStream *st = s->streams[i];
+        unsigned int size = st->nb_index_entries * sizeof(AVIndexEntry);
+        AVIndexEntry *entries;
+
+        if (!size || st->index_entries_allocated_size <= size)
+            continue;
+        entries = av_realloc(st->index_entries, size);
+        if (entries) {
+            st->index_entries = entries;
+            st->index_entries_allocated_size = size;
+        }
+    }
+}
+
 /**
  * Open a media file from an IO stream. 'fmt' must be specified.
  */
@@ -457,6 +500,8 @@ int av_open_input_stream(AVFormatContext **ic_ptr,
     if (pb && !ic->data_offset)
         ic->data_offset = url_ftell(ic->pb);
 
+    trim_index(ic);
+
 #if LIBAVFORMAT_VERSION_MAJOR < 53
     ff_metadata_demux_compat(ic);
 #endif
@@ -1077,6 +1122,7 @@ static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
                     if(pkt->data == st->cur_pkt.data && pkt->size == st->cur_pkt.size){
                         s->cur_st = NULL;
                         pkt->destruct= st->cur_pkt.destruct;
+                        pkt->priv    = st->cur_pkt.priv;
                         st->cur_pkt.destruct= NULL;
                         st->cur_pkt.data    = NULL;
                         assert(st->cur_len == 0);
@@ -1355,7 +1401,12 @@ int av_add_index_entry(AVStream *st,
 
     st->index_entries= entries;
 
-    index= av_index_search_timestamp(st, timestamp, AVSEEK_FLAG_ANY);
+    /* demuxers build their index in timestamp order almost always, so
+     * appending needs neither the search nor the memmove below */
+    if(!st->nb_index_entries || entries[st->nb_index_entries-1].timestamp < timestamp)
+        index= -1;
+    else
+        index= av_index_search_timestamp(st, timestamp, AVSEEK_FLAG_ANY);
 
     if(index<0){
         index= st->nb_index_entries++;
@@ -1386,7 +1437,7 @@ int av_index_search_timestamp(AVStream *st, int64_t wanted_timestamp,
 {
     AVIndexEntry *entries= st->index_entries;
     int nb_entries= st->nb_index_entries;
-    int a, b, m;
+    int a, b, m, interp = 0;
     int64_t timestamp;
 
     a = - 1;
@@ -1397,7 +1448,17 @@ int av_index_search_timestamp(AVStream *st, int64_t wanted_timestamp,
         a= b-1;
 
     while (b - a > 1) {
-        m = (a + b) >> 1;
+        /* Index timestamps are usually close to evenly spaced, so guess
+         * the position by interpolation first; alternate with bisection
+         * to keep the worst case logarithmic. */
+        if (interp && a >= 0 && b < nb_entries &&
+            entries[b].timestamp > entries[a].timestamp) {
+            m = a + av_rescale(wanted_timestamp - entries[a].timestamp, b - a,
+                               entries[b].timestamp - entries[a].timestamp);
+            m = av_clip(m, a + 1, b - 1);
+        } else
+            m = (a + b) >> 1;
+        interp = !interp;
         timestamp = entries[m].timestamp;
         if(timestamp >= wanted_timestamp)
             b = m;
@@ -1417,6 +1478,203 @@ int av_index_search_timestamp(AVStream *st, int64_t wanted_timestamp,
     return  m;
 }
 
+static void reset_index(AVStream *st)
+{
+    av_freep(&st->index_entries);
+    st->nb_index_entries = 0;
+    st->index_entries_allocated_size = 0;
+    st->index_complete = 0;
+}
+
+/**
+ * Replace the index of the streams by the ones collected in tmp,
+ * skipping streams whose discard is AVDISCARD_ALL if not all is set.
+ */
+static void swap_index(AVFormatContext *s, AVStream *tmp, int all)
+{
+    int i;
+
+    for (i = 0; i < s->nb_streams; i++) {
+        AVStream *st = s->streams[i];
+
+        if (!all && st->discard >= AVDISCARD_ALL) {
+            reset_index(&tmp[i]);
+            continue;
+        }
+        reset_index(st);
+        st->index_entries                = tmp[i].index_entries;
+        st->nb_index_entries             = tmp[i].nb_index_entries;
+        st->index_entries_allocated_size = tmp[i].index_entries_allocated_size;
+        st->index_complete               = tmp[i].index_complete;
+    }
+}
+
+int av_build_index(AVFormatContext *s)
+{
+    AVStream *tmp;
+    AVPacket pkt;
+    int i, ret;
+
+    if (url_is_streamed(s->pb))
+        return AVERROR(ENOSYS);
+
+    /* collect the entries separately, demuxers such as mpeg add entries
+     * of their own for non-keyframes while reading */
+    tmp = av_mallocz(s->nb_streams * sizeof(*tmp));
+    if (!tmp)
+        return AVERROR(ENOMEM);
+
+    ff_read_frame_flush(s);
+    if ((ret = url_fseek(s->pb, s->data_offset, SEEK_SET)) < 0)
+        goto fail;
+
+    for (;;) {
+        ret = av_read_frame(s, &pkt);
+        if (ret == AVERROR(EAGAIN))
+            continue;
+        if (ret < 0)
+            break;
+        if ((pkt.flags & AV_PKT_FLAG_KEY) && pkt.dts != AV_NOPTS_VALUE && pkt.pos >= 0)
+            av_add_index_entry(&tmp[pkt.stream_index], pkt.pos, pkt.dts,
+                               pkt.size, 0, AVINDEX_KEYFRAME);
+        av_free_packet(&pkt);
+    }
+    if ((ret = url_ferror(s->pb)) < 0)
+        goto fail;
+
+    for (i = 0; i < s->nb_streams; i++)
+        tmp[i].index_complete = tmp[i].nb_index_entries > 0;
+    swap_index(s, tmp, 0);
+    av_free(tmp);
+
+    ff_read_frame_flush(s);
+    ret = url_fseek(s->pb, s->data_offset, SEEK_SET);
+    return ret < 0 ? ret : 0;
+fail:
+    for (i = 0; i < s->nb_streams; i++)
+        reset_index(&tmp[i]);
+    av_free(tmp);
+    return ret;
+}
+
+#define INDEX_TAG     MKTAG('F', 'F', 'I', 'X')
+#define INDEX_VERSION 1
+
+static void put_sv(ByteIOContext *pb, int64_t val)
+{
+    ff_put_v(pb, (uint64_t)val << 1 ^ (val >> 63));
+}
+
+static int64_t get_sv(ByteIOContext *pb)
+{
+    uint64_t v = ff_get_v(pb);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+int av_save_index(AVFormatContext *s, ByteIOContext *pb)
+{
+    int i, j;
+
+    put_le32(pb, INDEX_TAG);
+    put_byte(pb, INDEX_VERSION);
+    ff_put_v(pb, FFMAX(url_fsize(s->pb), 0));
+    ff_put_v(pb, s->nb_streams);
+
+    for (i = 0; i < s->nb_streams; i++) {
+        AVStream *st = s->streams[i];
+        int64_t pos = 0, timestamp = 0;
+
+        ff_put_v(pb, st->index_complete);
+        ff_put_v(pb, st->nb_index_entries);
+        for (j = 0; j < st->nb_index_entries; j++) {
+            AVIndexEntry *ie = &st->index_entries[j];
+            put_sv(pb, ie->pos - pos);
+            put_sv(pb, ie->timestamp - timestamp);
+            ff_put_v(pb, (uint64_t)ie->size << 2 | (ie->flags & 3));
+            ff_put_v(pb, ie->min_distance);
+            pos       = ie->pos;
+            timestamp = ie->timestamp;
+        }
+    }
+    put_flush_packet(pb);
+
+    return url_ferror(pb);
+}
+
+int av_load_index(AVFormatContext *s, ByteIOContext *pb)
+{
+    AVStream *tmp;
+    int i, j, ret = AVERROR_INVALIDDATA;
+
+    if (get_le32(pb) != INDEX_TAG || get_byte(pb) != INDEX_VERSION)
+        return AVERROR_INVALIDDATA;
+    if (ff_get_v(pb) != FFMAX(url_fsize(s->pb), 0) ||
+        ff_get_v(pb) != s->nb_streams) {
+        av_log(s, AV_LOG_ERROR, "Index does not match the file\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    /* read into scratch streams so that a damaged index file leaves the
+     * current index alone */
+    tmp = av_mallocz(s->nb_streams * sizeof(*tmp));
+    if (!tmp)
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < s->nb_streams; i++) {
+        int64_t pos = 0, timestamp = 0;
+        int complete = ff_get_v(pb);
+        unsigned int nb_entries = ff_get_v(pb);
+
+        for (j = 0; j < nb_entries; j++) {
+            unsigned int size, distance;
+
+            pos       += get_sv(pb);
+            timestamp += get_sv(pb);
+            size       = ff_get_v(pb);
+            distance   = ff_get_v(pb);
+            if (url_feof(pb))
+                goto fail;
+            if (av_add_index_entry(&tmp[i], pos, timestamp, size >> 2,
+                                   distance, size & 3) < 0) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+        }
+        tmp[i].index_complete = complete && nb_entries;
+    }
+
+    swap_index(s, tmp, 1);
+    av_free(tmp);
+    return 0;
+fail:
+    for (i = 0; i < s->nb_streams; i++)
+        reset_index(&tmp[i]);
+    av_free(tmp);
+    return ret;
+}
+
+/**
+ * Seek to the index entry for timestamp in a stream with a complete
+ * index, without reading the file.
+ */
+static int seek_frame_index(AVFormatContext *s, AVStream *st,
+                            int64_t timestamp, int flags)
+{
+    AVIndexEntry *ie;
+    int64_t ret;
+    int index = av_index_search_timestamp(st, timestamp, flags);
+
+    if (index < 0)
+        return -1;
+
+    ie = &st->index_entries[index];
+    if ((ret = url_fseek(s->pb, ie->pos, SEEK_SET)) < 0)
+        return ret;
+    av_update_cur_dts(s, st, ie->timestamp);
+
+    return 0;
+}
+
 #define DEBUG_SEEK
 
 int av_seek_frame_binary(AVFormatContext *s, int stream_index, int64_t target_ts, int flags){
@@ -1705,6 +1963,13 @@ int av_seek_frame(AVFormatContext *s, int stream_index, int64_t timestamp, int f
         timestamp = av_rescale(timestamp, st->time_base.den, AV_TIME_BASE * (int64_t)st->time_base.num);
     }
 
+    /* formats without an index search the file for every seek, which a
+     * complete index from av_build_index() or av_load_index() avoids */
+    st = s->streams[stream_index];
+    if (st->index_complete && s->iformat->read_timestamp &&
+        seek_frame_index(s, st, timestamp, flags) >= 0)
+        return 0;
+
     /* first, we try the format specific seek */
     if (s->iformat->read_seek)
         ret = s->iformat->read_seek(s, stream_index, timestamp, flags);
@@ -2019,13 +2284,16 @@ static int has_codec_parameters(AVCodecContext *enc)
     return enc->codec_id != CODEC_ID_NONE && val != 0;
 }
 
-static int has_decode_delay_been_guessed(AVStream *st)
+static int has_decode_delay_been_guessed(AVStream *st, int nb_frames)
 {
     return st->codec->codec_id != CODEC_ID_H264 ||
-        st->codec_info_nb_frames >= 4 + st->codec->has_b_frames;
+        nb_frames >= 4 + st->codec->has_b_frames;
 }
 
-static int try_decode_frame(AVStream *st, AVPacket *avpkt)
+/**
+ * @param nb_frames number of frames of the stream read before avpkt
+ */
+static int try_decode_frame(AVStream *st, AVPacket *avpkt, int nb_frames)
 {
     int16_t *samples;
     AVCodec *codec;
@@ -2041,7 +2309,7 @@ static int try_decode_frame(AVStream *st, AVPacket *avpkt)
             return ret;
     }
 
-    if(!has_codec_parameters(st->codec) || !has_decode_delay_been_guessed(st)){
+    if(!has_codec_parameters(st->codec) || !has_decode_delay_been_guessed(st, nb_frames)){
         switch(st->codec->codec_type) {
         case AVMEDIA_TYPE_VIDEO:
             avcodec_get_frame_defaults(&picture);
@@ -2155,6 +2423,207 @@ static int tb_unreliable(AVCodecContext *c){
     return 0;
 }
 
+#define MAX_PROBE_BATCH 32
+
+/**
+ * Packets read by av_find_stream_info() which still have to be decoded,
+ * used with AVFMT_FLAG_PROBE_THREADS.
+ */
+typedef struct ProbeQueue {
+    AVStream *st;
+    AVPacket *pkt[MAX_PROBE_BATCH];
+    int nb_frames[MAX_PROBE_BATCH];
+    int nb_pkts;
+#if HAVE_PTHREADS
+    pthread_t thread;
+#endif
+} ProbeQueue;
+
+static void *decode_probe_queue(void *arg)
+{
+    ProbeQueue *q = arg;
+    int i;
+
+    /* stop as soon as the stream has its parameters, like the serial path */
+    for (i = 0; i < q->nb_pkts; i++)
+        try_decode_frame(q->st, q->pkt[i], q->nb_frames[i]);
+    q->nb_pkts = 0;
+    return NULL;
+}
+
+/**
+ * Decode the queued packets, each stream in a thread of its own, with
+ * no more threads than CPUs. The caller must not touch the codec
+ * contexts meanwhile, so this runs between reading packets.
+ */
+static void decode_probe_queues(ProbeQueue *queues, int nb_queues)
+{
+    int active[MAX_STREAMS], nb_active = 0, nb_threads = 0;
+    int started[MAX_STREAMS] = {0};
+    int i;
+
+    for (i = 0; i < nb_queues; i++) {
+        ProbeQueue *q = &queues[i];
+
+        if (!q->nb_pkts)
+            continue;
+        /* avcodec_open() must not run concurrently */
+        if (!q->st->codec->codec) {
+            AVCodec *codec = avcodec_find_decoder(q->st->codec->codec_id);
+            if (!codec || avcodec_open(q->st->codec, codec) < 0) {
+                q->nb_pkts = 0;
+                continue;
+            }
+        }
+        active[nb_active++] = i;
+    }
+    if (!nb_active)
+        return;
+
+#if HAVE_PTHREADS
+    /* the calling thread decodes too */
+    nb_threads = FFMIN(nb_active, ff_get_cpu_count()) - 1;
+    for (i = 0; i < nb_threads; i++)
+        started[i] = !pthread_create(&queues[active[i]].thread, NULL,
+                                     decode_probe_queue, &queues[active[i]]);
+#endif
+    for (i = 0; i < nb_active; i++)
+        if (!started[i])
+            decode_probe_queue(&queues[active[i]]);
+#if HAVE_PTHREADS
+    for (i = 0; i < nb_threads; i++)
+        if (started[i])
+            pthread_join(queues[active[i]].thread, NULL);
+#endif
+}
+
+#define PROBE_CACHE_SIZE 64
+
+/**
+ * Codec parameters found by av_find_stream_info() for a stream, reused
+ * for streams with the same signature with AVFMT_FLAG_PROBE_CACHE.
+ */
+typedef struct ProbeCacheEntry {
+    uint32_t key;
+    enum AVMediaType codec_type;
+    int width, height;
+    enum PixelFormat pix_fmt;
+    int has_b_frames;
+    AVRational sample_aspect_ratio;
+    AVRational time_base;
+    int ticks_per_frame;
+    int sample_rate, channels, frame_size;
+    enum SampleFormat sample_fmt;
+    int64_t channel_layout;
+    int bit_rate;
+    AVRational r_frame_rate, avg_frame_rate;
+} ProbeCacheEntry;
+
+static ProbeCacheEntry probe_cache[PROBE_CACHE_SIZE];
+static int probe_cache_next;
+#if HAVE_PTHREADS
+static pthread_mutex_t probe_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * The signature of a stream: the input, the stream id and what the
+ * demuxer knows about the codec.
+ */
+static uint32_t probe_cache_key(AVFormatContext *ic, AVStream *st)
+{
+    const AVCRC *tab = av_crc_get_table(AV_CRC_32_IEEE);
+    AVCodecContext *c = st->codec;
+    uint32_t key = 0;
+    int32_t ids[3] = { st->id, c->codec_id, c->codec_tag };
+
+    key = av_crc(tab, key, ic->iformat->name, strlen(ic->iformat->name));
+    key = av_crc(tab, key, ic->filename, strlen(ic->filename));
+    key = av_crc(tab, key, (const uint8_t *)ids, sizeof(ids));
+    if (c->extradata)
+        key = av_crc(tab, key, c->extradata, c->extradata_size);
+    return key ? key : 1;
+}
+
+static int probe_cache_get(AVFormatContext *ic, AVStream *st)
+{
+    uint32_t key = probe_cache_key(ic, st);
+    AVCodecContext *c = st->codec;
+    int i, found = 0;
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&probe_cache_mutex);
+#endif
+    for (i = 0; i < PROBE_CACHE_SIZE; i++) {
+        ProbeCacheEntry *e = &probe_cache[i];
+        if (e->key != key || e->codec_type != c->codec_type)
+            continue;
+        c->width                  = e->width;
+        c->height                 = e->height;
+        c->pix_fmt                = e->pix_fmt;
+        /* has_b_frames changes how timestamps are filled in, so it is
+           only set up front where it would be guessed by decoding */
+        if (c->codec_id == CODEC_ID_H264)
+            c->has_b_frames       = e->has_b_frames;
+        c->sample_aspect_ratio    = e->sample_aspect_ratio;
+        c->time_base              = e->time_base;
+        c->ticks_per_frame        = e->ticks_per_frame;
+        c->sample_rate            = e->sample_rate;
+        c->channels               = e->channels;
+        c->frame_size             = e->frame_size;
+        c->sample_fmt             = e->sample_fmt;
+        c->channel_layout         = e->channel_layout;
+        c->bit_rate               = e->bit_rate;
+        if (!st->r_frame_rate.num)
+            st->r_frame_rate      = e->r_frame_rate;
+        if (!st->avg_frame_rate.num)
+            st->avg_frame_rate    = e->avg_frame_rate;
+        found = has_codec_parameters(c);
+        break;
+    }
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&probe_cache_mutex);
+#endif
+    return found;
+}
+
+static void probe_cache_put(AVFormatContext *ic, AVStream *st, uint32_t key)
+{
+    AVCodecContext *c = st->codec;
+    ProbeCacheEntry *e = NULL;
+    int i;
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&probe_cache_mutex);
+#endif
+    for (i = 0; i < PROBE_CACHE_SIZE; i++)
+        if (probe_cache[i].key == key)
+            e = &probe_cache[i];
+    if (!e) {
+        e = &probe_cache[probe_cache_next];
+        probe_cache_next = (probe_cache_next + 1) % PROBE_CACHE_SIZE;
+    }
+    e->key                 = key;
+    e->codec_type          = c->codec_type;
+    e->width               = c->width;
+    e->height              = c->height;
+    e->pix_fmt             = c->pix_fmt;
+    e->has_b_frames        = c->has_b_frames;
+    e->sample_aspect_ratio = c->sample_aspect_ratio;
+    e->time_base           = c->time_base;
+    e->ticks_per_frame     = c->ticks_per_frame;
+    e->sample_rate         = c->sample_rate;
+    e->channels            = c->channels;
+    e->frame_size          = c->frame_size;
+    e->sample_fmt          = c->sample_fmt;
+    e->channel_layout      = c->channel_layout;
+    e->bit_rate            = c->bit_rate;
+    e->r_frame_rate        = st->r_frame_rate;
+    e->avg_frame_rate      = st->avg_frame_rate;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&probe_cache_mutex);
+#endif
+}
+
 int av_find_stream_info(AVFormatContext *ic)
 {
     int i, count, ret, read_size, j;
@@ -2166,9 +2635,20 @@ int av_find_stream_info(AVFormatContext *ic)
     double (*duration_error)[MAX_STD_TIMEBASES];
     int64_t old_offset = url_ftell(ic->pb);
     int64_t codec_info_duration[MAX_STREAMS]={0};
+    uint32_t cache_key[MAX_STREAMS]={0};
+    int cached[MAX_STREAMS]={0};
+    ProbeQueue *queues = NULL;
+    int nb_queued = 0;
 
     duration_error = av_mallocz(MAX_STREAMS * sizeof(*duration_error));
     if (!duration_error) return AVERROR(ENOMEM);
+    if (ic->flags & AVFMT_FLAG_PROBE_THREADS) {
+        queues = av_mallocz(MAX_STREAMS * sizeof(*queues));
+        if (!queues) {
+            av_free(duration_error);
+            return AVERROR(ENOMEM);
+        }
+    }
 
     for(i=0;i<ic->nb_streams;i++) {
         st = ic->streams[i];
@@ -2191,6 +2671,11 @@ int av_find_stream_info(AVFormatContext *ic)
             }
         }
         assert(!st->codec->codec);
+        if (ic->flags & AVFMT_FLAG_PROBE_CACHE) {
+            cache_key[i] = probe_cache_key(ic, st);
+            if (!has_codec_parameters(st->codec))
+                cached[i] = probe_cache_get(ic, st);
+        }
         //try to just open decoders, in case this is enough to get parameters
         if(!has_codec_parameters(st->codec)){
             AVCodec *codec = avcodec_find_decoder(st->codec->codec_id);
@@ -2212,6 +2697,23 @@ int av_find_stream_info(AVFormatContext *ic)
             break;
         }
 
+        /* decode the queued packets once every stream which still needs
+           decoding has some, or enough have been collected */
+        if (nb_queued) {
+            for(i=0;i<ic->nb_streams;i++) {
+                st = ic->streams[i];
+                if (st->codec->codec_type == AVMEDIA_TYPE_VIDEO &&
+                    !queues[i].nb_pkts && !cached[i] &&
+                    (!has_codec_parameters(st->codec) ||
+                     !has_decode_delay_been_guessed(st, st->codec_info_nb_frames)))
+                    break;
+            }
+            if (i == ic->nb_streams || nb_queued >= MAX_PROBE_BATCH) {
+                decode_probe_queues(queues, ic->nb_streams);
+                nb_queued = 0;
+            }
+        }
+
         /* check if one codec still needs to be handled */
         for(i=0;i<ic->nb_streams;i++) {
             st = ic->streams[i];
@@ -2251,6 +2753,10 @@ int av_find_stream_info(AVFormatContext *ic)
             continue;
         if (ret < 0) {
             /* EOF or error */
+            if (nb_queued) {
+                decode_probe_queues(queues, ic->nb_streams);
+                nb_queued = 0;
+            }
             ret = -1; /* we could not have all the codec parameters before EOF */
             for(i=0;i<ic->nb_streams;i++) {
                 st = ic->streams[i];
@@ -2268,6 +2774,7 @@ int av_find_stream_info(AVFormatContext *ic)
         pkt= add_to_pktbuf(&ic->packet_buffer, &pkt1, &ic->packet_buffer_end);
         if(av_dup_packet(pkt) < 0) {
             av_free(duration_error);
+            av_free(queues);
             return AVERROR(ENOMEM);
         }
 
@@ -2321,13 +2828,29 @@ int av_find_stream_info(AVFormatContext *ic)
            decompress the frame. We try to avoid that in most cases as
            it takes longer and uses more memory. For MPEG-4, we need to
            decompress for QuickTime. */
-        if (!has_codec_parameters(st->codec) || !has_decode_delay_been_guessed(st))
-            try_decode_frame(st, pkt);
+        if (!has_codec_parameters(st->codec) ||
+            (!cached[st->index] && !has_decode_delay_been_guessed(st, st->codec_info_nb_frames))) {
+            /* audio is cheap to decode and its packet durations depend
+               on the frame size found by decoding, so only video waits */
+            if (queues && st->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+                ProbeQueue *q = &queues[st->index];
+                q->st = st;
+                q->pkt      [q->nb_pkts] = pkt;
+                q->nb_frames[q->nb_pkts] = st->codec_info_nb_frames;
+                q->nb_pkts++;
+                nb_queued++;
+            } else
+                try_decode_frame(st, pkt, st->codec_info_nb_frames);
+        }
 
         st->codec_info_nb_frames++;
         count++;
     }
 
+    if (nb_queued)
+        decode_probe_queues(queues, ic->nb_streams);
+    av_free(queues);
+
     // close codecs which were opened in try_decode_frame()
     for(i=0;i<ic->nb_streams;i++) {
         st = ic->streams[i];
@@ -2387,6 +2910,14 @@ int av_find_stream_info(AVFormatContext *ic)
         }
     }
 
+    if (ic->flags & AVFMT_FLAG_PROBE_CACHE) {
+        for(i=0;i<ic->nb_streams && i<MAX_STREAMS;i++) {
+            st = ic->streams[i];
+            if (cache_key[i] && has_codec_parameters(st->codec))
+                probe_cache_put(ic, st, cache_key[i]);
+        }
+    }
+
     av_estimate_timings(ic, old_offset);
 
     compute_chapters_end(ic);
@@ -2895,10 +3426,12 @@ int ff_interleave_compare_dts(AVFormatContext *s, AVPacket *next, AVPacket *pkt)
     AVStream *st2= s->streams[ next->stream_index];
     int64_t a= st2->time_base.num * (int64_t)st ->time_base.den;
     int64_t b= st ->time_base.num * (int64_t)st2->time_base.den;
+    if (a == b)
+        return pkt->dts < next->dts;
     return av_rescale_rnd(pkt->dts, b, a, AV_ROUND_DOWN) < next->dts;
 }
 
-int av_interleave_packet_per_dts(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush){
+int ff_interleave_get_list_packet(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush){
     AVPacketList *pktl;
     int stream_count=0;
     int i;
@@ -2928,6 +3461,176 @@ int av_interleave_packet_per_dts(AVFormatContext *s, AVPacket *out, AVPacket *pk
     }
 }
 
+typedef struct InterleaveNode {
+    AVPacket pkt;
+    uint64_t seq;                ///< arrival order, orders packets with equal dts
+    struct InterleaveNode *next;
+} InterleaveNode;
+
+typedef struct InterleaveQueue {
+    InterleaveNode *first, *last;
+} InterleaveQueue;
+
+/**
+ * State of av_interleave_packet_per_dts(). Each stream has a FIFO of
+ * packets, and a binary min-heap orders the streams with queued packets
+ * by the dts of their first packet, so adding or taking a packet costs
+ * O(log(number of streams)) rather than a walk over the whole buffer.
+ */
+typedef struct PacketInterleaver {
+    int nb_streams;
+    InterleaveQueue *queues;
+    int *heap;                   ///< indexes of the streams with queued packets
+    int heap_size;
+    uint64_t seq;
+    InterleaveNode *free_nodes;  ///< nodes kept for reuse
+} PacketInterleaver;
+
+/** @return nonzero if the first packet of stream a is output before the one of b */
+static int interleave_before(AVFormatContext *s, PacketInterleaver *il, int a, int b)
+{
+    InterleaveNode *na = il->queues[a].first, *nb = il->queues[b].first;
+
+    /* same order as inserting the later packet into a sorted list */
+    if (na->seq < nb->seq)
+        return !ff_interleave_compare_dts(s, &na->pkt, &nb->pkt);
+    else
+        return  ff_interleave_compare_dts(s, &nb->pkt, &na->pkt);
+}
+
+static void interleave_heap_up(AVFormatContext *s, PacketInterleaver *il, int i)
+{
+    int *heap = il->heap;
+
+    while (i > 0) {
+        int parent = (i - 1) >> 1;
+        if (!interleave_before(s, il, heap[i], heap[parent]))
+            break;
+        FFSWAP(int, heap[i], heap[parent]);
+        i = parent;
+    }
+}
+
+static void interleave_heap_down(AVFormatContext *s, PacketInterleaver *il, int i)
+{
+    int *heap = il->heap;
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= il->heap_size)
+            break;
+        if (child + 1 < il->heap_size &&
+            interleave_before(s, il, heap[child + 1], heap[child]))
+            child++;
+        if (!interleave_before(s, il, heap[child], heap[i]))
+            break;
+        FFSWAP(int, heap[i], heap[child]);
+        i = child;
+    }
+}
+
+static PacketInterleaver *get_interleaver(AVFormatContext *s)
+{
+    PacketInterleaver *il = s->interleaver;
+
+    if (!il) {
+        il = s->interleaver = av_mallocz(sizeof(*il));
+        if (!il)
+            return NULL;
+    }
+    if (il->nb_streams < s->nb_streams) {
+        InterleaveQueue *queues;
+        int *heap;
+
+        queues = av_realloc(il->queues, s->nb_streams * sizeof(*queues));
+        if (!queues)
+            return NULL;
+        il->queues = queues;
+        heap = av_realloc(il->heap, s->nb_streams * sizeof(*heap));
+        if (!heap)
+            return NULL;
+        il->heap = heap;
+        memset(&queues[il->nb_streams], 0,
+               (s->nb_streams - il->nb_streams) * sizeof(*queues));
+        il->nb_streams = s->nb_streams;
+    }
+    return il;
+}
+
+static void free_interleaver(AVFormatContext *s)
+{
+    PacketInterleaver *il = s->interleaver;
+    InterleaveNode *node;
+    int i;
+
+    if (!il)
+        return;
+    for (i = 0; i < il->nb_streams; i++) {
+        while ((node = il->queues[i].first)) {
+            il->queues[i].first = node->next;
+            av_free_packet(&node->pkt);
+            av_free(node);
+        }
+    }
+    while ((node = il->free_nodes)) {
+        il->free_nodes = node->next;
+        av_free(node);
+    }
+    av_freep(&il->queues);
+    av_freep(&il->heap);
+    av_freep(&s->interleaver);
+}
+
+int av_interleave_packet_per_dts(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush){
+    PacketInterleaver *il = get_interleaver(s);
+    InterleaveNode *node;
+    InterleaveQueue *q;
+
+    if (!il)
+        return AVERROR(ENOMEM);
+
+    if (pkt) {
+        if ((node = il->free_nodes))
+            il->free_nodes = node->next;
+        else if (!(node = av_malloc(sizeof(*node))))
+            return AVERROR(ENOMEM);
+        node->pkt  = *pkt;
+        node->seq  = il->seq++;
+        node->next = NULL;
+        pkt->destruct= NULL;             // do not free original but only the copy
+        av_dup_packet(&node->pkt);       // duplicate the packet if it uses non-alloced memory
+
+        q = &il->queues[pkt->stream_index];
+        if (q->last) {
+            q->last->next = node;
+            q->last = node;
+        } else {
+            q->first = q->last = node;
+            il->heap[il->heap_size] = pkt->stream_index;
+            interleave_heap_up(s, il, il->heap_size++);
+        }
+    }
+
+    if (il->heap_size && (il->heap_size == s->nb_streams || flush)) {
+        q = &il->queues[il->heap[0]];
+        node = q->first;
+        *out = node->pkt;
+
+        if (!(q->first = node->next)) {
+            q->last = NULL;
+            il->heap[0] = il->heap[--il->heap_size];
+        }
+        interleave_heap_down(s, il, 0);
+
+        node->next = il->free_nodes;
+        il->free_nodes = node;
+        return 1;
+    }else{
+        av_init_packet(out);
+        return 0;
+    }
+}
+
 /**
  * Interleave an AVPacket correctly so it can be muxed.
  * @param out the interleaved packet will be output here
@@ -3003,6 +3706,7 @@ int av_write_trailer(AVFormatContext *s)
 fail:
     if(ret == 0)
        ret=url_ferror(s->pb);
+    free_interleaver(s);
     for(i=0;i<s->nb_streams;i++) {
         av_freep(&s->streams[i]->priv_data);
         av_freep(&s->streams[i]->index_entries);
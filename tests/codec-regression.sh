@@ -103,21 +103,38 @@ fi
 if [ -n "$do_mpeg4" ] ; then
 do_video_encoding odivx.mp4 "-flags +mv4 -mbd bits -qscale 10" "-an -vcodec mpeg4"
 do_video_decoding
+do_video_decoding "-threads 2 -thread_type frame"
+fi
+
+if [ -n "$do_parallel_outputs" ] ; then
+# the outputs of the mpeg and mpeg4 tests, encoded in parallel, must
+# not differ from the serially encoded ones
+file=${outfile}parallel-mpeg1.mpg
+file2=${outfile}parallel-odivx.mp4
+$echov $ffmpeg $FFMPEG_OPTS -f image2 -vcodec pgmyuv -i $raw_src -parallel_outputs -qscale 10 -f mpeg1video $target_path/$file -flags +mv4 -mbd bits -qscale 10 -an -vcodec mpeg4 $target_path/$file2
+$ffmpeg $FFMPEG_OPTS -f image2 -vcodec pgmyuv -i $raw_src -parallel_outputs -qscale 10 -f mpeg1video $target_path/$file -flags +mv4 -mbd bits -qscale 10 -an -vcodec mpeg4 $target_path/$file2
+do_md5sum $file >> $logfile
+wc -c $file >> $logfile
+do_md5sum $file2 >> $logfile
+wc -c $file2 >> $logfile
 fi
 
 if [ -n "$do_huffyuv" ] ; then
 do_video_encoding huffyuv.avi "" "-an -vcodec huffyuv -pix_fmt yuv422p -sws_flags neighbor+bitexact"
 do_video_decoding "" "-strict -2 -pix_fmt yuv420p -sws_flags neighbor+bitexact"
+do_video_decoding "-threads 2 -thread_type frame" "-strict -2 -pix_fmt yuv420p -sws_flags neighbor+bitexact"
 fi
 
 if [ -n "$do_rc" ] ; then
 do_video_encoding mpeg4-rc.avi "-b 400k -bf 2" "-an -vcodec mpeg4"
 do_video_decoding
+do_video_decoding "-threads 2 -thread_type frame"
 fi
 
 if [ -n "$do_mpeg4adv" ] ; then
 do_video_encoding mpeg4-adv.avi "-qscale 9 -flags +mv4+part+aic -trellis 1 -mbd bits -ps 200" "-an -vcodec mpeg4"
 do_video_decoding
+do_video_decoding "-threads 2 -thread_type frame"
 
 do_video_encoding mpeg4-qprd.avi "-b 450k -bf 2 -trellis 1 -flags +mv4+qprd+mv0 -cmp 2 -subcmp 2 -mbd rd" "-an -vcodec mpeg4"
 do_video_decoding
@@ -127,11 +144,13 @@ do_video_decoding
 
 do_video_encoding mpeg4-Q.avi "-qscale 7 -flags +mv4+qpel -mbd 2 -bf 2 -cmp 1 -subcmp 2" "-an -vcodec mpeg4"
 do_video_decoding
+do_video_decoding "-threads 2 -thread_type frame"
 fi
 
 if [ -n "$do_mpeg4thread" ] ; then
 do_video_encoding mpeg4-thread.avi "-b 500k -flags +mv4+part+aic -trellis 1 -mbd bits -ps 200 -bf 2" "-an -vcodec mpeg4 -threads 2"
 do_video_decoding
+do_video_decoding "-threads 2 -thread_type frame"
 fi
 
 if [ -n "$do_error" ] ; then
@@ -194,6 +213,11 @@ do_video_encoding ffv1.avi "-strict -2" "-an -vcodec ffv1"
 do_video_decoding
 fi
 
+if [ -n "$do_ffv1v2" ] ; then
+do_video_encoding ffv1v2.avi "-strict -2 -level 2" "-an -vcodec ffv1 -threads 2"
+do_video_decoding "-threads 2"
+fi
+
 if [ -n "$do_snow" ] ; then
 do_video_encoding snow.avi "-strict -2" "-an -vcodec snow -qscale 2 -flags +qpel -me_method iter -dia_size 2 -cmp 12 -subcmp 12 -s 128x64"
 do_video_decoding "" "-s 352x288"
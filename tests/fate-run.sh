@@ -85,6 +85,11 @@ lavfitest(){
 seektest(){
     t="${test#seek-}"
     ref=${base}/ref/seek/$t
+    index=
+    case $t in
+        index_*) index="-index tests/data/$t.idx"
+                 t="${t#index_}" ;;
+    esac
     case $t in
         image_*) file="tests/data/images/${t#image_}/%02d.${t#image_}" ;;
         *)       file=$(echo $t | tr _ '?')
@@ -94,7 +99,7 @@ seektest(){
                  file=$(echo tests/data/$d/$file)
                  ;;
     esac
-    $target_exec $target_path/tests/seek_test $target_path/$file
+    $target_exec $target_path/tests/seek_test $index $target_path/$file
 }
 
 mkdir -p "$outdir"
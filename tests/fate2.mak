@@ -284,3 +284,53 @@ fate-wmapro-2ch: REF = $(SAMPLES)/wmapro/Beethovens_9th-1_small.pcm
 
 FATE_TESTS += fate-vp8-sign-bias
 fate-vp8-sign-bias: CMD = framemd5  -i $(SAMPLES)/vp8/sintel-signbias.ivf
+
+# frame-threaded decoding must match the single-threaded references
+
+FATE2_TESTS += fate-vp8-test-vector-001-frame-threads
+fate-vp8-test-vector-001-frame-threads: CMD = framemd5 -threads 2 -thread_type frame -i $(SAMPLES)/vp8-test-vectors-r1/vp80-00-comprehensive-001.ivf
+fate-vp8-test-vector-001-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/vp8-test-vector-001
+
+FATE2_TESTS += fate-vp8-test-vector-008-frame-threads
+fate-vp8-test-vector-008-frame-threads: CMD = framemd5 -threads 2 -thread_type frame -i $(SAMPLES)/vp8-test-vectors-r1/vp80-00-comprehensive-008.ivf
+fate-vp8-test-vector-008-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/vp8-test-vector-008
+
+FATE2_TESTS += fate-vp8-test-vector-017-frame-threads
+fate-vp8-test-vector-017-frame-threads: CMD = framemd5 -threads 2 -thread_type frame -i $(SAMPLES)/vp8-test-vectors-r1/vp80-00-comprehensive-017.ivf
+fate-vp8-test-vector-017-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/vp8-test-vector-017
+
+FATE2_TESTS += fate-vp8-sign-bias-frame-threads
+fate-vp8-sign-bias-frame-threads: CMD = framemd5 -threads 2 -thread_type frame -i $(SAMPLES)/vp8/sintel-signbias.ivf
+fate-vp8-sign-bias-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/vp8-sign-bias
+
+FATE2_TESTS += fate-h264-conformance-cabac_mot_frm0_full-frame-threads
+fate-h264-conformance-cabac_mot_frm0_full-frame-threads: CMD = framecrc -threads 2 -thread_type frame -vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/camp_mot_frm0_full.26l
+fate-h264-conformance-cabac_mot_frm0_full-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/h264-conformance-cabac_mot_frm0_full
+
+FATE2_TESTS += fate-h264-conformance-cabac_mot_fld0_full-frame-threads
+fate-h264-conformance-cabac_mot_fld0_full-frame-threads: CMD = framecrc -threads 2 -thread_type frame -vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/camp_mot_fld0_full.26l
+fate-h264-conformance-cabac_mot_fld0_full-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/h264-conformance-cabac_mot_fld0_full
+
+FATE2_TESTS += fate-h264-conformance-cabac_mot_mbaff0_full-frame-threads
+fate-h264-conformance-cabac_mot_mbaff0_full-frame-threads: CMD = framecrc -threads 2 -thread_type frame -vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/camp_mot_mbaff0_full.26l
+fate-h264-conformance-cabac_mot_mbaff0_full-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/h264-conformance-cabac_mot_mbaff0_full
+
+FATE2_TESTS += fate-h264-conformance-cabac_mot_picaff0_full-frame-threads
+fate-h264-conformance-cabac_mot_picaff0_full-frame-threads: CMD = framecrc -threads 2 -thread_type frame -vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/camp_mot_picaff0_full.26l
+fate-h264-conformance-cabac_mot_picaff0_full-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/h264-conformance-cabac_mot_picaff0_full
+
+FATE2_TESTS += fate-h264-conformance-cavlc_mot_picaff0_full_b-frame-threads
+fate-h264-conformance-cavlc_mot_picaff0_full_b-frame-threads: CMD = framecrc -threads 2 -thread_type frame -vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/cvmp_mot_picaff0_full_B.26l
+fate-h264-conformance-cavlc_mot_picaff0_full_b-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/h264-conformance-cavlc_mot_picaff0_full_b
+
+FATE2_TESTS += fate-h264-conformance-cama3_sand_e-frame-threads
+fate-h264-conformance-cama3_sand_e-frame-threads: CMD = framecrc -threads 2 -thread_type frame -vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/CAMA3_Sand_E.264
+fate-h264-conformance-cama3_sand_e-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/h264-conformance-cama3_sand_e
+
+FATE2_TESTS += fate-h264-conformance-capama3_sand_f-frame-threads
+fate-h264-conformance-capama3_sand_f-frame-threads: CMD = framecrc -threads 2 -thread_type frame -vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/CAPAMA3_Sand_F.264
+fate-h264-conformance-capama3_sand_f-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/h264-conformance-capama3_sand_f
+
+FATE2_TESTS += fate-h264-conformance-mr9_bt_b-frame-threads
+fate-h264-conformance-mr9_bt_b-frame-threads: CMD = framecrc -threads 2 -thread_type frame -vsync 0 -strict 1 -i $(SAMPLES)/h264-conformance/MR9_BT_B.h264
+fate-h264-conformance-mr9_bt_b-frame-threads: REF = $(SRC_PATH)/tests/ref/fate/h264-conformance-mr9_bt_b
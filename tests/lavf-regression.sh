@@ -62,6 +62,14 @@ do_ffmpeg $file -t 1 -qscale 10 -f image2 -vcodec pgmyuv -i $raw_src -f s16le -i
 #do_ffmpeg_crc $file -i $target_path/$file
 fi
 
+if [ -n "$do_mmap" ] ; then
+file=${outfile}lavf-mmap.avi
+do_ffmpeg $file -t 1 -f image2 -vcodec pgmyuv -i $raw_src -f s16le -i $pcm_src -vcodec rawvideo
+# packets mapped through the mmap protocol must decode like copied ones
+do_ffmpeg_crc $file -i $target_path/$file
+do_ffmpeg_crc $file -i mmap:$target_path/$file
+fi
+
 if [ -n "$do_mpg" ] ; then
 do_lavf mpg
 fi
@@ -75,6 +83,16 @@ if [ -n "$do_ts" ] ; then
 do_lavf ts
 fi
 
+if [ -n "$do_ts_probe" ] ; then
+file=${outfile}lavf-probe.ts
+do_ffmpeg $file -t 1 -qscale 10 -f image2 -vcodec pgmyuv -i $raw_src -f s16le -i $pcm_src
+# the stream parameters must be the same as with the serial probe
+do_ffmpeg_streams -i $target_path/$file
+do_ffmpeg_streams -fflags +probethreads -i $target_path/$file
+# the second input is probed from the cache
+do_ffmpeg_streams -fflags +probecache -i $target_path/$file -i $target_path/$file
+fi
+
 if [ -n "$do_swf" ] ; then
 do_lavf swf -an
 fi
@@ -91,6 +109,18 @@ if [ -n "$do_mov" ] ; then
 do_lavf mov "-acodec pcm_alaw"
 fi
 
+if [ -n "$do_mov_frag" ] ; then
+file=${outfile}lavf-frag.mov
+do_ffmpeg $file -t 1 -qscale 10 -f image2 -vcodec pgmyuv -i $raw_src -f s16le -i $pcm_src -acodec pcm_alaw -bf 2 -fflags +frag+fragidx -fragduration 200000
+do_ffmpeg_crc $file -i $target_path/$file
+fi
+
+if [ -n "$do_mov_faststart" ] ; then
+file=${outfile}lavf-faststart.mov
+do_ffmpeg $file -t 1 -qscale 10 -f image2 -vcodec pgmyuv -i $raw_src -f s16le -i $pcm_src -acodec pcm_alaw -fflags +faststart
+do_ffmpeg_crc $file -i $target_path/$file
+fi
+
 if [ -n "$do_dv_fmt" ] ; then
 do_lavf dv "-ar 48000 -r 25 -s pal -ac 2"
 fi
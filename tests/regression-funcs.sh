@@ -94,6 +94,12 @@ do_ffmpeg_crc()
     echo "$f $(cat $crcfile)" >> $logfile
 }
 
+do_ffmpeg_streams()
+{
+    $echov $ffmpeg $*
+    $ffmpeg $* 2>&1 | grep 'Stream #' >> $logfile
+}
+
 do_ffmpeg_nocheck()
 {
     f="$1"
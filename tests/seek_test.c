@@ -57,9 +57,46 @@ static void ts_str(char buffer[60], int64_t ts, AVRational base)
     snprintf(buffer, 60, "%9f", tsval);
 }
 
+/**
+ * Build the index of a file, save it to index_file and load it back in a
+ * new context, which is returned in *ic.
+ */
+static int load_built_index(AVFormatContext **ic, const char *filename,
+                            const char *index_file, AVFormatParameters *ap)
+{
+    ByteIOContext *pb;
+    int i, ret;
+
+    if ((ret = av_build_index(*ic)) < 0)
+        return ret;
+    if ((ret = url_fopen(&pb, index_file, URL_WRONLY)) < 0)
+        return ret;
+    ret = av_save_index(*ic, pb);
+    url_fclose(pb);
+    if (ret < 0)
+        return ret;
+    av_close_input_file(*ic);
+    *ic = NULL;
+
+    if ((ret = av_open_input_file(ic, filename, NULL, 0, ap)) < 0 ||
+        (ret = av_find_stream_info(*ic)) < 0)
+        return ret;
+    if ((ret = url_fopen(&pb, index_file, URL_RDONLY)) < 0)
+        return ret;
+    ret = av_load_index(*ic, pb);
+    url_fclose(pb);
+    if (ret < 0)
+        return ret;
+    for (i = 0; i < (*ic)->nb_streams; i++)
+        printf("st:%2d index entries:%d complete:%d\n", i,
+               (*ic)->streams[i]->nb_index_entries,
+               (*ic)->streams[i]->index_complete);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
-    const char *filename;
+    const char *filename, *index_file = NULL;
     AVFormatContext *ic = NULL;
     int i, ret, stream_id;
     int64_t timestamp;
@@ -71,8 +108,13 @@ int main(int argc, char **argv)
     /* initialize libavcodec, and register all codecs and formats */
     av_register_all();
 
+    if (argc == 4 && !strcmp(argv[1], "-index")) {
+        index_file = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
     if (argc != 2) {
-        printf("usage: %s input_file\n"
+        printf("usage: %s [-index index_file] input_file\n"
                "\n", argv[0]);
         exit(1);
     }
@@ -91,6 +133,11 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    if (index_file && load_built_index(&ic, filename, index_file, ap) < 0) {
+        fprintf(stderr, "%s: could not build, save and load the index\n", filename);
+        exit(1);
+    }
+
     for(i=0; ; i++){
         AVPacket pkt;
         AVStream *av_uninit(st);